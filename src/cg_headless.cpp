@@ -0,0 +1,173 @@
+// Headless OpenGL contexts (EGL without a window system) and offscreen
+// render targets, for rendering on machines without a display.
+//
+
+#include "cg_headless.h"
+
+#ifdef HAVE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#include <cstring>
+#include <iostream>
+
+namespace cg {
+
+#ifdef HAVE_EGL
+// Return the surfaceless Mesa display if it is supported, and the default
+// display otherwise
+static EGLDisplay get_headless_display()
+{
+    const char *extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    if (extensions && std::strstr(extensions, "EGL_MESA_platform_surfaceless")) {
+        auto getPlatformDisplay =
+            (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+        if (getPlatformDisplay) {
+            return getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+        }
+    }
+    return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+#endif
+
+bool create_headless_context(HeadlessContext &context)
+{
+    context = HeadlessContext();
+#ifdef HAVE_EGL
+    EGLDisplay display = get_headless_display();
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr)) {
+        std::cerr << "Error: could not initialize EGL display" << std::endl;
+        return false;
+    }
+    if (!eglBindAPI(EGL_OPENGL_API)) {
+        std::cerr << "Error: EGL does not support desktop OpenGL" << std::endl;
+        return false;
+    }
+
+    // Note: the default surface type (window) is not supported by surfaceless displays
+    const EGLint configAttribs[] = {EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE,
+                                    EGL_OPENGL_BIT, EGL_NONE};
+    EGLConfig config;
+    EGLint numConfigs = 0;
+    if (!eglChooseConfig(display, configAttribs, &config, 1, &numConfigs) || numConfigs < 1) {
+        std::cerr << "Error: no EGL config for OpenGL" << std::endl;
+        return false;
+    }
+
+    const EGLint contextAttribs[] = {EGL_CONTEXT_MAJOR_VERSION,
+                                     3,
+                                     EGL_CONTEXT_MINOR_VERSION,
+                                     3,
+                                     EGL_CONTEXT_OPENGL_PROFILE_MASK,
+                                     EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+                                     EGL_NONE};
+    EGLContext eglContext = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+    if (eglContext == EGL_NO_CONTEXT) {
+        std::cerr << "Error: could not create OpenGL 3.3 context with EGL" << std::endl;
+        return false;
+    }
+
+    // Rendering goes to framebuffer objects, so no surface is needed
+    // (EGL_KHR_surfaceless_context)
+    if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, eglContext)) {
+        std::cerr << "Error: could not make EGL context current without a surface" << std::endl;
+        eglDestroyContext(display, eglContext);
+        return false;
+    }
+    context.display = display;
+    context.context = eglContext;
+    return true;
+#else
+    std::cerr << "Error: headless rendering needs EGL, which this build does not have"
+              << std::endl;
+    return false;
+#endif
+}
+
+void destroy_headless_context(HeadlessContext &context)
+{
+#ifdef HAVE_EGL
+    if (context.context) {
+        eglMakeCurrent(context.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(context.display, context.context);
+        eglReleaseThread();
+    }
+    // Note: the display is not terminated, since contexts of other threads
+    // may still use it
+#endif
+    context = HeadlessContext();
+}
+
+void create_offscreen_target(OffscreenTarget &target, int width, int height)
+{
+    destroy_offscreen_target(target);
+    target.width = width;
+    target.height = height;
+
+    glGenRenderbuffers(1, &target.colorRenderbuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, target.colorRenderbuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glGenRenderbuffers(1, &target.depthRenderbuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, target.depthRenderbuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glGenFramebuffers(1, &target.framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER,
+                              target.colorRenderbuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER,
+                              target.depthRenderbuffer);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        std::cerr << "Error: framebuffer object not complete" << std::endl;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    glGenBuffers(2, target.readbackBuffers);
+    for (GLuint buffer : target.readbackBuffers) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer);
+        glBufferData(GL_PIXEL_PACK_BUFFER, width * height * 3, nullptr, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+void destroy_offscreen_target(OffscreenTarget &target)
+{
+    if (target.framebuffer) glDeleteFramebuffers(1, &target.framebuffer);
+    if (target.colorRenderbuffer) glDeleteRenderbuffers(1, &target.colorRenderbuffer);
+    if (target.depthRenderbuffer) glDeleteRenderbuffers(1, &target.depthRenderbuffer);
+    if (target.readbackBuffers[0]) glDeleteBuffers(2, target.readbackBuffers);
+    target = OffscreenTarget();
+}
+
+void begin_offscreen_readback(const OffscreenTarget &target, int slot)
+{
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, target.framebuffer);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, target.readbackBuffers[slot]);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, target.width, target.height, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+}
+
+void finish_offscreen_readback(const OffscreenTarget &target, int slot,
+                               std::vector<uint8_t> &pixels)
+{
+    int rowSize = target.width * 3;
+    pixels.resize(rowSize * target.height);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, target.readbackBuffers[slot]);
+    const uint8_t *data = (const uint8_t *)glMapBufferRange(
+        GL_PIXEL_PACK_BUFFER, 0, rowSize * target.height, GL_MAP_READ_BIT);
+    if (data) {
+        // OpenGL returns the bottom row first
+        for (int y = 0; y < target.height; ++y) {
+            std::memcpy(&pixels[y * rowSize], data + (target.height - 1 - y) * rowSize, rowSize);
+        }
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+}  // namespace cg
@@ -0,0 +1,54 @@
+// Headless OpenGL contexts (EGL without a window system) and offscreen
+// render targets, for rendering on machines without a display.
+//
+
+#pragma once
+
+#include <GL/gl3w.h>
+
+#include <cstdint>
+#include <vector>
+
+namespace cg {
+
+// OpenGL 3.3 core context on a surfaceless EGL display (e.g., Mesa llvmpipe
+// on a render node). The handles are EGL types, kept opaque here so that the
+// EGL headers are only needed where the context is created.
+struct HeadlessContext {
+    void *display = nullptr;
+    void *context = nullptr;
+};
+
+// Create a context and make it current on the calling thread. Each thread
+// that renders needs its own context. Returns false if EGL is not available
+// (the build defines HAVE_EGL when it is) or no suitable context exists.
+bool create_headless_context(HeadlessContext &context);
+
+void destroy_headless_context(HeadlessContext &context);
+
+// Framebuffer with RGBA8 color and depth renderbuffers, and two pixel pack
+// buffers, so that the pixels of one frame can be read back while the next
+// one is rendered
+struct OffscreenTarget {
+    int width = 0;
+    int height = 0;
+    GLuint framebuffer = 0;
+    GLuint colorRenderbuffer = 0;
+    GLuint depthRenderbuffer = 0;
+    GLuint readbackBuffers[2] = {};
+};
+
+void create_offscreen_target(OffscreenTarget &target, int width, int height);
+
+void destroy_offscreen_target(OffscreenTarget &target);
+
+// Start an asynchronous copy of the color buffer into one of the two pack
+// buffers (slot 0 or 1). This returns without waiting for rendering to finish.
+void begin_offscreen_readback(const OffscreenTarget &target, int slot);
+
+// Wait for the copy into a slot, and return its pixels as RGB8 rows, top
+// row first
+void finish_offscreen_readback(const OffscreenTarget &target, int slot,
+                               std::vector<uint8_t> &pixels);
+
+}  // namespace cg
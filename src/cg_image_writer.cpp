@@ -0,0 +1,74 @@
+// Background PNG encoding, so that rendering does not wait for images to be
+// compressed and written to disk.
+//
+
+#include "cg_image_writer.h"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb_image_write.h>
+
+#include <iostream>
+
+namespace cg {
+
+static void run_image_writer(ImageWriter &writer)
+{
+    while (true) {
+        ImageWriteJob job;
+        {
+            std::unique_lock<std::mutex> lock(writer.mutex);
+            writer.jobQueued.wait(lock, [&] { return writer.stopping || !writer.jobs.empty(); });
+            if (writer.jobs.empty()) return;  // Stopping, and all images are written
+            job = std::move(writer.jobs.front());
+            writer.jobs.pop_front();
+        }
+        writer.jobTaken.notify_one();
+
+        bool written = stbi_write_png(job.filename.c_str(), job.width, job.height, 3,
+                                      job.pixels.data(), job.width * 3) != 0;
+        std::lock_guard<std::mutex> lock(writer.mutex);
+        if (written) {
+            writer.writtenCount += 1;
+        } else {
+            writer.failedCount += 1;
+            std::cerr << "Error: could not write " << job.filename << std::endl;
+        }
+    }
+}
+
+void start_image_writer(ImageWriter &writer, int threadCount)
+{
+    writer.stopping = false;
+    for (int i = 0; i < threadCount; ++i) {
+        writer.threads.push_back(std::thread(run_image_writer, std::ref(writer)));
+    }
+}
+
+void write_png_async(ImageWriter &writer, const std::string &filename, int width, int height,
+                     std::vector<uint8_t> &pixels)
+{
+    {
+        std::unique_lock<std::mutex> lock(writer.mutex);
+        writer.jobTaken.wait(lock, [&] { return int(writer.jobs.size()) < writer.maxQueuedJobs; });
+        ImageWriteJob job;
+        job.filename = filename;
+        job.width = width;
+        job.height = height;
+        job.pixels.swap(pixels);
+        writer.jobs.push_back(std::move(job));
+    }
+    writer.jobQueued.notify_one();
+}
+
+void stop_image_writer(ImageWriter &writer)
+{
+    {
+        std::lock_guard<std::mutex> lock(writer.mutex);
+        writer.stopping = true;
+    }
+    writer.jobQueued.notify_all();
+    for (std::thread &thread : writer.threads) thread.join();
+    writer.threads.clear();
+}
+
+}  // namespace cg
@@ -0,0 +1,49 @@
+// Background PNG encoding, so that rendering does not wait for images to be
+// compressed and written to disk.
+//
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace cg {
+
+struct ImageWriteJob {
+    std::string filename;
+    int width;
+    int height;
+    std::vector<uint8_t> pixels;  // RGB8 rows, top row first
+};
+
+// Queue of images that are encoded by worker threads. Queuing blocks while
+// maxQueuedJobs images are waiting, to bound the memory used when encoding
+// is slower than rendering.
+struct ImageWriter {
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable jobQueued;
+    std::condition_variable jobTaken;
+    std::deque<ImageWriteJob> jobs;
+    int maxQueuedJobs = 16;
+    bool stopping = false;
+    int writtenCount = 0;
+    int failedCount = 0;
+};
+
+void start_image_writer(ImageWriter &writer, int threadCount = 1);
+
+// Queue an image to be written as a PNG file. The pixels are moved into the
+// queue.
+void write_png_async(ImageWriter &writer, const std::string &filename, int width, int height,
+                     std::vector<uint8_t> &pixels);
+
+// Write the remaining images and stop the worker threads
+void stop_image_writer(ImageWriter &writer);
+
+}  // namespace cg
@@ -0,0 +1,104 @@
+// Multi-draw submission of render queue batches, with indirect draw
+// commands where GL_ARB_multi_draw_indirect is available.
+//
+
+#include "cg_multi_draw.h"
+
+#include <cstdint>
+#include <cstring>
+
+namespace cg {
+
+bool has_gl_extension(const char *name)
+{
+    GLint numExtensions = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &numExtensions);
+    for (GLint i = 0; i < numExtensions; ++i) {
+        const char *extension = (const char *)glGetStringi(GL_EXTENSIONS, i);
+        if (extension && !std::strcmp(extension, name)) return true;
+    }
+    return false;
+}
+
+bool has_multi_draw_indirect()
+{
+    return glMultiDrawElementsIndirect != nullptr &&
+           has_gl_extension("GL_ARB_multi_draw_indirect") &&
+           has_gl_extension("GL_ARB_shader_draw_parameters");
+}
+
+void write_multi_draw_buffer(MultiDrawBuffer &buffer, StreamBuffer &stream,
+                             const std::vector<DrawElementsIndirectCommand> &commands,
+                             const std::vector<DrawData> &draws, int firstInstance,
+                             bool useIndirect)
+{
+    if (!buffer.drawTexture) glGenTextures(1, &buffer.drawTexture);
+
+    if (useIndirect) {
+        void *data;
+        int size = int(commands.size() * sizeof(DrawElementsIndirectCommand));
+        int offset = allocate_stream_buffer(stream, size, 4, &data);
+        if (size) std::memcpy(data, &commands[0], size);
+        buffer.commandOffset = stream_buffer_offset(stream, offset);
+    }
+
+    void *data;
+    int offset = allocate_stream_buffer(stream, int(draws.size() * sizeof(DrawData)),
+                                        sizeof(DrawData), &data);
+    DrawData *frameDraws = (DrawData *)data;
+    for (unsigned i = 0; i < draws.size(); ++i) {
+        frameDraws[i].firstInstance = draws[i].firstInstance + firstInstance;
+        frameDraws[i].materialLayers = draws[i].materialLayers;
+    }
+    buffer.firstDraw = stream_buffer_offset(stream, offset) / int(sizeof(DrawData));
+
+    if (buffer.buffer != stream.buffer) {
+        buffer.buffer = stream.buffer;
+        glBindTexture(GL_TEXTURE_BUFFER, buffer.drawTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32I, buffer.buffer);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+    }
+}
+
+void destroy_multi_draw_buffer(MultiDrawBuffer &buffer)
+{
+    glDeleteTextures(1, &buffer.drawTexture);  // The buffer belongs to the stream buffer
+    buffer = MultiDrawBuffer();
+}
+
+void multi_draw_elements(const MultiDrawBuffer &buffer,
+                         const std::vector<DrawElementsIndirectCommand> &commands, GLenum mode,
+                         GLenum indexType, int first, int count, bool useIndirect)
+{
+    if (useIndirect) {
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, buffer.buffer);
+        glMultiDrawElementsIndirect(
+            mode, indexType,
+            (const GLvoid *)(uintptr_t)(buffer.commandOffset +
+                                        first * sizeof(DrawElementsIndirectCommand)),
+            count, 0);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+        return;
+    }
+
+    // Scratch arrays for the fallback path (the draw commands are kept on
+    // the CPU side, so no readback is needed). They are per thread, since
+    // headless batch rendering draws from several threads.
+    thread_local std::vector<GLsizei> counts;
+    thread_local std::vector<const GLvoid *> offsets;
+    thread_local std::vector<GLint> baseVertices;
+    counts.resize(count);
+    offsets.resize(count);
+    baseVertices.resize(count);
+    GLuint indexSize = (indexType == GL_UNSIGNED_SHORT) ? 2 : 4;
+    for (int i = 0; i < count; ++i) {
+        const DrawElementsIndirectCommand &command = commands[first + i];
+        counts[i] = command.count;
+        offsets[i] = (const GLvoid *)(uintptr_t)(command.firstIndex * indexSize);
+        baseVertices[i] = command.baseVertex;
+    }
+    glMultiDrawElementsBaseVertex(mode, &counts[0], indexType, &offsets[0], count,
+                                  &baseVertices[0]);
+}
+
+}  // namespace cg
@@ -0,0 +1,66 @@
+// Multi-draw submission of render queue batches, with indirect draw
+// commands where GL_ARB_multi_draw_indirect is available.
+//
+
+#pragma once
+
+#include "cg_stream_buffer.h"
+
+#include <GL/gl3w.h>
+
+#include <vector>
+
+namespace cg {
+
+// Layout of the commands read by glMultiDrawElementsIndirect()
+struct DrawElementsIndirectCommand {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;  // Must be zero without GL_ARB_base_instance
+};
+
+// Per-draw data, fetched by the vertex shader with gl_DrawIDARB
+struct DrawData {
+    GLint firstInstance;
+    GLint materialLayers;  // Texture array layers of the material (see mesh.vert)
+};
+
+// Draw commands and per-draw data of a frame, written to a stream buffer
+// (see cg_stream_buffer.h). The whole stream buffer is attached to the draw
+// texture, so the offsets are those within the buffer, not the frame.
+struct MultiDrawBuffer {
+    GLuint buffer = 0;       // Stream buffer that is attached to drawTexture
+    GLuint drawTexture = 0;  // RG32I buffer texture of the stream buffer
+    int commandOffset = 0;   // Byte offset of the draw commands in the buffer
+    int firstDraw = 0;       // Texel of the data of the first draw in drawTexture
+};
+
+// Return true if the context supports an extension
+bool has_gl_extension(const char *name);
+
+// Return true if glMultiDrawElementsIndirect() and gl_DrawIDARB can be used
+bool has_multi_draw_indirect();
+
+// Write the draw commands and per-draw data of a frame to the current frame
+// of the stream buffer, adding firstInstance (the first instance of the frame
+// in the instance buffer texture) to the first instance of each draw. The
+// commands are only written if useIndirect is true. The buffer is
+// re-attached to the draw texture if it is a new one (e.g., after the stream
+// buffer has grown).
+void write_multi_draw_buffer(MultiDrawBuffer &buffer, StreamBuffer &stream,
+                             const std::vector<DrawElementsIndirectCommand> &commands,
+                             const std::vector<DrawData> &draws, int firstInstance,
+                             bool useIndirect);
+
+void destroy_multi_draw_buffer(MultiDrawBuffer &buffer);
+
+// Submit the draws [first, first + count) of the frame with a single call.
+// Without indirect draws, this uses glMultiDrawElementsBaseVertex(), which
+// ignores the instance counts of the commands.
+void multi_draw_elements(const MultiDrawBuffer &buffer,
+                         const std::vector<DrawElementsIndirectCommand> &commands, GLenum mode,
+                         GLenum indexType, int first, int count, bool useIndirect);
+
+}  // namespace cg
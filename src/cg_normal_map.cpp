@@ -0,0 +1,73 @@
+// Conversion of height maps to tangent-space normal maps, so that shaders
+// can read a normal with a single texture fetch.
+//
+
+#include "cg_normal_map.h"
+#include "cg_simd.h"
+
+#include <vector>
+
+namespace cg {
+
+void convert_height_to_normal_map(uint8_t *pixels, int width, int height, float scale)
+{
+    if (width <= 0 || height <= 0) return;
+
+    // Heights of the rows, with a wrapped-around texel on each side (column
+    // x is at x + 1) and padding to whole lanes
+    int stride = (width + 2 + 3) / 4 * 4;
+    std::vector<float> heights(height * stride, 0.0f);
+    for (int y = 0; y < height; ++y) {
+        float *row = &heights[y * stride];
+        for (int x = 0; x < width; ++x) row[x + 1] = pixels[(y * width + x) * 4] / 255.0f;
+        row[0] = row[width];
+        row[width + 1] = row[1];
+    }
+
+    // The Sobel filters sum eight times the slope (per texel), which is then
+    // scaled to the slope per unit of texture coordinates
+    Lanes scaleX = lanes(scale * width / 8.0f), scaleY = lanes(scale * height / 8.0f);
+    Lanes one = lanes(1.0f);
+    std::vector<float> smoothed(stride + 4), difference(stride + 4);
+    alignas(16) float normals[3][4];
+    for (int y = 0; y < height; ++y) {
+        const float *above = &heights[((y + height - 1) % height) * stride];
+        const float *center = &heights[y * stride];
+        const float *below = &heights[((y + 1) % height) * stride];
+
+        // Vertical parts of the filters: smoothing for the X slope, and
+        // differences for the Y slope
+        for (int i = 0; i < stride; i += 4) {
+            Lanes a = lanes_load_unaligned(above + i), b = lanes_load_unaligned(below + i);
+            Lanes c = lanes_load_unaligned(center + i);
+            lanes_store_unaligned(&smoothed[i], lanes_add(lanes_add(a, b), lanes_add(c, c)));
+            lanes_store_unaligned(&difference[i], lanes_sub(b, a));
+        }
+
+        // Horizontal parts, and the normals of four texels at a time
+        for (int x = 0; x < width; x += 4) {
+            Lanes slopeX = lanes_sub(lanes_load_unaligned(&smoothed[x + 2]),
+                                     lanes_load_unaligned(&smoothed[x]));
+            Lanes d = lanes_load_unaligned(&difference[x + 1]);
+            Lanes slopeY = lanes_add(lanes_add(lanes_load_unaligned(&difference[x]),
+                                               lanes_load_unaligned(&difference[x + 2])),
+                                     lanes_add(d, d));
+            Lanes nx = lanes_mul(slopeX, scaleX), ny = lanes_mul(slopeY, scaleY);
+            Lanes lengthSquared = lanes_add(lanes_add(lanes_mul(nx, nx), lanes_mul(ny, ny)), one);
+            Lanes invLength = lanes_div(one, lanes_sqrt(lengthSquared));
+            lanes_store(normals[0], lanes_mul(nx, invLength));
+            lanes_store(normals[1], lanes_mul(ny, invLength));
+            lanes_store(normals[2], invLength);
+
+            for (int i = 0; i < 4 && x + i < width; ++i) {
+                uint8_t *pixel = &pixels[(y * width + x + i) * 4];
+                for (int j = 0; j < 3; ++j) {
+                    pixel[j] = uint8_t((normals[j][i] * 0.5f + 0.5f) * 255.0f + 0.5f);
+                }
+                pixel[3] = 255;
+            }
+        }
+    }
+}
+
+}  // namespace cg
@@ -0,0 +1,27 @@
+// Conversion of height maps to tangent-space normal maps, so that shaders
+// can read a normal with a single texture fetch.
+//
+
+#pragma once
+
+#include <cstdint>
+
+namespace cg {
+
+// Height map scale for convert_height_to_normal_map(): the normal leans by
+// this times the slope of the heights (in [0, 1] per unit of texture
+// coordinates)
+const float HEIGHT_MAP_SCALE = 0.002f;
+
+// Replace an RGBA8 height map (with the heights in R) by a normal map with
+// the tangent-space normal in RGB (mapped from [-1, 1] to [0, 255]) and 255
+// in A. The slopes are estimated with a Sobel filter (with SSE2, see
+// cg_simd.h), wrapping around at the borders. The normals lean towards
+// increasing heights: along +X where the heights increase with the column,
+// and along +Y where they increase with the row. Since the scale is per
+// unit of texture coordinates, the normals do not depend on the image size,
+// and mip levels can be made by averaging them.
+void convert_height_to_normal_map(uint8_t *pixels, int width, int height,
+                                  float scale = HEIGHT_MAP_SCALE);
+
+}  // namespace cg
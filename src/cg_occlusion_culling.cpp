@@ -0,0 +1,244 @@
+// Software occlusion culling: occluder triangles are rasterized into a small
+// CPU depth buffer, against which the bounding boxes of other objects are
+// tested before they are submitted. Does not depend on OpenGL.
+//
+
+#include "cg_occlusion_culling.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CG_OCCLUSION_SSE2
+#endif
+
+namespace cg {
+
+// Occluder triangle in window coordinates (pixels, and depth from 0 to 1)
+struct ScreenTriangle {
+    glm::vec3 v[3];
+};
+
+// Coefficients of a function a * x + b * y + c that is linear in screen space
+struct Plane {
+    float a, b, c;
+};
+
+void create_occlusion_buffer(OcclusionBuffer &buffer, int width, int height)
+{
+    buffer.width = (width + OCCLUSION_TILE_SIZE - 1) / OCCLUSION_TILE_SIZE * OCCLUSION_TILE_SIZE;
+    buffer.height = (height + OCCLUSION_TILE_SIZE - 1) / OCCLUSION_TILE_SIZE * OCCLUSION_TILE_SIZE;
+    buffer.depth.assign(buffer.width * buffer.height, 1.0f);
+    buffer.tileMaxDepth.assign(buffer.depth.size() / (OCCLUSION_TILE_SIZE * OCCLUSION_TILE_SIZE),
+                               1.0f);
+}
+
+// Transform the occluder triangles to window coordinates, leaving out those
+// that cross the near plane
+static void transform_occluders(const OcclusionBuffer &buffer, const glm::mat4 &viewProjection,
+                                const std::vector<Occluder> &occluders,
+                                std::vector<ScreenTriangle> &triangles)
+{
+    std::vector<glm::vec4> clip;
+    std::vector<glm::vec3> window;
+    triangles.clear();
+    for (const Occluder &occluder : occluders) {
+        const OccluderMesh &mesh = *occluder.mesh;
+        glm::mat4 modelViewProjection = viewProjection * occluder.model;
+        clip.resize(mesh.positions.size());
+        window.resize(mesh.positions.size());
+        for (unsigned i = 0; i < mesh.positions.size(); ++i) {
+            clip[i] = modelViewProjection * glm::vec4(mesh.positions[i], 1.0f);
+            glm::vec3 ndc = glm::vec3(clip[i]) / clip[i].w;
+            window[i] = glm::vec3((ndc.x * 0.5f + 0.5f) * buffer.width,
+                                  (ndc.y * 0.5f + 0.5f) * buffer.height, ndc.z * 0.5f + 0.5f);
+        }
+
+        for (unsigned i = 0; i + 2 < mesh.indices.size(); i += 3) {
+            ScreenTriangle triangle;
+            bool clipped = false;
+            for (int j = 0; j < 3; ++j) {
+                uint32_t index = mesh.indices[i + j];
+                clipped = clipped || clip[index].w <= 0.0f || clip[index].z < -clip[index].w;
+                triangle.v[j] = window[index];
+            }
+            if (!clipped) triangles.push_back(triangle);
+        }
+    }
+}
+
+// Return the coefficients of the edge function of the edge from a to b,
+// which is positive to the left of the edge
+static Plane edge_function(const glm::vec3 &a, const glm::vec3 &b)
+{
+    Plane edge;
+    edge.a = a.y - b.y;
+    edge.b = b.x - a.x;
+    edge.c = (b.y - a.y) * a.x - (b.x - a.x) * a.y;
+    return edge;
+}
+
+// Rasterize the triangles into the rows [yBegin, yEnd) of the buffer, keeping
+// the nearest depth of each pixel, and update the tile depths of the rows
+static void rasterize_band(OcclusionBuffer &buffer, const std::vector<ScreenTriangle> &triangles,
+                           int yBegin, int yEnd)
+{
+    int width = buffer.width;
+    std::fill(buffer.depth.begin() + yBegin * width, buffer.depth.begin() + yEnd * width, 1.0f);
+
+    for (const ScreenTriangle &triangle : triangles) {
+        glm::vec3 v0 = triangle.v[0], v1 = triangle.v[1], v2 = triangle.v[2];
+        float area = (v1.x - v0.x) * (v2.y - v0.y) - (v1.y - v0.y) * (v2.x - v0.x);
+        if (std::abs(area) < 1e-8f) continue;
+        if (area < 0.0f) {
+            std::swap(v1, v2);
+            area = -area;
+        }
+
+        // Bounding box of the pixel centers, clipped to the band. The first
+        // column is aligned to four pixels for the SIMD loop.
+        int xMin = std::max(int(std::floor(std::min(v0.x, std::min(v1.x, v2.x)))), 0) & ~3;
+        int xMax = std::min(int(std::ceil(std::max(v0.x, std::max(v1.x, v2.x)))), width - 1);
+        int yMin = std::max(int(std::floor(std::min(v0.y, std::min(v1.y, v2.y)))), yBegin);
+        int yMax = std::min(int(std::ceil(std::max(v0.y, std::max(v1.y, v2.y)))), yEnd - 1);
+        if (xMin > xMax || yMin > yMax) continue;
+
+        // Edge functions, and depth interpolated with the barycentric weights
+        // of v1 and v2 (given by the edges opposite to them)
+        Plane e0 = edge_function(v1, v2), e1 = edge_function(v2, v0), e2 = edge_function(v0, v1);
+        Plane z;
+        z.a = (e1.a * (v1.z - v0.z) + e2.a * (v2.z - v0.z)) / area;
+        z.b = (e1.b * (v1.z - v0.z) + e2.b * (v2.z - v0.z)) / area;
+        z.c = v0.z + (e1.c * (v1.z - v0.z) + e2.c * (v2.z - v0.z)) / area;
+
+        for (int y = yMin; y <= yMax; ++y) {
+            float py = y + 0.5f;
+            float *row = &buffer.depth[y * width];
+#ifdef CG_OCCLUSION_SSE2
+            const __m128 offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+            const __m128 zero = _mm_setzero_ps();
+            for (int x = xMin; x <= xMax; x += 4) {
+                __m128 px = _mm_add_ps(_mm_set1_ps(float(x)), offsets);
+                __m128 w0 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(e0.a), px),
+                                       _mm_set1_ps(e0.b * py + e0.c));
+                __m128 w1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(e1.a), px),
+                                       _mm_set1_ps(e1.b * py + e1.c));
+                __m128 w2 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(e2.a), px),
+                                       _mm_set1_ps(e2.b * py + e2.c));
+                __m128 inside = _mm_and_ps(_mm_cmpge_ps(w0, zero),
+                                           _mm_and_ps(_mm_cmpge_ps(w1, zero),
+                                                      _mm_cmpge_ps(w2, zero)));
+                if (!_mm_movemask_ps(inside)) continue;
+
+                __m128 depth = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(z.a), px),
+                                          _mm_set1_ps(z.b * py + z.c));
+                __m128 old = _mm_loadu_ps(row + x);
+                __m128 nearest = _mm_min_ps(old, depth);
+                _mm_storeu_ps(row + x,
+                              _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, old)));
+            }
+#else
+            for (int x = xMin; x <= xMax; ++x) {
+                float px = x + 0.5f;
+                if (e0.a * px + e0.b * py + e0.c < 0.0f || e1.a * px + e1.b * py + e1.c < 0.0f ||
+                    e2.a * px + e2.b * py + e2.c < 0.0f) {
+                    continue;
+                }
+                row[x] = std::min(row[x], z.a * px + z.b * py + z.c);
+            }
+#endif
+        }
+    }
+
+    // Farthest depth of each tile
+    int tilesX = width / OCCLUSION_TILE_SIZE;
+    for (int ty = yBegin / OCCLUSION_TILE_SIZE; ty < yEnd / OCCLUSION_TILE_SIZE; ++ty) {
+        for (int tx = 0; tx < tilesX; ++tx) {
+            float maxDepth = 0.0f;
+            for (int y = 0; y < OCCLUSION_TILE_SIZE; ++y) {
+                const float *row = &buffer.depth[(ty * OCCLUSION_TILE_SIZE + y) * width];
+                for (int x = 0; x < OCCLUSION_TILE_SIZE; ++x) {
+                    maxDepth = std::max(maxDepth, row[tx * OCCLUSION_TILE_SIZE + x]);
+                }
+            }
+            buffer.tileMaxDepth[ty * tilesX + tx] = maxDepth;
+        }
+    }
+}
+
+void rasterize_occluders(OcclusionBuffer &buffer, WorkerPool &workers,
+                         const glm::mat4 &viewProjection, const std::vector<Occluder> &occluders)
+{
+    std::vector<ScreenTriangle> triangles;
+    transform_occluders(buffer, viewProjection, occluders, triangles);
+
+    // Split the buffer into bands of whole tile rows, one per chunk
+    const int bandTileRows = 2;
+    int tileRows = buffer.height / OCCLUSION_TILE_SIZE;
+    parallel_for(workers, tileRows, bandTileRows, [&](int first, int last) {
+        rasterize_band(buffer, triangles, first * OCCLUSION_TILE_SIZE,
+                       last * OCCLUSION_TILE_SIZE);
+    });
+}
+
+bool project_bounds(const glm::mat4 &viewProjection, const glm::vec3 &boundsMin,
+                    const glm::vec3 &boundsMax, glm::vec2 &ndcMin, glm::vec2 &ndcMax,
+                    float &minDepth)
+{
+    ndcMin = glm::vec2(1e30f);
+    ndcMax = glm::vec2(-1e30f);
+    minDepth = 1.0f;
+    for (int i = 0; i < 8; ++i) {
+        glm::vec3 corner((i & 1) ? boundsMax.x : boundsMin.x, (i & 2) ? boundsMax.y : boundsMin.y,
+                         (i & 4) ? boundsMax.z : boundsMin.z);
+        glm::vec4 clip = viewProjection * glm::vec4(corner, 1.0f);
+        if (clip.w <= 0.0f || clip.z < -clip.w) return false;
+        glm::vec3 ndc = glm::vec3(clip) / clip.w;
+        ndcMin = glm::min(ndcMin, glm::vec2(ndc));
+        ndcMax = glm::max(ndcMax, glm::vec2(ndc));
+        minDepth = std::min(minDepth, ndc.z * 0.5f + 0.5f);
+    }
+    return true;
+}
+
+bool is_bounds_occluded(const OcclusionBuffer &buffer, const glm::mat4 &viewProjection,
+                        const glm::vec3 &boundsMin, const glm::vec3 &boundsMax)
+{
+    glm::vec2 ndcMin, ndcMax;
+    float minDepth;
+    if (!project_bounds(viewProjection, boundsMin, boundsMax, ndcMin, ndcMax, minDepth)) {
+        return false;
+    }
+
+    // Pixels covered by the screen-space rectangle of the box (leaving boxes
+    // outside of the view to frustum culling)
+    int xMin = std::max(int(std::floor((ndcMin.x * 0.5f + 0.5f) * buffer.width)), 0);
+    int xMax = std::min(int(std::ceil((ndcMax.x * 0.5f + 0.5f) * buffer.width)), buffer.width) - 1;
+    int yMin = std::max(int(std::floor((ndcMin.y * 0.5f + 0.5f) * buffer.height)), 0);
+    int yMax =
+        std::min(int(std::ceil((ndcMax.y * 0.5f + 0.5f) * buffer.height)), buffer.height) - 1;
+    if (xMin > xMax || yMin > yMax) return false;
+
+    // The box is occluded if the occluders are nearer than the box in all
+    // pixels. Whole tiles are tested with their farthest depth first.
+    int tilesX = buffer.width / OCCLUSION_TILE_SIZE;
+    for (int ty = yMin / OCCLUSION_TILE_SIZE; ty <= yMax / OCCLUSION_TILE_SIZE; ++ty) {
+        for (int tx = xMin / OCCLUSION_TILE_SIZE; tx <= xMax / OCCLUSION_TILE_SIZE; ++tx) {
+            if (buffer.tileMaxDepth[ty * tilesX + tx] < minDepth) continue;
+
+            int x0 = std::max(tx * OCCLUSION_TILE_SIZE, xMin);
+            int x1 = std::min((tx + 1) * OCCLUSION_TILE_SIZE - 1, xMax);
+            int y0 = std::max(ty * OCCLUSION_TILE_SIZE, yMin);
+            int y1 = std::min((ty + 1) * OCCLUSION_TILE_SIZE - 1, yMax);
+            for (int y = y0; y <= y1; ++y) {
+                for (int x = x0; x <= x1; ++x) {
+                    if (buffer.depth[y * buffer.width + x] >= minDepth) return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+}  // namespace cg
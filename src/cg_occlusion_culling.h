@@ -0,0 +1,62 @@
+// Software occlusion culling: occluder triangles are rasterized into a small
+// CPU depth buffer, against which the bounding boxes of other objects are
+// tested before they are submitted. Does not depend on OpenGL.
+//
+
+#pragma once
+
+#include "cg_worker_pool.h"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+namespace cg {
+
+// Triangles of a mesh that can be used as an occluder (the mesh itself, or a
+// simplified proxy that lies inside it)
+struct OccluderMesh {
+    std::vector<glm::vec3> positions;
+    std::vector<uint32_t> indices;
+};
+
+struct Occluder {
+    const OccluderMesh *mesh;
+    glm::mat4 model;
+};
+
+// Tile size of the hierarchical depth. The buffer size must be a multiple of it.
+const int OCCLUSION_TILE_SIZE = 8;
+
+// Depth buffer with the nearest occluder depth (window-space, 0 to 1) of each
+// pixel, and the farthest of those depths in each tile
+struct OcclusionBuffer {
+    int width = 0;
+    int height = 0;
+    std::vector<float> depth;
+    std::vector<float> tileMaxDepth;
+};
+
+// Set the size of the buffer (rounded up to whole tiles)
+void create_occlusion_buffer(OcclusionBuffer &buffer, int width, int height);
+
+// Clear the buffer and rasterize the occluders. The buffer is split into
+// bands of tile rows that are rasterized in parallel on the worker pool.
+// Triangles that cross the near plane are skipped, which leaves holes rather
+// than false occlusion.
+void rasterize_occluders(OcclusionBuffer &buffer, WorkerPool &workers,
+                         const glm::mat4 &viewProjection, const std::vector<Occluder> &occluders);
+
+// Project a world-space bounding box to normalized device coordinates, and
+// return its nearest window-space depth. Returns false if the box crosses
+// the near plane.
+bool project_bounds(const glm::mat4 &viewProjection, const glm::vec3 &boundsMin,
+                    const glm::vec3 &boundsMax, glm::vec2 &ndcMin, glm::vec2 &ndcMax,
+                    float &minDepth);
+
+// Return true if a world-space bounding box is hidden behind the occluders
+bool is_bounds_occluded(const OcclusionBuffer &buffer, const glm::mat4 &viewProjection,
+                        const glm::vec3 &boundsMin, const glm::vec3 &boundsMax);
+
+}  // namespace cg
@@ -0,0 +1,716 @@
+// Multi-threaded path tracer: the hierarchy is built by splitting the
+// triangles of each node (up to) twice with the surface area heuristic, and
+// each sample traces one path per pixel, with a shadow ray towards the sun
+// at each bounce. Does not depend on OpenGL.
+//
+
+#include "cg_path_tracer.h"
+#include "cg_simd.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+
+namespace cg {
+
+const float PI = 3.14159265f;
+
+// Triangles per leaf (one group)
+const int LEAF_SIZE = 4;
+
+// Bins of the surface area heuristic
+const int SAH_BINS = 16;
+
+// Below this depth, nodes are split at the median instead, so that the
+// traversal stack cannot overflow
+const int MAX_SAH_DEPTH = 32;
+
+const int TRAVERSAL_STACK_SIZE = 256;
+
+// Hierarchy construction
+
+struct Bounds {
+    glm::vec3 min = glm::vec3(std::numeric_limits<float>::max());
+    glm::vec3 max = glm::vec3(-std::numeric_limits<float>::max());
+};
+
+static void grow_bounds(Bounds &bounds, const glm::vec3 &min, const glm::vec3 &max)
+{
+    bounds.min = glm::min(bounds.min, min);
+    bounds.max = glm::max(bounds.max, max);
+}
+
+static float surface_area(const Bounds &bounds)
+{
+    glm::vec3 extent = glm::max(bounds.max - bounds.min, glm::vec3(0.0f));
+    return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+}
+
+struct BuildPrimitive {
+    Bounds bounds;
+    glm::vec3 centroid;
+    int triangle;
+};
+
+static Bounds range_bounds(const std::vector<BuildPrimitive> &primitives, int first, int last)
+{
+    Bounds bounds;
+    for (int i = first; i < last; ++i) {
+        grow_bounds(bounds, primitives[i].bounds.min, primitives[i].bounds.max);
+    }
+    return bounds;
+}
+
+// Split a range of primitives in two, at the best of the bin boundaries of
+// their centroids along the longest axis, or at the median. Returns the first
+// primitive of the second half.
+static int split_range(std::vector<BuildPrimitive> &primitives, int first, int last, bool median)
+{
+    Bounds centroids;
+    for (int i = first; i < last; ++i) {
+        grow_bounds(centroids, primitives[i].centroid, primitives[i].centroid);
+    }
+    glm::vec3 extent = centroids.max - centroids.min;
+    int axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : (extent.y >= extent.z ? 1 : 2);
+    int middle = (first + last) / 2;
+    if (!(extent[axis] > 0.0f)) return middle;  // Coinciding centroids
+    if (median) {
+        std::nth_element(primitives.begin() + first, primitives.begin() + middle,
+                         primitives.begin() + last,
+                         [axis](const BuildPrimitive &a, const BuildPrimitive &b) {
+                             return a.centroid[axis] < b.centroid[axis];
+                         });
+        return middle;
+    }
+
+    float scale = SAH_BINS / extent[axis];
+    float origin = centroids.min[axis];
+    auto bin_of = [&](const BuildPrimitive &primitive) {
+        return std::min(int((primitive.centroid[axis] - origin) * scale), SAH_BINS - 1);
+    };
+    Bounds bins[SAH_BINS];
+    int counts[SAH_BINS] = {};
+    for (int i = first; i < last; ++i) {
+        int bin = bin_of(primitives[i]);
+        grow_bounds(bins[bin], primitives[i].bounds.min, primitives[i].bounds.max);
+        counts[bin] += 1;
+    }
+
+    // Cost of each split (area times primitives of both sides), with the
+    // sides to the right of the boundaries swept first
+    float rightAreas[SAH_BINS];
+    int rightCounts[SAH_BINS];
+    Bounds right;
+    int count = 0;
+    for (int i = SAH_BINS - 1; i > 0; --i) {
+        grow_bounds(right, bins[i].min, bins[i].max);
+        count += counts[i];
+        rightAreas[i] = surface_area(right);
+        rightCounts[i] = count;
+    }
+    Bounds left;
+    count = 0;
+    float bestCost = std::numeric_limits<float>::max();
+    int bestSplit = 0;
+    for (int i = 1; i < SAH_BINS; ++i) {
+        grow_bounds(left, bins[i - 1].min, bins[i - 1].max);
+        count += counts[i - 1];
+        if (count == 0 || rightCounts[i] == 0) continue;
+        float cost = surface_area(left) * count + rightAreas[i] * rightCounts[i];
+        if (cost < bestCost) {
+            bestCost = cost;
+            bestSplit = i;
+        }
+    }
+    if (bestSplit == 0) return middle;
+
+    auto split = std::partition(primitives.begin() + first, primitives.begin() + last,
+                                [&](const BuildPrimitive &primitive) {
+                                    return bin_of(primitive) < bestSplit;
+                                });
+    return int(split - primitives.begin());
+}
+
+// Append the triangles of a leaf to the groups, four at a time. Returns the
+// index of the first group.
+static int add_leaf(PathTracerScene &scene, const std::vector<BuildPrimitive> &primitives,
+                    const std::vector<glm::vec3> &positions, int first, int last)
+{
+    int firstGroup = int(scene.groups.size());
+    for (int i = first; i < last; i += 4) {
+        PathTracerTriangleGroup group = {};
+        for (int lane = 0; lane < 4; ++lane) {
+            group.triangles[lane] = -1;
+            if (i + lane >= last) continue;
+            int triangle = primitives[i + lane].triangle;
+            const glm::vec3 *p = &positions[triangle * 3];
+            for (int axis = 0; axis < 3; ++axis) {
+                group.v0[axis][lane] = p[0][axis];
+                group.e1[axis][lane] = p[1][axis] - p[0][axis];
+                group.e2[axis][lane] = p[2][axis] - p[0][axis];
+            }
+            group.triangles[lane] = triangle;
+        }
+        scene.groups.push_back(group);
+    }
+    return firstGroup;
+}
+
+// Build the node of a range of primitives, which is split into (up to) four
+// children by splitting the largest of its parts until there are four, or
+// until all parts fit in leaves. Returns the index of the node.
+static int build_node(PathTracerScene &scene, std::vector<BuildPrimitive> &primitives,
+                      const std::vector<glm::vec3> &positions, int first, int last, int depth)
+{
+    int ranges[4][2] = {{first, last}};
+    int rangeCount = 1;
+    while (rangeCount < 4) {
+        int largest = -1, largestSize = LEAF_SIZE;
+        for (int i = 0; i < rangeCount; ++i) {
+            if (ranges[i][1] - ranges[i][0] > largestSize) {
+                largest = i;
+                largestSize = ranges[i][1] - ranges[i][0];
+            }
+        }
+        if (largest < 0) break;
+        int begin = ranges[largest][0], end = ranges[largest][1];
+        int split = split_range(primitives, begin, end, depth >= MAX_SAH_DEPTH);
+        ranges[largest][1] = split;
+        ranges[rangeCount][0] = split;
+        ranges[rangeCount][1] = end;
+        rangeCount += 1;
+    }
+
+    int index = int(scene.nodes.size());
+    scene.nodes.push_back(PathTracerNode());
+    PathTracerNode node = {};
+    for (int i = 0; i < 4; ++i) node.children[i] = -1;
+    for (int i = 0; i < rangeCount; ++i) {
+        int begin = ranges[i][0], end = ranges[i][1];
+        if (begin == end) continue;
+        Bounds bounds = range_bounds(primitives, begin, end);
+        node.minX[i] = bounds.min.x, node.minY[i] = bounds.min.y, node.minZ[i] = bounds.min.z;
+        node.maxX[i] = bounds.max.x, node.maxY[i] = bounds.max.y, node.maxZ[i] = bounds.max.z;
+        if (end - begin <= LEAF_SIZE) {
+            node.children[i] = add_leaf(scene, primitives, positions, begin, end);
+            node.groups[i] = (end - begin + 3) / 4;
+        } else {
+            node.children[i] = build_node(scene, primitives, positions, begin, end, depth + 1);
+        }
+    }
+    scene.nodes[index] = node;
+    return index;
+}
+
+void build_path_tracer_scene(PathTracerScene &scene, const std::vector<PathTracerObject> &objects,
+                             const std::vector<PathTracerMaterial> &materials)
+{
+    scene = PathTracerScene();
+    scene.materials = materials;
+
+    std::vector<glm::vec3> positions;  // Three per triangle
+    std::vector<BuildPrimitive> primitives;
+    for (const PathTracerObject &object : objects) {
+        const SoftwareMesh &mesh = *object.mesh;
+        glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(object.model)));
+        int material = (object.material < int(materials.size())) ? object.material : -1;
+        for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+            PathTracerTriangle triangle;
+            BuildPrimitive primitive;
+            for (int k = 0; k < 3; ++k) {
+                const SoftwareVertex &vertex = mesh.vertices[mesh.indices[i + k]];
+                glm::vec3 position = glm::vec3(object.model * glm::vec4(vertex.position, 1.0f));
+                glm::vec3 normal = normalMatrix * vertex.normal;
+                float length = glm::length(normal);
+                triangle.normals[k] = (length > 0.0f) ? normal / length : normal;
+                triangle.texcoords[k] = vertex.texcoord;
+                grow_bounds(primitive.bounds, position, position);
+                positions.push_back(position);
+            }
+            triangle.material = material;
+            primitive.centroid = 0.5f * (primitive.bounds.min + primitive.bounds.max);
+            primitive.triangle = int(scene.triangles.size());
+            primitives.push_back(primitive);
+            scene.triangles.push_back(triangle);
+        }
+    }
+
+    if (primitives.empty()) {
+        PathTracerNode node = {};
+        for (int i = 0; i < 4; ++i) node.children[i] = -1;
+        scene.nodes.push_back(node);
+        return;
+    }
+    build_node(scene, primitives, positions, 0, int(primitives.size()), 0);
+}
+
+// Ray intersection
+
+struct Ray {
+    glm::vec3 origin;
+    glm::vec3 direction;
+    float tMax;
+};
+
+// Ray broadcast to all lanes
+struct RayLanes {
+    Lanes origin[3];
+    Lanes direction[3];
+    Lanes inverseDirection[3];
+};
+
+struct Hit {
+    int group = -1;
+    int lane = 0;
+    float u = 0.0f, v = 0.0f;  // Barycentric coordinates of the second and third vertex
+};
+
+// Test a ray against the four triangles of a group, and shorten it to the
+// closest hit. Returns true if any triangle was hit.
+static bool intersect_group(const PathTracerScene &scene, int index, const RayLanes &r, Ray &ray,
+                            Hit &hit)
+{
+    const PathTracerTriangleGroup &group = scene.groups[index];
+    Lanes e1[3], e2[3], s[3];
+    for (int i = 0; i < 3; ++i) {
+        e1[i] = lanes_load(group.e1[i]);
+        e2[i] = lanes_load(group.e2[i]);
+        s[i] = lanes_sub(r.origin[i], lanes_load(group.v0[i]));
+    }
+    const Lanes *d = r.direction;
+    Lanes p[3] = {lanes_sub(lanes_mul(d[1], e2[2]), lanes_mul(d[2], e2[1])),
+                  lanes_sub(lanes_mul(d[2], e2[0]), lanes_mul(d[0], e2[2])),
+                  lanes_sub(lanes_mul(d[0], e2[1]), lanes_mul(d[1], e2[0]))};
+    Lanes q[3] = {lanes_sub(lanes_mul(s[1], e1[2]), lanes_mul(s[2], e1[1])),
+                  lanes_sub(lanes_mul(s[2], e1[0]), lanes_mul(s[0], e1[2])),
+                  lanes_sub(lanes_mul(s[0], e1[1]), lanes_mul(s[1], e1[0]))};
+    auto dot = [](const Lanes *a, const Lanes *b) {
+        return lanes_add(lanes_add(lanes_mul(a[0], b[0]), lanes_mul(a[1], b[1])),
+                         lanes_mul(a[2], b[2]));
+    };
+    Lanes det = dot(e1, p);
+    Lanes inverseDet = lanes_div(lanes(1.0f), det);
+    Lanes u = lanes_mul(dot(s, p), inverseDet);
+    Lanes v = lanes_mul(dot(d, q), inverseDet);
+    Lanes t = lanes_mul(dot(e2, q), inverseDet);
+
+    Lanes zero = lanes(0.0f);
+    Lanes valid = lanes_greater(lanes_mul(det, det), zero);  // Not degenerate or parallel
+    valid = lanes_and(valid, lanes_and(lanes_greater_equal(u, zero), lanes_greater_equal(v, zero)));
+    valid = lanes_and(valid, lanes_greater_equal(lanes(1.0f), lanes_add(u, v)));
+    valid = lanes_and(valid, lanes_and(lanes_greater(t, zero), lanes_greater(lanes(ray.tMax), t)));
+    int mask = lanes_mask(valid);
+    if (!mask) return false;
+
+    alignas(16) float ts[4], us[4], vs[4];
+    lanes_store(ts, t);
+    lanes_store(us, u);
+    lanes_store(vs, v);
+    for (int lane = 0; lane < 4; ++lane) {
+        if (!(mask & (1 << lane)) || !(ts[lane] < ray.tMax)) continue;
+        ray.tMax = ts[lane];
+        hit.group = index;
+        hit.lane = lane;
+        hit.u = us[lane];
+        hit.v = vs[lane];
+    }
+    return true;
+}
+
+// Find the closest hit of a ray, or with anyHit, stop at the first hit.
+// Returns true if the ray hit a triangle.
+static bool intersect_scene(const PathTracerScene &scene, Ray &ray, Hit &hit, bool anyHit)
+{
+    RayLanes r;
+    for (int i = 0; i < 3; ++i) {
+        // Avoid infinities in the slab tests (which would give NaNs)
+        float d = ray.direction[i];
+        if (std::abs(d) < 1e-20f) d = (d < 0.0f) ? -1e-20f : 1e-20f;
+        r.origin[i] = lanes(ray.origin[i]);
+        r.direction[i] = lanes(ray.direction[i]);
+        r.inverseDirection[i] = lanes(1.0f / d);
+    }
+
+    // Entries are nodes, or the groups of leaves, with the distance at which
+    // the ray enters their boxes
+    struct Entry {
+        int index;
+        int groups;
+        float t;
+    };
+    Entry stack[TRAVERSAL_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = {0, 0, 0.0f};
+    bool found = false;
+    while (stackSize > 0) {
+        Entry entry = stack[--stackSize];
+        if (entry.t > ray.tMax) continue;
+        if (entry.groups > 0) {
+            for (int i = entry.index; i < entry.index + entry.groups; ++i) {
+                if (intersect_group(scene, i, r, ray, hit)) {
+                    found = true;
+                    if (anyHit) return true;
+                }
+            }
+            continue;
+        }
+
+        const PathTracerNode &node = scene.nodes[entry.index];
+        const float *mins[3] = {node.minX, node.minY, node.minZ};
+        const float *maxs[3] = {node.maxX, node.maxY, node.maxZ};
+        Lanes tNear = lanes(0.0f), tFar = lanes(ray.tMax);
+        for (int i = 0; i < 3; ++i) {
+            Lanes t0 = lanes_mul(lanes_sub(lanes_load(mins[i]), r.origin[i]),
+                                 r.inverseDirection[i]);
+            Lanes t1 = lanes_mul(lanes_sub(lanes_load(maxs[i]), r.origin[i]),
+                                 r.inverseDirection[i]);
+            tNear = lanes_max(tNear, lanes_min(t0, t1));
+            tFar = lanes_min(tFar, lanes_max(t0, t1));
+        }
+        int mask = lanes_mask(lanes_greater_equal(tFar, tNear));
+        if (!mask) continue;
+
+        // Push the children that were hit farthest first, so that the
+        // nearest is visited first
+        alignas(16) float ts[4];
+        lanes_store(ts, tNear);
+        int order[4], count = 0;
+        for (int i = 0; i < 4; ++i) {
+            if (!(mask & (1 << i)) || node.children[i] < 0) continue;
+            int k = count++;
+            while (k > 0 && ts[order[k - 1]] < ts[i]) {
+                order[k] = order[k - 1];
+                k -= 1;
+            }
+            order[k] = i;
+        }
+        for (int k = 0; k < count; ++k) {
+            int i = order[k];
+            stack[stackSize++] = {node.children[i], node.groups[i], ts[i]};
+        }
+    }
+    return found;
+}
+
+// Shading
+
+// Random sequence (a PCG generator)
+struct Random {
+    uint32_t state;
+};
+
+static uint32_t hash(uint32_t x)
+{
+    uint32_t state = x * 747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+static float random_float(Random &random)
+{
+    random.state = random.state * 747796405u + 2891336453u;
+    uint32_t word = ((random.state >> ((random.state >> 28u) + 4u)) ^ random.state) * 277803737u;
+    word = (word >> 22u) ^ word;
+    return (word >> 8) * (1.0f / 16777216.0f);
+}
+
+static float linear_to_srgb(float value)
+{
+    return (value <= 0.0031308f) ? value * 12.92f : 1.055f * std::pow(value, 1.0f / 2.4f) - 0.055f;
+}
+
+static float luminance(const glm::vec3 &color)
+{
+    return glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+struct SurfacePoint {
+    glm::vec3 position;
+    glm::vec3 normal;           // Shading normal
+    glm::vec3 geometricNormal;  // Facing the incoming ray
+    glm::vec3 baseColor;
+    float metallic;
+    float roughness;
+};
+
+static SurfacePoint surface_point(const PathTracerScene &scene, const Ray &ray, const Hit &hit)
+{
+    const PathTracerTriangleGroup &group = scene.groups[hit.group];
+    const PathTracerTriangle &triangle = scene.triangles[group.triangles[hit.lane]];
+    glm::vec3 e1(group.e1[0][hit.lane], group.e1[1][hit.lane], group.e1[2][hit.lane]);
+    glm::vec3 e2(group.e2[0][hit.lane], group.e2[1][hit.lane], group.e2[2][hit.lane]);
+    float w = 1.0f - hit.u - hit.v;
+
+    SurfacePoint point;
+    point.position = ray.origin + ray.tMax * ray.direction;
+    point.geometricNormal = glm::normalize(glm::cross(e1, e2));
+    if (glm::dot(point.geometricNormal, ray.direction) > 0.0f) {
+        point.geometricNormal = -point.geometricNormal;
+    }
+    glm::vec3 normal = w * triangle.normals[0] + hit.u * triangle.normals[1] +
+                       hit.v * triangle.normals[2];
+    float length = glm::length(normal);
+    point.normal = (length > 1e-6f) ? normal / length : point.geometricNormal;
+    if (glm::dot(point.normal, point.geometricNormal) < 0.0f) point.normal = -point.normal;
+
+    PathTracerMaterial material;
+    if (triangle.material >= 0) material = scene.materials[triangle.material];
+    glm::vec2 texcoord = w * triangle.texcoords[0] + hit.u * triangle.texcoords[1] +
+                         hit.v * triangle.texcoords[2];
+    point.baseColor = material.baseColor;
+    point.metallic = material.metallic;
+    point.roughness = material.roughness;
+    if (material.baseColorTexture) {
+        glm::vec4 texel = sample_software_texture(*material.baseColorTexture, texcoord, 0.0f);
+        point.baseColor *= glm::vec3(srgb_to_linear(texel.r), srgb_to_linear(texel.g),
+                                     srgb_to_linear(texel.b));
+    }
+    if (material.metallicRoughnessTexture) {
+        glm::vec4 texel =
+            sample_software_texture(*material.metallicRoughnessTexture, texcoord, 0.0f);
+        point.roughness *= texel.g;
+        point.metallic *= texel.b;
+    }
+    return point;
+}
+
+// Offset a ray origin from a surface, to the side of a direction, so that
+// the ray does not hit the surface again
+static glm::vec3 offset_origin(const SurfacePoint &point, const glm::vec3 &direction)
+{
+    glm::vec3 a = glm::abs(point.position);
+    float epsilon = 1e-4f * (1.0f + std::max(a.x, std::max(a.y, a.z)));
+    float side = (glm::dot(direction, point.geometricNormal) >= 0.0f) ? 1.0f : -1.0f;
+    return point.position + side * epsilon * point.geometricNormal;
+}
+
+// Probability of sampling the specular lobe instead of the diffuse one
+static float specular_probability(const SurfacePoint &point, const glm::vec3 &V)
+{
+    glm::vec3 F0 = glm::mix(glm::vec3(0.04f), point.baseColor, point.metallic);
+    float NdotV = std::max(glm::dot(point.normal, V), 1e-4f);
+    float specular = luminance(F0 + (1.0f - F0) * std::pow(1.0f - NdotV, 5.0f));
+    float diffuse = luminance(point.baseColor) * (1.0f - point.metallic) * (1.0f - specular);
+    return (specular + diffuse > 0.0f) ? specular / (specular + diffuse) : 0.5f;
+}
+
+// Evaluate the BRDF (Lambert diffuse and GGX specular) times the cosine
+// for light from direction L, and the probability density of sampling L
+static glm::vec3 evaluate_brdf(const SurfacePoint &point, const glm::vec3 &V, const glm::vec3 &L,
+                               float specularProbability, float &pdf)
+{
+    pdf = 0.0f;
+    const glm::vec3 &N = point.normal;
+    float NdotL = glm::dot(N, L);
+    if (NdotL <= 0.0f) return glm::vec3(0.0f);
+    float NdotV = std::max(glm::dot(N, V), 1e-4f);
+    glm::vec3 H = glm::normalize(V + L);
+    float NdotH = std::max(glm::dot(N, H), 0.0f);
+    float VdotH = std::max(glm::dot(V, H), 1e-4f);
+
+    float alpha = std::max(point.roughness * point.roughness, 1e-3f);
+    float alpha2 = alpha * alpha;
+    float d = NdotH * NdotH * (alpha2 - 1.0f) + 1.0f;
+    float D = alpha2 / (PI * d * d);
+    float visibility = 0.5f / (NdotL * std::sqrt(NdotV * NdotV * (1.0f - alpha2) + alpha2) +
+                               NdotV * std::sqrt(NdotL * NdotL * (1.0f - alpha2) + alpha2));
+    glm::vec3 F0 = glm::mix(glm::vec3(0.04f), point.baseColor, point.metallic);
+    glm::vec3 F = F0 + (1.0f - F0) * std::pow(1.0f - VdotH, 5.0f);
+
+    glm::vec3 specular = D * visibility * F;
+    glm::vec3 diffuse = (1.0f - point.metallic) * (1.0f - F) * point.baseColor / PI;
+    pdf = specularProbability * D * NdotH / (4.0f * VdotH) +
+          (1.0f - specularProbability) * NdotL / PI;
+    return (diffuse + specular) * NdotL;
+}
+
+// Return an orthonormal basis with N as its third axis
+static glm::mat3 tangent_frame(const glm::vec3 &N)
+{
+    float sign = (N.z >= 0.0f) ? 1.0f : -1.0f;
+    float a = -1.0f / (sign + N.z);
+    float b = N.x * N.y * a;
+    glm::vec3 T(1.0f + sign * N.x * N.x * a, sign * b, -sign * N.x);
+    glm::vec3 B(b, sign + N.y * N.y * a, -N.y);
+    return glm::mat3(T, B, N);
+}
+
+// Sample the direction of the next bounce, from the GGX distribution of
+// half vectors or the cosine-weighted hemisphere
+static glm::vec3 sample_brdf(const SurfacePoint &point, const glm::vec3 &V,
+                             float specularProbability, Random &random)
+{
+    glm::mat3 frame = tangent_frame(point.normal);
+    float u1 = random_float(random), u2 = random_float(random);
+    float phi = 2.0f * PI * u2;
+    if (random_float(random) < specularProbability) {
+        float alpha = std::max(point.roughness * point.roughness, 1e-3f);
+        float alpha2 = alpha * alpha;
+        float cosTheta = std::sqrt((1.0f - u1) / (1.0f + (alpha2 - 1.0f) * u1));
+        float sinTheta = std::sqrt(std::max(1.0f - cosTheta * cosTheta, 0.0f));
+        glm::vec3 H = frame * glm::vec3(sinTheta * std::cos(phi), sinTheta * std::sin(phi),
+                                        cosTheta);
+        return glm::reflect(-V, H);
+    }
+    float r = std::sqrt(u1);
+    return frame * glm::vec3(r * std::cos(phi), r * std::sin(phi), std::sqrt(1.0f - u1));
+}
+
+static glm::vec3 environment_radiance(const PathTracerFrame &frame, const glm::vec3 &direction)
+{
+    if (frame.environment) return sample_software_cubemap(*frame.environment, direction, 0.0f);
+    return frame.environmentColor;
+}
+
+// Trace a path from the camera, and return the radiance it carries back
+static glm::vec3 trace_path(const PathTracerScene &scene, const PathTracerFrame &frame, Ray ray,
+                            Random &random, int64_t &rays)
+{
+    glm::vec3 radiance(0.0f), throughput(1.0f);
+    bool sunLight = glm::dot(frame.sunColor, frame.sunColor) > 0.0f;
+    for (int bounce = 0;; ++bounce) {
+        Hit hit;
+        rays += 1;
+        if (!intersect_scene(scene, ray, hit, false)) {
+            glm::vec3 background = (bounce == 0) ? frame.backgroundColor
+                                                 : environment_radiance(frame, ray.direction);
+            radiance += throughput * background;
+            break;
+        }
+        SurfacePoint point = surface_point(scene, ray, hit);
+        glm::vec3 V = -ray.direction;
+        float specularProbability = specular_probability(point, V);
+
+        // Light from the sun, if it is not in shadow
+        const glm::vec3 &sun = frame.sunDirection;
+        if (sunLight && glm::dot(point.normal, sun) > 0.0f &&
+            glm::dot(point.geometricNormal, sun) > 0.0f) {
+            Ray shadowRay = {offset_origin(point, sun), sun, std::numeric_limits<float>::max()};
+            Hit shadowHit;
+            rays += 1;
+            if (!intersect_scene(scene, shadowRay, shadowHit, true)) {
+                float pdf;
+                radiance += throughput * evaluate_brdf(point, V, sun, specularProbability, pdf) *
+                            frame.sunColor;
+            }
+        }
+        if (bounce == frame.maxBounces) break;
+
+        glm::vec3 L = sample_brdf(point, V, specularProbability, random);
+        if (glm::dot(L, point.geometricNormal) <= 0.0f) break;
+        float pdf;
+        glm::vec3 weight = evaluate_brdf(point, V, L, specularProbability, pdf);
+        if (!(pdf > 0.0f)) break;
+        throughput *= weight / pdf;
+
+        // Russian roulette
+        if (bounce >= 2) {
+            float survival = std::min(std::max(throughput.r, std::max(throughput.g, throughput.b)),
+                                      0.95f);
+            if (!(random_float(random) < survival)) break;
+            throughput /= survival;
+        }
+        ray = {offset_origin(point, L), L, std::numeric_limits<float>::max()};
+    }
+    return radiance;
+}
+
+// Sampling
+
+void create_path_tracer(PathTracer &tracer, int width, int height, WorkerPool &workers)
+{
+    tracer.width = width;
+    tracer.height = height;
+    tracer.workers = &workers;
+    reset_path_tracer(tracer);
+}
+
+void reset_path_tracer(PathTracer &tracer)
+{
+    tracer.accumulation.assign(tracer.width * tracer.height, glm::vec3(0.0f));
+    tracer.samples = 0;
+    tracer.rays = 0;
+    tracer.seconds = 0.0;
+}
+
+// Add one sample to the pixels of a tile
+static void trace_tile(PathTracer &tracer, const PathTracerScene &scene,
+                       const PathTracerFrame &frame, const glm::mat4 &inverseViewProjection,
+                       int tile, int64_t &rays)
+{
+    int tilesX = (tracer.width + PATH_TRACER_TILE_SIZE - 1) / PATH_TRACER_TILE_SIZE;
+    int x0 = tile % tilesX * PATH_TRACER_TILE_SIZE, y0 = tile / tilesX * PATH_TRACER_TILE_SIZE;
+    int x1 = std::min(x0 + PATH_TRACER_TILE_SIZE, tracer.width);
+    int y1 = std::min(y0 + PATH_TRACER_TILE_SIZE, tracer.height);
+    for (int y = y0; y < y1; ++y) {
+        for (int x = x0; x < x1; ++x) {
+            int pixel = y * tracer.width + x;
+            Random random = {hash(uint32_t(pixel) ^ hash(uint32_t(tracer.samples)))};
+
+            // Camera ray through a random point of the pixel, from the near
+            // plane to the far plane
+            glm::vec2 ndc = glm::vec2((x + random_float(random)) / tracer.width,
+                                      (y + random_float(random)) / tracer.height) * 2.0f - 1.0f;
+            glm::vec4 near = inverseViewProjection * glm::vec4(ndc, -1.0f, 1.0f);
+            glm::vec4 far = inverseViewProjection * glm::vec4(ndc, 1.0f, 1.0f);
+            glm::vec3 origin = glm::vec3(near) / near.w;
+            Ray ray = {origin, glm::normalize(glm::vec3(far) / far.w - origin),
+                       std::numeric_limits<float>::max()};
+
+            glm::vec3 radiance = trace_path(scene, frame, ray, random, rays);
+            if (std::isfinite(radiance.r + radiance.g + radiance.b)) {
+                tracer.accumulation[pixel] += radiance;
+            }
+        }
+    }
+}
+
+void trace_path_tracer_samples(PathTracer &tracer, const PathTracerScene &scene,
+                               const PathTracerFrame &frame, int maxSamples, double maxSeconds)
+{
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    glm::mat4 inverseViewProjection = glm::inverse(frame.projection * frame.view);
+    int tilesX = (tracer.width + PATH_TRACER_TILE_SIZE - 1) / PATH_TRACER_TILE_SIZE;
+    int tilesY = (tracer.height + PATH_TRACER_TILE_SIZE - 1) / PATH_TRACER_TILE_SIZE;
+    int tileCount = tilesX * tilesY;
+
+    double elapsed = 0.0, sampleSeconds = 0.0;
+    for (int added = 0;; ++added) {
+        if (added > 0 && (tracer.samples >= maxSamples ||
+                          (maxSeconds > 0.0 && elapsed + sampleSeconds > maxSeconds))) {
+            break;
+        }
+
+        std::vector<int64_t> rays(tileCount, 0);
+        parallel_for(*tracer.workers, tileCount, 1, [&](int first, int last) {
+            for (int tile = first; tile < last; ++tile) {
+                trace_tile(tracer, scene, frame, inverseViewProjection, tile, rays[tile]);
+            }
+        });
+        tracer.samples += 1;
+        for (int64_t count : rays) tracer.rays += count;
+
+        double now = std::chrono::duration<double>(Clock::now() - start).count();
+        sampleSeconds = now - elapsed;
+        elapsed = now;
+    }
+    tracer.seconds += elapsed;
+}
+
+void read_path_tracer_pixels(const PathTracer &tracer, std::vector<uint8_t> &pixels)
+{
+    pixels.resize(tracer.width * tracer.height * 3);
+    float scale = 1.0f / std::max(tracer.samples, 1);
+    for (int y = 0; y < tracer.height; ++y) {
+        const glm::vec3 *src = &tracer.accumulation[(tracer.height - 1 - y) * tracer.width];
+        uint8_t *dst = &pixels[y * tracer.width * 3];
+        for (int x = 0; x < tracer.width * 3; ++x) {
+            float value = linear_to_srgb(std::min(std::max(src[x / 3][x % 3] * scale, 0.0f), 1.0f));
+            dst[x] = uint8_t(value * 255.0f + 0.5f);
+        }
+    }
+}
+
+}  // namespace cg
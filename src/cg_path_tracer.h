@@ -0,0 +1,125 @@
+// Multi-threaded path tracer, for reference images of the shadows and
+// reflections that the rasterizers approximate. The triangles of a scene are
+// stored in a 4-wide bounding volume hierarchy, whose nodes test a ray
+// against their four child boxes at once, and whose leaves test it against
+// four triangles at once (with SSE2, see cg_simd.h). Images are accumulated
+// one sample per pixel at a time, with the tiles shared out to a worker pool
+// (see cg_worker_pool.h), until a sample count or a time budget is reached.
+// Does not depend on OpenGL.
+//
+
+#pragma once
+
+#include "cg_software_renderer.h"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+namespace cg {
+
+// Width and height of the tiles that the workers take in turn
+const int PATH_TRACER_TILE_SIZE = 16;
+
+// glTF metallic-roughness material. The base color texture is sRGB, and the
+// metallic-roughness texture has roughness in G and metalness in B.
+struct PathTracerMaterial {
+    glm::vec3 baseColor = glm::vec3(1.0f);
+    float metallic = 0.0f;
+    float roughness = 1.0f;
+    const SoftwareTexture *baseColorTexture = nullptr;
+    const SoftwareTexture *metallicRoughnessTexture = nullptr;
+};
+
+struct PathTracerObject {
+    const SoftwareMesh *mesh;
+    glm::mat4 model;
+    int material;  // Index into the materials of the scene, or -1 for the default
+};
+
+// Node of the hierarchy, with the boxes of its four children as structure of
+// arrays. Empty child slots have inverted boxes, which no ray hits.
+struct alignas(16) PathTracerNode {
+    float minX[4], minY[4], minZ[4];
+    float maxX[4], maxY[4], maxZ[4];
+    int children[4];  // Index of the child node, or of the first group of a leaf
+    int groups[4];    // Triangle groups of leaf children (0 for inner nodes)
+};
+
+// Four triangles, as their first vertices and the edges from them (for
+// Moller-Trumbore tests). Unused lanes have degenerate triangles.
+struct alignas(16) PathTracerTriangleGroup {
+    float v0[3][4];
+    float e1[3][4];
+    float e2[3][4];
+    int triangles[4];  // Index into PathTracerScene::triangles
+};
+
+// Shading attributes of a triangle (in world space)
+struct PathTracerTriangle {
+    glm::vec3 normals[3];
+    glm::vec2 texcoords[3];
+    int material;
+};
+
+struct PathTracerScene {
+    std::vector<PathTracerNode> nodes;  // Root first
+    std::vector<PathTracerTriangleGroup> groups;
+    std::vector<PathTracerTriangle> triangles;
+    std::vector<PathTracerMaterial> materials;
+};
+
+// Transform the triangles of the objects to world space, and build the
+// hierarchy over them (with the surface area heuristic)
+void build_path_tracer_scene(PathTracerScene &scene, const std::vector<PathTracerObject> &objects,
+                             const std::vector<PathTracerMaterial> &materials);
+
+// Camera and lights of a frame
+struct PathTracerFrame {
+    glm::mat4 view;
+    glm::mat4 projection;
+    glm::vec3 backgroundColor;  // Seen by camera rays that miss the scene
+
+    // The environment lights the scene from all directions (given in world
+    // space), with the radiance of a cubemap or a uniform color
+    const SoftwareCubemap *environment = nullptr;
+    glm::vec3 environmentColor = glm::vec3(0.0f);  // Used without a cubemap
+
+    // Directional light, sampled with shadow rays at each bounce
+    glm::vec3 sunDirection = glm::vec3(0.0f, 1.0f, 0.0f);  // Towards the light, in world space
+    glm::vec3 sunColor = glm::vec3(0.0f);                   // Irradiance
+
+    int maxBounces = 4;  // Bounces after the first hit (paths are also ended by roulette)
+};
+
+struct PathTracer {
+    int width = 0;
+    int height = 0;
+    WorkerPool *workers = nullptr;
+    std::vector<glm::vec3> accumulation;  // Sum of the samples of each pixel, bottom row first
+    int samples = 0;                      // Samples per pixel accumulated so far
+
+    // Statistics since the last reset
+    int64_t rays = 0;      // Camera, bounce and shadow rays
+    double seconds = 0.0;  // Time spent tracing them
+};
+
+// Set the image size, and the pool whose workers (and the calling thread)
+// trace the samples
+void create_path_tracer(PathTracer &tracer, int width, int height, WorkerPool &workers);
+
+// Discard the accumulated samples (e.g., when the camera has moved)
+void reset_path_tracer(PathTracer &tracer);
+
+// Accumulate samples until maxSamples per pixel have been, or until the
+// next sample would exceed a budget of maxSeconds (if positive) since the
+// call. At least one sample is added. Each sample of a pixel has its own
+// random sequence, so that images do not depend on the number of threads.
+void trace_path_tracer_samples(PathTracer &tracer, const PathTracerScene &scene,
+                               const PathTracerFrame &frame, int maxSamples, double maxSeconds);
+
+// Copy the average of the samples as sRGB rows, top row first
+void read_path_tracer_pixels(const PathTracer &tracer, std::vector<uint8_t> &pixels);
+
+}  // namespace cg
@@ -0,0 +1,317 @@
+// Frame profiler: scoped CPU timers and GPU timer queries, which record
+// events into per-thread rings. The events are collected into rolling
+// statistics per scope, and can be written as a Chrome trace_event JSON file
+// (for chrome://tracing or https://ui.perfetto.dev).
+//
+
+#include "cg_profiler.h"
+#include "cg_utils.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+namespace cg {
+
+std::atomic<bool> profilerEnabled(false);
+
+const unsigned PROFILE_RING_SIZE = 8192;  // Must be a power of two
+const size_t MAX_TRACE_EVENTS = 4 * 1024 * 1024;
+
+// Event ring of one thread. Only the owning thread advances head, and only
+// the collector advances tail.
+struct ProfileRing {
+    ProfileEvent events[PROFILE_RING_SIZE];
+    std::atomic<uint64_t> head;
+    uint64_t tail = 0;
+    int thread = 0;  // Index of the thread, in order of its first event
+};
+
+struct ProfileTraceEvent {
+    ProfileEvent event;
+    int thread;
+};
+
+struct ProfileHistory {
+    std::string name;
+    bool gpu;
+    std::vector<float> samples;  // Ring of the last historySize samples
+    int next = 0;
+};
+
+struct ProfileState {
+    std::mutex ringsMutex;  // Only taken when a thread records its first event
+    std::vector<std::unique_ptr<ProfileRing>> rings;
+
+    std::mutex collectMutex;
+    std::vector<ProfileHistory> histories;  // In order of first collection
+    int historySize = PROFILE_HISTORY;
+    bool tracing = false;
+    double traceStart = 0.0;
+    std::vector<ProfileTraceEvent> trace;
+};
+
+static ProfileState profileState;
+
+void set_profiler_enabled(bool enabled)
+{
+    profilerEnabled.store(enabled);
+}
+
+static ProfileRing &thread_ring()
+{
+    thread_local ProfileRing *ring = nullptr;
+    if (!ring) {
+        std::lock_guard<std::mutex> lock(profileState.ringsMutex);
+        profileState.rings.emplace_back(new ProfileRing());
+        ring = profileState.rings.back().get();
+        ring->head.store(0);
+        ring->thread = int(profileState.rings.size()) - 1;
+    }
+    return *ring;
+}
+
+void record_profile_event(const char *name, double start, double end, bool gpu)
+{
+    ProfileRing &ring = thread_ring();
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    ProfileEvent &event = ring.events[head & (PROFILE_RING_SIZE - 1)];
+    event.name = name;
+    event.start = start;
+    event.end = end;
+    event.gpu = gpu;
+    ring.head.store(head + 1, std::memory_order_release);
+}
+
+void ProfileScope::begin(const char *scopeName)
+{
+    name = scopeName;
+    start = get_time();
+}
+
+void ProfileScope::end()
+{
+    record_profile_event(name, start, get_time());
+}
+
+void begin_gpu_profiler_frame(GpuProfiler &gpuProfiler)
+{
+    if (!gpuProfiler.calibrated && profilerEnabled.load(std::memory_order_relaxed)) {
+        GLint64 timestamp = 0;
+        glGetInteger64v(GL_TIMESTAMP, &timestamp);
+        gpuProfiler.gpuToCpuTime = get_time() - timestamp * 1e-9;
+        gpuProfiler.calibrated = true;
+    }
+
+    gpuProfiler.frame += 1;
+    int slot = gpuProfiler.frame % GPU_PROFILER_LATENCY;
+    const std::vector<GLuint> &queries = gpuProfiler.queries[slot];
+    for (const GpuProfiler::Scope &scope : gpuProfiler.scopes[slot]) {
+        GLint available = 0;
+        glGetQueryObjectiv(queries[scope.queryIndex + 1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) {
+            gpuProfiler.droppedScopes += 1;
+            continue;
+        }
+        GLuint64 start = 0, end = 0;
+        glGetQueryObjectui64v(queries[scope.queryIndex], GL_QUERY_RESULT, &start);
+        glGetQueryObjectui64v(queries[scope.queryIndex + 1], GL_QUERY_RESULT, &end);
+        record_profile_event(scope.name, start * 1e-9 + gpuProfiler.gpuToCpuTime,
+                             end * 1e-9 + gpuProfiler.gpuToCpuTime, true);
+    }
+    gpuProfiler.scopes[slot].clear();
+}
+
+void flush_gpu_profiler(GpuProfiler &gpuProfiler)
+{
+    glFinish();
+    for (int i = 0; i < GPU_PROFILER_LATENCY; ++i) begin_gpu_profiler_frame(gpuProfiler);
+}
+
+void destroy_gpu_profiler(GpuProfiler &gpuProfiler)
+{
+    for (std::vector<GLuint> &queries : gpuProfiler.queries) {
+        if (!queries.empty()) glDeleteQueries(GLsizei(queries.size()), queries.data());
+    }
+    gpuProfiler = GpuProfiler();
+}
+
+void GpuProfileScope::begin(GpuProfiler &gpuProfiler, const char *name)
+{
+    int slot = gpuProfiler.frame % GPU_PROFILER_LATENCY;
+    std::vector<GLuint> &queries = gpuProfiler.queries[slot];
+    int index = int(gpuProfiler.scopes[slot].size()) * 2;
+    if (index + 2 > int(queries.size())) {
+        queries.resize(index + 2);
+        glGenQueries(2, &queries[index]);
+    }
+    glQueryCounter(queries[index], GL_TIMESTAMP);
+
+    GpuProfiler::Scope scope;
+    scope.name = name;
+    scope.queryIndex = index;
+    gpuProfiler.scopes[slot].push_back(scope);
+    profiler = &gpuProfiler;
+    queryIndex = index;
+}
+
+void GpuProfileScope::end()
+{
+    int slot = profiler->frame % GPU_PROFILER_LATENCY;
+    glQueryCounter(profiler->queries[slot][queryIndex + 1], GL_TIMESTAMP);
+}
+
+static ProfileHistory &find_history(const std::string &name, bool gpu)
+{
+    for (ProfileHistory &history : profileState.histories) {
+        if (history.gpu == gpu && history.name == name) return history;
+    }
+    profileState.histories.push_back(ProfileHistory());
+    profileState.histories.back().name = name;
+    profileState.histories.back().gpu = gpu;
+    return profileState.histories.back();
+}
+
+void collect_profile_events()
+{
+    std::lock_guard<std::mutex> lock(profileState.collectMutex);
+    std::vector<ProfileRing *> rings;
+    {
+        std::lock_guard<std::mutex> ringsLock(profileState.ringsMutex);
+        for (auto &ring : profileState.rings) rings.push_back(ring.get());
+    }
+
+    // Total time of each scope since the last collection
+    std::vector<std::pair<ProfileEvent, float>> totals;
+    for (ProfileRing *ring : rings) {
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t oldest = (head > PROFILE_RING_SIZE) ? head - PROFILE_RING_SIZE : 0;
+        uint64_t first = std::max(ring->tail, oldest);
+        std::vector<ProfileEvent> events;
+        for (uint64_t i = first; i < head; ++i) {
+            events.push_back(ring->events[i & (PROFILE_RING_SIZE - 1)]);
+        }
+        ring->tail = head;
+
+        // Events that the thread may have overwritten while they were copied
+        // are dropped
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t headAfterCopy = ring->head.load(std::memory_order_relaxed);
+        for (uint64_t i = first; i < head; ++i) {
+            if (headAfterCopy >= i + PROFILE_RING_SIZE) continue;
+            const ProfileEvent &event = events[i - first];
+            float duration = float(event.end - event.start);
+            auto total = std::find_if(totals.begin(), totals.end(),
+                                      [&](const std::pair<ProfileEvent, float> &t) {
+                                          return t.first.gpu == event.gpu &&
+                                                 std::strcmp(t.first.name, event.name) == 0;
+                                      });
+            if (total == totals.end()) {
+                totals.push_back(std::make_pair(event, duration));
+            } else {
+                total->second += duration;
+            }
+            if (profileState.tracing && profileState.trace.size() < MAX_TRACE_EVENTS &&
+                event.start >= profileState.traceStart) {
+                ProfileTraceEvent traceEvent;
+                traceEvent.event = event;
+                traceEvent.thread = ring->thread;
+                profileState.trace.push_back(traceEvent);
+            }
+        }
+    }
+
+    for (const auto &total : totals) {
+        ProfileHistory &history = find_history(total.first.name, total.first.gpu);
+        if (int(history.samples.size()) < profileState.historySize) {
+            history.samples.push_back(total.second);
+        } else {
+            history.samples[history.next] = total.second;
+            history.next = (history.next + 1) % profileState.historySize;
+        }
+    }
+}
+
+std::vector<ProfileScopeStats> get_profile_stats()
+{
+    std::lock_guard<std::mutex> lock(profileState.collectMutex);
+    std::vector<ProfileScopeStats> stats;
+    for (const ProfileHistory &history : profileState.histories) {
+        std::vector<float> samples = history.samples;
+        std::sort(samples.begin(), samples.end());
+
+        ProfileScopeStats scope;
+        scope.name = history.name;
+        scope.gpu = history.gpu;
+        scope.count = int(samples.size());
+        if (!samples.empty()) {
+            float sum = 0.0f;
+            for (float sample : samples) sum += sample;
+            scope.minTime = samples.front();
+            scope.avgTime = sum / samples.size();
+            scope.p99Time = samples[int(std::ceil(0.99f * samples.size())) - 1];
+        }
+        stats.push_back(scope);
+    }
+    return stats;
+}
+
+void reset_profile_stats(int historySize)
+{
+    std::lock_guard<std::mutex> lock(profileState.collectMutex);
+    profileState.histories.clear();
+    profileState.historySize = std::max(1, historySize);
+}
+
+void start_profile_trace()
+{
+    std::lock_guard<std::mutex> lock(profileState.collectMutex);
+    profileState.tracing = true;
+    profileState.traceStart = get_time();
+    profileState.trace.clear();
+}
+
+bool write_profile_trace(const std::string &filename)
+{
+    std::lock_guard<std::mutex> lock(profileState.collectMutex);
+    std::ofstream file(filename);
+    if (!file) return false;
+
+    // Each thread gets a track for its CPU scopes, and one for the GPU scopes
+    // of its context
+    file << "{\"traceEvents\":[\n";
+    std::vector<std::pair<int, bool>> tracks;
+    char line[256];
+    for (const ProfileTraceEvent &traceEvent : profileState.trace) {
+        const ProfileEvent &event = traceEvent.event;
+        int track = traceEvent.thread * 2 + (event.gpu ? 1 : 0);
+        std::pair<int, bool> key(traceEvent.thread, event.gpu);
+        if (std::find(tracks.begin(), tracks.end(), key) == tracks.end()) tracks.push_back(key);
+        std::snprintf(line, sizeof(line),
+                      "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                      "\"ts\":%.3f,\"dur\":%.3f},\n",
+                      event.name, event.gpu ? "gpu" : "cpu", track,
+                      (event.start - profileState.traceStart) * 1e6,
+                      (event.end - event.start) * 1e6);
+        file << line;
+    }
+    for (const auto &key : tracks) {
+        std::snprintf(line, sizeof(line),
+                      "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                      "\"args\":{\"name\":\"%s %d\"}},\n",
+                      key.first * 2 + (key.second ? 1 : 0), key.second ? "GPU" : "CPU thread",
+                      key.first);
+        file << line;
+    }
+    file << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"args\":{\"name\":\"model_viewer\"}}\n";
+    file << "],\"displayTimeUnit\":\"ms\"}\n";
+    return bool(file);
+}
+
+}  // namespace cg
@@ -0,0 +1,137 @@
+// Frame profiler: scoped CPU timers and GPU timer queries, which record
+// events into per-thread rings. The events are collected into rolling
+// statistics per scope, and can be written as a Chrome trace_event JSON file
+// (for chrome://tracing or https://ui.perfetto.dev).
+//
+
+#pragma once
+
+#include <GL/gl3w.h>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace cg {
+
+// Profiling is off by default. When it is off, scopes cost a flag test.
+extern std::atomic<bool> profilerEnabled;
+
+void set_profiler_enabled(bool enabled);
+
+// A timed scope, in seconds on the cg::get_time() clock
+struct ProfileEvent {
+    const char *name;  // Not copied, so this should be a string literal
+    double start;
+    double end;
+    bool gpu;
+};
+
+// Record an event in the ring of the calling thread. This does not lock:
+// each thread writes its own ring, and events that are not collected before
+// the ring wraps around are dropped.
+void record_profile_event(const char *name, double start, double end, bool gpu = false);
+
+// Times the enclosing scope on the CPU
+struct ProfileScope {
+    const char *name = nullptr;
+    double start = 0.0;
+
+    explicit ProfileScope(const char *scopeName)
+    {
+        if (profilerEnabled.load(std::memory_order_relaxed)) begin(scopeName);
+    }
+    ~ProfileScope()
+    {
+        if (name) end();
+    }
+    ProfileScope(const ProfileScope &) = delete;
+    ProfileScope &operator=(const ProfileScope &) = delete;
+
+    void begin(const char *scopeName);
+    void end();
+};
+
+// Number of frames that GPU queries are in flight before their results are
+// read. Results that are still not available then are dropped, so reading
+// them never stalls.
+const int GPU_PROFILER_LATENCY = 3;
+
+// GPU timer queries of an OpenGL context. Each scope is timed with a pair
+// of GL_TIMESTAMP queries, which (unlike GL_TIME_ELAPSED) may be nested.
+struct GpuProfiler {
+    struct Scope {
+        const char *name;
+        int queryIndex;  // Index of the first query of the pair in the frame's pool
+    };
+    std::vector<GLuint> queries[GPU_PROFILER_LATENCY];  // Pool of each frame in flight
+    std::vector<Scope> scopes[GPU_PROFILER_LATENCY];
+    int frame = 0;
+    double gpuToCpuTime = 0.0;  // Offset from GPU timestamps to the CPU clock
+    bool calibrated = false;
+    int droppedScopes = 0;
+};
+
+// Start a new frame: the results of the frame GPU_PROFILER_LATENCY frames
+// back are recorded as events of the calling thread
+void begin_gpu_profiler_frame(GpuProfiler &profiler);
+
+// Wait for the queries in flight and record their results (e.g., before
+// writing a trace at exit)
+void flush_gpu_profiler(GpuProfiler &profiler);
+
+void destroy_gpu_profiler(GpuProfiler &profiler);
+
+// Times the enclosing scope on the GPU
+struct GpuProfileScope {
+    GpuProfiler *profiler = nullptr;
+    int queryIndex = 0;
+
+    GpuProfileScope(GpuProfiler &gpuProfiler, const char *name)
+    {
+        if (profilerEnabled.load(std::memory_order_relaxed)) begin(gpuProfiler, name);
+    }
+    ~GpuProfileScope()
+    {
+        if (profiler) end();
+    }
+    GpuProfileScope(const GpuProfileScope &) = delete;
+    GpuProfileScope &operator=(const GpuProfileScope &) = delete;
+
+    void begin(GpuProfiler &gpuProfiler, const char *name);
+    void end();
+};
+
+// Rolling statistics of a scope over the last PROFILE_HISTORY samples (by
+// default, see reset_profile_stats()). Each sample is the total time of the
+// scope between two collections (i.e., per frame when events are collected
+// once per frame).
+const int PROFILE_HISTORY = 120;
+
+struct ProfileScopeStats {
+    std::string name;
+    bool gpu = false;
+    int count = 0;  // Number of samples in the history
+    float minTime = 0.0f;
+    float avgTime = 0.0f;
+    float p99Time = 0.0f;
+};
+
+// Collect the events of all threads into the statistics (and the trace, if
+// one is being recorded). Collections from several threads are serialized.
+void collect_profile_events();
+
+std::vector<ProfileScopeStats> get_profile_stats();
+
+// Clear the statistics, and keep the last historySize samples of each scope
+// from now on
+void reset_profile_stats(int historySize = PROFILE_HISTORY);
+
+// Keep all collected events from now on, for write_profile_trace()
+void start_profile_trace();
+
+// Write the recorded events as a Chrome trace_event JSON file
+bool write_profile_trace(const std::string &filename);
+
+}  // namespace cg
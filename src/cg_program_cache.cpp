@@ -0,0 +1,122 @@
+// Cache of linked shader program binaries on disk, so that programs do not
+// have to be compiled from source again on the next start.
+//
+
+#include "cg_program_cache.h"
+#include "cg_multi_draw.h"
+#include "cg_utils.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+namespace cg {
+
+// 64-bit FNV-1a hash
+static uint64_t hash_string(const std::string &str, uint64_t hash = 14695981039346656037ull)
+{
+    for (unsigned char c : str) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static void make_directory(const std::string &directory)
+{
+#ifdef _WIN32
+    _mkdir(directory.c_str());
+#else
+    mkdir(directory.c_str(), 0755);
+#endif
+}
+
+void create_program_cache(ProgramCache &cache, const std::string &directory)
+{
+    cache = ProgramCache();
+    cache.driver = std::string((const char *)glGetString(GL_VENDOR)) + "\n" +
+                   (const char *)glGetString(GL_RENDERER) + "\n" +
+                   (const char *)glGetString(GL_VERSION);
+
+    // Let the driver compile shaders on its own threads, so that compiles
+    // that are issued together can run in parallel
+    if (has_gl_extension("GL_KHR_parallel_shader_compile")) {
+        auto maxShaderCompilerThreads = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)gl3wGetProcAddress(
+            "glMaxShaderCompilerThreadsKHR");
+        if (maxShaderCompilerThreads) {
+            maxShaderCompilerThreads(0xFFFFFFFF);  // Use the driver's default number
+            cache.parallelCompile = true;
+        }
+    }
+
+    // Note: glGetProgramBinary() is core in OpenGL 4.1
+    GLint numFormats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+    cache.binariesSupported = numFormats > 0 && glGetProgramBinary && glProgramBinary;
+    if (!cache.binariesSupported || directory.empty()) return;
+
+    make_directory(directory);
+    cache.directory = directory;
+}
+
+std::string program_cache_key(const ProgramCache &cache, const std::string &vertexShaderSource,
+                              const std::string &fragmentShaderSource)
+{
+    uint64_t hash = hash_string(cache.driver);
+    hash = hash_string(vertexShaderSource, hash_string("\nvs\n", hash));
+    hash = hash_string(fragmentShaderSource, hash_string("\nfs\n", hash));
+
+    char key[17];
+    std::snprintf(key, sizeof(key), "%016llx", (unsigned long long)hash);
+    return key;
+}
+
+GLuint load_cached_program(ProgramCache &cache, const std::string &key)
+{
+    if (cache.directory.empty()) return 0;
+
+    // The file has the binary format, followed by the binary
+    std::ifstream file(cache.directory + key + ".bin", std::ios::binary);
+    GLenum format = 0;
+    if (!file.read((char *)&format, sizeof(format))) return 0;
+    std::vector<char> binary((std::istreambuf_iterator<char>(file)),
+                             std::istreambuf_iterator<char>());
+    if (binary.empty()) return 0;
+
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, format, binary.data(), GLsizei(binary.size()));
+    return program;
+}
+
+void save_cached_program(ProgramCache &cache, const std::string &key, GLuint program)
+{
+    if (cache.directory.empty()) return;
+
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) return;
+    std::vector<char> binary(length);
+    GLenum format = 0;
+    glGetProgramBinary(program, length, &length, &format, binary.data());
+
+    // Write to a temporary file first, so that other processes or threads
+    // rendering with the same cache never read a partly written binary
+    std::string filename = cache.directory + key + ".bin";
+    std::string tempFilename = temporary_filename(filename);
+    {
+        std::ofstream file(tempFilename, std::ios::binary);
+        file.write((const char *)&format, sizeof(format));
+        file.write(binary.data(), length);
+    }
+    if (std::rename(tempFilename.c_str(), filename.c_str()) != 0) std::remove(tempFilename.c_str());
+}
+
+}  // namespace cg
@@ -0,0 +1,43 @@
+// Cache of linked shader program binaries on disk, so that programs do not
+// have to be compiled from source again on the next start.
+//
+
+#pragma once
+
+#include <GL/gl3w.h>
+
+#include <string>
+
+namespace cg {
+
+// Program binaries are stored in one file per program, named by a hash of
+// the shader sources and the GL driver. Binaries from another driver (or
+// driver version) are never loaded, since the driver is part of the hash.
+struct ProgramCache {
+    std::string directory;           // Empty if the cache is disabled
+    std::string driver;              // GL vendor, renderer and version
+    bool binariesSupported = false;  // Set if the driver has a binary format
+    bool parallelCompile = false;    // Set if GL_KHR_parallel_shader_compile is used
+    int loadedCount = 0;             // Programs loaded from binaries
+    int compiledCount = 0;           // Programs compiled from source
+};
+
+// Set up a cache in a directory (which is created if needed). This also
+// enables parallel shader compilation in the driver, if supported.
+void create_program_cache(ProgramCache &cache, const std::string &directory);
+
+// Return the cache key of a program
+std::string program_cache_key(const ProgramCache &cache, const std::string &vertexShaderSource,
+                              const std::string &fragmentShaderSource);
+
+// Create a program from a cached binary. Returns 0 if there is no binary for
+// the key. The link status of the program must be checked, since drivers may
+// reject binaries, and the program is counted in loadedCount once it has
+// linked (see cg::finish_shader_program()).
+GLuint load_cached_program(ProgramCache &cache, const std::string &key);
+
+// Store the binary of a linked program. The program should have been linked
+// with GL_PROGRAM_BINARY_RETRIEVABLE_HINT set.
+void save_cached_program(ProgramCache &cache, const std::string &key, GLuint program);
+
+}  // namespace cg
@@ -0,0 +1,66 @@
+// Render queue for sorting draws by a 64-bit state key.
+//
+
+#include "cg_render_queue.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace cg {
+
+uint64_t make_sort_key(unsigned pass, unsigned program, unsigned material, unsigned vertexArray,
+                       float depth)
+{
+    // Quantize depth (expected to be in range [0, 1]) to 24 bits
+    uint64_t depthBits = uint64_t(std::min(std::max(depth, 0.0f), 1.0f) * 0xffffff);
+    return (uint64_t(pass & 0xf) << 60) | (uint64_t(program & 0xff) << 52) |
+           (uint64_t(material & 0xfffff) << 32) | (uint64_t(vertexArray & 0xff) << 24) | depthBits;
+}
+
+unsigned sort_key_pass(uint64_t key)
+{
+    return unsigned(key >> 60) & 0xf;
+}
+
+unsigned sort_key_program(uint64_t key)
+{
+    return unsigned(key >> 52) & 0xff;
+}
+
+unsigned sort_key_material(uint64_t key)
+{
+    return unsigned(key >> 32) & 0xfffff;
+}
+
+unsigned sort_key_vertex_array(uint64_t key)
+{
+    return unsigned(key >> 24) & 0xff;
+}
+
+void sort_render_queue(RenderQueue &queue)
+{
+    if (queue.size() < 2) return;
+
+    // Find which bits differ between keys, so that digits that are the same
+    // for all items can be skipped
+    uint64_t differing = 0;
+    for (const auto &item : queue) { differing |= item.key ^ queue[0].key; }
+
+    RenderQueue tmp(queue.size());
+    for (unsigned shift = 0; shift < 64; shift += 8) {
+        if (((differing >> shift) & 0xff) == 0) continue;
+
+        unsigned offsets[256];
+        std::memset(offsets, 0, sizeof(offsets));
+        for (const auto &item : queue) { offsets[(item.key >> shift) & 0xff] += 1; }
+        for (unsigned i = 0, sum = 0; i < 256; ++i) {
+            unsigned count = offsets[i];
+            offsets[i] = sum;
+            sum += count;
+        }
+        for (const auto &item : queue) { tmp[offsets[(item.key >> shift) & 0xff]++] = item; }
+        queue.swap(tmp);
+    }
+}
+
+}  // namespace cg
@@ -0,0 +1,50 @@
+// Render queue for sorting draws by a 64-bit state key.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace cg {
+
+// Bit layout of a sort key, from most to least significant bits:
+//
+//   pass (4) | program (8) | material (20) | vertex array (8) | depth (24)
+//
+// Sorting by the key groups draws by pass, then by state that is expensive to
+// change, and finally orders draws with the same state front-to-back.
+uint64_t make_sort_key(unsigned pass, unsigned program, unsigned material, unsigned vertexArray,
+                       float depth);
+
+unsigned sort_key_pass(uint64_t key);
+
+unsigned sort_key_program(uint64_t key);
+
+unsigned sort_key_material(uint64_t key);
+
+unsigned sort_key_vertex_array(uint64_t key);
+
+struct RenderItem {
+    uint64_t key;
+    int index;  // Index of the draw in a caller-defined list
+    int part;   // Part of the draw, for draws that are split (e.g., into chunks)
+};
+
+typedef std::vector<RenderItem> RenderQueue;
+
+// Sort the queue by key with a stable LSD radix sort (8 bits per digit).
+// Digits that are equal for all items are skipped.
+void sort_render_queue(RenderQueue &queue);
+
+// Per-frame counters for submitted draws and state changes
+struct RenderStats {
+    int drawCalls = 0;
+    int commands = 0;  // Draws, counting each draw of a multi-draw call
+    int instances = 0;
+    int64_t triangles = 0;  // Triangles of all draws and instances (can exceed 2^31)
+    int binds = 0;  // Texture and vertex array binds
+    int programSwitches = 0;
+};
+
+}  // namespace cg
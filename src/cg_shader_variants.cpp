@@ -0,0 +1,75 @@
+// Shader permutations: variants of a shader program compiled with different
+// sets of feature #defines, lazily on first use.
+//
+
+#include "cg_shader_variants.h"
+#include "cg_utils.h"
+
+#include <algorithm>
+
+namespace cg {
+
+void create_shader_variants(ShaderVariants &variants, const std::string &vertexShaderFilename,
+                            const std::string &fragmentShaderFilename,
+                            const std::vector<std::string> &features)
+{
+    destroy_shader_variants(variants);
+    variants.vertexShaderFilename = vertexShaderFilename;
+    variants.fragmentShaderFilename = fragmentShaderFilename;
+    variants.features = features;
+}
+
+void invalidate_shader_variants(ShaderVariants &variants)
+{
+    for (auto &variant : variants.programs) glDeleteProgram(variant.second);
+    variants.programs.clear();
+}
+
+void destroy_shader_variants(ShaderVariants &variants)
+{
+    invalidate_shader_variants(variants);
+    variants.features.clear();
+}
+
+std::string shader_variant_defines(const ShaderVariants &variants, unsigned features)
+{
+    std::string defines;
+    for (unsigned i = 0; i < variants.features.size(); ++i) {
+        if (features & (1u << i)) defines += "#define " + variants.features[i] + "\n";
+    }
+    return defines;
+}
+
+void prepare_shader_variants(ShaderVariants &variants, const std::vector<unsigned> &features)
+{
+    std::vector<unsigned> missing;
+    std::vector<ShaderProgramBuild> builds;
+    for (unsigned mask : features) {
+        if (variants.programs.count(mask)) continue;
+        if (std::find(missing.begin(), missing.end(), mask) != missing.end()) continue;
+        missing.push_back(mask);
+        builds.push_back(begin_shader_program(variants.vertexShaderFilename,
+                                              variants.fragmentShaderFilename,
+                                              shader_variant_defines(variants, mask),
+                                              variants.cache));
+    }
+
+    // Note: failed variants are stored too, so that we do not try to compile
+    // them again every frame
+    for (unsigned i = 0; i < builds.size(); ++i) {
+        GLuint program = finish_shader_program(builds[i]);
+        if (program && variants.initialize) variants.initialize(program, variants.userData);
+        variants.programs[missing[i]] = program;
+    }
+}
+
+GLuint get_shader_variant(ShaderVariants &variants, unsigned features)
+{
+    auto it = variants.programs.find(features);
+    if (it != variants.programs.end()) return it->second;
+
+    prepare_shader_variants(variants, std::vector<unsigned>(1, features));
+    return variants.programs[features];
+}
+
+}  // namespace cg
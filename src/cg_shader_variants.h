@@ -0,0 +1,51 @@
+// Shader permutations: variants of a shader program compiled with different
+// sets of feature #defines, lazily on first use.
+//
+
+#pragma once
+
+#include "cg_program_cache.h"
+
+#include <GL/gl3w.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace cg {
+
+// Programs compiled from the same shader files, keyed by a feature bitmask.
+// Bit i of the mask enables the #define features[i] in both shaders.
+struct ShaderVariants {
+    std::string vertexShaderFilename;
+    std::string fragmentShaderFilename;
+    std::vector<std::string> features;                // Define name of each feature bit
+    std::unordered_map<unsigned, GLuint> programs;  // Feature mask -> program (0 if failed)
+    void (*initialize)(GLuint program, void *userData) = nullptr;  // Called for new variants
+    void *userData = nullptr;
+    ProgramCache *cache = nullptr;  // Optional cache of program binaries
+};
+
+void create_shader_variants(ShaderVariants &variants, const std::string &vertexShaderFilename,
+                            const std::string &fragmentShaderFilename,
+                            const std::vector<std::string> &features);
+
+// Delete the compiled variants, so that they are recompiled (e.g., from
+// modified shader files) when next used
+void invalidate_shader_variants(ShaderVariants &variants);
+
+void destroy_shader_variants(ShaderVariants &variants);
+
+// Return the #define lines of a feature mask
+std::string shader_variant_defines(const ShaderVariants &variants, unsigned features);
+
+// Build the variants of a list of feature masks that have not been used
+// before. The builds are issued together, so that a driver with parallel
+// shader compilation can compile them at the same time.
+void prepare_shader_variants(ShaderVariants &variants, const std::vector<unsigned> &features);
+
+// Return the program of a variant, compiling and initializing it if it has
+// not been used before. Returns 0 if the variant failed to compile.
+GLuint get_shader_variant(ShaderVariants &variants, unsigned features);
+
+}  // namespace cg
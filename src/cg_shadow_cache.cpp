@@ -0,0 +1,84 @@
+// Cache for shadow maps that only re-renders a map when the light, the
+// transforms of shadow casters, or the geometry have changed.
+//
+
+#include "cg_shadow_cache.h"
+
+#include <GL/gl3w.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace cg {
+
+void invalidate_shadow_cache(ShadowCache &cache)
+{
+    cache.version += 1;
+    cache.fullUpdate = true;
+}
+
+void invalidate_shadow_cache_region(ShadowCache &cache, const glm::mat4 &model,
+                                    const glm::vec3 &boundsMin, const glm::vec3 &boundsMax)
+{
+    if (cache.fullUpdate) {
+        cache.version += 1;
+        return;
+    }
+
+    // Project the corners of the box to texel coordinates of the map
+    glm::vec2 texelMin(cache.size), texelMax(0.0f);
+    for (int i = 0; i < 8; ++i) {
+        glm::vec3 corner((i & 1) ? boundsMax.x : boundsMin.x, (i & 2) ? boundsMax.y : boundsMin.y,
+                         (i & 4) ? boundsMax.z : boundsMin.z);
+        glm::vec4 clip = cache.shadowMatrix * model * glm::vec4(corner, 1.0f);
+        if (clip.w <= 0.0f) {
+            invalidate_shadow_cache(cache);
+            return;
+        }
+        glm::vec2 texel = (glm::vec2(clip) / clip.w * 0.5f + 0.5f) * float(cache.size);
+        texelMin = glm::min(texelMin, texel);
+        texelMax = glm::max(texelMax, texel);
+    }
+
+    // Grow the region by one texel to cover rounding, and merge it with the
+    // regions invalidated earlier
+    glm::ivec2 regionMin = glm::max(glm::ivec2(glm::floor(texelMin)) - 1, glm::ivec2(0));
+    glm::ivec2 regionMax = glm::min(glm::ivec2(glm::ceil(texelMax)) + 1, glm::ivec2(cache.size));
+    if (regionMin.x >= regionMax.x || regionMin.y >= regionMax.y) return;  // Outside the map
+    if (cache.dirtyMin.x >= cache.dirtyMax.x || cache.dirtyMin.y >= cache.dirtyMax.y) {
+        cache.dirtyMin = regionMin;
+        cache.dirtyMax = regionMax;
+    } else {
+        cache.dirtyMin = glm::min(cache.dirtyMin, regionMin);
+        cache.dirtyMax = glm::max(cache.dirtyMax, regionMax);
+    }
+    cache.version += 1;
+}
+
+bool shadow_cache_needs_update(const ShadowCache &cache)
+{
+    return cache.version != cache.renderedVersion;
+}
+
+void begin_shadow_cache_update(ShadowCache &cache)
+{
+    if (cache.fullUpdate) {
+        glDisable(GL_SCISSOR_TEST);
+    } else {
+        glm::ivec2 extent = cache.dirtyMax - cache.dirtyMin;
+        glEnable(GL_SCISSOR_TEST);
+        glScissor(cache.dirtyMin.x, cache.dirtyMin.y, extent.x, extent.y);
+    }
+
+    cache.renderedVersion = cache.version;
+    cache.fullUpdate = false;
+    cache.dirtyMin = glm::ivec2(0);
+    cache.dirtyMax = glm::ivec2(0);
+}
+
+void end_shadow_cache_update(ShadowCache &/*cache*/)
+{
+    glDisable(GL_SCISSOR_TEST);
+}
+
+}  // namespace cg
@@ -0,0 +1,46 @@
+// Cache for shadow maps that only re-renders a map when the light, the
+// transforms of shadow casters, or the geometry have changed.
+//
+
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+namespace cg {
+
+// Version tracking for the contents of one shadow map. Callers invalidate the
+// cache (fully, or a light-space region) when its inputs change, and render
+// the map only when the version differs from the rendered version.
+struct ShadowCache {
+    unsigned version = 0;                 // Incremented by each invalidation
+    unsigned renderedVersion = ~0u;       // Version of the current map contents
+    int size = 0;                         // Width and height of the map in texels
+    glm::mat4 shadowMatrix;               // Light view-projection of the map
+    unsigned geometryVersion = 0;         // Geometry version of the map
+    std::vector<glm::mat4> transforms;    // Node transforms of the map
+    bool fullUpdate = true;               // Set if the whole map must be redrawn
+    glm::ivec2 dirtyMin = glm::ivec2(0);  // Texel region to redraw otherwise
+    glm::ivec2 dirtyMax = glm::ivec2(0);
+};
+
+// Mark the whole shadow map for re-rendering
+void invalidate_shadow_cache(ShadowCache &cache);
+
+// Mark the light-space region covered by a bounding box for re-rendering.
+// Falls back to a full invalidation if the box is partly behind the light.
+void invalidate_shadow_cache_region(ShadowCache &cache, const glm::mat4 &model,
+                                    const glm::vec3 &boundsMin, const glm::vec3 &boundsMax);
+
+bool shadow_cache_needs_update(const ShadowCache &cache);
+
+// Set up the scissor rectangle for rendering the invalidated region of the
+// map (disabled for full updates), and mark the map as up to date. The
+// depth buffer of the map should be cleared after this call.
+void begin_shadow_cache_update(ShadowCache &cache);
+
+// Disable the scissor test again
+void end_shadow_cache_update(ShadowCache &cache);
+
+}  // namespace cg
@@ -0,0 +1,238 @@
+// Cascaded shadow maps for a directional light, fitted to slices of the view
+// frustum and to the bounds of the scene.
+//
+
+#include "cg_shadow_cascades.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+namespace cg {
+
+void create_shadow_cascades(ShadowCascades &cascades, int size)
+{
+    destroy_shadow_cascades(cascades);
+    cascades.size = size;
+
+    glGenTextures(1, &cascades.shadowmap);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, cascades.shadowmap);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, size, size, MAX_SHADOW_CASCADES, 0,
+                 GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    // One depth-only framebuffer per layer
+    glGenFramebuffers(MAX_SHADOW_CASCADES, cascades.framebuffers);
+    for (int i = 0; i < MAX_SHADOW_CASCADES; ++i) {
+        glBindFramebuffer(GL_FRAMEBUFFER, cascades.framebuffers[i]);
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, cascades.shadowmap, 0, i);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            std::cerr << "Error: framebuffer object not complete" << std::endl;
+        }
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    // Note: the texture itself keeps nearest filtering without comparisons,
+    // so that the depth values can be shown in the debug view
+    glGenSamplers(1, &cascades.compareSampler);
+    glSamplerParameteri(cascades.compareSampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glSamplerParameteri(cascades.compareSampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glSamplerParameteri(cascades.compareSampler, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glSamplerParameteri(cascades.compareSampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glSamplerParameteri(cascades.compareSampler, GL_TEXTURE_COMPARE_MODE,
+                        GL_COMPARE_REF_TO_TEXTURE);
+    glSamplerParameteri(cascades.compareSampler, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+}
+
+static GLuint create_moment_texture(int size, int layers)
+{
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RG32F, size, size, layers, 0, GL_RG, GL_FLOAT,
+                 nullptr);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    return texture;
+}
+
+void create_shadow_moments(ShadowCascades &cascades)
+{
+    if (cascades.moments) return;
+
+    cascades.moments = create_moment_texture(cascades.size, MAX_SHADOW_CASCADES);
+    cascades.blurTexture = create_moment_texture(cascades.size, 1);
+
+    // The moment framebuffers share the depth layers of the shadowmap
+    glGenFramebuffers(MAX_SHADOW_CASCADES, cascades.momentFramebuffers);
+    for (int i = 0; i < MAX_SHADOW_CASCADES; ++i) {
+        glBindFramebuffer(GL_FRAMEBUFFER, cascades.momentFramebuffers[i]);
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, cascades.moments, 0, i);
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, cascades.shadowmap, 0, i);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            std::cerr << "Error: framebuffer object not complete" << std::endl;
+        }
+    }
+    glGenFramebuffers(1, &cascades.blurFramebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, cascades.blurFramebuffer);
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, cascades.blurTexture, 0, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void destroy_shadow_cascades(ShadowCascades &cascades)
+{
+    if (cascades.shadowmap) {
+        glDeleteFramebuffers(MAX_SHADOW_CASCADES, cascades.framebuffers);
+        glDeleteTextures(1, &cascades.shadowmap);
+        glDeleteSamplers(1, &cascades.compareSampler);
+    }
+    if (cascades.moments) {
+        glDeleteFramebuffers(MAX_SHADOW_CASCADES, cascades.momentFramebuffers);
+        glDeleteFramebuffers(1, &cascades.blurFramebuffer);
+        glDeleteTextures(1, &cascades.moments);
+        glDeleteTextures(1, &cascades.blurTexture);
+    }
+    cascades.shadowmap = 0;
+    cascades.compareSampler = 0;
+    cascades.moments = 0;
+    cascades.blurTexture = 0;
+    cascades.blurFramebuffer = 0;
+    std::fill(cascades.framebuffers, cascades.framebuffers + MAX_SHADOW_CASCADES, 0);
+    std::fill(cascades.momentFramebuffers, cascades.momentFramebuffers + MAX_SHADOW_CASCADES, 0);
+}
+
+void compute_cascade_splits(float zNear, float zFar, int count, float lambda, float *splits)
+{
+    splits[0] = zNear;
+    for (int i = 1; i < count; ++i) {
+        float t = float(i) / count;
+        float logSplit = zNear * std::pow(zFar / zNear, t);
+        float uniformSplit = zNear + (zFar - zNear) * t;
+        splits[i] = lambda * logSplit + (1.0f - lambda) * uniformSplit;
+    }
+    splits[count] = zFar;
+}
+
+// Compute the bounding box of a box transformed by a matrix (without
+// perspective division)
+static void transform_bounds(const glm::mat4 &m, const glm::vec3 &boundsMin,
+                             const glm::vec3 &boundsMax, glm::vec3 &outMin, glm::vec3 &outMax)
+{
+    for (int i = 0; i < 8; ++i) {
+        glm::vec3 corner((i & 1) ? boundsMax.x : boundsMin.x, (i & 2) ? boundsMax.y : boundsMin.y,
+                         (i & 4) ? boundsMax.z : boundsMin.z);
+        glm::vec3 p = glm::vec3(m * glm::vec4(corner, 1.0f));
+        outMin = i ? glm::min(outMin, p) : p;
+        outMax = i ? glm::max(outMax, p) : p;
+    }
+}
+
+void fit_shadow_cascades(ShadowCascades &cascades, const glm::vec3 &lightDirection,
+                         const glm::mat4 &cameraView, const glm::mat4 &cameraProjection,
+                         float zNear, float zFar, const glm::vec3 &sceneMin,
+                         const glm::vec3 &sceneMax)
+{
+    // Place the light outside the bounding sphere of the scene
+    glm::vec3 center = 0.5f * (sceneMin + sceneMax);
+    float radius = std::max(0.5f * glm::length(sceneMax - sceneMin), 1e-3f);
+    glm::vec3 direction = glm::normalize(lightDirection);
+    glm::vec3 up = std::abs(direction.y) < 0.99f ? glm::vec3(0, 1, 0) : glm::vec3(1, 0, 0);
+    cascades.lightView = glm::lookAt(center - direction * radius, center, up);
+    cascades.lightDepthRange = 2.0f * radius;
+
+    // Clamp the depth range of the camera to the bounding sphere of the
+    // scene, so that no cascade covers empty space in front of or behind the
+    // scene. Unlike the bounding box of the scene in view space, the sphere
+    // gives the same splits however the camera is turned.
+    glm::vec3 eye = glm::vec3(glm::inverse(cameraView)[3]);
+    float centerDistance = glm::length(center - eye);
+    float sceneNear = std::max(zNear, centerDistance - radius);
+    float sceneFar = std::min(zFar, centerDistance + radius);
+    if (sceneFar <= sceneNear) sceneFar = sceneNear + 1e-3f;
+    compute_cascade_splits(sceneNear, sceneFar, cascades.count, cascades.splitLambda,
+                           cascades.splits);
+
+    // Corners of the view frustum (on the near and far plane) in world space
+    glm::mat4 inverseViewProjection = glm::inverse(cameraProjection * cameraView);
+    glm::vec3 nearCorners[4], farCorners[4];
+    for (int i = 0; i < 4; ++i) {
+        glm::vec2 ndc((i & 1) ? 1.0f : -1.0f, (i & 2) ? 1.0f : -1.0f);
+        glm::vec4 p0 = inverseViewProjection * glm::vec4(ndc, -1.0f, 1.0f);
+        glm::vec4 p1 = inverseViewProjection * glm::vec4(ndc, 1.0f, 1.0f);
+        nearCorners[i] = glm::vec3(p0) / p0.w;
+        farCorners[i] = glm::vec3(p1) / p1.w;
+    }
+
+    // Depth range of the scene along the light
+    glm::vec3 lightSceneMin, lightSceneMax;
+    transform_bounds(cascades.lightView, sceneMin, sceneMax, lightSceneMin, lightSceneMax);
+
+    for (int c = 0; c < cascades.count; ++c) {
+        // Bounding sphere of the frustum slice. Points on the edges of the
+        // frustum have view-space depth that is linear in t.
+        glm::vec3 corners[8];
+        glm::vec3 sliceCenter(0.0f);
+        for (int i = 0; i < 8; ++i) {
+            float depth = cascades.splits[c + (i >> 2)];
+            float t = (depth - zNear) / (zFar - zNear);
+            corners[i] = glm::mix(nearCorners[i & 3], farCorners[i & 3], t);
+            sliceCenter += corners[i] / 8.0f;
+        }
+        float sliceRadius = 0.0f;
+        for (int i = 0; i < 8; ++i) {
+            sliceRadius = std::max(sliceRadius, glm::length(corners[i] - sliceCenter));
+        }
+
+        // Unlike a box fitted to the slice, the sphere does not change as the
+        // camera turns. Its radius is rounded up to a step of the scene size,
+        // so that the extent of the cascade, and its texel size, only change
+        // when the camera moves toward or away from the scene by more than
+        // that.
+        float step = radius / 64.0f;
+        sliceRadius = std::max(std::ceil(sliceRadius / step), 1.0f) * step;
+        float texelSize = 2.0f * sliceRadius / float(cascades.size - 1);
+        glm::vec3 lightCenter = glm::vec3(cascades.lightView * glm::vec4(sliceCenter, 1.0f));
+
+        // Cover the sphere with whole texels of a fixed grid in light space,
+        // so that shadow edges do not shimmer when the camera moves. Along
+        // axes where the scene is smaller than the sphere, the cascade covers
+        // the scene instead, which does not depend on the camera either.
+        glm::vec2 boxMin, boxMax;
+        for (int k = 0; k < 2; ++k) {
+            if (lightSceneMax[k] - lightSceneMin[k] <= 2.0f * sliceRadius) {
+                boxMin[k] = lightSceneMin[k];
+                boxMax[k] = std::max(lightSceneMax[k], lightSceneMin[k] + 1e-3f);
+            } else {
+                boxMin[k] = std::floor((lightCenter[k] - sliceRadius) / texelSize) * texelSize;
+                boxMax[k] = boxMin[k] + texelSize * float(cascades.size);
+            }
+        }
+
+        // The depth range covers the whole scene, so that casters outside
+        // the slice still cast shadows into it
+        cascades.projections[c] = glm::ortho(boxMin.x, boxMax.x, boxMin.y, boxMax.y,
+                                             -lightSceneMax.z, -lightSceneMin.z);
+        cascades.matrices[c] = cascades.projections[c] * cascades.lightView;
+    }
+}
+
+bool bounds_overlap_cascade(const ShadowCascades &cascades, int cascade, const glm::vec3 &boundsMin,
+                            const glm::vec3 &boundsMax)
+{
+    glm::vec3 clipMin, clipMax;
+    transform_bounds(cascades.matrices[cascade], boundsMin, boundsMax, clipMin, clipMax);
+    return clipMin.x <= 1.0f && clipMax.x >= -1.0f && clipMin.y <= 1.0f && clipMax.y >= -1.0f;
+}
+
+}  // namespace cg
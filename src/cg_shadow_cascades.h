@@ -0,0 +1,70 @@
+// Cascaded shadow maps for a directional light, fitted to slices of the view
+// frustum and to the bounds of the scene.
+//
+
+#pragma once
+
+#include <GL/gl3w.h>
+
+#include <glm/glm.hpp>
+
+namespace cg {
+
+const int MAX_SHADOW_CASCADES = 4;
+
+// Shadow filtering quality tiers, from cheapest to most expensive
+enum ShadowFilter {
+    SHADOW_FILTER_PCF = 0,      // One bilinear hardware comparison (2x2 PCF)
+    SHADOW_FILTER_POISSON = 1,  // Rotated Poisson disk of hardware comparisons
+    SHADOW_FILTER_VARIANCE = 2  // Variance shadow maps with a separable blur
+};
+
+struct ShadowCascades {
+    int count = 4;             // Number of cascades in use (1 to MAX_SHADOW_CASCADES)
+    int size = 1024;           // Width and height of each cascade in texels
+    float splitLambda = 0.75f;  // Blend between uniform (0) and logarithmic (1) splits
+    GLuint shadowmap = 0;      // Depth texture array with one layer per cascade
+    GLuint framebuffers[MAX_SHADOW_CASCADES] = {};
+    GLuint compareSampler = 0;  // Sampler for hardware depth comparisons (PCF)
+
+    // Depth moments for variance shadow maps (created on demand)
+    GLuint moments = 0;  // RG32F texture array with one layer per cascade
+    GLuint momentFramebuffers[MAX_SHADOW_CASCADES] = {};
+    GLuint blurTexture = 0;  // Single-layer RG32F array for the separable blur
+    GLuint blurFramebuffer = 0;
+    float splits[MAX_SHADOW_CASCADES + 1] = {};  // View-space depths of the split planes
+    glm::mat4 lightView;                         // Shared view matrix of the cascades
+    float lightDepthRange = 1.0f;                // Depth of the scene along the light
+    glm::mat4 projections[MAX_SHADOW_CASCADES];  // Orthographic projection of each cascade
+    glm::mat4 matrices[MAX_SHADOW_CASCADES];     // Projection * light view
+};
+
+void create_shadow_cascades(ShadowCascades &cascades, int size);
+
+void destroy_shadow_cascades(ShadowCascades &cascades);
+
+// Create the moment textures and framebuffers used for variance shadow
+// maps, if they do not exist yet
+void create_shadow_moments(ShadowCascades &cascades);
+
+// Compute split depths between the near and far plane, blending uniform and
+// logarithmic split schemes
+void compute_cascade_splits(float zNear, float zFar, int count, float lambda, float *splits);
+
+// Fit the cascades to the view frustum of the camera and the scene bounds.
+// The light looks along lightDirection (in world space), and the view and
+// projection matrices of the camera are given with their near and far
+// plane distances. Each cascade covers the bounding sphere of its frustum
+// slice with a fixed texel size, snapped to whole texels, so that shadow
+// edges do not shimmer when the camera moves.
+void fit_shadow_cascades(ShadowCascades &cascades, const glm::vec3 &lightDirection,
+                         const glm::mat4 &cameraView, const glm::mat4 &cameraProjection,
+                         float zNear, float zFar, const glm::vec3 &sceneMin,
+                         const glm::vec3 &sceneMax);
+
+// Return true if a world-space bounding box overlaps a cascade (used for
+// culling shadow casters per cascade)
+bool bounds_overlap_cascade(const ShadowCascades &cascades, int cascade, const glm::vec3 &boundsMin,
+                            const glm::vec3 &boundsMax);
+
+}  // namespace cg
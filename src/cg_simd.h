@@ -0,0 +1,86 @@
+// Four-wide float vectors for the CPU renderers and image processing, with
+// SSE2 when the compiler targets it and a scalar fallback otherwise.
+// Comparisons return masks, which should only be used with lanes_and(),
+// lanes_or(), lanes_select() and lanes_mask().
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CG_SIMD_SSE2
+#endif
+
+namespace cg {
+
+#ifdef CG_SIMD_SSE2
+typedef __m128 Lanes;
+
+static inline Lanes lanes(float a) { return _mm_set1_ps(a); }
+static inline Lanes lanes(float a, float b, float c, float d) { return _mm_setr_ps(a, b, c, d); }
+static inline Lanes lanes_add(Lanes a, Lanes b) { return _mm_add_ps(a, b); }
+static inline Lanes lanes_sub(Lanes a, Lanes b) { return _mm_sub_ps(a, b); }
+static inline Lanes lanes_mul(Lanes a, Lanes b) { return _mm_mul_ps(a, b); }
+static inline Lanes lanes_div(Lanes a, Lanes b) { return _mm_div_ps(a, b); }
+static inline Lanes lanes_min(Lanes a, Lanes b) { return _mm_min_ps(a, b); }
+static inline Lanes lanes_max(Lanes a, Lanes b) { return _mm_max_ps(a, b); }
+static inline Lanes lanes_sqrt(Lanes a) { return _mm_sqrt_ps(a); }
+static inline Lanes lanes_greater(Lanes a, Lanes b) { return _mm_cmpgt_ps(a, b); }
+static inline Lanes lanes_greater_equal(Lanes a, Lanes b) { return _mm_cmpge_ps(a, b); }
+static inline Lanes lanes_and(Lanes a, Lanes b) { return _mm_and_ps(a, b); }
+static inline Lanes lanes_or(Lanes a, Lanes b) { return _mm_or_ps(a, b); }
+static inline Lanes lanes_select(Lanes mask, Lanes a, Lanes b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+static inline int lanes_mask(Lanes mask) { return _mm_movemask_ps(mask); }
+static inline Lanes lanes_load(const float *p) { return _mm_load_ps(p); }
+static inline Lanes lanes_load_unaligned(const float *p) { return _mm_loadu_ps(p); }
+static inline void lanes_store(float *p, Lanes a) { _mm_store_ps(p, a); }
+static inline void lanes_store_unaligned(float *p, Lanes a) { _mm_storeu_ps(p, a); }
+#else
+struct Lanes {
+    float v[4];
+};
+
+static inline Lanes lanes(float a) { return {{a, a, a, a}}; }
+static inline Lanes lanes(float a, float b, float c, float d) { return {{a, b, c, d}}; }
+#define CG_LANES_OP(expression)                              \
+    Lanes r;                                                 \
+    for (int i = 0; i < 4; ++i) { r.v[i] = (expression); } \
+    return r;
+static inline Lanes lanes_add(Lanes a, Lanes b) { CG_LANES_OP(a.v[i] + b.v[i]) }
+static inline Lanes lanes_sub(Lanes a, Lanes b) { CG_LANES_OP(a.v[i] - b.v[i]) }
+static inline Lanes lanes_mul(Lanes a, Lanes b) { CG_LANES_OP(a.v[i] * b.v[i]) }
+static inline Lanes lanes_div(Lanes a, Lanes b) { CG_LANES_OP(a.v[i] / b.v[i]) }
+static inline Lanes lanes_min(Lanes a, Lanes b) { CG_LANES_OP(std::min(a.v[i], b.v[i])) }
+static inline Lanes lanes_max(Lanes a, Lanes b) { CG_LANES_OP(std::max(a.v[i], b.v[i])) }
+static inline Lanes lanes_sqrt(Lanes a) { CG_LANES_OP(std::sqrt(a.v[i])) }
+static inline Lanes lanes_greater(Lanes a, Lanes b) { CG_LANES_OP(a.v[i] > b.v[i] ? 1.0f : 0.0f) }
+static inline Lanes lanes_greater_equal(Lanes a, Lanes b)
+{
+    CG_LANES_OP(a.v[i] >= b.v[i] ? 1.0f : 0.0f)
+}
+static inline Lanes lanes_and(Lanes a, Lanes b) { CG_LANES_OP(a.v[i] * b.v[i]) }
+static inline Lanes lanes_or(Lanes a, Lanes b) { CG_LANES_OP(std::max(a.v[i], b.v[i])) }
+static inline Lanes lanes_select(Lanes mask, Lanes a, Lanes b)
+{
+    CG_LANES_OP(mask.v[i] != 0.0f ? a.v[i] : b.v[i])
+}
+#undef CG_LANES_OP
+static inline int lanes_mask(Lanes mask)
+{
+    int bits = 0;
+    for (int i = 0; i < 4; ++i) bits |= (mask.v[i] != 0.0f) << i;
+    return bits;
+}
+static inline Lanes lanes_load(const float *p) { return {{p[0], p[1], p[2], p[3]}}; }
+static inline Lanes lanes_load_unaligned(const float *p) { return lanes_load(p); }
+static inline void lanes_store(float *p, Lanes a) { std::copy(a.v, a.v + 4, p); }
+static inline void lanes_store_unaligned(float *p, Lanes a) { lanes_store(p, a); }
+#endif
+
+}  // namespace cg
@@ -0,0 +1,990 @@
+// Multi-threaded software renderer: each pass transforms the vertices of the
+// draws, sets up and bins their triangles to screen tiles, and rasterizes
+// the tiles, with all threads working on each step. Does not depend on
+// OpenGL.
+//
+
+#include "cg_software_renderer.h"
+#include "cg_simd.h"
+
+#include "stb_image.h"
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+
+namespace cg {
+
+// Outputs of mesh.vert, in the order of the components of ClipVertex::varyings
+enum Varying {
+    VARYING_V = 0,  // View vector (three components)
+    VARYING_N = 3,  // View-space normal
+    VARYING_L = 6,  // View-space light direction
+    VARYING_NORMAL = 9,
+    VARYING_COLOR = 12,
+    VARYING_TEXCOORD = 15,
+    VARYING_TANGENT = 17,  // View-space tangent, and the handedness of the bitangent
+    VARYING_COUNT = 21
+};
+
+struct ClipVertex {
+    glm::vec4 position;  // Clip space
+    float varyings[VARYING_COUNT];
+};
+
+// Coefficients of a function a * x + b * y + c that is linear in screen space
+struct Plane {
+    float a, b, c;
+};
+
+// Triangle in window coordinates, set up for rasterization
+struct SetupTriangle {
+    Plane edges[3];    // Barycentric weight of each vertex (times twice the area)
+    bool topLeft[3];   // Edges that own the pixels whose centers are on them
+    Plane depth;       // Window-space depth
+    float invW[3];     // For perspective-correct interpolation of the varyings
+    const ClipVertex *vertices[3];
+    int draw;
+    int xMin, yMin, xMax, yMax;  // Pixels whose centers are within the bounds
+};
+
+// State of a pass (a shadow cascade or the image)
+struct SoftwarePass {
+    const SoftwareRenderer *renderer;
+    const SoftwareFrame *frame;
+    const std::vector<SoftwareDraw> *draws;
+    int partCount;  // Parts of the triangles that are set up in parallel
+    bool shade;  // Shade the pixels (or only write depth)
+
+    glm::mat4 view;
+    glm::mat4 projection;
+    glm::mat4 shadowFromView[SOFTWARE_MAX_CASCADES];
+    int width;  // Viewport
+    int height;
+    float guardBand;  // Clip-space x and y (relative to w) beyond which triangles are clipped
+
+    // Target buffers, padded to whole tiles
+    int bufferWidth;
+    int bufferHeight;
+    float *depth;
+    uint8_t *color;  // RGB, or null for depth-only passes
+    uint8_t background[3];
+
+    // Vertices and triangles of the draws
+    std::vector<int> firstVertex;    // Of each draw, and the total count
+    std::vector<int> firstTriangle;  // Of each draw, and the total count
+    std::vector<ClipVertex> vertices;
+
+    // Set up triangles of each part, with the clipped vertices they
+    // created, and their bins (triangle indices) for each tile
+    std::vector<std::vector<SetupTriangle>> triangles;
+    std::vector<std::deque<ClipVertex>> clippedVertices;
+    std::vector<std::vector<std::vector<int>>> bins;
+
+    std::vector<int64_t> shadedPixels;  // Of each tile
+};
+
+const float POISSON_DISK[16][2] = {
+    {-0.94201624f, -0.39906216f}, {0.94558609f, -0.76890725f}, {-0.09418410f, -0.92938870f},
+    {0.34495938f, 0.29387760f},   {-0.91588581f, 0.45771432f}, {-0.81544232f, -0.87912464f},
+    {-0.38277543f, 0.27676845f},  {0.97484398f, 0.75648379f},  {0.44323325f, -0.97511554f},
+    {0.53742981f, -0.47373420f},  {-0.26496911f, -0.41893023f}, {0.79197514f, 0.19090188f},
+    {-0.24188840f, 0.99706507f},  {-0.81409955f, 0.91437590f}, {0.19984126f, 0.78641367f},
+    {0.14383161f, -0.14100790f}};
+
+const float SHADOW_BLUR_WEIGHTS[4] = {0.383103f, 0.241843f, 0.060626f, 0.005977f};
+
+static int pad_to_tiles(int size)
+{
+    return (size + SOFTWARE_TILE_SIZE - 1) / SOFTWARE_TILE_SIZE * SOFTWARE_TILE_SIZE;
+}
+
+static uint8_t to_unorm8(float value)
+{
+    if (!(value > 0.0f)) return 0;  // Also NaN
+    if (value >= 1.0f) return 255;
+    return uint8_t(value * 255.0f + 0.5f);
+}
+
+void create_software_renderer(SoftwareRenderer &renderer, int width, int height,
+                              WorkerPool &workers)
+{
+    renderer.width = width;
+    renderer.height = height;
+    renderer.bufferWidth = pad_to_tiles(width);
+    renderer.bufferHeight = pad_to_tiles(height);
+    renderer.color.assign(renderer.bufferWidth * renderer.bufferHeight * 3, 0);
+    renderer.depth.assign(renderer.bufferWidth * renderer.bufferHeight, 1.0f);
+    renderer.workers = &workers;
+}
+
+// Textures
+
+static int clamp_texel(int i, int size) { return std::min(std::max(i, 0), size - 1); }
+
+static int wrap_texel(int i, int size, SoftwareWrap wrap)
+{
+    if (wrap == SOFTWARE_WRAP_REPEAT) {
+        i %= size;
+        return (i < 0) ? i + size : i;
+    }
+    if (wrap == SOFTWARE_WRAP_MIRROR) {
+        i %= 2 * size;
+        if (i < 0) i += 2 * size;
+        return (i < size) ? i : 2 * size - 1 - i;
+    }
+    return clamp_texel(i, size);
+}
+
+static glm::vec4 fetch_texel(const SoftwareTexture &texture, int level, int x, int y)
+{
+    int width = texture.widths[level];
+    const uint8_t *texel = &texture.levels[level][(y * width + x) * 4];
+    return glm::vec4(texel[0], texel[1], texel[2], texel[3]) * (1.0f / 255.0f);
+}
+
+static glm::vec4 sample_texture_level(const SoftwareTexture &texture, int level,
+                                      const glm::vec2 &texcoord, bool linear)
+{
+    int width = texture.widths[level], height = texture.heights[level];
+    if (!linear) {
+        int x = wrap_texel(int(std::floor(texcoord.x * width)), width, texture.wrapS);
+        int y = wrap_texel(int(std::floor(texcoord.y * height)), height, texture.wrapT);
+        return fetch_texel(texture, level, x, y);
+    }
+
+    float u = texcoord.x * width - 0.5f, v = texcoord.y * height - 0.5f;
+    float x0 = std::floor(u), y0 = std::floor(v);
+    float fx = u - x0, fy = v - y0;
+    int xs[2] = {wrap_texel(int(x0), width, texture.wrapS),
+                 wrap_texel(int(x0) + 1, width, texture.wrapS)};
+    int ys[2] = {wrap_texel(int(y0), height, texture.wrapT),
+                 wrap_texel(int(y0) + 1, height, texture.wrapT)};
+    glm::vec4 top = glm::mix(fetch_texel(texture, level, xs[0], ys[0]),
+                             fetch_texel(texture, level, xs[1], ys[0]), fx);
+    glm::vec4 bottom = glm::mix(fetch_texel(texture, level, xs[0], ys[1]),
+                                fetch_texel(texture, level, xs[1], ys[1]), fx);
+    return glm::mix(top, bottom, fy);
+}
+
+// Return the level of detail of a texture, from the derivatives of its
+// texture coordinates
+static float texture_lod(const SoftwareTexture &texture, const glm::vec2 &dx, const glm::vec2 &dy)
+{
+    glm::vec2 size(texture.widths[0], texture.heights[0]);
+    float rho = std::max(glm::length(dx * size), glm::length(dy * size));
+    return std::log2(rho);
+}
+
+glm::vec4 sample_software_texture(const SoftwareTexture &texture, const glm::vec2 &texcoord,
+                                  float lod)
+{
+    if (texture.levels.empty()) return glm::vec4(1.0f);
+    if (!(lod > 0.0f)) return sample_texture_level(texture, 0, texcoord, texture.magLinear);
+
+    int maxLevel = int(texture.levels.size()) - 1;
+    if (texture.mipmapFilter == SOFTWARE_MIPMAP_NONE) {
+        return sample_texture_level(texture, 0, texcoord, texture.minLinear);
+    }
+    if (texture.mipmapFilter == SOFTWARE_MIPMAP_NEAREST) {
+        int level = std::min(int(std::ceil(lod + 0.5f)) - 1, maxLevel);
+        return sample_texture_level(texture, level, texcoord, texture.minLinear);
+    }
+    lod = std::min(lod, float(maxLevel));
+    int level = int(lod);
+    glm::vec4 color = sample_texture_level(texture, level, texcoord, texture.minLinear);
+    if (level == maxLevel) return color;
+    return glm::mix(color, sample_texture_level(texture, level + 1, texcoord, texture.minLinear),
+                    lod - level);
+}
+
+// Cubemaps
+
+float srgb_to_linear(float value)
+{
+    return (value <= 0.04045f) ? value / 12.92f : std::pow((value + 0.055f) / 1.055f, 2.4f);
+}
+
+bool load_software_cubemap(SoftwareCubemap &cubemap, const std::string &dirname)
+{
+    const char *filenames[] = {"posx.png", "negx.png", "posy.png",
+                               "negy.png", "posz.png", "negz.png"};
+    float decode[256];
+    for (int i = 0; i < 256; ++i) decode[i] = srgb_to_linear(i / 255.0f);
+
+    cubemap = SoftwareCubemap();
+    for (int face = 0; face < 6; ++face) {
+        std::string filename = dirname + "/" + filenames[face];
+        int width, height, comp;
+        uint8_t *image = stbi_load(filename.c_str(), &width, &height, &comp, 4);
+        if (image == nullptr || width != height || (face > 0 && width != cubemap.size)) {
+            stbi_image_free(image);
+            cubemap = SoftwareCubemap();
+            return false;
+        }
+        cubemap.size = width;
+
+        std::vector<std::vector<glm::vec3>> &levels = cubemap.levels[face];
+        levels.push_back(std::vector<glm::vec3>(width * width));
+        for (int i = 0; i < width * width; ++i) {
+            levels[0][i] = glm::vec3(decode[image[4 * i]], decode[image[4 * i + 1]],
+                                     decode[image[4 * i + 2]]);
+        }
+        stbi_image_free(image);
+
+        // Average 2x2 blocks in linear space, like glGenerateMipmap() does
+        // for sRGB textures
+        for (int size = width / 2; size >= 1; size /= 2) {
+            const std::vector<glm::vec3> &src = levels.back();
+            std::vector<glm::vec3> dst(size * size);
+            for (int y = 0; y < size; ++y) {
+                for (int x = 0; x < size; ++x) {
+                    int i = 2 * y * 2 * size + 2 * x;
+                    dst[y * size + x] = 0.25f * (src[i] + src[i + 1] + src[i + 2 * size] +
+                                                 src[i + 2 * size + 1]);
+                }
+            }
+            levels.push_back(dst);
+        }
+    }
+    return true;
+}
+
+// Return the coordinates of a direction on a cubemap face (the major axis
+// of the direction selects the face if it is negative)
+static int cubemap_face_coords(const glm::vec3 &r, int face, glm::vec2 &st)
+{
+    if (face < 0) {
+        glm::vec3 a = glm::abs(r);
+        if (a.x >= a.y && a.x >= a.z) {
+            face = (r.x >= 0.0f) ? 0 : 1;
+        } else if (a.y >= a.z) {
+            face = (r.y >= 0.0f) ? 2 : 3;
+        } else {
+            face = (r.z >= 0.0f) ? 4 : 5;
+        }
+    }
+    float sc, tc, ma;
+    switch (face) {
+    case 0: sc = -r.z, tc = -r.y, ma = r.x; break;
+    case 1: sc = r.z, tc = -r.y, ma = -r.x; break;
+    case 2: sc = r.x, tc = r.z, ma = r.y; break;
+    case 3: sc = r.x, tc = -r.z, ma = -r.y; break;
+    case 4: sc = r.x, tc = -r.y, ma = r.z; break;
+    default: sc = -r.x, tc = -r.y, ma = -r.z; break;
+    }
+    st = glm::vec2(sc, tc) / (2.0f * std::abs(ma)) + 0.5f;
+    return face;
+}
+
+static glm::vec3 sample_cubemap_level(const SoftwareCubemap &cubemap, int face, int level,
+                                      const glm::vec2 &st)
+{
+    int size = std::max(cubemap.size >> level, 1);
+    const std::vector<glm::vec3> &texels = cubemap.levels[face][level];
+    float u = st.x * size - 0.5f, v = st.y * size - 0.5f;
+    float x0 = std::floor(u), y0 = std::floor(v);
+    float fx = u - x0, fy = v - y0;
+    int xs[2] = {clamp_texel(int(x0), size), clamp_texel(int(x0) + 1, size)};
+    int ys[2] = {clamp_texel(int(y0), size), clamp_texel(int(y0) + 1, size)};
+    glm::vec3 top = glm::mix(texels[ys[0] * size + xs[0]], texels[ys[0] * size + xs[1]], fx);
+    glm::vec3 bottom = glm::mix(texels[ys[1] * size + xs[0]], texels[ys[1] * size + xs[1]], fx);
+    return glm::mix(top, bottom, fy);
+}
+
+glm::vec3 sample_software_cubemap(const SoftwareCubemap &cubemap, const glm::vec3 &direction,
+                                  float lod)
+{
+    if (!cubemap.size) return glm::vec3(0.0f);
+    glm::vec2 st;
+    int face = cubemap_face_coords(direction, -1, st);
+    if (!(lod > 0.0f)) return sample_cubemap_level(cubemap, face, 0, st);
+
+    int maxLevel = int(cubemap.levels[face].size()) - 1;
+    lod = std::min(lod, float(maxLevel));
+    int level = int(lod);
+    glm::vec3 color = sample_cubemap_level(cubemap, face, level, st);
+    if (level == maxLevel) return color;
+    return glm::mix(color, sample_cubemap_level(cubemap, face, level + 1, st), lod - level);
+}
+
+// Sample a cubemap with trilinear filtering, with the level of detail given
+// by the directions of the quad (the first three lanes)
+static glm::vec3 sample_cubemap(const SoftwareCubemap &cubemap, const glm::vec3 &r,
+                                const glm::vec3 quad[3])
+{
+    if (!cubemap.size) return glm::vec3(0.0f);
+
+    // Derivatives of the coordinates on the face of the first pixel
+    glm::vec2 st0, st1, st2;
+    int quadFace = cubemap_face_coords(quad[0], -1, st0);
+    cubemap_face_coords(quad[1], quadFace, st1);
+    cubemap_face_coords(quad[2], quadFace, st2);
+    float rho = std::max(glm::length(st1 - st0), glm::length(st2 - st0)) * cubemap.size;
+    return sample_software_cubemap(cubemap, r, std::log2(rho));
+}
+
+// Shadows
+
+// Bilinear 2x2 comparison of a reference depth with a shadowmap (like a
+// texture() call on a sampler2DShadow with linear filtering)
+static float compare_shadowmap(const float *depth, int stride, int size, const glm::vec2 &texcoord,
+                               float reference)
+{
+    reference = std::min(std::max(reference, 0.0f), 1.0f);
+    float u = texcoord.x * size - 0.5f, v = texcoord.y * size - 0.5f;
+    float x0 = std::floor(u), y0 = std::floor(v);
+    float fx = u - x0, fy = v - y0;
+    int xs[2] = {clamp_texel(int(x0), size), clamp_texel(int(x0) + 1, size)};
+    int ys[2] = {clamp_texel(int(y0), size), clamp_texel(int(y0) + 1, size)};
+    float lit[4];
+    for (int i = 0; i < 4; ++i) {
+        lit[i] = (reference <= depth[ys[i / 2] * stride + xs[i % 2]]) ? 1.0f : 0.0f;
+    }
+    return glm::mix(glm::mix(lit[0], lit[1], fx), glm::mix(lit[2], lit[3], fx), fy);
+}
+
+static glm::vec2 sample_moments(const glm::vec2 *moments, int stride, int size,
+                                const glm::vec2 &texcoord)
+{
+    float u = texcoord.x * size - 0.5f, v = texcoord.y * size - 0.5f;
+    float x0 = std::floor(u), y0 = std::floor(v);
+    float fx = u - x0, fy = v - y0;
+    int xs[2] = {clamp_texel(int(x0), size), clamp_texel(int(x0) + 1, size)};
+    int ys[2] = {clamp_texel(int(y0), size), clamp_texel(int(y0) + 1, size)};
+    glm::vec2 top = glm::mix(moments[ys[0] * stride + xs[0]], moments[ys[0] * stride + xs[1]], fx);
+    glm::vec2 bottom =
+        glm::mix(moments[ys[1] * stride + xs[0]], moments[ys[1] * stride + xs[1]], fx);
+    return glm::mix(top, bottom, fy);
+}
+
+// Return a visibility value in range [0, 1] for a position in the clip space
+// of a shadow cascade (see shadowmap_visibility() in mesh.frag)
+static float shadow_visibility(const SoftwarePass &pass, int cascade, const glm::vec4 &shadowPos,
+                               float bias, float fragX, float fragY)
+{
+    const SoftwareRenderer &renderer = *pass.renderer;
+    const SoftwareFrame &frame = *pass.frame;
+    glm::vec2 texcoord = glm::vec2(shadowPos) / shadowPos.w * 0.5f + 0.5f;
+    float depth = shadowPos.z / shadowPos.w * 0.5f + 0.5f;
+    int stride = renderer.shadowBufferSize, size = frame.shadowSize;
+
+    if (frame.shadowFilter == SOFTWARE_SHADOW_VARIANCE) {
+        glm::vec2 moments =
+            sample_moments(renderer.shadowMoments[cascade].data(), stride, size, texcoord);
+        if (depth <= moments.x) return 1.0f;
+        float variance = std::max(moments.y - moments.x * moments.x, 1e-6f);
+        float d = depth - moments.x;
+        float pMax = variance / (variance + d * d);
+        return std::min(std::max((pMax - 0.2f) / 0.8f, 0.0f), 1.0f);
+    }
+
+    const float *shadowmap = renderer.shadowDepth[cascade].data();
+    if (frame.shadowFilter != SOFTWARE_SHADOW_POISSON) {
+        return compare_shadowmap(shadowmap, stride, size, texcoord, depth - bias);
+    }
+
+    // Poisson disk, rotated per pixel
+    float radius = 2.5f / size;
+    float noise = std::sin(fragX * 12.9898f + fragY * 78.233f) * 43758.5453f;
+    float angle = 6.2831853f * (noise - std::floor(noise));
+    float c = std::cos(angle), s = std::sin(angle);
+    int taps = std::min(std::max(frame.shadowTaps, 1), 16);
+    float visibility = 0.0f;
+    for (int i = 0; i < taps; ++i) {
+        glm::vec2 p(POISSON_DISK[i][0], POISSON_DISK[i][1]);
+        glm::vec2 offset = glm::vec2(c * p.x - s * p.y, s * p.x + c * p.y) * radius;
+        visibility += compare_shadowmap(shadowmap, stride, size, texcoord + offset, depth - bias);
+    }
+    return visibility / taps;
+}
+
+// Fill the depth moments of a cascade from its shadowmap, and blur them with
+// the separable Gaussian of shadow_blur.frag
+static void blur_shadow_moments(SoftwareRenderer &renderer, const SoftwareFrame &frame, int cascade)
+{
+    int stride = renderer.shadowBufferSize, size = frame.shadowSize;
+    const std::vector<float> &depth = renderer.shadowDepth[cascade];
+    std::vector<glm::vec2> blurred(depth.size());
+    std::vector<glm::vec2> &moments = renderer.shadowMoments[cascade];
+    moments.resize(depth.size());
+
+    parallel_for(*renderer.workers, size, 16, [&](int first, int last) {
+        for (int y = first; y < last; ++y) {
+            for (int x = 0; x < size; ++x) {
+                glm::vec2 sum(0.0f);
+                for (int i = -3; i <= 3; ++i) {
+                    float d = depth[y * stride + std::min(std::max(x + i, 0), size - 1)];
+                    sum += SHADOW_BLUR_WEIGHTS[std::abs(i)] * glm::vec2(d, d * d);
+                }
+                blurred[y * stride + x] = sum;
+            }
+        }
+    });
+    parallel_for(*renderer.workers, size, 16, [&](int first, int last) {
+        for (int y = first; y < last; ++y) {
+            for (int x = 0; x < size; ++x) {
+                glm::vec2 sum(0.0f);
+                for (int i = -3; i <= 3; ++i) {
+                    int row = std::min(std::max(y + i, 0), size - 1);
+                    sum += SHADOW_BLUR_WEIGHTS[std::abs(i)] * blurred[row * stride + x];
+                }
+                moments[y * stride + x] = sum;
+            }
+        }
+    });
+}
+
+// Vertex processing
+
+// Transform the vertices of the draws in [first, last) of all vertices, with
+// the computations of mesh.vert (or only the positions for depth passes)
+static void transform_vertices(SoftwarePass &pass, int first, int last)
+{
+    const std::vector<SoftwareDraw> &draws = *pass.draws;
+    int draw = int(std::upper_bound(pass.firstVertex.begin(), pass.firstVertex.end(), first) -
+                   pass.firstVertex.begin()) - 1;
+    glm::mat4 mv, mvp;
+    glm::mat3 normalMatrix;
+    for (int i = first; i < last; ++i) {
+        if (i == first || i == pass.firstVertex[draw + 1]) {
+            while (i >= pass.firstVertex[draw + 1]) draw += 1;
+            mv = pass.view * draws[draw].model;
+            mvp = pass.projection * mv;
+            normalMatrix = glm::mat3(mv);
+        }
+        const SoftwareVertex &vertex = draws[draw].mesh->vertices[i - pass.firstVertex[draw]];
+        ClipVertex &out = pass.vertices[i];
+        out.position = mvp * glm::vec4(vertex.position, 1.0f);
+        if (!pass.shade) continue;
+
+        glm::vec3 positionEye = glm::vec3(mv * glm::vec4(vertex.position, 1.0f));
+        glm::vec3 values[5] = {-positionEye, glm::normalize(normalMatrix * vertex.normal),
+                               glm::normalize(pass.frame->lightPosition - positionEye),
+                               vertex.normal, vertex.color};
+        for (int j = 0; j < 5; ++j) {
+            for (int k = 0; k < 3; ++k) out.varyings[3 * j + k] = values[j][k];
+        }
+        out.varyings[VARYING_TEXCOORD] = vertex.texcoord.x;
+        out.varyings[VARYING_TEXCOORD + 1] = vertex.texcoord.y;
+        glm::vec3 tangent = glm::normalize(normalMatrix * glm::vec3(vertex.tangent));
+        for (int k = 0; k < 3; ++k) out.varyings[VARYING_TANGENT + k] = tangent[k];
+        out.varyings[VARYING_TANGENT + 3] = vertex.tangent.w;
+    }
+}
+
+// Triangle setup and binning
+
+// Return the coefficients of the edge function of the edge from a to b,
+// which is positive to the left of the edge
+static Plane edge_function(const glm::vec3 &a, const glm::vec3 &b)
+{
+    Plane edge;
+    edge.a = a.y - b.y;
+    edge.b = b.x - a.x;
+    edge.c = (b.y - a.y) * a.x - (b.x - a.x) * a.y;
+    return edge;
+}
+
+// Set up a triangle whose vertices are in front of the near plane, and add
+// it to the bins of the tiles that it overlaps
+static void setup_triangle(SoftwarePass &pass, int part, const ClipVertex *v0,
+                           const ClipVertex *v1, const ClipVertex *v2, int draw)
+{
+    SetupTriangle triangle;
+    triangle.vertices[0] = v0;
+    triangle.vertices[1] = v1;
+    triangle.vertices[2] = v2;
+    triangle.draw = draw;
+
+    // Window coordinates, snapped to 1/256 pixels
+    glm::vec3 window[3];
+    for (int i = 0; i < 3; ++i) {
+        const glm::vec4 &p = triangle.vertices[i]->position;
+        triangle.invW[i] = 1.0f / p.w;
+        glm::vec3 ndc = glm::vec3(p) * triangle.invW[i];
+        window[i].x = std::floor((ndc.x * 0.5f + 0.5f) * pass.width * 256.0f + 0.5f) / 256.0f;
+        window[i].y = std::floor((ndc.y * 0.5f + 0.5f) * pass.height * 256.0f + 0.5f) / 256.0f;
+        window[i].z = ndc.z * 0.5f + 0.5f;
+    }
+
+    // Both windings are drawn (there is no face culling), as counterclockwise
+    float area = (window[1].x - window[0].x) * (window[2].y - window[0].y) -
+                 (window[1].y - window[0].y) * (window[2].x - window[0].x);
+    if (!(std::abs(area) > 0.0f)) return;
+    if (area < 0.0f) {
+        std::swap(window[1], window[2]);
+        std::swap(triangle.vertices[1], triangle.vertices[2]);
+        std::swap(triangle.invW[1], triangle.invW[2]);
+        area = -area;
+    }
+
+    glm::vec3 minCorner = glm::min(window[0], glm::min(window[1], window[2]));
+    glm::vec3 maxCorner = glm::max(window[0], glm::max(window[1], window[2]));
+    triangle.xMin = std::max(int(std::ceil(minCorner.x - 0.5f)), 0);
+    triangle.yMin = std::max(int(std::ceil(minCorner.y - 0.5f)), 0);
+    triangle.xMax = std::min(int(std::floor(maxCorner.x - 0.5f)), pass.width - 1);
+    triangle.yMax = std::min(int(std::floor(maxCorner.y - 0.5f)), pass.height - 1);
+    if (triangle.xMin > triangle.xMax || triangle.yMin > triangle.yMax) return;
+
+    for (int i = 0; i < 3; ++i) {
+        Plane &edge = triangle.edges[i];
+        edge = edge_function(window[(i + 1) % 3], window[(i + 2) % 3]);
+        // Left edges go down, and top edges go left (window y is up)
+        triangle.topLeft[i] = edge.a > 0.0f || (edge.a == 0.0f && edge.b < 0.0f);
+    }
+    const Plane &e1 = triangle.edges[1], &e2 = triangle.edges[2];
+    float z1 = window[1].z - window[0].z, z2 = window[2].z - window[0].z;
+    triangle.depth.a = (e1.a * z1 + e2.a * z2) / area;
+    triangle.depth.b = (e1.b * z1 + e2.b * z2) / area;
+    triangle.depth.c = window[0].z + (e1.c * z1 + e2.c * z2) / area;
+
+    // Bin the triangle to the tiles that it overlaps, leaving out tiles that
+    // are entirely outside of one of its edges
+    std::vector<SetupTriangle> &triangles = pass.triangles[part];
+    int index = int(triangles.size());
+    triangles.push_back(triangle);
+    int tilesX = pass.bufferWidth / SOFTWARE_TILE_SIZE;
+    int tx0 = triangle.xMin / SOFTWARE_TILE_SIZE, tx1 = triangle.xMax / SOFTWARE_TILE_SIZE;
+    int ty0 = triangle.yMin / SOFTWARE_TILE_SIZE, ty1 = triangle.yMax / SOFTWARE_TILE_SIZE;
+    for (int ty = ty0; ty <= ty1; ++ty) {
+        for (int tx = tx0; tx <= tx1; ++tx) {
+            bool outside = false;
+            if (tx0 != tx1 || ty0 != ty1) {
+                float x0 = tx * SOFTWARE_TILE_SIZE + 0.5f, x1 = x0 + SOFTWARE_TILE_SIZE - 1;
+                float y0 = ty * SOFTWARE_TILE_SIZE + 0.5f, y1 = y0 + SOFTWARE_TILE_SIZE - 1;
+                for (const Plane &edge : triangle.edges) {
+                    float x = (edge.a > 0.0f) ? x1 : x0, y = (edge.b > 0.0f) ? y1 : y0;
+                    outside = outside || edge.a * x + edge.b * y + edge.c < 0.0f;
+                }
+            }
+            if (!outside) pass.bins[part][ty * tilesX + tx].push_back(index);
+        }
+    }
+}
+
+static ClipVertex lerp_vertex(const ClipVertex &a, const ClipVertex &b, float t)
+{
+    ClipVertex v;
+    v.position = glm::mix(a.position, b.position, t);
+    for (int i = 0; i < VARYING_COUNT; ++i) {
+        v.varyings[i] = a.varyings[i] + (b.varyings[i] - a.varyings[i]) * t;
+    }
+    return v;
+}
+
+// Distance of a clip-space position to a clipping plane (positive inside):
+// the near plane, then the sides of the guard band
+static float clip_distance(const glm::vec4 &p, int plane, float guardBand)
+{
+    switch (plane) {
+    case 0: return p.z + p.w;
+    case 1: return guardBand * p.w - p.x;
+    case 2: return guardBand * p.w + p.x;
+    case 3: return guardBand * p.w - p.y;
+    default: return guardBand * p.w + p.y;
+    }
+}
+
+// Clip a triangle that crosses the near plane or the guard band, and set up
+// the triangles of the clipped polygon
+static void clip_triangle(SoftwarePass &pass, int part, const ClipVertex *triangle[3], int draw)
+{
+    const int maxVertices = 3 + 5;
+    const ClipVertex *polygon[maxVertices], *clipped[maxVertices];
+    int count = 3;
+    std::copy(triangle, triangle + 3, polygon);
+    std::deque<ClipVertex> &created = pass.clippedVertices[part];
+    for (int plane = 0; plane < 5 && count >= 3; ++plane) {
+        int clippedCount = 0;
+        for (int i = 0; i < count; ++i) {
+            const ClipVertex *a = polygon[i], *b = polygon[(i + 1) % count];
+            float da = clip_distance(a->position, plane, pass.guardBand);
+            float db = clip_distance(b->position, plane, pass.guardBand);
+            if (da >= 0.0f) clipped[clippedCount++] = a;
+            if ((da >= 0.0f) != (db >= 0.0f)) {
+                created.push_back(lerp_vertex(*a, *b, da / (da - db)));
+                clipped[clippedCount++] = &created.back();
+            }
+        }
+        count = clippedCount;
+        std::copy(clipped, clipped + count, polygon);
+    }
+    for (int i = 1; i + 1 < count; ++i) {
+        setup_triangle(pass, part, polygon[0], polygon[i], polygon[i + 1], draw);
+    }
+}
+
+// Set up the triangles in [first, last) of all triangles of the draws
+static void setup_triangles(SoftwarePass &pass, int part, int first, int last)
+{
+    const std::vector<SoftwareDraw> &draws = *pass.draws;
+    int draw = int(std::upper_bound(pass.firstTriangle.begin(), pass.firstTriangle.end(), first) -
+                   pass.firstTriangle.begin()) - 1;
+    for (int i = first; i < last; ++i) {
+        while (i >= pass.firstTriangle[draw + 1]) draw += 1;
+        const uint32_t *indices = &draws[draw].mesh->indices[3 * (i - pass.firstTriangle[draw])];
+        const ClipVertex *triangle[3];
+        int inside = 0x3ff, outside = 0;  // Bits of the planes that all vertices are in or out of
+        for (int j = 0; j < 3; ++j) {
+            triangle[j] = &pass.vertices[pass.firstVertex[draw] + indices[j]];
+            const glm::vec4 &p = triangle[j]->position;
+            float guard = pass.guardBand * p.w;
+            int codes = (p.x < -p.w) | (p.x > p.w) << 1 | (p.y < -p.w) << 2 | (p.y > p.w) << 3 |
+                        (p.z < -p.w) << 4 | (p.z > p.w) << 5 | (p.x < -guard) << 6 |
+                        (p.x > guard) << 7 | (p.y < -guard) << 8 | (p.y > guard) << 9;
+            inside &= codes;
+            outside |= codes;
+        }
+        if (inside & 0x3f) continue;  // Outside of the view volume
+        if (outside & 0x3d0) {
+            clip_triangle(pass, part, triangle, draw);
+        } else {
+            setup_triangle(pass, part, triangle[0], triangle[1], triangle[2], draw);
+        }
+    }
+}
+
+// Fragment processing
+
+// Interpolated varyings of the pixels of a quad. Lanes (see cg_simd.h) hold
+// one value per pixel, in the order (0, 0), (1, 0), (0, 1), (1, 1).
+struct QuadVaryings {
+    alignas(16) float values[VARYING_COUNT][4];
+
+    glm::vec3 vec3(int varying, int lane) const
+    {
+        return glm::vec3(values[varying][lane], values[varying + 1][lane],
+                         values[varying + 2][lane]);
+    }
+    glm::vec2 vec2(int varying, int lane) const
+    {
+        return glm::vec2(values[varying][lane], values[varying + 1][lane]);
+    }
+};
+
+// Calculate the tangent space matrix from the interpolated vertex tangent
+// (see tangent_space() in mesh.frag)
+static glm::mat3 tangent_space(const QuadVaryings &quad, int lane, const glm::vec3 &normal)
+{
+    glm::vec3 t = glm::normalize(quad.vec3(VARYING_TANGENT, lane));
+    glm::vec3 b = quad.values[VARYING_TANGENT + 3][lane] * glm::cross(normal, t);
+    return glm::mat3(t, b, normal);
+}
+
+// Shade a pixel of a quad (see main() in mesh.frag)
+static glm::vec3 shade_pixel(const SoftwarePass &pass, const SoftwareDraw &draw,
+                             const QuadVaryings &quad, int lane, float fragX, float fragY)
+{
+    const SoftwareFrame &frame = *pass.frame;
+    unsigned features = draw.features;
+    glm::vec3 V = quad.vec3(VARYING_V, lane), N = quad.vec3(VARYING_N, lane);
+    glm::vec2 texcoord = quad.vec2(VARYING_TEXCOORD, lane);
+
+    if (features & SOFTWARE_TEXCOORDS_AS_COLOR) return glm::vec3(texcoord, 0.0f);
+    if (features & SOFTWARE_CUBEMAP) {
+        if (!frame.cubemap) return glm::vec3(0.0f);
+        glm::vec3 reflected[3];
+        for (int i = 0; i < 3; ++i) {
+            reflected[i] = glm::reflect(-quad.vec3(VARYING_V, i), quad.vec3(VARYING_N, i));
+        }
+        return sample_cubemap(*frame.cubemap, glm::reflect(-V, N), reflected);
+    }
+
+    // The level of detail of the textures is shared by the quad
+    glm::vec2 dx = quad.vec2(VARYING_TEXCOORD, 1) - quad.vec2(VARYING_TEXCOORD, 0);
+    glm::vec2 dy = quad.vec2(VARYING_TEXCOORD, 2) - quad.vec2(VARYING_TEXCOORD, 0);
+
+    glm::vec3 color;
+    if (features & SOFTWARE_NORMALS_AS_COLOR) {
+        color = 0.5f * quad.vec3(VARYING_NORMAL, lane) + 0.5f;
+    } else {
+        if ((features & SOFTWARE_BASE_COLOR_TEXTURE) && draw.baseColorTexture) {
+            const SoftwareTexture &texture = *draw.baseColorTexture;
+            float lod = texture_lod(texture, dx, dy);
+            color = glm::vec3(sample_software_texture(texture, texcoord, lod));
+        } else {
+            color = quad.vec3(VARYING_COLOR, lane);
+        }
+
+        glm::vec3 normal = N;
+        if ((features & SOFTWARE_NORMAL_TEXTURE) && draw.normalTexture) {
+            // Normal vector from the normal map, in tangent space
+            const SoftwareTexture &texture = *draw.normalTexture;
+            float lod = texture_lod(texture, dx, dy);
+            glm::vec4 texel = sample_software_texture(texture, texcoord, lod);
+            glm::vec2 xy = glm::vec2(texel) * 2.0f - 1.0f;
+            glm::vec3 tangentNormal(xy, std::sqrt(std::max(1.0f - glm::dot(xy, xy), 0.0f)));
+            normal = glm::normalize(tangent_space(quad, lane, N) * tangentNormal);
+        }
+
+        if (features & SOFTWARE_LIGHTING) {
+            glm::vec3 L = quad.vec3(VARYING_L, lane);
+            float diffuse = std::max(0.0f, glm::dot(normal, L));
+            glm::vec3 H = glm::normalize(L + V);
+            float cosine = glm::dot(normal, H);
+            float specular = (cosine > 0.0f) ? std::pow(cosine, frame.specularPower) : 0.0f;
+
+            float visibility = 1.0f;
+            if (features & (SOFTWARE_DIFFUSE_LIGHTING | SOFTWARE_SPECULAR_LIGHTING)) {
+                int cascade = frame.cascadeCount - 1;
+                for (int i = 0; i < frame.cascadeCount - 1; ++i) {
+                    if (V.z < frame.cascadeSplits[i]) {
+                        cascade = i;
+                        break;
+                    }
+                }
+                glm::vec4 shadowPos = pass.shadowFromView[cascade] * glm::vec4(-V, 1.0f);
+                visibility = shadow_visibility(pass, cascade, shadowPos, 0.005f, fragX, fragY);
+            }
+
+            if (features & SOFTWARE_AMBIENT_LIGHTING) color += frame.ambientColor;
+            if (features & SOFTWARE_DIFFUSE_LIGHTING) {
+                color += diffuse * frame.diffuseColor * visibility;
+            }
+            if (features & SOFTWARE_SPECULAR_LIGHTING) {
+                color += ((frame.specularPower + 8.0f) / 8.0f) * frame.specularColor * specular *
+                         visibility;
+            }
+        }
+    }
+
+    if (features & SOFTWARE_GAMMA_CORRECTION) color = glm::pow(color, glm::vec3(1.0f / 2.2f));
+    return color;
+}
+
+// Interpolate the varyings of a triangle over a quad, from the values of its
+// edge functions, and shade the pixels of the quad that are in mask
+static void shade_quad(SoftwarePass &pass, int tile, const SetupTriangle &triangle,
+                       const Lanes weights[3], int mask, int x, int y)
+{
+    // Perspective-correct barycentric coordinates
+    Lanes q0 = lanes_mul(weights[0], lanes(triangle.invW[0]));
+    Lanes q1 = lanes_mul(weights[1], lanes(triangle.invW[1]));
+    Lanes q2 = lanes_mul(weights[2], lanes(triangle.invW[2]));
+    Lanes scale = lanes_div(lanes(1.0f), lanes_add(lanes_add(q0, q1), q2));
+    q0 = lanes_mul(q0, scale);
+    q1 = lanes_mul(q1, scale);
+    q2 = lanes_mul(q2, scale);
+
+    QuadVaryings quad;
+    const float *a0 = triangle.vertices[0]->varyings, *a1 = triangle.vertices[1]->varyings,
+                *a2 = triangle.vertices[2]->varyings;
+    for (int i = 0; i < VARYING_COUNT; ++i) {
+        Lanes value = lanes_add(lanes_mul(q0, lanes(a0[i])), lanes_mul(q1, lanes(a1[i])));
+        lanes_store(quad.values[i], lanes_add(value, lanes_mul(q2, lanes(a2[i]))));
+    }
+
+    const SoftwareDraw &draw = (*pass.draws)[triangle.draw];
+    for (int lane = 0; lane < 4; ++lane) {
+        if (!(mask & (1 << lane))) continue;
+        int px = x + (lane & 1), py = y + (lane >> 1);
+        glm::vec3 color = shade_pixel(pass, draw, quad, lane, px + 0.5f, py + 0.5f);
+        uint8_t *pixel = &pass.color[(py * pass.bufferWidth + px) * 3];
+        pixel[0] = to_unorm8(color.r);
+        pixel[1] = to_unorm8(color.g);
+        pixel[2] = to_unorm8(color.b);
+        pass.shadedPixels[tile] += 1;
+    }
+}
+
+// Evaluate a plane at the pixels of a quad
+static inline Lanes lanes_plane(const Plane &plane, Lanes x, Lanes y)
+{
+    return lanes_add(lanes_add(lanes_mul(lanes(plane.a), x), lanes_mul(lanes(plane.b), y)),
+                     lanes(plane.c));
+}
+
+// Rasterize a triangle into a tile, whose depth is stored quad by quad
+static void rasterize_triangle(SoftwarePass &pass, int tile, const SetupTriangle &triangle,
+                               int tileX, int tileY, float *tileDepth)
+{
+    int x0 = std::max(triangle.xMin, tileX) & ~1;
+    int y0 = std::max(triangle.yMin, tileY) & ~1;
+    int x1 = std::min(triangle.xMax, tileX + SOFTWARE_TILE_SIZE - 1);
+    int y1 = std::min(triangle.yMax, tileY + SOFTWARE_TILE_SIZE - 1);
+    const Lanes offsetX = lanes(0.5f, 1.5f, 0.5f, 1.5f), offsetY = lanes(0.5f, 0.5f, 1.5f, 1.5f);
+    const Lanes zero = lanes(0.0f), one = lanes(1.0f);
+    const Plane *edges = triangle.edges;
+
+    for (int y = y0; y <= y1; y += 2) {
+        Lanes py = lanes_add(lanes(float(y)), offsetY);
+        for (int x = x0; x <= x1; x += 2) {
+            Lanes px = lanes_add(lanes(float(x)), offsetX);
+            Lanes weights[3];
+            Lanes inside = lanes_greater_equal(one, zero);
+            for (int i = 0; i < 3; ++i) {
+                weights[i] = lanes_plane(edges[i], px, py);
+                inside = lanes_and(inside, triangle.topLeft[i]
+                                               ? lanes_greater_equal(weights[i], zero)
+                                               : lanes_greater(weights[i], zero));
+            }
+            if (!lanes_mask(inside)) continue;
+
+            // Depth test (GL_LESS), with depth clipping
+            Lanes z = lanes_plane(triangle.depth, px, py);
+            float *quadDepth = tileDepth + ((y - tileY) / 2 * (SOFTWARE_TILE_SIZE / 2) +
+                                            (x - tileX) / 2) * 4;
+            Lanes old = lanes_load(quadDepth);
+            inside = lanes_and(inside, lanes_greater(old, z));
+            inside = lanes_and(inside, lanes_and(lanes_greater_equal(z, zero),
+                                                 lanes_greater_equal(one, z)));
+            int mask = lanes_mask(inside);
+            if (!mask) continue;
+            lanes_store(quadDepth, lanes_select(inside, z, old));
+
+            if (pass.shade) shade_quad(pass, tile, triangle, weights, mask, x, y);
+        }
+    }
+}
+
+// Rasterize the triangles of all bins of a tile, in the order in which the
+// draws were submitted
+static void rasterize_tile(SoftwarePass &pass, int tile)
+{
+    int tilesX = pass.bufferWidth / SOFTWARE_TILE_SIZE;
+    int tileX = tile % tilesX * SOFTWARE_TILE_SIZE, tileY = tile / tilesX * SOFTWARE_TILE_SIZE;
+    alignas(16) float tileDepth[SOFTWARE_TILE_SIZE * SOFTWARE_TILE_SIZE];
+    std::fill(tileDepth, tileDepth + SOFTWARE_TILE_SIZE * SOFTWARE_TILE_SIZE, 1.0f);
+    if (pass.color) {
+        for (int y = tileY; y < tileY + SOFTWARE_TILE_SIZE; ++y) {
+            uint8_t *row = &pass.color[(y * pass.bufferWidth + tileX) * 3];
+            for (int x = 0; x < SOFTWARE_TILE_SIZE; ++x) {
+                std::copy(pass.background, pass.background + 3, row + 3 * x);
+            }
+        }
+    }
+
+    for (int i = 0; i < pass.partCount; ++i) {
+        const std::vector<SetupTriangle> &triangles = pass.triangles[i];
+        for (int index : pass.bins[i][tile]) {
+            rasterize_triangle(pass, tile, triangles[index], tileX, tileY, tileDepth);
+        }
+    }
+
+    for (int y = 0; y < SOFTWARE_TILE_SIZE; ++y) {
+        float *row = &pass.depth[(tileY + y) * pass.bufferWidth + tileX];
+        for (int x = 0; x < SOFTWARE_TILE_SIZE; ++x) {
+            int quad = y / 2 * (SOFTWARE_TILE_SIZE / 2) + x / 2;
+            row[x] = tileDepth[quad * 4 + (y & 1) * 2 + (x & 1)];
+        }
+    }
+}
+
+// Run the vertex, setup and rasterization steps of a pass
+static void render_software_pass(SoftwarePass &pass)
+{
+    const std::vector<SoftwareDraw> &draws = *pass.draws;
+    WorkerPool &workers = *pass.renderer->workers;
+    int partCount = pass.partCount;
+    pass.firstVertex.assign(1, 0);
+    pass.firstTriangle.assign(1, 0);
+    for (const SoftwareDraw &draw : draws) {
+        pass.firstVertex.push_back(pass.firstVertex.back() + int(draw.mesh->vertices.size()));
+        pass.firstTriangle.push_back(pass.firstTriangle.back() +
+                                     int(draw.mesh->indices.size() / 3));
+    }
+    pass.vertices.resize(pass.firstVertex.back());
+    int vertexCount = pass.firstVertex.back(), triangleCount = pass.firstTriangle.back();
+
+    int tilesX = pass.bufferWidth / SOFTWARE_TILE_SIZE;
+    int tileCount = tilesX * (pass.bufferHeight / SOFTWARE_TILE_SIZE);
+    pass.triangles.assign(partCount, std::vector<SetupTriangle>());
+    pass.clippedVertices.assign(partCount, std::deque<ClipVertex>());
+    pass.bins.assign(partCount, std::vector<std::vector<int>>(tileCount));
+    pass.shadedPixels.assign(tileCount, 0);
+
+    parallel_for(workers, vertexCount, 1024, [&](int first, int last) {
+        transform_vertices(pass, first, last);
+    });
+    // The parts are consecutive ranges of triangles, so the bins of a tile
+    // keep the submission order when they are rasterized part by part
+    parallel_for(workers, partCount, 1, [&](int first, int last) {
+        for (int part = first; part < last; ++part) {
+            setup_triangles(pass, part, int(int64_t(triangleCount) * part / partCount),
+                            int(int64_t(triangleCount) * (part + 1) / partCount));
+        }
+    });
+    parallel_for(workers, tileCount, 1, [&](int first, int last) {
+        for (int tile = first; tile < last; ++tile) rasterize_tile(pass, tile);
+    });
+}
+
+static void init_software_pass(SoftwarePass &pass, const SoftwareRenderer &renderer,
+                               const SoftwareFrame &frame, const std::vector<SoftwareDraw> &draws,
+                               int width, int height)
+{
+    pass.renderer = &renderer;
+    pass.frame = &frame;
+    pass.draws = &draws;
+    pass.partCount = int(renderer.workers->threads.size()) + 1;
+    pass.width = width;
+    pass.height = height;
+    pass.bufferWidth = pad_to_tiles(width);
+    pass.bufferHeight = pad_to_tiles(height);
+    // Keep window coordinates within 8192 pixels of the viewport, where
+    // 1/256 pixels are still exact in floats
+    pass.guardBand = 1.0f + 16384.0f / std::max(width, height);
+}
+
+void render_software_frame(SoftwareRenderer &renderer, const SoftwareFrame &frame,
+                           const std::vector<SoftwareDraw> &draws)
+{
+    bool useShadows = false;
+    for (const SoftwareDraw &draw : draws) {
+        useShadows = useShadows ||
+                     ((draw.features & SOFTWARE_LIGHTING) &&
+                      (draw.features & (SOFTWARE_DIFFUSE_LIGHTING | SOFTWARE_SPECULAR_LIGHTING)));
+    }
+
+    // Shadowmap cascades, from the light
+    int cascadeCount = std::min(std::max(frame.cascadeCount, 1), SOFTWARE_MAX_CASCADES);
+    for (int c = 0; useShadows && c < cascadeCount; ++c) {
+        SoftwarePass pass;
+        init_software_pass(pass, renderer, frame, draws, frame.shadowSize, frame.shadowSize);
+        pass.shade = false;
+        pass.view = glm::mat4(1.0f);
+        pass.projection = frame.shadowMatrices[c];
+        renderer.shadowBufferSize = pass.bufferWidth;
+        renderer.shadowDepth[c].resize(pass.bufferWidth * pass.bufferHeight);
+        pass.depth = renderer.shadowDepth[c].data();
+        pass.color = nullptr;
+        render_software_pass(pass);
+        if (frame.shadowFilter == SOFTWARE_SHADOW_VARIANCE) {
+            blur_shadow_moments(renderer, frame, c);
+        }
+    }
+
+    // Image, from the camera
+    SoftwarePass pass;
+    init_software_pass(pass, renderer, frame, draws, renderer.width, renderer.height);
+    pass.shade = true;
+    pass.view = frame.view;
+    pass.projection = frame.projection;
+    glm::mat4 viewToWorld = glm::inverse(frame.view);
+    for (int c = 0; c < SOFTWARE_MAX_CASCADES; ++c) {
+        pass.shadowFromView[c] = frame.shadowMatrices[c] * viewToWorld;
+    }
+    pass.depth = renderer.depth.data();
+    pass.color = renderer.color.data();
+    for (int i = 0; i < 3; ++i) pass.background[i] = to_unorm8(frame.backgroundColor[i]);
+    render_software_pass(pass);
+
+    renderer.triangles = 0;
+    for (const std::vector<SetupTriangle> &triangles : pass.triangles) {
+        renderer.triangles += int(triangles.size());
+    }
+    renderer.shadedPixels = 0;
+    for (int64_t count : pass.shadedPixels) renderer.shadedPixels += count;
+}
+
+void read_software_pixels(const SoftwareRenderer &renderer, std::vector<uint8_t> &pixels)
+{
+    pixels.resize(renderer.width * renderer.height * 3);
+    for (int y = 0; y < renderer.height; ++y) {
+        const uint8_t *row = &renderer.color[(renderer.height - 1 - y) * renderer.bufferWidth * 3];
+        std::copy(row, row + renderer.width * 3, &pixels[y * renderer.width * 3]);
+    }
+}
+
+}  // namespace cg
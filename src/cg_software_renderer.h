@@ -0,0 +1,175 @@
+// Multi-threaded software renderer, for machines without a GPU. It draws
+// meshes with the shading of mesh.vert and mesh.frag (Blinn-Phong lighting
+// with cascaded shadow maps, base color and normal textures, cubemap
+// reflections and gamma correction), so that its images match those of the
+// OpenGL renderer. Triangles are set up and binned to screen tiles in
+// parallel, and the tiles are then rasterized on the same worker pool (see
+// cg_worker_pool.h), which keeps its threads from frame to frame. Tiles are rasterized in 2x2 pixel quads, whose edge functions and
+// depth tests are evaluated with SSE2, and whose differences give the
+// derivatives for texture filtering. Does not depend on OpenGL.
+//
+
+#pragma once
+
+#include "cg_worker_pool.h"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace cg {
+
+// Width and height of the screen tiles in pixels (must be even)
+const int SOFTWARE_TILE_SIZE = 64;
+
+const int SOFTWARE_MAX_CASCADES = 4;
+
+// Shading features of a draw (see the #defines of mesh.frag)
+enum SoftwareFeature {
+    SOFTWARE_LIGHTING = 1 << 0,
+    SOFTWARE_AMBIENT_LIGHTING = 1 << 1,
+    SOFTWARE_DIFFUSE_LIGHTING = 1 << 2,
+    SOFTWARE_SPECULAR_LIGHTING = 1 << 3,
+    SOFTWARE_NORMALS_AS_COLOR = 1 << 4,
+    SOFTWARE_GAMMA_CORRECTION = 1 << 5,
+    SOFTWARE_CUBEMAP = 1 << 6,
+    SOFTWARE_TEXCOORDS_AS_COLOR = 1 << 7,
+    SOFTWARE_BASE_COLOR_TEXTURE = 1 << 8,
+    SOFTWARE_NORMAL_TEXTURE = 1 << 9
+};
+
+// Shadow filters (see cg::ShadowFilter)
+enum SoftwareShadowFilter {
+    SOFTWARE_SHADOW_PCF = 0,
+    SOFTWARE_SHADOW_POISSON = 1,
+    SOFTWARE_SHADOW_VARIANCE = 2
+};
+
+struct SoftwareVertex {
+    glm::vec3 position;
+    glm::vec3 normal;
+    glm::vec2 texcoord;
+    glm::vec3 color;
+    glm::vec4 tangent;  // Handedness of the bitangent in w
+};
+
+struct SoftwareMesh {
+    std::vector<SoftwareVertex> vertices;
+    std::vector<uint32_t> indices;  // Triangle list
+};
+
+enum SoftwareWrap {
+    SOFTWARE_WRAP_REPEAT,
+    SOFTWARE_WRAP_CLAMP,
+    SOFTWARE_WRAP_MIRROR
+};
+
+enum SoftwareMipmapFilter {
+    SOFTWARE_MIPMAP_NONE,     // Only level 0
+    SOFTWARE_MIPMAP_NEAREST,  // Nearest level
+    SOFTWARE_MIPMAP_LINEAR    // Blend of the two nearest levels
+};
+
+// RGBA8 texture with its mip chain, and sampler state
+struct SoftwareTexture {
+    std::vector<std::vector<uint8_t>> levels;
+    std::vector<int> widths;  // Size of each level
+    std::vector<int> heights;
+    SoftwareWrap wrapS = SOFTWARE_WRAP_CLAMP;
+    SoftwareWrap wrapT = SOFTWARE_WRAP_CLAMP;
+    bool magLinear = true;  // Bilinear filtering when magnified (nearest otherwise)
+    bool minLinear = true;  // Bilinear filtering when minified
+    SoftwareMipmapFilter mipmapFilter = SOFTWARE_MIPMAP_LINEAR;
+};
+
+// Sample a texture with the filters of its sampler, at a level of detail
+// (like textureLod() in GLSL; levels below 0 use the magnification filter)
+glm::vec4 sample_software_texture(const SoftwareTexture &texture, const glm::vec2 &texcoord,
+                                  float lod);
+
+// Decode an sRGB component (0 to 1) to linear
+float srgb_to_linear(float value);
+
+// Cubemap with linear RGB texels. Like the sRGB textures of cg::load_cubemap(),
+// the faces are decoded from sRGB when they are loaded, and their mip chains
+// are averaged in linear space.
+struct SoftwareCubemap {
+    int size = 0;  // Width and height of the faces
+    std::vector<std::vector<glm::vec3>> levels[6];  // Of each face (+x, -x, +y, -y, +z, -z)
+};
+
+// Load the faces of a cubemap directory (posx.png, negx.png, ...). Returns
+// false if a face could not be loaded.
+bool load_software_cubemap(SoftwareCubemap &cubemap, const std::string &dirname);
+
+// Sample a cubemap with trilinear filtering, at a level of detail
+glm::vec3 sample_software_cubemap(const SoftwareCubemap &cubemap, const glm::vec3 &direction,
+                                  float lod);
+
+struct SoftwareDraw {
+    const SoftwareMesh *mesh;
+    glm::mat4 model;
+    unsigned features;                        // SoftwareFeature bits
+    const SoftwareTexture *baseColorTexture;  // Used with SOFTWARE_BASE_COLOR_TEXTURE
+    const SoftwareTexture *normalTexture;     // Used with SOFTWARE_NORMAL_TEXTURE
+};
+
+// Camera, lighting and shadow parameters of a frame (see the uniform blocks
+// of mesh.frag)
+struct SoftwareFrame {
+    glm::mat4 view;
+    glm::mat4 projection;
+    glm::vec3 lightPosition;  // In view space
+    float specularPower = 2.0f;
+    glm::vec3 ambientColor;
+    glm::vec3 diffuseColor;
+    glm::vec3 specularColor;
+    glm::vec3 backgroundColor;
+    const SoftwareCubemap *cubemap = nullptr;  // Used with SOFTWARE_CUBEMAP
+
+    // Shadow cascades (e.g., fitted with cg::fit_shadow_cascades()). The
+    // shadow maps are only rendered if a draw has diffuse or specular
+    // lighting.
+    int cascadeCount = 1;
+    int shadowSize = 1024;
+    float cascadeSplits[SOFTWARE_MAX_CASCADES] = {};  // View-space far depth of each cascade
+    glm::mat4 shadowMatrices[SOFTWARE_MAX_CASCADES];  // Projection * light view of each cascade
+    SoftwareShadowFilter shadowFilter = SOFTWARE_SHADOW_PCF;
+    int shadowTaps = 8;  // Poisson disk taps (4 to 16)
+};
+
+struct SoftwareRenderer {
+    int width = 0;
+    int height = 0;
+    WorkerPool *workers = nullptr;
+    int bufferWidth = 0;  // Size of the buffers, padded to whole tiles
+    int bufferHeight = 0;
+    std::vector<uint8_t> color;  // RGB, bottom row first
+    std::vector<float> depth;    // Window-space depth
+
+    // Shadow maps of the last frame, one per cascade (with rows of
+    // shadowBufferSize texels)
+    int shadowBufferSize = 0;
+    std::vector<float> shadowDepth[SOFTWARE_MAX_CASCADES];
+    std::vector<glm::vec2> shadowMoments[SOFTWARE_MAX_CASCADES];  // Blurred (variance filter)
+
+    // Statistics of the last frame
+    int triangles = 0;         // Triangles of the color pass after clipping
+    int64_t shadedPixels = 0;  // Pixels that passed the depth test
+};
+
+// Set the image size, and the pool whose workers (and the calling thread)
+// render the frames
+void create_software_renderer(SoftwareRenderer &renderer, int width, int height,
+                              WorkerPool &workers);
+
+// Render the shadow maps (if needed) and the image of a frame
+void render_software_frame(SoftwareRenderer &renderer, const SoftwareFrame &frame,
+                           const std::vector<SoftwareDraw> &draws);
+
+// Copy the image as RGB rows, top row first (like cg::finish_offscreen_readback())
+void read_software_pixels(const SoftwareRenderer &renderer, std::vector<uint8_t> &pixels);
+
+}  // namespace cg
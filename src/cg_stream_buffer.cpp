@@ -0,0 +1,172 @@
+// Ring buffer for streaming per-frame data to the GPU, written directly by
+// the CPU through a mapped pointer.
+//
+
+#include "cg_stream_buffer.h"
+#include "cg_multi_draw.h"
+#include "cg_utils.h"
+
+#include <algorithm>
+
+namespace cg {
+
+// Regions start at multiples of this, so that offsets that are aligned
+// within a region are also aligned within the buffer
+const int STREAM_BUFFER_REGION_ALIGNMENT = 4096;
+
+const GLbitfield PERSISTENT_FLAGS = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+static int region_size(int size)
+{
+    size = std::max(size, 1);
+    return (size + STREAM_BUFFER_REGION_ALIGNMENT - 1) / STREAM_BUFFER_REGION_ALIGNMENT *
+           STREAM_BUFFER_REGION_ALIGNMENT;
+}
+
+// Create the GL buffer with regions of frameSize bytes (persistently mapped
+// if stream.persistent is set)
+static void create_storage(StreamBuffer &stream, int frameSize)
+{
+    stream.frameSize = frameSize;
+    GLsizeiptr size = GLsizeiptr(frameSize) * STREAM_BUFFER_FRAME_COUNT;
+    glGenBuffers(1, &stream.buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, stream.buffer);
+    if (stream.persistent) {
+        glBufferStorage(GL_COPY_WRITE_BUFFER, size, nullptr, PERSISTENT_FLAGS);
+        stream.base = (char *)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, size, PERSISTENT_FLAGS);
+    } else {
+        glBufferData(GL_COPY_WRITE_BUFFER, size, nullptr, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+// Map the current region from byte first to its end
+static void map_region(StreamBuffer &stream, int first)
+{
+    int start = stream_buffer_offset(stream, first);
+    if (stream.persistent) {
+        stream.data = stream.base + start;
+    } else {
+        // The fences ensure that the GPU no longer reads the region, so the
+        // driver does not have to synchronize
+        glBindBuffer(GL_COPY_WRITE_BUFFER, stream.buffer);
+        stream.data = (char *)glMapBufferRange(
+            GL_COPY_WRITE_BUFFER, start, stream.frameSize - first,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT |
+                GL_MAP_FLUSH_EXPLICIT_BIT);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+    stream.mappedOffset = first;
+    stream.mapped = true;
+}
+
+static void unmap_region(StreamBuffer &stream)
+{
+    if (!stream.mapped) return;
+    if (!stream.persistent) {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, stream.buffer);
+        if (stream.used > stream.mappedOffset) {
+            glFlushMappedBufferRange(GL_COPY_WRITE_BUFFER, 0, stream.used - stream.mappedOffset);
+        }
+        glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+    stream.data = nullptr;
+    stream.mapped = false;
+}
+
+static void delete_fences(StreamBuffer &stream)
+{
+    for (GLsync &fence : stream.fences) {
+        if (fence) glDeleteSync(fence);
+        fence = 0;
+    }
+}
+
+void create_stream_buffer(StreamBuffer &stream, int frameSize, bool allowPersistent)
+{
+    destroy_stream_buffer(stream);
+
+    stream.persistent = allowPersistent && glBufferStorage != nullptr &&
+                        has_gl_extension("GL_ARB_buffer_storage");
+    create_storage(stream, region_size(frameSize));
+}
+
+void destroy_stream_buffer(StreamBuffer &stream)
+{
+    unmap_region(stream);
+    delete_fences(stream);
+    if (stream.buffer) glDeleteBuffers(1, &stream.buffer);  // Also unmaps a persistent mapping
+    stream = StreamBuffer();
+}
+
+void begin_stream_buffer_frame(StreamBuffer &stream)
+{
+    unmap_region(stream);
+
+    // The fence of a region follows all commands that can read it
+    if (stream.frames > 0) {
+        stream.fences[stream.frameIndex] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    stream.frameIndex = (stream.frameIndex + 1) % STREAM_BUFFER_FRAME_COUNT;
+    stream.frames += 1;
+
+    GLsync &fence = stream.fences[stream.frameIndex];
+    if (fence) {
+        if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+            double startTime = get_time();
+            GLenum status;
+            do {
+                status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+            } while (status == GL_TIMEOUT_EXPIRED);
+            stream.fenceWaits += 1;
+            stream.fenceWaitTime += get_time() - startTime;
+        }
+        glDeleteSync(fence);
+        fence = 0;
+    }
+
+    stream.used = 0;
+    map_region(stream, 0);
+}
+
+// Reallocate the buffer with regions of at least minSize bytes, and copy the
+// data written in the current frame to the new current region
+static void grow_stream_buffer(StreamBuffer &stream, int minSize)
+{
+    int oldStart = stream_buffer_offset(stream, 0);
+    GLuint oldBuffer = stream.buffer;
+    unmap_region(stream);
+    delete_fences(stream);  // The GPU can go on reading the old buffer until it is done
+
+    create_storage(stream, region_size(std::max(minSize, 2 * stream.frameSize)));
+    if (stream.used > 0) {
+        glBindBuffer(GL_COPY_READ_BUFFER, oldBuffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, stream.buffer);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, oldStart,
+                            stream_buffer_offset(stream, 0), stream.used);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+    glDeleteBuffers(1, &oldBuffer);
+    stream.reallocations += 1;
+
+    // Only map the part after the copied data, which the copy must not wait for
+    map_region(stream, stream.used);
+}
+
+int allocate_stream_buffer(StreamBuffer &stream, int size, int alignment, void **data)
+{
+    int offset = (stream.used + alignment - 1) / alignment * alignment;
+    if (offset + size > stream.frameSize) grow_stream_buffer(stream, offset + size);
+    stream.used = offset + size;
+    *data = stream.data + (offset - stream.mappedOffset);
+    return offset;
+}
+
+void end_stream_buffer_frame(StreamBuffer &stream)
+{
+    unmap_region(stream);
+}
+
+}  // namespace cg
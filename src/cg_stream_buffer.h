@@ -0,0 +1,70 @@
+// Ring buffer for streaming per-frame data to the GPU, written directly by
+// the CPU through a mapped pointer. Any kind of buffer data (uniform blocks,
+// draw commands, vertex data, ...) can be allocated from it.
+//
+
+#pragma once
+
+#include <GL/gl3w.h>
+
+namespace cg {
+
+const int STREAM_BUFFER_FRAME_COUNT = 3;
+
+// One GL buffer split into per-frame regions that are used in round-robin
+// order. Each frame allocates from its region with a bump pointer, and a
+// fence is inserted after the frame, so that a region is only written again
+// once the GPU has finished reading it. With GL_ARB_buffer_storage, the
+// buffer is mapped once (persistent and coherent); otherwise each region is
+// mapped with glMapBufferRange(), invalidating the region and skipping the
+// implicit synchronization (which the fences provide).
+struct StreamBuffer {
+    GLuint buffer = 0;
+    int frameSize = 0;        // Size (in bytes) of each per-frame region
+    int frameIndex = 0;
+    int used = 0;             // Bytes allocated in the current region
+    bool persistent = false;  // Mapped once for the lifetime of the buffer
+    bool mapped = false;      // The current region is mapped (and allocations are allowed)
+    char *base = nullptr;     // Whole buffer, if persistently mapped
+    char *data = nullptr;     // Mapped memory of the current region, from mappedOffset on
+    int mappedOffset = 0;
+    GLsync fences[STREAM_BUFFER_FRAME_COUNT] = {};
+
+    // Statistics since creation
+    int frames = 0;
+    int fenceWaits = 0;        // Frames whose region was still read by the GPU
+    double fenceWaitTime = 0;  // Seconds spent waiting for those
+    int reallocations = 0;     // Times the regions were too small for a frame
+};
+
+// Create the buffer with regions of frameSize bytes. Persistent mapping is
+// used if allowPersistent is true and the context supports it.
+void create_stream_buffer(StreamBuffer &stream, int frameSize, bool allowPersistent = true);
+
+void destroy_stream_buffer(StreamBuffer &stream);
+
+// Move to the next region, waiting for the GPU to finish reading it if
+// needed (which is counted in fenceWaits), and map it
+void begin_stream_buffer_frame(StreamBuffer &stream);
+
+// Allocate size bytes at an offset (within the current region) that is a
+// multiple of alignment (a power of two of at most 4096), and return the
+// offset. The memory to write them to is returned in data, and is valid
+// until the next allocation. If the region is full, the buffer is
+// reallocated with larger regions (keeping what has been written in this
+// frame), so that offsets stay valid.
+int allocate_stream_buffer(StreamBuffer &stream, int size, int alignment, void **data);
+
+// Make the data of the current frame visible to the GPU (unmapping the
+// region if it is not persistently mapped). The region must not be
+// allocated from until the next begin_stream_buffer_frame(), and its data
+// must not be used by the GPU before this call.
+void end_stream_buffer_frame(StreamBuffer &stream);
+
+// Return the offset in the buffer of an offset within the current region
+inline int stream_buffer_offset(const StreamBuffer &stream, int offset)
+{
+    return stream.frameIndex * stream.frameSize + offset;
+}
+
+}  // namespace cg
@@ -0,0 +1,350 @@
+// Progressive texture uploads. Each texture gets storage for its full mip
+// chain up front, and its levels are uploaded smallest first through a ring
+// of pixel buffer objects, under a budget of bytes per frame. The base level
+// of a texture follows the levels that have arrived, so that it can be
+// sampled (blurry) at once and sharpens over the next frames.
+//
+
+#include "cg_texture_streamer.h"
+#include "cg_multi_draw.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace cg {
+
+// Large enough for a row of the largest textures
+const int TEXTURE_STREAM_MIN_BUFFER_SIZE = 256 * 1024;
+
+void create_texture_streamer(TextureStreamer &streamer, int bytesPerFrame)
+{
+    destroy_texture_streamer(streamer);
+    streamer.bufferSize = std::max(bytesPerFrame, TEXTURE_STREAM_MIN_BUFFER_SIZE);
+    streamer.textureStorageSupported =
+        glTexStorage2D != nullptr && has_gl_extension("GL_ARB_texture_storage");
+
+    glGenBuffers(TEXTURE_STREAM_BUFFERS, streamer.buffers);
+    for (GLuint buffer : streamer.buffers) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, streamer.bufferSize, nullptr, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+void destroy_texture_streamer(TextureStreamer &streamer)
+{
+    for (GLsync fence : streamer.fences) {
+        if (fence) glDeleteSync(fence);
+    }
+    if (streamer.buffers[0]) glDeleteBuffers(TEXTURE_STREAM_BUFFERS, streamer.buffers);
+    streamer = TextureStreamer();
+}
+
+// Average 2x2 blocks of texels (clamped at the edges of odd sizes)
+static void downsample_rgba8(const uint8_t *src, int width, int height, uint8_t *dst,
+                             int dstWidth, int dstHeight)
+{
+    for (int y = 0; y < dstHeight; ++y) {
+        const uint8_t *row0 = src + std::min(2 * y, height - 1) * width * 4;
+        const uint8_t *row1 = src + std::min(2 * y + 1, height - 1) * width * 4;
+        for (int x = 0; x < dstWidth; ++x) {
+            int x0 = std::min(2 * x, width - 1) * 4;
+            int x1 = std::min(2 * x + 1, width - 1) * 4;
+            for (int c = 0; c < 4; ++c) {
+                int sum = row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c];
+                dst[(y * dstWidth + x) * 4 + c] = uint8_t((sum + 2) / 4);
+            }
+        }
+    }
+}
+
+// Resize an image with bilinear filtering, after halving it while it is at
+// least twice as large as the new size
+static std::vector<uint8_t> resize_rgba8(std::vector<uint8_t> src, int width, int height,
+                                         int dstWidth, int dstHeight)
+{
+    while (width >= 2 * dstWidth || height >= 2 * dstHeight) {
+        int halfWidth = (width >= 2 * dstWidth) ? width / 2 : width;
+        int halfHeight = (height >= 2 * dstHeight) ? height / 2 : height;
+        std::vector<uint8_t> half(halfWidth * halfHeight * 4);
+        if (halfWidth < width && halfHeight < height) {
+            downsample_rgba8(src.data(), width, height, half.data(), halfWidth, halfHeight);
+        } else {
+            // Average pairs of texels along one axis only
+            int dx = (halfWidth < width) ? 1 : 0, dy = 1 - dx;
+            for (int y = 0; y < halfHeight; ++y) {
+                for (int x = 0; x < halfWidth; ++x) {
+                    const uint8_t *a = &src[(((y << dy) * width) + (x << dx)) * 4];
+                    const uint8_t *b = &src[((((y << dy) + dy) * width) + (x << dx) + dx) * 4];
+                    for (int c = 0; c < 4; ++c) {
+                        half[(y * halfWidth + x) * 4 + c] = uint8_t((a[c] + b[c] + 1) / 2);
+                    }
+                }
+            }
+        }
+        src.swap(half);
+        width = halfWidth;
+        height = halfHeight;
+    }
+    if (width == dstWidth && height == dstHeight) return src;
+
+    std::vector<uint8_t> dst(dstWidth * dstHeight * 4);
+    for (int y = 0; y < dstHeight; ++y) {
+        float v = std::max((y + 0.5f) * height / dstHeight - 0.5f, 0.0f);
+        int y0 = std::min(int(v), height - 1), y1 = std::min(y0 + 1, height - 1);
+        float fy = v - y0;
+        for (int x = 0; x < dstWidth; ++x) {
+            float u = std::max((x + 0.5f) * width / dstWidth - 0.5f, 0.0f);
+            int x0 = std::min(int(u), width - 1), x1 = std::min(x0 + 1, width - 1);
+            float fx = u - x0;
+            for (int c = 0; c < 4; ++c) {
+                float top = src[(y0 * width + x0) * 4 + c] * (1.0f - fx) +
+                            src[(y0 * width + x1) * 4 + c] * fx;
+                float bottom = src[(y1 * width + x0) * 4 + c] * (1.0f - fx) +
+                               src[(y1 * width + x1) * 4 + c] * fx;
+                dst[(y * dstWidth + x) * 4 + c] = uint8_t(top * (1.0f - fy) + bottom * fy + 0.5f);
+            }
+        }
+    }
+    return dst;
+}
+
+GLuint create_streamed_texture_array(TextureStreamer &streamer, int width, int height,
+                                     int layerCount)
+{
+    StreamedTexture texture;
+    texture.widths.push_back(width);
+    texture.heights.push_back(height);
+    while (texture.widths.back() > 1 || texture.heights.back() > 1) {
+        texture.widths.push_back(std::max(texture.widths.back() / 2, 1));
+        texture.heights.push_back(std::max(texture.heights.back() / 2, 1));
+    }
+    int levelCount = int(texture.widths.size());
+    texture.layerBaseLevels.assign(layerCount, levelCount - 1);
+    texture.baseLevel = levelCount - 1;
+
+    glGenTextures(1, &texture.texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture.texture);
+    if (streamer.textureStorageSupported) {
+        glTexStorage3D(GL_TEXTURE_2D_ARRAY, levelCount, GL_RGBA8, width, height, layerCount);
+    } else {
+        for (int i = 0; i < levelCount; ++i) {
+            glTexImage3D(GL_TEXTURE_2D_ARRAY, i, GL_RGBA8, texture.widths[i], texture.heights[i],
+                         layerCount, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        }
+    }
+    // Only sample levels that have arrived
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, levelCount - 1);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, levelCount - 1);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    streamer.textures.push_back(texture);
+    return texture.texture;
+}
+
+void create_rgba8_mip_chain(const void *pixels, int width, int height, int levelWidth,
+                            int levelHeight, std::vector<std::vector<uint8_t>> &levels)
+{
+    // Images that failed to load get a white texel
+    const uint8_t white[4] = {255, 255, 255, 255};
+    if (!pixels || width <= 0 || height <= 0) {
+        pixels = white;
+        width = height = 1;
+    }
+    std::vector<uint8_t> image((const uint8_t *)pixels,
+                               (const uint8_t *)pixels + width * height * 4);
+    if (width != levelWidth || height != levelHeight) {
+        image = resize_rgba8(std::move(image), width, height, levelWidth, levelHeight);
+    }
+
+    levels.clear();
+    levels.push_back(std::move(image));
+    while (levelWidth > 1 || levelHeight > 1) {
+        int nextWidth = std::max(levelWidth / 2, 1), nextHeight = std::max(levelHeight / 2, 1);
+        levels.push_back(std::vector<uint8_t>(nextWidth * nextHeight * 4));
+        downsample_rgba8(levels[levels.size() - 2].data(), levelWidth, levelHeight,
+                         levels.back().data(), nextWidth, nextHeight);
+        levelWidth = nextWidth;
+        levelHeight = nextHeight;
+    }
+}
+
+void stream_texture_layer(TextureStreamer &streamer, GLuint texture, int layer, int width,
+                          int height, const void *pixels)
+{
+    auto streamed = std::find_if(streamer.textures.begin(), streamer.textures.end(),
+                                 [&](const StreamedTexture &t) { return t.texture == texture; });
+    if (streamed == streamer.textures.end()) return;
+
+    std::vector<std::vector<uint8_t>> pixelLevels;
+    create_rgba8_mip_chain(pixels, width, height, streamed->widths[0], streamed->heights[0],
+                           pixelLevels);
+
+    // Queue the levels smallest first (the jobs are sorted by size later)
+    int levelCount = int(streamed->widths.size());
+    for (int i = levelCount - 1; i >= 0; --i) {
+        TextureStreamJob job;
+        job.texture = int(streamed - streamer.textures.begin());
+        job.layer = layer;
+        job.level = i;
+        job.uploadedRows = 0;
+        job.pixels.swap(pixelLevels[i]);
+        streamer.jobs.push_back(std::move(job));
+    }
+    streamer.jobsSorted = false;
+}
+
+static bool is_required_level(const TextureStreamer &streamer, const TextureStreamJob &job)
+{
+    const StreamedTexture &texture = streamer.textures[job.texture];
+    return texture.widths[job.level] <= TEXTURE_STREAM_MIN_SIZE &&
+           texture.heights[job.level] <= TEXTURE_STREAM_MIN_SIZE;
+}
+
+// Rows of a level that were copied into a pixel buffer
+struct TextureStreamCopy {
+    int texture;
+    int layer;
+    int level;
+    int firstRow;
+    int rowCount;
+    int offset;
+};
+
+static void upload_texture_levels(TextureStreamer &streamer, bool uploadAll)
+{
+    if (!streamer.jobsSorted) {
+        // Smallest levels first (the levels of each texture are already in
+        // that order, and stay so)
+        std::stable_sort(streamer.jobs.begin(), streamer.jobs.end(),
+                         [](const TextureStreamJob &a, const TextureStreamJob &b) {
+                             return a.pixels.size() < b.pixels.size();
+                         });
+        streamer.jobsSorted = true;
+    }
+
+    unsigned next = 0;
+    bool budgetLeft = true;
+    std::vector<TextureStreamCopy> copies;
+    while (next < streamer.jobs.size()) {
+        bool required = uploadAll || is_required_level(streamer, streamer.jobs[next]);
+        if (!required && !budgetLeft) break;
+
+        // Wait for the previous uploads from the buffer only if the level
+        // cannot be left for a later frame
+        GLsync &fence = streamer.fences[streamer.nextBuffer];
+        if (fence) {
+            GLenum status = glClientWaitSync(fence, 0, 0);
+            if (status == GL_TIMEOUT_EXPIRED) {
+                if (!required) break;
+                while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) ==
+                       GL_TIMEOUT_EXPIRED) {
+                }
+            }
+            glDeleteSync(fence);
+            fence = nullptr;
+        }
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, streamer.buffers[streamer.nextBuffer]);
+        uint8_t *data = (uint8_t *)glMapBufferRange(
+            GL_PIXEL_UNPACK_BUFFER, 0, streamer.bufferSize,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+        if (!data) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            break;
+        }
+
+        // Fill the buffer with as many rows as fit, in job order
+        copies.clear();
+        int offset = 0;
+        while (next < streamer.jobs.size()) {
+            TextureStreamJob &job = streamer.jobs[next];
+            if (!uploadAll && !budgetLeft && !is_required_level(streamer, job)) break;
+            const StreamedTexture &texture = streamer.textures[job.texture];
+            int rowSize = texture.widths[job.level] * 4;
+            int height = texture.heights[job.level];
+            int rowCount =
+                std::min(height - job.uploadedRows, (streamer.bufferSize - offset) / rowSize);
+            if (rowCount <= 0) break;
+
+            std::memcpy(data + offset, &job.pixels[job.uploadedRows * rowSize], rowCount * rowSize);
+            TextureStreamCopy copy;
+            copy.texture = job.texture;
+            copy.layer = job.layer;
+            copy.level = job.level;
+            copy.firstRow = job.uploadedRows;
+            copy.rowCount = rowCount;
+            copy.offset = offset;
+            copies.push_back(copy);
+            offset += rowCount * rowSize;
+            job.uploadedRows += rowCount;
+            if (job.uploadedRows == height) {
+                std::vector<uint8_t>().swap(job.pixels);
+                next += 1;
+            }
+        }
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+        // The copies from the buffer into the textures run asynchronously.
+        // Draws issued after them see the new levels, so the base level can
+        // be lowered at once (when the level has arrived in all layers).
+        for (const TextureStreamCopy &copy : copies) {
+            StreamedTexture &texture = streamer.textures[copy.texture];
+            glBindTexture(GL_TEXTURE_2D_ARRAY, texture.texture);
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, copy.level, 0, copy.firstRow, copy.layer,
+                            texture.widths[copy.level], copy.rowCount, 1, GL_RGBA,
+                            GL_UNSIGNED_BYTE, (const void *)(intptr_t)copy.offset);
+            if (copy.firstRow + copy.rowCount < texture.heights[copy.level]) continue;
+
+            streamer.uploadedLevels += 1;
+            texture.layerBaseLevels[copy.layer] = copy.level;
+            int baseLevel = *std::max_element(texture.layerBaseLevels.begin(),
+                                              texture.layerBaseLevels.end());
+            if (baseLevel < texture.baseLevel) {
+                glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, baseLevel);
+                texture.baseLevel = baseLevel;
+            }
+        }
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+        fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        streamer.nextBuffer = (streamer.nextBuffer + 1) % TEXTURE_STREAM_BUFFERS;
+        streamer.uploadedBytes += offset;
+        budgetLeft = false;
+    }
+    streamer.jobs.erase(streamer.jobs.begin(), streamer.jobs.begin() + next);
+    if (streamer.jobs.empty()) streamer.textures.clear();
+}
+
+void update_texture_streamer(TextureStreamer &streamer)
+{
+    if (!streamer.jobs.empty()) upload_texture_levels(streamer, false);
+}
+
+void finish_texture_streaming(TextureStreamer &streamer)
+{
+    if (!streamer.jobs.empty()) upload_texture_levels(streamer, true);
+}
+
+void cancel_texture_streaming(TextureStreamer &streamer)
+{
+    streamer.jobs.clear();
+    streamer.textures.clear();
+    streamer.jobsSorted = true;
+}
+
+int pending_texture_levels(const TextureStreamer &streamer)
+{
+    return int(streamer.jobs.size());
+}
+
+bool is_texture_streaming(const TextureStreamer &streamer, GLuint texture)
+{
+    for (const TextureStreamJob &job : streamer.jobs) {
+        if (streamer.textures[job.texture].texture == texture) return true;
+    }
+    return false;
+}
+
+}  // namespace cg
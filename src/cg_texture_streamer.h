@@ -0,0 +1,100 @@
+// Progressive texture uploads. Each texture array gets storage for its full
+// mip chain up front, and the levels of its layers are uploaded smallest
+// first through a ring of pixel buffer objects, under a budget of bytes per
+// frame. The base level of an array follows the levels that have arrived in
+// all its layers, so that it can be sampled (blurry) at once and sharpens
+// over the next frames.
+//
+
+#pragma once
+
+#include <GL/gl3w.h>
+
+#include <cstdint>
+#include <vector>
+
+namespace cg {
+
+// Number of pixel buffers in the ring. A buffer is only refilled when the
+// fence of its previous uploads has signaled, so that filling it never waits
+// for the GPU.
+const int TEXTURE_STREAM_BUFFERS = 3;
+
+// Levels up to this size are uploaded by the first update after a texture
+// is created, regardless of the budget, so that it is never incomplete
+const int TEXTURE_STREAM_MIN_SIZE = 32;
+
+// RGBA8 texture array (GL_TEXTURE_2D_ARRAY) with queued levels
+struct StreamedTexture {
+    GLuint texture = 0;
+    std::vector<int> widths;  // Size of each level
+    std::vector<int> heights;
+    std::vector<int> layerBaseLevels;  // Smallest level that has arrived in each layer
+    int baseLevel = 0;                 // Smallest level that has arrived in all layers
+};
+
+// Upload of (the remaining rows of) one level of a layer
+struct TextureStreamJob {
+    int texture;  // Index into TextureStreamer::textures
+    int layer;
+    int level;
+    int uploadedRows;  // Rows that have been copied so far
+    std::vector<uint8_t> pixels;
+};
+
+struct TextureStreamer {
+    GLuint buffers[TEXTURE_STREAM_BUFFERS] = {};
+    GLsync fences[TEXTURE_STREAM_BUFFERS] = {};
+    int bufferSize = 0;  // Bytes of each pixel buffer (the budget per frame)
+    int nextBuffer = 0;
+    bool textureStorageSupported = false;  // glTexStorage3D() (immutable storage)
+    std::vector<StreamedTexture> textures;  // Arrays with pending jobs
+    std::vector<TextureStreamJob> jobs;     // Pending jobs, smallest levels first
+    bool jobsSorted = true;
+
+    // Statistics
+    int64_t uploadedBytes = 0;
+    int uploadedLevels = 0;
+};
+
+void create_texture_streamer(TextureStreamer &streamer, int bytesPerFrame);
+
+// Delete the pixel buffers (but not the streamed textures)
+void destroy_texture_streamer(TextureStreamer &streamer);
+
+// Create a 2D texture array with storage for the mip chains of layerCount
+// RGBA8 layers. The texture is left unbound.
+GLuint create_streamed_texture_array(TextureStreamer &streamer, int width, int height,
+                                     int layerCount);
+
+// Queue an RGBA8 image for uploading into a layer of a streamed array. The
+// image is resized to the size of the array if needed, and its mip chain is
+// generated on the CPU (with a box filter, like glGenerateMipmap). Every
+// layer should be queued, since the array only sharpens when all have.
+void stream_texture_layer(TextureStreamer &streamer, GLuint texture, int layer, int width,
+                          int height, const void *pixels);
+
+// Resize an RGBA8 image to levelWidth x levelHeight if needed, and generate
+// its mip chain down to 1x1 (with the same filters as stream_texture_layer()).
+// Null pixels give a white texel.
+void create_rgba8_mip_chain(const void *pixels, int width, int height, int levelWidth,
+                            int levelHeight, std::vector<std::vector<uint8_t>> &levels);
+
+// Upload queued levels, at most one pixel buffer (bytesPerFrame) of them
+// except for levels up to TEXTURE_STREAM_MIN_SIZE. Call once per frame.
+void update_texture_streamer(TextureStreamer &streamer);
+
+// Upload all queued levels, waiting for pixel buffers if needed (e.g.,
+// before rendering an image that should have sharp textures)
+void finish_texture_streaming(TextureStreamer &streamer);
+
+// Drop the queued levels, e.g., when the streamed textures are deleted
+void cancel_texture_streaming(TextureStreamer &streamer);
+
+// Number of levels that have not been uploaded yet
+int pending_texture_levels(const TextureStreamer &streamer);
+
+// Return true if levels of a texture have not been uploaded yet
+bool is_texture_streaming(const TextureStreamer &streamer, GLuint texture);
+
+}  // namespace cg
@@ -0,0 +1,62 @@
+// Uniform block layouts shared by the shaders, and a ring buffer for
+// streaming uniform block data to the GPU.
+//
+
+#include "cg_uniform_blocks.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace cg {
+
+void set_uniform_block_bindings(GLuint program)
+{
+    const char *names[] = {"FrameBlock", "LightBlock", "ObjectBlock"};
+    const GLuint bindings[] = {FRAME_BLOCK, LIGHT_BLOCK, OBJECT_BLOCK};
+    for (unsigned i = 0; i < 3; ++i) {
+        GLuint index = glGetUniformBlockIndex(program, names[i]);
+        if (index != GL_INVALID_INDEX) glUniformBlockBinding(program, index, bindings[i]);
+    }
+}
+
+void create_uniform_ring(UniformRing &ring, int frameSize, bool allowPersistent)
+{
+    destroy_uniform_ring(ring);
+
+    GLint alignment = 256;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    ring.alignment = std::max(alignment, 16);
+    create_stream_buffer(ring.stream, frameSize, allowPersistent);
+}
+
+void destroy_uniform_ring(UniformRing &ring)
+{
+    destroy_stream_buffer(ring.stream);
+    ring = UniformRing();
+}
+
+void begin_uniform_ring_frame(UniformRing &ring)
+{
+    begin_stream_buffer_frame(ring.stream);
+}
+
+int push_uniform_block(UniformRing &ring, const void *data, int size)
+{
+    void *block;
+    int offset = allocate_stream_buffer(ring.stream, size, ring.alignment, &block);
+    std::memcpy(block, data, size);
+    return offset;
+}
+
+void flush_uniform_ring(UniformRing &ring)
+{
+    end_stream_buffer_frame(ring.stream);
+}
+
+void bind_uniform_block(const UniformRing &ring, GLuint binding, int offset, int size)
+{
+    glBindBufferRange(GL_UNIFORM_BUFFER, binding, ring.stream.buffer,
+                      stream_buffer_offset(ring.stream, offset), size);
+}
+
+}  // namespace cg
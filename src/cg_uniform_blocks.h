@@ -0,0 +1,82 @@
+// Uniform block layouts shared by the shaders, and a ring buffer for
+// streaming uniform block data to the GPU.
+//
+
+#pragma once
+
+#include "cg_stream_buffer.h"
+
+#include <GL/gl3w.h>
+
+#include <glm/glm.hpp>
+
+
+namespace cg {
+
+// Binding points of the uniform blocks declared in the shaders
+enum UniformBlockBinding { FRAME_BLOCK = 0, LIGHT_BLOCK = 1, OBJECT_BLOCK = 2 };
+
+// C++ mirrors of the std140 uniform blocks in mesh.vert/mesh.frag and
+// shadow.vert. Keep the member order in sync with the shaders! Shader
+// features are selected with #defines rather than flags in the blocks (see
+// cg_shader_variants.h).
+
+struct FrameBlock {
+    glm::mat4 view;
+    glm::mat4 projection;
+    glm::mat4 shadowFromView[4];  // One matrix per shadow cascade
+    glm::vec4 cascadeSplits;      // View-space far depth of each cascade
+    float time;
+    int cascadeCount;
+    int shadowTaps;
+    int pad0;
+};
+
+struct LightBlock {
+    glm::vec3 lightPosition;
+    float specularPower;
+    glm::vec3 ambientColor;
+    float pad0;
+    glm::vec3 diffuseColor;
+    float pad1;
+    glm::vec3 specularColor;
+    float pad2;
+};
+
+struct ObjectBlock {
+    int firstDraw;  // Index of the first draw in the multi-draw buffer
+    int pad0;
+    int pad1;
+    int pad2;
+};
+
+// Assign the binding points above to the uniform blocks of a program. Blocks
+// that the program does not use are ignored.
+void set_uniform_block_bindings(GLuint program);
+
+// Uniform blocks of each frame are written to a stream buffer (see
+// cg_stream_buffer.h), which has a region per frame for the last few frames,
+// so that writing the blocks of a new frame does not have to wait for the GPU
+// to finish reading the blocks of the previous frames.
+struct UniformRing {
+    StreamBuffer stream;
+    int alignment = 256;
+};
+
+void create_uniform_ring(UniformRing &ring, int frameSize, bool allowPersistent = true);
+
+void destroy_uniform_ring(UniformRing &ring);
+
+// Start writing blocks for a new frame in the next region of the ring
+void begin_uniform_ring_frame(UniformRing &ring);
+
+// Write a uniform block and return its offset within the current frame
+int push_uniform_block(UniformRing &ring, const void *data, int size);
+
+// Finish writing the blocks of the current frame, before they are bound
+void flush_uniform_ring(UniformRing &ring);
+
+// Bind a block that was written in the current frame to a binding point
+void bind_uniform_block(const UniformRing &ring, GLuint binding, int offset, int size);
+
+}  // namespace cg
@@ -8,10 +8,21 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+#include <algorithm>
+#include <chrono>
 #include <cstdlib>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <sstream>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <unistd.h>
+#endif
 
 namespace cg {
 
@@ -23,6 +34,20 @@ static std::string read_shader_source(const std::string &filename)
     return stream.str();
 }
 
+// Insert preprocessor definitions after the #version directive of a shader
+// source, and reset the line numbering so that compile errors still refer to
+// lines in the file
+static std::string insert_shader_defines(const std::string &source, const std::string &defines)
+{
+    if (defines.empty()) return source;
+    size_t versionEnd = 0;
+    if (source.compare(0, 8, "#version") == 0) {
+        versionEnd = source.find('\n');
+        versionEnd = (versionEnd == std::string::npos) ? source.size() : versionEnd + 1;
+    }
+    return source.substr(0, versionEnd) + defines + "#line 2\n" + source.substr(versionEnd);
+}
+
 static void show_shader_info_log(GLuint shader)
 {
     GLint infoLogLength = 0;
@@ -53,6 +78,53 @@ std::string get_env_var(const std::string &name)
     }
 }
 
+double get_time()
+{
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration<double>(now).count();
+}
+
+std::vector<std::string> list_directory(const std::string &directory,
+                                        const std::string &extension)
+{
+    std::vector<std::string> names;
+    auto hasExtension = [&](const std::string &name) {
+        return name.size() > extension.size() &&
+               name.compare(name.size() - extension.size(), extension.size(), extension) == 0;
+    };
+#ifdef _WIN32
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA((directory + "/*" + extension).c_str(), &data);
+    if (find != INVALID_HANDLE_VALUE) {
+        do {
+            if (hasExtension(data.cFileName)) names.push_back(data.cFileName);
+        } while (FindNextFileA(find, &data));
+        FindClose(find);
+    }
+#else
+    DIR *dir = opendir(directory.c_str());
+    if (dir) {
+        while (dirent *entry = readdir(dir)) {
+            if (hasExtension(entry->d_name)) names.push_back(entry->d_name);
+        }
+        closedir(dir);
+    }
+#endif
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+std::string temporary_filename(const std::string &filename)
+{
+#ifdef _WIN32
+    unsigned long processId = GetCurrentProcessId();
+#else
+    unsigned long processId = getpid();
+#endif
+    size_t threadId = std::hash<std::thread::id>()(std::this_thread::get_id());
+    return filename + "." + std::to_string(processId) + "." + std::to_string(threadId);
+}
+
 void reset_gl_render_state()
 {
     // See e.g. http://docs.gl for information about each state
@@ -86,70 +158,113 @@ void reset_gl_render_state()
     glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
 }
 
-GLuint load_shader_program(const std::string &vertexShaderFilename,
-                           const std::string &fragmentShaderFilename)
+static GLuint create_shader(GLenum type, const std::string &source)
 {
-    // Load and compile vertex shader
-    GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    std::string vertexShaderSource = read_shader_source(vertexShaderFilename);
-    const char *vertexShaderSourcePtr = vertexShaderSource.c_str();
-    glShaderSource(vertexShader, 1, &vertexShaderSourcePtr, nullptr);
-
-    glCompileShader(vertexShader);
-    GLint compiled = 0;
-    glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &compiled);
-    if (!compiled) {
-        std::cerr << "Vertex shader compilation failed:" << std::endl;
-        show_shader_info_log(vertexShader);
-        glDeleteShader(vertexShader);
-        return 0;
-    }
+    GLuint shader = glCreateShader(type);
+    const char *sourcePtr = source.c_str();
+    glShaderSource(shader, 1, &sourcePtr, nullptr);
+    glCompileShader(shader);
+    return shader;
+}
 
-    // Load and compile fragment shader
-    GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    std::string fragmentShaderSource = read_shader_source(fragmentShaderFilename);
-    const char *fragmentShaderSourcePtr = fragmentShaderSource.c_str();
-    glShaderSource(fragmentShader, 1, &fragmentShaderSourcePtr, nullptr);
-
-    glCompileShader(fragmentShader);
-    compiled = 0;
-    glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &compiled);
-    if (!compiled) {
-        std::cerr << "Fragment shader compilation failed:" << std::endl;
-        show_shader_info_log(fragmentShader);
-        glDeleteShader(vertexShader);
-        glDeleteShader(fragmentShader);
-        return 0;
-    }
+// Issue the compile and link of a program from source, without waiting for
+// the results
+static void compile_shader_program(ShaderProgramBuild &build)
+{
+    build.vertexShader = create_shader(GL_VERTEX_SHADER, build.vertexShaderSource);
+    build.fragmentShader = create_shader(GL_FRAGMENT_SHADER, build.fragmentShaderSource);
 
-    // Create program object
-    GLuint program = glCreateProgram();
+    // Create program object, and attach shaders to the program
+    build.program = glCreateProgram();
+    glAttachShader(build.program, build.vertexShader);
+    glAttachShader(build.program, build.fragmentShader);
 
-    // Attach shaders to the program. Also flag the shaders for automatic
-    // deletion after their shader program is destroyed.
-    glAttachShader(program, vertexShader);
-    glDeleteShader(vertexShader);
-    glAttachShader(program, fragmentShader);
-    glDeleteShader(fragmentShader);
+    // Link program (with the binary retrievable, for the program cache)
+    if (build.cache && !build.cache->directory.empty()) {
+        glProgramParameteri(build.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+    glLinkProgram(build.program);
+    if (build.cache) build.cache->compiledCount += 1;
+}
 
-    // Link program
-    glLinkProgram(program);
+ShaderProgramBuild begin_shader_program(const std::string &vertexShaderFilename,
+                                        const std::string &fragmentShaderFilename,
+                                        const std::string &defines, ProgramCache *cache)
+{
+    ShaderProgramBuild build;
+    build.vertexShaderSource =
+        insert_shader_defines(read_shader_source(vertexShaderFilename), defines);
+    build.fragmentShaderSource =
+        insert_shader_defines(read_shader_source(fragmentShaderFilename), defines);
+    build.cache = cache;
+
+    // Use the cached binary of the program if there is one
+    if (cache) {
+        build.cacheKey =
+            program_cache_key(*cache, build.vertexShaderSource, build.fragmentShaderSource);
+        build.program = load_cached_program(*cache, build.cacheKey);
+        if (build.program) return build;
+    }
+    compile_shader_program(build);
+    return build;
+}
 
-    // Check linking status
+GLuint finish_shader_program(ShaderProgramBuild &build)
+{
+    GLuint program = build.program;
     GLint linked = 0;
     glGetProgramiv(program, GL_LINK_STATUS, &linked);
-    if (!linked) {
-        std::cerr << "Linking failed:" << std::endl;
-        show_program_info_log(program);
+
+    // If the driver rejected a cached binary, compile the program from source
+    if (!linked && !build.vertexShader) {
         glDeleteProgram(program);
-        glDeleteShader(vertexShader);
-        glDeleteShader(fragmentShader);
-        return 0;
+        compile_shader_program(build);
+        return finish_shader_program(build);
+    }
+    if (linked && !build.vertexShader && build.cache) build.cache->loadedCount += 1;
+
+    if (build.vertexShader) {
+        // Check the compile status of the shaders
+        GLint vertexCompiled = 0, fragmentCompiled = 0;
+        glGetShaderiv(build.vertexShader, GL_COMPILE_STATUS, &vertexCompiled);
+        glGetShaderiv(build.fragmentShader, GL_COMPILE_STATUS, &fragmentCompiled);
+        if (!vertexCompiled) {
+            std::cerr << "Vertex shader compilation failed:" << std::endl;
+            show_shader_info_log(build.vertexShader);
+        } else if (!fragmentCompiled) {
+            std::cerr << "Fragment shader compilation failed:" << std::endl;
+            show_shader_info_log(build.fragmentShader);
+        } else if (!linked) {
+            std::cerr << "Linking failed:" << std::endl;
+            show_program_info_log(program);
+        } else if (build.cache) {
+            save_cached_program(*build.cache, build.cacheKey, program);
+        }
+
+        // The shaders are not needed after linking
+        glDetachShader(program, build.vertexShader);
+        glDetachShader(program, build.fragmentShader);
+        glDeleteShader(build.vertexShader);
+        glDeleteShader(build.fragmentShader);
     }
 
+    if (!linked) {
+        glDeleteProgram(program);
+        program = 0;
+    }
+    build = ShaderProgramBuild();
     return program;
 }
 
+GLuint load_shader_program(const std::string &vertexShaderFilename,
+                           const std::string &fragmentShaderFilename, const std::string &defines,
+                           ProgramCache *cache)
+{
+    ShaderProgramBuild build =
+        begin_shader_program(vertexShaderFilename, fragmentShaderFilename, defines, cache);
+    return finish_shader_program(build);
+}
+
 GLuint load_texture_2d(const std::string &filename)
 {
     // Load image file (as an RGBA image with four components)
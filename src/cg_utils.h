@@ -5,6 +5,8 @@
 
 #pragma once
 
+#include "cg_program_cache.h"
+
 #include <GL/gl3w.h>
 
 #include <string>
@@ -15,13 +17,55 @@ namespace cg {
 // Helper function for loading values from environment variables
 std::string get_env_var(const std::string &name);
 
+// Return the time in seconds since an arbitrary point (unlike glfwGetTime(),
+// this does not need GLFW to be initialized, e.g., when rendering headless)
+double get_time();
+
+// Return the sorted names of the files in a directory that end with an
+// extension (e.g., ".gltf")
+std::vector<std::string> list_directory(const std::string &directory,
+                                        const std::string &extension);
+
+// Return a name for a temporary file next to a file, which is unique to the
+// calling process and thread. Files are written to it and then renamed, so
+// that other processes or threads never read a partly written file.
+std::string temporary_filename(const std::string &filename);
+
 // This function should be called at the beginning of each frame and whenever
 // we want to restore the OpenGL pipeline to its default state. Feel free to
 // change or extend this function if necessary!
 void reset_gl_render_state();
 
+// Load, compile and link a shader program. Preprocessor definitions (e.g.,
+// "#define USE_LIGHTING\n") can be given for selecting shader features, and
+// are inserted after the #version directive of both shaders. If a program
+// cache is given, the program is loaded from its binary when possible.
 GLuint load_shader_program(const std::string &vertexShaderFilename,
-                           const std::string &fragmentShaderFilename);
+                           const std::string &fragmentShaderFilename,
+                           const std::string &defines = "", ProgramCache *cache = nullptr);
+
+// A shader program whose compile and link (or binary load) has been issued,
+// but not checked yet
+struct ShaderProgramBuild {
+    GLuint program = 0;
+    GLuint vertexShader = 0;  // Zero if the program was loaded from the cache
+    GLuint fragmentShader = 0;
+    std::string vertexShaderSource;
+    std::string fragmentShaderSource;
+    ProgramCache *cache = nullptr;
+    std::string cacheKey;
+};
+
+// Split version of load_shader_program(). Querying the result of a compile
+// waits for it to finish, so issue all programs with begin_shader_program()
+// before finishing any, to let the driver compile them in parallel.
+ShaderProgramBuild begin_shader_program(const std::string &vertexShaderFilename,
+                                        const std::string &fragmentShaderFilename,
+                                        const std::string &defines = "",
+                                        ProgramCache *cache = nullptr);
+
+// Check the result of a build, and return the program (or 0 on errors)
+GLuint finish_shader_program(ShaderProgramBuild &build);
 
 GLuint load_texture_2d(const std::string &filename);
 
@@ -0,0 +1,127 @@
+// Pool of worker threads for the CPU work of a frame.
+//
+
+#include "cg_worker_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+namespace cg {
+
+static void run_worker(WorkerPool &pool)
+{
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(pool.mutex);
+            pool.taskQueued.wait(lock, [&] { return pool.stopping || !pool.tasks.empty(); });
+            if (pool.tasks.empty()) return;  // Stopping, and all tasks are done
+            task = std::move(pool.tasks.front());
+            pool.tasks.pop_front();
+        }
+        task();
+    }
+}
+
+void start_worker_pool(WorkerPool &pool, int threadCount)
+{
+    if (threadCount <= 0) threadCount = std::max(int(std::thread::hardware_concurrency()) - 1, 1);
+    pool.stopping = false;
+    for (int i = 0; i < threadCount; ++i) {
+        pool.threads.push_back(std::thread(run_worker, std::ref(pool)));
+    }
+}
+
+void stop_worker_pool(WorkerPool &pool)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.stopping = true;
+    }
+    pool.taskQueued.notify_all();
+    for (std::thread &thread : pool.threads) thread.join();
+    pool.threads.clear();
+}
+
+static void queue_task(WorkerPool &pool, std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.tasks.push_back(std::move(task));
+    }
+    pool.taskQueued.notify_one();
+}
+
+// Chunks of a parallel_for() loop. Helper tasks that start after the loop
+// has returned find no chunks left, so they only keep this state alive and
+// never call the function.
+struct ParallelLoop {
+    const std::function<void(int, int)> *function;
+    int count;
+    int grainSize;
+    int chunkCount;
+    std::atomic<int> nextChunk;
+    std::atomic<int> doneChunks;
+    std::mutex mutex;
+    std::condition_variable finished;
+};
+
+static void run_chunks(ParallelLoop &loop)
+{
+    while (true) {
+        int chunk = loop.nextChunk.fetch_add(1);
+        if (chunk >= loop.chunkCount) return;
+        int first = chunk * loop.grainSize;
+        (*loop.function)(first, std::min(first + loop.grainSize, loop.count));
+        if (loop.doneChunks.fetch_add(1) + 1 == loop.chunkCount) {
+            std::lock_guard<std::mutex> lock(loop.mutex);
+            loop.finished.notify_all();
+        }
+    }
+}
+
+void parallel_for(WorkerPool &pool, int count, int grainSize,
+                  const std::function<void(int first, int last)> &function)
+{
+    if (count <= 0) return;
+    grainSize = std::max(grainSize, 1);
+    int chunkCount = (count + grainSize - 1) / grainSize;
+    int helperCount = std::min(int(pool.threads.size()), chunkCount - 1);
+    if (helperCount == 0) {
+        for (int first = 0; first < count; first += grainSize) {
+            function(first, std::min(first + grainSize, count));
+        }
+        return;
+    }
+
+    std::shared_ptr<ParallelLoop> loop = std::make_shared<ParallelLoop>();
+    loop->function = &function;
+    loop->count = count;
+    loop->grainSize = grainSize;
+    loop->chunkCount = chunkCount;
+    loop->nextChunk = 0;
+    loop->doneChunks = 0;
+    for (int i = 0; i < helperCount; ++i) {
+        queue_task(pool, [loop]() { run_chunks(*loop); });
+    }
+    run_chunks(*loop);
+
+    std::unique_lock<std::mutex> lock(loop->mutex);
+    loop->finished.wait(lock, [&] { return loop->doneChunks.load() == chunkCount; });
+}
+
+std::future<void> run_async(WorkerPool &pool, std::function<void()> task)
+{
+    std::shared_ptr<std::packaged_task<void()>> packagedTask =
+        std::make_shared<std::packaged_task<void()>>(std::move(task));
+    std::future<void> future = packagedTask->get_future();
+    if (pool.threads.empty()) {
+        (*packagedTask)();
+    } else {
+        queue_task(pool, [packagedTask]() { (*packagedTask)(); });
+    }
+    return future;
+}
+
+}  // namespace cg
@@ -0,0 +1,43 @@
+// Pool of worker threads for the CPU work of a frame. Loops are split into
+// chunks that the workers and the calling thread take in turn, and whole
+// tasks can run in the background while the calling thread goes on.
+//
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace cg {
+
+struct WorkerPool {
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable taskQueued;
+    std::deque<std::function<void()>> tasks;
+    bool stopping = false;
+};
+
+// Start threadCount workers (0 to use one per hardware thread but one, and
+// at least one)
+void start_worker_pool(WorkerPool &pool, int threadCount = 0);
+
+// Finish the queued tasks and stop the workers
+void stop_worker_pool(WorkerPool &pool);
+
+// Call function(first, last) for the consecutive chunks [0, grainSize),
+// [grainSize, 2 * grainSize), ... of [0, count), on the workers and the
+// calling thread, and return when all chunks are done. Since the caller
+// takes chunks too, this can also be called from a task of the pool.
+void parallel_for(WorkerPool &pool, int count, int grainSize,
+                  const std::function<void(int first, int last)> &function);
+
+// Run a task on a worker, and return a future for waiting on it
+std::future<void> run_async(WorkerPool &pool, std::function<void()> task);
+
+}  // namespace cg
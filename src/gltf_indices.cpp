@@ -0,0 +1,213 @@
+// Compaction of primitive indices to 16 bits, splitting large primitives
+// into chunks, and generation of triangle strips.
+//
+
+#include "gltf_indices.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <utility>
+
+namespace gltf {
+
+// Range of triangles of a chunk, and its vertices
+struct ChunkRange {
+    int firstIndex;
+    int indexCount;
+    int baseVertex;
+};
+
+// Split the triangles into chunks of consecutive triangles with at most
+// MAX_CHUNK_VERTICES vertices. The vertices of each chunk are appended to
+// chunkVertices in the order of their first use, and its triangles to
+// chunkIndices with indices relative to the first vertex of the chunk.
+static void split_into_chunks(const std::vector<Vertex> &vertices,
+                              const std::vector<uint32_t> &indices,
+                              std::vector<Vertex> &chunkVertices,
+                              std::vector<uint32_t> &chunkIndices, std::vector<ChunkRange> &chunks)
+{
+    std::vector<int> owner(vertices.size(), -1);  // Last chunk that used each vertex
+    std::vector<uint32_t> local(vertices.size());  // Index of each vertex in that chunk
+    ChunkRange chunk = {0, 0, 0};
+    for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+        int current = int(chunks.size());
+        int newVertices = 0;
+        for (int j = 0; j < 3; ++j) {
+            uint32_t v = indices[i + j];
+            bool repeated = (j > 0 && v == indices[i]) || (j > 1 && v == indices[i + 1]);
+            if (owner[v] != current && !repeated) newVertices += 1;
+        }
+        int chunkVertexCount = int(chunkVertices.size()) - chunk.baseVertex;
+        if (chunkVertexCount + newVertices > MAX_CHUNK_VERTICES) {
+            chunks.push_back(chunk);
+            chunk.firstIndex = int(chunkIndices.size());
+            chunk.indexCount = 0;
+            chunk.baseVertex = int(chunkVertices.size());
+            current += 1;
+        }
+
+        for (int j = 0; j < 3; ++j) {
+            uint32_t v = indices[i + j];
+            if (owner[v] != current) {
+                owner[v] = current;
+                local[v] = uint32_t(chunkVertices.size() - chunk.baseVertex);
+                chunkVertices.push_back(vertices[v]);
+            }
+            chunkIndices.push_back(local[v]);
+        }
+        chunk.indexCount += 3;
+    }
+    chunks.push_back(chunk);
+}
+
+static uint64_t edge_key(uint32_t u, uint32_t v)
+{
+    return (uint64_t(u) << 32) | v;
+}
+
+// Join triangles into strips, greedily: each strip starts at the first
+// unused triangle, and is extended by unused triangles that share its last
+// edge with the winding that the strip gives them. The strips are appended
+// to strips, separated by PRIMITIVE_RESTART_INDEX.
+static void make_triangle_strips(const uint32_t *triangles, int triangleCount,
+                                 std::vector<uint32_t> &strips)
+{
+    // Triangles by their directed edges, in the winding order of the triangles
+    std::vector<std::pair<uint64_t, int>> edges;
+    edges.reserve(3 * triangleCount);
+    for (int t = 0; t < triangleCount; ++t) {
+        const uint32_t *triangle = &triangles[3 * t];
+        for (int j = 0; j < 3; ++j) {
+            edges.push_back(std::make_pair(edge_key(triangle[j], triangle[(j + 1) % 3]), t));
+        }
+    }
+    std::sort(edges.begin(), edges.end());
+
+    // Return an unused triangle with the directed edge (u, v), and set w to
+    // its third vertex, or return -1 if there is none
+    std::vector<bool> used(triangleCount, false);
+    auto find_triangle = [&](uint32_t u, uint32_t v, uint32_t &w) {
+        uint64_t key = edge_key(u, v);
+        auto it = std::lower_bound(edges.begin(), edges.end(), std::make_pair(key, INT_MIN));
+        for (; it != edges.end() && it->first == key; ++it) {
+            if (used[it->second]) continue;
+            const uint32_t *triangle = &triangles[3 * it->second];
+            for (int j = 0; j < 3; ++j) {
+                if (triangle[j] == u && triangle[(j + 1) % 3] == v) w = triangle[(j + 2) % 3];
+            }
+            return it->second;
+        }
+        return -1;
+    };
+
+    for (int start = 0; start < triangleCount; ++start) {
+        if (used[start]) continue;
+        used[start] = true;
+
+        // Start with a rotation of the triangle whose last edge is shared by
+        // a triangle that can follow, if any (the second triangle of a strip
+        // (s0, s1, s2, s3) is (s2, s1, s3))
+        const uint32_t *triangle = &triangles[3 * start];
+        int rotation = 0;
+        for (int r = 0; r < 3; ++r) {
+            uint32_t w;
+            if (find_triangle(triangle[(r + 2) % 3], triangle[(r + 1) % 3], w) >= 0) {
+                rotation = r;
+                break;
+            }
+        }
+        if (!strips.empty()) strips.push_back(PRIMITIVE_RESTART_INDEX);
+        size_t first = strips.size();
+        for (int j = 0; j < 3; ++j) strips.push_back(triangle[(rotation + j) % 3]);
+
+        // Triangle k of the strip is (s[k], s[k + 1], s[k + 2]) for even k,
+        // and (s[k + 1], s[k], s[k + 2]) for odd k
+        while (true) {
+            size_t k = strips.size() - first - 2;
+            uint32_t a = strips[strips.size() - 2], b = strips[strips.size() - 1];
+            uint32_t w;
+            int next = (k % 2 == 0) ? find_triangle(a, b, w) : find_triangle(b, a, w);
+            if (next < 0) break;
+            used[next] = true;
+            strips.push_back(w);
+        }
+    }
+}
+
+static void append_indices(std::vector<char> &data, const uint32_t *indices, size_t count,
+                           GLenum indexType)
+{
+    size_t offset = data.size();
+    if (indexType == GL_UNSIGNED_INT) {
+        data.resize(offset + count * sizeof(uint32_t));
+        std::memcpy(&data[offset], indices, count * sizeof(uint32_t));
+    } else {
+        data.resize(offset + count * sizeof(uint16_t));
+        uint16_t *shortIndices = (uint16_t *)&data[offset];
+        for (size_t i = 0; i < count; ++i) shortIndices[i] = uint16_t(indices[i]);
+    }
+}
+
+void pack_primitive_indices(std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices,
+                            bool useStrips, PackedIndices &packed)
+{
+    packed = PackedIndices();
+    packed.mode = GL_TRIANGLES;
+
+    std::vector<uint32_t> chunkIndices;
+    std::vector<ChunkRange> ranges;
+    if (vertices.size() <= size_t(MAX_CHUNK_VERTICES)) {
+        ChunkRange range = {0, int(indices.size()), 0};
+        ranges.push_back(range);
+    } else {
+        // Each chunk has its own copies of the vertices that it shares with
+        // other chunks, which only pays off if the chunks are local enough
+        std::vector<Vertex> chunkVertices;
+        split_into_chunks(vertices, indices, chunkVertices, chunkIndices, ranges);
+        size_t chunkBytes = chunkVertices.size() * sizeof(Vertex) + chunkIndices.size() * 2;
+        size_t wideBytes = vertices.size() * sizeof(Vertex) + indices.size() * 4;
+        if (chunkBytes >= wideBytes) {
+            packed.indexType = GL_UNSIGNED_INT;
+            DrawableChunk chunk = {int(indices.size()), 0, 0, int(indices.size() / 3)};
+            packed.chunks.push_back(chunk);
+            append_indices(packed.data, indices.data(), indices.size(), packed.indexType);
+            return;
+        }
+        vertices.swap(chunkVertices);
+    }
+    const std::vector<uint32_t> &source = chunkIndices.empty() ? indices : chunkIndices;
+    packed.indexType = GL_UNSIGNED_SHORT;
+
+    // Strips are only used if they are smaller for the primitive as a whole,
+    // since all chunks are drawn with the same mode
+    std::vector<std::vector<uint32_t>> strips(ranges.size());
+    if (useStrips) {
+        size_t stripIndexCount = 0;
+        for (unsigned i = 0; i < ranges.size(); ++i) {
+            make_triangle_strips(source.data() + ranges[i].firstIndex, ranges[i].indexCount / 3,
+                                 strips[i]);
+            stripIndexCount += strips[i].size();
+        }
+        if (stripIndexCount < source.size()) packed.mode = GL_TRIANGLE_STRIP;
+    }
+
+    for (unsigned i = 0; i < ranges.size(); ++i) {
+        const ChunkRange &range = ranges[i];
+        DrawableChunk chunk;
+        chunk.indexByteOffset = int(packed.data.size());
+        chunk.baseVertex = range.baseVertex;
+        chunk.triangleCount = range.indexCount / 3;
+        if (packed.mode == GL_TRIANGLE_STRIP) {
+            chunk.indexCount = int(strips[i].size());
+            append_indices(packed.data, strips[i].data(), strips[i].size(), packed.indexType);
+        } else {
+            chunk.indexCount = range.indexCount;
+            append_indices(packed.data, source.data() + range.firstIndex, range.indexCount,
+                           packed.indexType);
+        }
+        packed.chunks.push_back(chunk);
+    }
+}
+
+}  // namespace gltf
@@ -0,0 +1,37 @@
+// Compaction of primitive indices to 16 bits, splitting large primitives
+// into chunks, and generation of triangle strips.
+//
+
+#pragma once
+
+#include "gltf_render.h"
+
+namespace gltf {
+
+// Maximum number of vertices of a chunk with 16-bit indices (see
+// PRIMITIVE_RESTART_INDEX)
+const int MAX_CHUNK_VERTICES = int(PRIMITIVE_RESTART_INDEX);
+
+// Index data of a primitive, ready to be copied into the geometry arena. The
+// index byte offsets and base vertices of the chunks are relative to the
+// data and to the vertices of the primitive.
+struct PackedIndices {
+    GLenum mode;
+    GLenum indexType;
+    std::vector<DrawableChunk> chunks;
+    std::vector<char> data;
+};
+
+// Pack the triangle indices of a primitive, whatever their type in the
+// asset. Primitives with at most MAX_CHUNK_VERTICES vertices get 16-bit
+// indices. Larger ones are split into chunks of consecutive triangles with
+// at most MAX_CHUNK_VERTICES vertices each, which replaces the vertices by
+// those of the chunks (copying the vertices that chunks share), unless that
+// takes more memory than 32-bit indices. With useStrips, the triangles of
+// the chunks are joined into strips separated by PRIMITIVE_RESTART_INDEX, if
+// that takes fewer indices than triangle lists (32-bit indices are always
+// triangle lists).
+void pack_primitive_indices(std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices,
+                            bool useStrips, PackedIndices &packed);
+
+}  // namespace gltf
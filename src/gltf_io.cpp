@@ -4,6 +4,7 @@
 //
 
 #include "gltf_io.h"
+#include "cg_normal_map.h"
 
 #include <rapidjson/rapidjson.h>
 #include <rapidjson/document.h>
@@ -93,15 +94,10 @@ static bool load_file_to_bytebuffer(const std::string &filename, std::vector<cha
 }
 
 // Load a base64 encoded file to a byte buffer
-<<<<<<< Updated upstream
-static bool load_byte64_file_to_bytebuffer(const std::vector<unsigned char> decoded_data, std::vector<char>& buffer) {
-    
-=======
 static bool load_byte64_file_to_bytebuffer(const std::vector<unsigned char> decoded_data,
                                            std::vector<char> &buffer)
 {
 
->>>>>>> Stashed changes
     int numBytes = decoded_data.size();
 
     buffer.resize(numBytes);
@@ -110,7 +106,7 @@ static bool load_byte64_file_to_bytebuffer(const std::vector<unsigned char> deco
 }
 
 static bool load_image_to_bytebuffer(const std::string &filename, std::vector<char> &buffer,
-                                     int &width, int &height)
+                                     int &width, int &height, int &components)
 {
     // Load image file (ask for RGBA format with four components)
     int w, h, c;
@@ -120,7 +116,7 @@ static bool load_image_to_bytebuffer(const std::string &filename, std::vector<ch
         return false;
     }
 
-    width = w, height = h;
+    width = w, height = h, components = c;
     buffer.resize(width * height * 4);
     std::memcpy(&buffer[0], image, width * height * 4);
     stbi_image_free(image);  // Clean up resources
@@ -128,37 +124,23 @@ static bool load_image_to_bytebuffer(const std::string &filename, std::vector<ch
 }
 
 // Load a base64 encoded image to a byte buffer
-<<<<<<< Updated upstream
-static bool load_base64_image_to_bytebuffer(const std::vector<unsigned char> &decoded_data, std::vector<char> &buffer)
-{
-    // Load image file (ask for RGBA format with four components)
-    int w, h, c;
-    uint8_t *image = stbi_load_from_memory((const stbi_uc *)decoded_data.data(), decoded_data.size(), &w, &h, &c, 4);
-=======
 static bool load_base64_image_to_bytebuffer(const std::vector<unsigned char> decoded_data,
-                                            std::vector<char> &buffer, int &width, int &height)
+                                            std::vector<char> &buffer, int &width, int &height,
+                                            int &components)
 {
     // Load image file (ask for RGBA format with four components)
     int w, h, c;
     uint8_t *image = stbi_load_from_memory((const stbi_uc *)decoded_data.data(),
                                            decoded_data.size(), &w, &h, &c, 4);
->>>>>>> Stashed changes
     if (image == nullptr) {
         std::cerr << "Error: " << stbi_failure_reason() << std::endl;
         return false;
     }
-<<<<<<< Updated upstream
-
-    buffer.resize(w * h * 4);
-    std::memcpy(&buffer[0], image, w * h * 4);
-    stbi_image_free(image);  // Clean up resources
-=======
-    width = w, height = h;
+    width = w, height = h, components = c;
     buffer.resize(w * h * 4);
     std::memcpy(&buffer[0], image, w * h * 4);
     stbi_image_free(image);  // Clean up resources
 
->>>>>>> Stashed changes
     return true;
 }
 
@@ -186,7 +168,11 @@ static std::vector<Node> create_nodes_from_json(const json::Value &value)
 {
     std::vector<Node> nodes(value.Size());
     for (unsigned i = 0; i < value.Size(); ++i) {
-        nodes[i].mesh = value[i]["mesh"].GetInt();
+        if (value[i].HasMember("mesh")) {
+            nodes[i].mesh = value[i]["mesh"].GetInt();
+        } else {
+            nodes[i].mesh = -1;
+        }
 
         if (value[i].HasMember("name")) {
             // Note: this attribute seems to be optional
@@ -265,6 +251,11 @@ static MaterialTexture create_material_texture_from_json(const json::Value &valu
     } else {
         materialTexture.strength = 1.0f;
     }
+
+    materialTexture.heightMap = value.HasMember("extras") && value["extras"].IsObject() &&
+                                value["extras"].HasMember("heightMap") &&
+                                value["extras"]["heightMap"].IsBool() &&
+                                value["extras"]["heightMap"].GetBool();
     return materialTexture;
 }
 
@@ -315,7 +306,7 @@ static std::vector<Material> create_materials_from_json(const json::Value &value
 {
     std::vector<Material> materials(value.Size());
     for (unsigned i = 0; i < value.Size(); ++i) {
-        materials[i].name = value[i]["name"].GetString();
+        if (value[i].HasMember("name")) { materials[i].name = value[i]["name"].GetString(); }
         materials[i].type = DEFAULT_MATERIAL;
 
         if (value[i].HasMember("pbrMetallicRoughness")) {
@@ -365,6 +356,7 @@ static std::vector<Image> create_images_from_json(const json::Value &value)
     std::vector<Image> images(value.Size());
     for (unsigned i = 0; i < value.Size(); ++i) {
         if (value[i].HasMember("uri")) { images[i].uri = value[i]["uri"].GetString(); }
+        images[i].components = 0;
     }
     return images;
 }
@@ -408,7 +400,11 @@ static std::vector<Primitive> create_primitives_from_json(const json::Value &val
             Attribute attribute = {it.name.GetString(), it.value.GetInt()};
             primitives[i].attributes.push_back(attribute);
         }
-        primitives[i].indices = value[i]["indices"].GetInt();
+        if (value[i].HasMember("indices")) {
+            primitives[i].indices = value[i]["indices"].GetInt();
+        } else {
+            primitives[i].indices = -1;
+        }
 
         if (value[i].HasMember("material")) {
             primitives[i].material = value[i]["material"].GetInt();
@@ -424,7 +420,7 @@ static std::vector<Mesh> create_meshes_from_json(const json::Value &value)
 {
     std::vector<Mesh> meshes(value.Size());
     for (unsigned i = 0; i < value.Size(); ++i) {
-        meshes[i].name = value[i]["name"].GetString();
+        if (value[i].HasMember("name")) { meshes[i].name = value[i]["name"].GetString(); }
         if (value[i].HasMember("primitives")) {
             auto primitives = create_primitives_from_json(value[i]["primitives"]);
             meshes[i].primitives = primitives;
@@ -457,7 +453,11 @@ static std::vector<BufferView> create_buffer_views_from_json(const json::Value &
     for (unsigned i = 0; i < value.Size(); ++i) {
         bufferViews[i].buffer = value[i]["buffer"].GetInt();
         bufferViews[i].byteLength = value[i]["byteLength"].GetInt();
-        bufferViews[i].byteOffset = value[i]["byteOffset"].GetInt();
+        if (value[i].HasMember("byteOffset")) {
+            bufferViews[i].byteOffset = value[i]["byteOffset"].GetInt();
+        } else {
+            bufferViews[i].byteOffset = 0;
+        }
 
         if (value[i].HasMember("byteStride")) {
             bufferViews[i].byteStride = value[i]["byteStride"].GetInt();
@@ -473,11 +473,33 @@ static std::vector<Buffer> create_buffers_from_json(const json::Value &value)
     std::vector<Buffer> buffers(value.Size());
     for (unsigned i = 0; i < value.Size(); ++i) {
         buffers[i].byteLength = value[i]["byteLength"].GetInt();
-        buffers[i].uri = value[i]["uri"].GetString();
+        if (value[i].HasMember("uri")) { buffers[i].uri = value[i]["uri"].GetString(); }
     }
     return buffers;
 }
 
+// Convert the normal textures that are height maps (single-channel images,
+// or flagged in the material) to normal maps, which shaders can read with a
+// single texture fetch
+static void convert_height_maps(GLTFAsset &asset)
+{
+    std::vector<bool> converted(asset.images.size(), false);
+    for (const Material &material : asset.materials) {
+        if (!material.hasNormalTexture) continue;
+        const MaterialTexture &normalTexture = material.normalTexture;
+        if (normalTexture.index < 0 || normalTexture.index >= int(asset.textures.size())) continue;
+        int source = asset.textures[normalTexture.index].source;
+        if (source < 0 || source >= int(asset.images.size()) || converted[source]) continue;
+
+        Image &image = asset.images[source];
+        bool heightMap = normalTexture.heightMap || image.components == 1 ||
+                         image.components == 2;
+        if (!heightMap || image.data.empty()) continue;
+        cg::convert_height_to_normal_map((uint8_t *)image.data.data(), image.width, image.height);
+        converted[source] = true;
+    }
+}
+
 bool load_gltf_asset(const std::string &filename, const std::string &filedir, GLTFAsset &asset)
 {
 
@@ -489,6 +511,10 @@ bool load_gltf_asset(const std::string &filename, const std::string &filedir, GL
         return false;
     }
     root.Parse(&buffer[0]);
+    if (root.HasParseError()) {
+        std::cerr << "Error: Could not parse " << filename << std::endl;
+        return false;
+    }
 
     asset = GLTFAsset();
 
@@ -517,22 +543,15 @@ bool load_gltf_asset(const std::string &filename, const std::string &filedir, GL
         auto images = create_images_from_json(root["images"]);
         // Now also load the actual image data (from image files)
         for (unsigned i = 0; i < images.size(); ++i) {
-<<<<<<< Updated upstream
-            if (images[i].uri.find(".png") != std::string::npos &&
-                images[i].uri.find(".jpeg") != std::string::npos) {
-                load_base64_image_to_bytebuffer(base64_decode(images[i].uri), images[i].data);
-            }
-            else {
-=======
-            int j = images[i].uri.find("base64");
+            size_t j = images[i].uri.find("base64,");
             if (j != std::string::npos) {
                 images[i].uri.erase(0, j + 7);
                 load_base64_image_to_bytebuffer(base64_decode(images[i].uri), images[i].data,
-                                                images[i].width, images[i].height);
+                                                images[i].width, images[i].height,
+                                                images[i].components);
             } else {
->>>>>>> Stashed changes
                 load_image_to_bytebuffer(filedir + images[i].uri, images[i].data, images[i].width,
-                                         images[i].height);
+                                         images[i].height, images[i].components);
             }
         }
         asset.images = images;
@@ -564,24 +583,21 @@ bool load_gltf_asset(const std::string &filename, const std::string &filedir, GL
         // Now also load the actual buffer data (from .bin files/base64 encoded strings)
         for (unsigned i = 0; i < buffers.size(); ++i) {
             // IF the buffer is base64 encoded, decode it first
-<<<<<<< Updated upstream
-            if (buffers[i].uri.find(".bin")==std::string::npos) {
-                load_byte64_file_to_bytebuffer(base64_decode(buffers[i].uri), buffers[i].data);
-            }
-            // Else, load the buffer from a .bin file 
-=======
-            if (buffers[i].uri.find(".bin") == std::string::npos) {
+            size_t j = buffers[i].uri.find("base64,");
+            if (j != std::string::npos) {
+                buffers[i].uri.erase(0, j + 7);
                 load_byte64_file_to_bytebuffer(base64_decode(buffers[i].uri), buffers[i].data);
             }
             // Else, load the buffer from a .bin file
->>>>>>> Stashed changes
-            else {
-                load_file_to_bytebuffer(filedir + buffers[i].uri, buffers[i].data);
+            else if (!load_file_to_bytebuffer(filedir + buffers[i].uri, buffers[i].data)) {
+                return false;  // Accessors would read past the missing data
             }
         }
         asset.buffers = buffers;
     }
 
+    convert_height_maps(asset);
+
     return true;
 }
 
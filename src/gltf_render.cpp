@@ -4,123 +4,825 @@
 //
 
 #include "gltf_render.h"
+#include "gltf_indices.h"
+#include "gltf_tangents.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <utility>
 
 namespace gltf {
 
-void create_drawables_from_gltf_asset(DrawableList &drawables, const GLTFAsset &asset)
+static bool allocate_range(RangeAllocator &allocator, int size, int alignment, ArenaRange &range)
 {
-    // First clean up existing OpenGL resources
-    destroy_drawables(drawables);
+    for (auto it = allocator.freeRanges.begin(); it != allocator.freeRanges.end(); ++it) {
+        int offset = it->first, freeSize = it->second;
+        int aligned = (offset + alignment - 1) / alignment * alignment;
+        if (aligned + size > offset + freeSize) continue;
 
-    // Create vertex buffer
-    GLuint buffer;
-    glGenBuffers(1, &buffer);
-    glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
-    assert(asset.buffers.size() == 1);
-    glBufferData(GL_COPY_WRITE_BUFFER, asset.buffers[0].byteLength, &asset.buffers[0].data[0],
-                 GL_STATIC_DRAW);
+        // Split the free range into (optional) head and tail ranges
+        allocator.freeRanges.erase(it);
+        if (aligned > offset) allocator.freeRanges[offset] = aligned - offset;
+        if (aligned + size < offset + freeSize) {
+            allocator.freeRanges[aligned + size] = offset + freeSize - (aligned + size);
+        }
+        range.offset = aligned;
+        range.size = size;
+        return true;
+    }
+    return false;
+}
 
-    // Create one vertex array object per mesh/drawable
-    drawables.resize(asset.meshes.size());
-    for (unsigned i = 0; i < asset.meshes.size(); ++i) {
-        assert(asset.meshes[i].primitives.size() == 1);
-        drawables[i].buffer = buffer;
+static void release_range(RangeAllocator &allocator, ArenaRange &range)
+{
+    if (!range.size) return;
+
+    auto it = allocator.freeRanges.insert(std::make_pair(range.offset, range.size)).first;
+    // Merge with the following free range
+    auto next = std::next(it);
+    if (next != allocator.freeRanges.end() && it->first + it->second == next->first) {
+        it->second += next->second;
+        allocator.freeRanges.erase(next);
+    }
+    // Merge with the preceding free range
+    if (it != allocator.freeRanges.begin()) {
+        auto prev = std::prev(it);
+        if (prev->first + prev->second == it->first) {
+            prev->second += it->second;
+            allocator.freeRanges.erase(it);
+        }
+    }
+    range = ArenaRange();
+}
+
+static void grow_range_allocator(RangeAllocator &allocator, int capacity)
+{
+    ArenaRange range;
+    range.offset = allocator.capacity;
+    range.size = capacity - allocator.capacity;
+    allocator.capacity = capacity;
+    release_range(allocator, range);
+}
+
+// Replace the buffer with a larger one and copy over its old content
+static void grow_buffer(GLuint &buffer, int oldByteSize, int newByteSize)
+{
+    GLuint newBuffer;
+    glGenBuffers(1, &newBuffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, newBuffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, newByteSize, nullptr, GL_STATIC_DRAW);
+    glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, oldByteSize);
+    glDeleteBuffers(1, &buffer);
+    buffer = newBuffer;
+}
+
+static void specify_arena_vertex_format(GeometryArena &arena)
+{
+    glBindVertexArray(arena.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, arena.vertexBuffer);
+    glEnableVertexAttribArray(POSITION);
+    glVertexAttribPointer(POSITION, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+                          (GLvoid *)offsetof(Vertex, position));
+    glEnableVertexAttribArray(NORMAL);
+    glVertexAttribPointer(NORMAL, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+                          (GLvoid *)offsetof(Vertex, normal));
+    glEnableVertexAttribArray(TEXCOORD_0);
+    glVertexAttribPointer(TEXCOORD_0, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+                          (GLvoid *)offsetof(Vertex, texcoord0));
+    glEnableVertexAttribArray(COLOR_0);
+    glVertexAttribPointer(COLOR_0, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+                          (GLvoid *)offsetof(Vertex, color));
+    glEnableVertexAttribArray(TANGENT);
+    glVertexAttribPointer(TANGENT, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+                          (GLvoid *)offsetof(Vertex, tangent));
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, arena.indexBuffer);
+    glBindVertexArray(0);
+}
+
+void create_geometry_arena(GeometryArena &arena, int vertexCapacity, int indexByteCapacity)
+{
+    destroy_geometry_arena(arena);
+
+    glGenBuffers(1, &arena.vertexBuffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, arena.vertexBuffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, vertexCapacity * sizeof(Vertex), nullptr, GL_STATIC_DRAW);
+    glGenBuffers(1, &arena.indexBuffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, arena.indexBuffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, indexByteCapacity, nullptr, GL_STATIC_DRAW);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    glGenVertexArrays(1, &arena.vao);
+    specify_arena_vertex_format(arena);
+
+    grow_range_allocator(arena.vertices, vertexCapacity);
+    grow_range_allocator(arena.indices, indexByteCapacity);
+}
+
+void destroy_geometry_arena(GeometryArena &arena)
+{
+    if (arena.vao) glDeleteVertexArrays(1, &arena.vao);
+    if (arena.vertexBuffer) glDeleteBuffers(1, &arena.vertexBuffer);
+    if (arena.indexBuffer) glDeleteBuffers(1, &arena.indexBuffer);
+    arena = GeometryArena();
+}
+
+// Allocate ranges from the arena, doubling the capacity of the arena buffers
+// when they run out of space
+static void allocate_arena_ranges(GeometryArena &arena, int vertexCount, int indexBytes,
+                                  DrawablePrimitive &primitive)
+{
+    while (!allocate_range(arena.vertices, vertexCount, 1, primitive.vertexRange)) {
+        int capacity = std::max(2 * arena.vertices.capacity, arena.vertices.capacity + vertexCount);
+        grow_buffer(arena.vertexBuffer, arena.vertices.capacity * sizeof(Vertex),
+                    capacity * sizeof(Vertex));
+        grow_range_allocator(arena.vertices, capacity);
+        specify_arena_vertex_format(arena);
+    }
+    // Note: index data is aligned to four bytes so that both 16- and 32-bit
+    // indices can share the same buffer
+    while (!allocate_range(arena.indices, indexBytes, 4, primitive.indexRange)) {
+        int capacity = std::max(2 * arena.indices.capacity, arena.indices.capacity + indexBytes + 4);
+        grow_buffer(arena.indexBuffer, arena.indices.capacity, capacity);
+        grow_range_allocator(arena.indices, capacity);
+        specify_arena_vertex_format(arena);
+    }
+}
+
+static int num_components(const std::string &type)
+{
+    if (type == "SCALAR") return 1;
+    if (type == "VEC2") return 2;
+    if (type == "VEC3") return 3;
+    if (type == "VEC4") return 4;
+    return 0;
+}
+
+static int component_size(int componentType)
+{
+    switch (componentType) {
+    case GL_BYTE:
+    case GL_UNSIGNED_BYTE: return 1;
+    case GL_SHORT:
+    case GL_UNSIGNED_SHORT: return 2;
+    default: return 4;
+    }
+}
+
+// Read element i of an accessor as floats. Integer components are treated
+// as normalized, which is what glTF uses for colors and texture coordinates.
+static glm::vec4 read_accessor_element(const GLTFAsset &asset, const Accessor &accessor, int i,
+                                       const glm::vec4 &defaults)
+{
+    const BufferView &bufferView = asset.bufferViews[accessor.bufferView];
+    const Buffer &buffer = asset.buffers[bufferView.buffer];
+    int n = num_components(accessor.type);
+    int size = component_size(accessor.componentType);
+    int stride = bufferView.byteStride ? bufferView.byteStride : n * size;
+    const char *ptr = &buffer.data[bufferView.byteOffset + accessor.byteOffset + i * stride];
+
+    glm::vec4 value = defaults;
+    for (int j = 0; j < n && j < 4; ++j) {
+        const char *component = ptr + j * size;
+        switch (accessor.componentType) {
+        case GL_FLOAT: value[j] = *(const float *)component; break;
+        case GL_UNSIGNED_BYTE: value[j] = *(const uint8_t *)component / 255.0f; break;
+        case GL_UNSIGNED_SHORT: value[j] = *(const uint16_t *)component / 65535.0f; break;
+        case GL_BYTE: value[j] = std::max(*(const int8_t *)component / 127.0f, -1.0f); break;
+        case GL_SHORT: value[j] = std::max(*(const int16_t *)component / 32767.0f, -1.0f); break;
+        default: value[j] = float(*(const uint32_t *)component); break;
+        }
+    }
+    return value;
+}
 
-        glGenVertexArrays(1, &drawables[i].vao);
-        glBindVertexArray(drawables[i].vao);
+static uint32_t read_index(const GLTFAsset &asset, const Accessor &accessor, int i)
+{
+    const BufferView &bufferView = asset.bufferViews[accessor.bufferView];
+    const char *ptr = &asset.buffers[bufferView.buffer].data[bufferView.byteOffset + accessor.byteOffset];
+    switch (accessor.componentType) {
+    case GL_UNSIGNED_BYTE: return ((const uint8_t *)ptr)[i];
+    case GL_UNSIGNED_SHORT: return ((const uint16_t *)ptr)[i];
+    default: return ((const uint32_t *)ptr)[i];
+    }
+}
 
-        // Specify vertex format
-        glBindBuffer(GL_ARRAY_BUFFER, drawables[i].buffer);
-        const Primitive &primitive = asset.meshes[i].primitives[0];
-        for (const auto &it : primitive.attributes) {
-            const Accessor &accessor = asset.accessors[it.index];
-            const BufferView &bufferView = asset.bufferViews[accessor.bufferView];
+void read_primitive_triangles(const GLTFAsset &asset, const Primitive &primitive,
+                              std::vector<glm::vec3> &positions, std::vector<uint32_t> &indices)
+{
+    positions.clear();
+    indices.clear();
+    for (const auto &it : primitive.attributes) {
+        if (it.name.compare("POSITION") != 0) continue;
+        const Accessor &accessor = asset.accessors[it.index];
+        positions.resize(accessor.count);
+        for (unsigned i = 0; i < positions.size(); ++i) {
+            positions[i] = glm::vec3(read_accessor_element(asset, accessor, i, glm::vec4(0.0f)));
+        }
+    }
 
-            // Note: must add accessor's byte offset to buffer-view's
-            int byteOffset = bufferView.byteOffset + accessor.byteOffset;
+    if (primitive.indices >= 0) {
+        const Accessor &accessor = asset.accessors[primitive.indices];
+        indices.resize(accessor.count);
+        for (unsigned i = 0; i < indices.size(); ++i) { indices[i] = read_index(asset, accessor, i); }
+    } else {
+        indices.resize(positions.size());
+        for (unsigned i = 0; i < indices.size(); ++i) { indices[i] = i; }
+    }
+}
+
+// Read the vertices of a primitive in the arena vertex format, and its
+// triangle indices (a sequential list for non-indexed primitives)
+static void read_primitive_vertices(const GLTFAsset &asset, const Primitive &primitive,
+                                    std::vector<Vertex> &vertices, std::vector<uint32_t> &indices)
+{
+    vertices.clear();
+    for (const auto &it : primitive.attributes) {
+        const Accessor &accessor = asset.accessors[it.index];
+        if (vertices.empty()) {
+            Vertex defaults;
+            defaults.position = glm::vec3(0.0f);
+            defaults.normal = glm::vec3(0.0f);
+            defaults.texcoord0 = glm::vec2(0.0f);
+            defaults.color = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+            defaults.tangent = glm::vec4(1.0f, 0.0f, 0.0f, 1.0f);
+            vertices.resize(accessor.count, defaults);
+        }
 
+        for (unsigned i = 0; i < vertices.size(); ++i) {
+            Vertex &v = vertices[i];
             if (it.name.compare("POSITION") == 0) {
-                glEnableVertexAttribArray(POSITION);
-                // Note: we often declare the position attribute as vec4 in the
-                // vertex shader, even if the actual type in the buffer is
-                // vec3. This is valid and will give us a homogenous coordinate
-                // with the last component assigned the value 1.
-                glVertexAttribPointer(POSITION, 3 /*VEC3*/, accessor.componentType, GL_FALSE,
-                                      bufferView.byteStride, (GLvoid *)(intptr_t)byteOffset);
+                v.position = glm::vec3(read_accessor_element(asset, accessor, i, glm::vec4(0.0f)));
             } else if (it.name.compare("COLOR_0") == 0) {
-                glEnableVertexAttribArray(COLOR_0);
-                glVertexAttribPointer(COLOR_0, 4 /*VEC4*/, accessor.componentType, GL_FALSE,
-                                      bufferView.byteStride, (GLvoid *)(intptr_t)byteOffset);
+                // Note: COLOR_0 can be either VEC3 or VEC4
+                v.color = read_accessor_element(asset, accessor, i, glm::vec4(1.0f));
             } else if (it.name.compare("NORMAL") == 0) {
-                glEnableVertexAttribArray(NORMAL);
-                glVertexAttribPointer(NORMAL, 3 /*VEC3*/, accessor.componentType, GL_FALSE,
-                                      bufferView.byteStride, (GLvoid *)(intptr_t)byteOffset);
+                v.normal = glm::vec3(read_accessor_element(asset, accessor, i, glm::vec4(0.0f)));
             } else if (it.name.compare("TEXCOORD_0") == 0) {
-                glEnableVertexAttribArray(TEXCOORD_0);
-                glVertexAttribPointer(TEXCOORD_0, 2 /*VEC2*/, accessor.componentType, GL_FALSE,
-                                      bufferView.byteStride, (GLvoid *)(intptr_t)byteOffset);
+                v.texcoord0 = glm::vec2(read_accessor_element(asset, accessor, i, glm::vec4(0.0f)));
+            } else if (it.name.compare("TANGENT") == 0) {
+                v.tangent = read_accessor_element(asset, accessor, i, glm::vec4(1.0f));
             }
             // You can add support for more named attributes here...
         }
+    }
 
-        // Specify index format
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, drawables[i].buffer);
+    if (primitive.indices >= 0) {
         const Accessor &accessor = asset.accessors[primitive.indices];
-        const BufferView &bufferView = asset.bufferViews[accessor.bufferView];
-        drawables[i].indexCount = accessor.count;
-        drawables[i].indexType = accessor.componentType;
-        drawables[i].indexByteOffset = bufferView.byteOffset;
+        indices.resize(accessor.count);
+        for (unsigned i = 0; i < indices.size(); ++i) { indices[i] = read_index(asset, accessor, i); }
+    } else {
+        indices.resize(vertices.size());
+        for (unsigned i = 0; i < indices.size(); ++i) { indices[i] = i; }
+    }
+}
+
+void set_primitive_info(DrawablePrimitive &drawable, const Primitive &primitive,
+                        const std::vector<Vertex> &vertices)
+{
+    drawable.material = primitive.hasMaterial ? primitive.material : -1;
+    drawable.boundsMin = vertices.size() ? vertices[0].position : glm::vec3(0.0f);
+    drawable.boundsMax = drawable.boundsMin;
+    for (const Vertex &v : vertices) {
+        drawable.boundsMin = glm::min(drawable.boundsMin, v.position);
+        drawable.boundsMax = glm::max(drawable.boundsMax, v.position);
+    }
+}
+
+// Return true if a primitive needs generated tangents, i.e., if it has a
+// normal texture, and normals and texture coordinates but no tangents
+static bool needs_tangents(const GLTFAsset &asset, const Primitive &primitive)
+{
+    if (!primitive.hasMaterial || !asset.materials[primitive.material].hasNormalTexture) {
+        return false;
+    }
+    bool hasNormals = false, hasTexcoords = false;
+    for (const auto &it : primitive.attributes) {
+        if (it.name.compare("TANGENT") == 0) return false;
+        hasNormals = hasNormals || it.name.compare("NORMAL") == 0;
+        hasTexcoords = hasTexcoords || it.name.compare("TEXCOORD_0") == 0;
+    }
+    return hasNormals && hasTexcoords;
+}
+
+void read_primitive_geometry(const GLTFAsset &asset, const Primitive &primitive,
+                             TangentCache *tangentCache, std::vector<Vertex> &vertices,
+                             std::vector<uint32_t> &indices)
+{
+    read_primitive_vertices(asset, primitive, vertices, indices);
+    if (needs_tangents(asset, primitive)) generate_cached_tangents(tangentCache, vertices, indices);
+}
+
+static void create_drawable_primitive(DrawablePrimitive &drawable, GeometryArena &arena,
+                                      const GLTFAsset &asset, const Primitive &primitive,
+                                      const std::vector<Vertex> &vertices,
+                                      const PackedIndices &packed)
+{
+    // Copy data into sub-allocated arena ranges
+    const std::vector<char> &indexData = packed.data;
+    allocate_arena_ranges(arena, vertices.size(), indexData.size(), drawable);
+    if (vertices.size()) {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, arena.vertexBuffer);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, drawable.vertexRange.offset * sizeof(Vertex),
+                        vertices.size() * sizeof(Vertex), vertices.data());
+    }
+    if (indexData.size()) {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, arena.indexBuffer);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, drawable.indexRange.offset, indexData.size(),
+                        indexData.data());
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    drawable.mode = packed.mode;
+    drawable.indexType = packed.indexType;
+    drawable.chunks = packed.chunks;
+    for (DrawableChunk &chunk : drawable.chunks) {
+        chunk.indexByteOffset += drawable.indexRange.offset;
+        chunk.baseVertex += drawable.vertexRange.offset;
+    }
+    drawable.assetIndexBytes = 0;
+    if (primitive.indices >= 0) {
+        const Accessor &accessor = asset.accessors[primitive.indices];
+        drawable.assetIndexBytes = accessor.count * component_size(accessor.componentType);
+    }
+    set_primitive_info(drawable, primitive, vertices);
+}
+
+void set_drawable_bounds(Drawable &drawable)
+{
+    drawable.boundsMin = glm::vec3(0.0f);
+    drawable.boundsMax = glm::vec3(0.0f);
+    for (unsigned j = 0; j < drawable.primitives.size(); ++j) {
+        const DrawablePrimitive &primitive = drawable.primitives[j];
+        drawable.boundsMin = j ? glm::min(drawable.boundsMin, primitive.boundsMin)
+                               : primitive.boundsMin;
+        drawable.boundsMax = j ? glm::max(drawable.boundsMax, primitive.boundsMax)
+                               : primitive.boundsMax;
+    }
+}
+
+void create_drawables_from_gltf_asset(DrawableList &drawables, GeometryArena &arena,
+                                      const GLTFAsset &asset, cg::WorkerPool *workers,
+                                      TangentCache *tangentCache, bool useTriangleStrips)
+{
+    // First release existing arena ranges
+    destroy_drawables(drawables, arena);
+
+    // Read the primitives and pack their indices (which is most of the work
+    // when tangents or strips are generated) in parallel, and then copy them
+    // into the arena buffers
+    std::vector<const Primitive *> primitives;
+    for (const Mesh &mesh : asset.meshes) {
+        for (const Primitive &primitive : mesh.primitives) primitives.push_back(&primitive);
+    }
+    std::vector<std::vector<Vertex>> vertices(primitives.size());
+    std::vector<PackedIndices> packedIndices(primitives.size());
+    auto read_primitives = [&](int first, int last) {
+        std::vector<uint32_t> indices;
+        for (int i = first; i < last; ++i) {
+            read_primitive_geometry(asset, *primitives[i], tangentCache, vertices[i], indices);
+            pack_primitive_indices(vertices[i], indices, useTriangleStrips, packedIndices[i]);
+        }
+    };
+    if (workers) {
+        cg::parallel_for(*workers, int(primitives.size()), 1, read_primitives);
+    } else {
+        read_primitives(0, int(primitives.size()));
+    }
+
+    drawables.resize(asset.meshes.size());
+    int index = 0;
+    for (unsigned i = 0; i < asset.meshes.size(); ++i) {
+        const Mesh &mesh = asset.meshes[i];
+        drawables[i].primitives.resize(mesh.primitives.size());
+        for (unsigned j = 0; j < mesh.primitives.size(); ++j, ++index) {
+            create_drawable_primitive(drawables[i].primitives[j], arena, asset, mesh.primitives[j],
+                                      vertices[index], packedIndices[index]);
+            std::vector<Vertex>().swap(vertices[index]);
+            packedIndices[index] = PackedIndices();
+        }
+        set_drawable_bounds(drawables[i]);
     }
-    glBindVertexArray(0);
 }
 
-void destroy_drawables(DrawableList &drawables)
+void destroy_drawables(DrawableList &drawables, GeometryArena &arena)
 {
-    for (unsigned i = 0; i < drawables.size(); ++i) {
-        glDeleteBuffers(1, &drawables[i].buffer);
-        glDeleteVertexArrays(1, &drawables[i].vao);
+    for (auto &drawable : drawables) {
+        for (auto &primitive : drawable.primitives) {
+            release_range(arena.vertices, primitive.vertexRange);
+            release_range(arena.indices, primitive.indexRange);
+        }
     }
     drawables.clear();
 }
 
-void create_textures_from_gltf_asset(TextureList &textures, const GLTFAsset &asset)
+IndexStats drawable_index_stats(const DrawableList &drawables)
+{
+    IndexStats stats;
+    for (const Drawable &drawable : drawables) {
+        for (const DrawablePrimitive &primitive : drawable.primitives) {
+            stats.bytes += primitive.indexRange.size;
+            stats.assetBytes += primitive.assetIndexBytes;
+            stats.chunks += int(primitive.chunks.size());
+            stats.splitPrimitives += primitive.chunks.size() > 1 ? 1 : 0;
+            stats.stripPrimitives += primitive.mode == GL_TRIANGLE_STRIP ? 1 : 0;
+        }
+    }
+    return stats;
+}
+
+// The power of two nearest to the size (in log scale)
+int pooled_texture_size(int size)
+{
+    int power = 1;
+    while (power < MAX_POOLED_TEXTURE_SIZE && 2 * power <= size) power *= 2;
+    if (power < MAX_POOLED_TEXTURE_SIZE && size * size > 2 * power * power) power *= 2;
+    return power;
+}
+
+// Size and sampler state shared by the textures of an array
+struct TextureArrayKey {
+    int width;
+    int height;
+    Sampler sampler;
+
+    bool operator==(const TextureArrayKey &other) const
+    {
+        return width == other.width && height == other.height &&
+               sampler.magFilter == other.sampler.magFilter &&
+               sampler.minFilter == other.sampler.minFilter &&
+               sampler.wrapS == other.sampler.wrapS && sampler.wrapT == other.sampler.wrapT;
+    }
+};
+
+int64_t texture_array_bytes(const TextureArray &array, int level)
+{
+    int64_t bytes = 0;
+    int width = std::max(array.width >> level, 1), height = std::max(array.height >> level, 1);
+    while (true) {
+        bytes += int64_t(width) * height * 4 * array.layerCount;
+        if (width == 1 && height == 1) break;
+        width = std::max(width / 2, 1);
+        height = std::max(height / 2, 1);
+    }
+    return bytes;
+}
+
+// Number of levels in the full-resolution mip chain of an array
+static int texture_array_levels(const TextureArray &array)
+{
+    int levels = 1;
+    while ((array.width >> levels) > 0 || (array.height >> levels) > 0) levels += 1;
+    return levels;
+}
+
+// Lower the levels of arrays one step at a time until their bytes fit the
+// budget. Arrays whose level is finer than their demand go first, then the
+// least recently used, then the largest.
+static void fit_texture_budget(const TexturePool &pool, std::vector<int> &levels,
+                               int64_t memoryBudget)
+{
+    int64_t total = 0;
+    for (unsigned i = 0; i < pool.arrays.size(); ++i) {
+        total += texture_array_bytes(pool.arrays[i], levels[i]);
+    }
+    while (total > memoryBudget) {
+        int victim = -1;
+        for (unsigned i = 0; i < pool.arrays.size(); ++i) {
+            const TextureArray &array = pool.arrays[i];
+            if (levels[i] + 1 >= texture_array_levels(array)) continue;
+            if (victim < 0) {
+                victim = int(i);
+                continue;
+            }
+            const TextureArray &other = pool.arrays[victim];
+            bool aboveDemand = levels[i] < array.demandLevel;
+            bool otherAboveDemand = levels[victim] < other.demandLevel;
+            if (aboveDemand != otherAboveDemand) {
+                if (aboveDemand) victim = int(i);
+            } else if (array.lastUsedFrame != other.lastUsedFrame) {
+                if (array.lastUsedFrame < other.lastUsedFrame) victim = int(i);
+            } else if (texture_array_bytes(array, levels[i]) >
+                       texture_array_bytes(other, levels[victim])) {
+                victim = int(i);
+            }
+        }
+        if (victim < 0) break;  // Everything is at 1x1
+
+        const TextureArray &array = pool.arrays[victim];
+        total -= texture_array_bytes(array, levels[victim]) -
+                 texture_array_bytes(array, levels[victim] + 1);
+        levels[victim] += 1;
+    }
+}
+
+// Create the texture of an array with the levels from a level of its
+// full-resolution chain, and queue its layers
+static GLuint create_array_texture(const TextureArray &array, int level, const GLTFAsset &asset,
+                                   cg::TextureStreamer &streamer)
+{
+    GLuint texture = cg::create_streamed_texture_array(
+        streamer, std::max(array.width >> level, 1), std::max(array.height >> level, 1),
+        array.layerCount);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, array.sampler.wrapS);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, array.sampler.wrapT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, array.sampler.minFilter);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, array.sampler.magFilter);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    for (int layer = 0; layer < array.layerCount; ++layer) {
+        const Image &image = asset.images[array.images[layer]];
+        cg::stream_texture_layer(streamer, texture, layer, image.width, image.height,
+                                 image.data.empty() ? nullptr : image.data.data());
+    }
+    return texture;
+}
+
+// Update the memory statistics of the pool
+static void count_texture_bytes(TexturePool &pool)
+{
+    pool.residentBytes = 0;
+    pool.evictedBytes = 0;
+    for (const TextureArray &array : pool.arrays) {
+        int64_t bytes = texture_array_bytes(array, array.residentLevel);
+        pool.residentBytes += bytes;
+        pool.evictedBytes += texture_array_bytes(array, 0) - bytes;
+        if (array.pendingTexture) {
+            pool.residentBytes += texture_array_bytes(array, array.pendingLevel);
+        }
+    }
+}
+
+void create_textures_from_gltf_asset(TexturePool &pool, const GLTFAsset &asset,
+                                     cg::TextureStreamer &streamer, int64_t memoryBudget)
 {
     // First clean up existing OpenGL resources
-    destroy_textures(textures);
-
-    // Create one texture object per texture in the asset
-    textures.resize(asset.textures.size());
-    for (unsigned i = 0; i < asset.textures.size(); ++i) {
-        const Image &image = asset.images[asset.textures[i].source];
-
-        glGenTextures(1, &textures[i]);
-        glBindTexture(GL_TEXTURE_2D, textures[i]);
-        if (asset.textures[i].hasSampler) {
-            const Sampler &sampler = asset.samplers[asset.textures[i].sampler];
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, sampler.wrapS);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, sampler.wrapT);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, sampler.minFilter);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, sampler.magFilter);
+    destroy_textures(pool);
+
+    GLint maxLayers = 256;
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+
+    // Group the images of the textures by array key, with one entry per
+    // distinct image in each group
+    std::vector<TextureArrayKey> keys;
+    std::vector<std::vector<int>> groupImages;
+    std::vector<std::pair<int, int>> textureEntries;  // Group and entry of each texture
+    for (const Texture &texture : asset.textures) {
+        const Image &image = asset.images[texture.source];
+        TextureArrayKey key;
+        key.width = image.data.empty() ? 1 : pooled_texture_size(image.width);
+        key.height = image.data.empty() ? 1 : pooled_texture_size(image.height);
+        if (texture.hasSampler) {
+            key.sampler = asset.samplers[texture.sampler];
         } else {
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            key.sampler.wrapS = GL_CLAMP_TO_EDGE;
+            key.sampler.wrapT = GL_CLAMP_TO_EDGE;
+            key.sampler.minFilter = GL_LINEAR_MIPMAP_LINEAR;
+            key.sampler.magFilter = GL_LINEAR;
+        }
+
+        int group = int(std::find(keys.begin(), keys.end(), key) - keys.begin());
+        if (group == int(keys.size())) {
+            keys.push_back(key);
+            groupImages.push_back(std::vector<int>());
+        }
+        std::vector<int> &images = groupImages[group];
+        int entry = int(std::find(images.begin(), images.end(), texture.source) - images.begin());
+        if (entry == int(images.size())) images.push_back(texture.source);
+        textureEntries.push_back(std::make_pair(group, entry));
+    }
+
+    // Split each group into arrays (more than one if a group has more images
+    // than an array can have layers)
+    std::vector<int> firstArrays;
+    for (unsigned i = 0; i < keys.size(); ++i) {
+        firstArrays.push_back(int(pool.arrays.size()));
+        const std::vector<int> &images = groupImages[i];
+        for (unsigned first = 0; first < images.size(); first += maxLayers) {
+            TextureArray array;
+            array.width = keys[i].width;
+            array.height = keys[i].height;
+            array.layerCount = std::min(int(images.size() - first), int(maxLayers));
+            array.sampler = keys[i].sampler;
+            array.images.assign(images.begin() + first,
+                                images.begin() + first + array.layerCount);
+            pool.arrays.push_back(array);
+        }
+    }
+
+    // Create the textures, at the levels that fit the budget, and queue
+    // their layers
+    std::vector<int> levels(pool.arrays.size(), 0);
+    if (memoryBudget > 0) fit_texture_budget(pool, levels, memoryBudget);
+    for (unsigned i = 0; i < pool.arrays.size(); ++i) {
+        TextureArray &array = pool.arrays[i];
+        array.residentLevel = levels[i];
+        array.texture = create_array_texture(array, levels[i], asset, streamer);
+    }
+    count_texture_bytes(pool);
+
+    for (const std::pair<int, int> &entry : textureEntries) {
+        TextureLayer layer;
+        layer.array = firstArrays[entry.first] + entry.second / maxLayers;
+        layer.layer = entry.second % maxLayers;
+        pool.layers.push_back(layer);
+    }
+}
+
+void destroy_textures(TexturePool &pool)
+{
+    for (const TextureArray &array : pool.arrays) {
+        glDeleteTextures(1, &array.texture);
+        if (array.pendingTexture) glDeleteTextures(1, &array.pendingTexture);
+    }
+    pool = TexturePool();
+}
+
+void request_texture_array(TexturePool &pool, int index, float screenSize)
+{
+    // The finest level that has at most one texel per pixel across the draw
+    TextureArray &array = pool.arrays[index];
+    float texels = float(std::max(array.width, array.height));
+    int level = int(std::floor(std::log2(texels / std::max(screenSize, 1.0f))));
+    level = std::min(std::max(level, 0), texture_array_levels(array) - 1);
+    if (array.lastUsedFrame != pool.frame) {
+        array.lastUsedFrame = pool.frame;
+        array.demandLevel = level;
+    } else {
+        array.demandLevel = std::min(array.demandLevel, level);
+    }
+}
+
+void update_texture_residency(TexturePool &pool, const GLTFAsset &asset,
+                              cg::TextureStreamer &streamer, int64_t memoryBudget)
+{
+    // Switch to reallocated textures once all their levels have arrived
+    for (TextureArray &array : pool.arrays) {
+        if (!array.pendingTexture || cg::is_texture_streaming(streamer, array.pendingTexture)) {
+            continue;
+        }
+        glDeleteTextures(1, &array.texture);
+        array.texture = array.pendingTexture;
+        array.residentLevel = array.pendingLevel;
+        array.pendingTexture = 0;
+    }
+
+    if (memoryBudget > 0) {
+        // Arrays that were used recently get the levels of their demand back,
+        // and cold arrays keep only the levels up to TEXTURE_STREAM_MIN_SIZE.
+        // Otherwise, arrays keep their levels unless the budget is exceeded,
+        // so that they are not reallocated back and forth as the camera moves.
+        std::vector<int> levels(pool.arrays.size());
+        for (unsigned i = 0; i < pool.arrays.size(); ++i) {
+            const TextureArray &array = pool.arrays[i];
+            if (pool.frame - array.lastUsedFrame > TEXTURE_COLD_FRAMES) {
+                int coldLevel = 0;
+                while ((array.width >> coldLevel) > cg::TEXTURE_STREAM_MIN_SIZE ||
+                       (array.height >> coldLevel) > cg::TEXTURE_STREAM_MIN_SIZE) {
+                    coldLevel += 1;
+                }
+                levels[i] = std::max(array.residentLevel, coldLevel);
+            } else {
+                levels[i] = std::min(array.residentLevel, array.demandLevel);
+            }
+        }
+        fit_texture_budget(pool, levels, memoryBudget);
+
+        // Reallocate the arrays whose level changed (but not while their
+        // levels are being streamed)
+        for (unsigned i = 0; i < pool.arrays.size(); ++i) {
+            TextureArray &array = pool.arrays[i];
+            if (levels[i] == array.residentLevel || array.pendingTexture ||
+                cg::is_texture_streaming(streamer, array.texture)) {
+                continue;
+            }
+            array.pendingTexture = create_array_texture(array, levels[i], asset, streamer);
+            array.pendingLevel = levels[i];
+            pool.reallocations += 1;
+        }
+    }
+
+    count_texture_bytes(pool);
+    pool.frame += 1;
+}
+
+// Expand a world-space bounding box by a transformed object-space box
+static void expand_world_bounds(const glm::mat4 &model, const glm::vec3 &boundsMin,
+                                const glm::vec3 &boundsMax, glm::vec3 &worldMin,
+                                glm::vec3 &worldMax)
+{
+    for (int i = 0; i < 8; ++i) {
+        glm::vec3 corner((i & 1) ? boundsMax.x : boundsMin.x, (i & 2) ? boundsMax.y : boundsMin.y,
+                         (i & 4) ? boundsMax.z : boundsMin.z);
+        glm::vec3 p = glm::vec3(model * glm::vec4(corner, 1.0f));
+        worldMin = glm::min(worldMin, p);
+        worldMax = glm::max(worldMax, p);
+    }
+}
+
+void group_instance_batches(InstanceBatchList &batches, std::vector<int> &instanceNodes,
+                            const GLTFAsset &asset, const DrawableList &drawables,
+                            int maxBatchInstances)
+{
+    // Sort mesh nodes by mesh, so that nodes sharing the same mesh end up
+    // next to each other
+    typedef std::pair<int, int> KeyedNode;
+    std::vector<KeyedNode> keyedNodes;
+    keyedNodes.reserve(asset.nodes.size());
+    for (unsigned i = 0; i < asset.nodes.size(); ++i) {
+        if (asset.nodes[i].mesh < 0) continue;
+        keyedNodes.push_back(KeyedNode(asset.nodes[i].mesh, i));
+    }
+    std::sort(keyedNodes.begin(), keyedNodes.end());
+
+    // Emit one batch per primitive for each unique mesh. All primitives of a
+    // mesh share the same instances.
+    batches.clear();
+    instanceNodes.resize(keyedNodes.size());
+    for (unsigned i = 0; i < keyedNodes.size(); ++i) {
+        int mesh = keyedNodes[i].first;
+        const Drawable &drawable = drawables[mesh];
+        if (i == 0 || mesh != keyedNodes[i - 1].first ||
+            (!batches.empty() && batches.back().instanceCount >= maxBatchInstances)) {
+            for (unsigned j = 0; j < drawable.primitives.size(); ++j) {
+                InstanceBatch batch;
+                batch.mesh = mesh;
+                batch.primitive = j;
+                batch.material = drawable.primitives[j].material;
+                batch.baseInstance = i;
+                batch.instanceCount = 0;
+                batch.boundsMin = glm::vec3(FLT_MAX);
+                batch.boundsMax = glm::vec3(-FLT_MAX);
+                batches.push_back(batch);
+            }
+        }
+        for (unsigned j = 0; j < drawable.primitives.size(); ++j) {
+            batches[batches.size() - 1 - j].instanceCount += 1;
         }
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, image.width, image.height, 0, GL_RGBA,
-                     GL_UNSIGNED_BYTE, &(image.data[0]));
-        // We also need to create a mipmap chain in case GL_TEXTURE_MIN_FILTER
-        // is set to something else than GL_NEAREST or GL_LINEAR
-        glGenerateMipmap(GL_TEXTURE_2D);
+        instanceNodes[i] = keyedNodes[i].second;
+    }
+}
+
+void expand_batch_bounds(const InstanceBatch &batch, const DrawableList &drawables,
+                         const std::vector<glm::mat4> &instanceTransforms, int first, int last,
+                         glm::vec3 &boundsMin, glm::vec3 &boundsMax)
+{
+    const DrawablePrimitive &primitive = drawables[batch.mesh].primitives[batch.primitive];
+    for (int i = first; i < last; ++i) {
+        expand_world_bounds(instanceTransforms[i], primitive.boundsMin, primitive.boundsMax,
+                            boundsMin, boundsMax);
+    }
+}
+
+void create_instance_batches(InstanceBatchList &batches, std::vector<glm::mat4> &instanceTransforms,
+                             const GLTFAsset &asset, const DrawableList &drawables,
+                             const std::vector<glm::mat4> &worldMatrices,
+                             int maxBatchInstances)
+{
+    std::vector<int> instanceNodes;
+    group_instance_batches(batches, instanceNodes, asset, drawables, maxBatchInstances);
+
+    // Pack the world matrices of the nodes
+    instanceTransforms.resize(instanceNodes.size());
+    for (unsigned i = 0; i < instanceNodes.size(); ++i) {
+        instanceTransforms[i] = worldMatrices[instanceNodes[i]];
+    }
+    for (InstanceBatch &batch : batches) {
+        expand_batch_bounds(batch, drawables, instanceTransforms, batch.baseInstance,
+                            batch.baseInstance + batch.instanceCount, batch.boundsMin,
+                            batch.boundsMax);
+    }
+}
+
+int write_instance_buffer(InstanceBuffer &instances, cg::StreamBuffer &stream,
+                          const std::vector<glm::mat4> &transforms)
+{
+    if (!instances.texture) glGenTextures(1, &instances.texture);
+
+    // The offset must be a multiple of the matrix size to be a matrix index
+    void *data;
+    int size = int(transforms.size() * sizeof(glm::mat4));
+    int offset = allocate_stream_buffer(stream, size, sizeof(glm::mat4), &data);
+    if (size) std::memcpy(data, &transforms[0], size);
+
+    if (instances.buffer != stream.buffer) {
+        instances.buffer = stream.buffer;
+        glBindTexture(GL_TEXTURE_BUFFER, instances.texture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, instances.buffer);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
     }
-    glBindTexture(GL_TEXTURE_2D, 0);
+    return cg::stream_buffer_offset(stream, offset) / int(sizeof(glm::mat4));
 }
 
-void destroy_textures(TextureList &textures)
+void destroy_instance_buffer(InstanceBuffer &instances)
 {
-    if (!textures.size()) return;
-    glDeleteTextures(textures.size(), &textures[0]);
-    textures.clear();
+    glDeleteTextures(1, &instances.texture);  // The buffer belongs to the stream buffer
+    instances = InstanceBuffer();
 }
 
 }  // namespace gltf
@@ -6,31 +6,270 @@
 #pragma once
 
 #include "gltf_scene.h"
+#include "cg_stream_buffer.h"
+#include "cg_texture_streamer.h"
+#include "cg_worker_pool.h"
 
 #include <GL/gl3w.h>
 
+#include <climits>
+#include <cstdint>
+#include <map>
+
 namespace gltf {
 
 // Attribute locations we will use in vertex shaders
-enum AttributeLocation { POSITION = 0, COLOR_0 = 1, NORMAL = 2, TEXCOORD_0 = 3 };
+enum AttributeLocation { POSITION = 0, COLOR_0 = 1, NORMAL = 2, TEXCOORD_0 = 3, TANGENT = 4 };
 
-struct Drawable {
-    GLuint vao;
-    GLuint buffer;
-    GLenum indexType;
+// Vertex format that all primitives are converted to when they are packed
+// into the geometry arena. Missing attributes get default values, except for
+// the tangents of primitives with normal textures, which are generated (see
+// gltf_tangents.h).
+struct Vertex {
+    glm::vec3 position;
+    glm::vec3 normal;
+    glm::vec2 texcoord0;
+    glm::vec4 color;
+    glm::vec4 tangent;  // Handedness of the bitangent in w
+};
+
+// First-fit free-list allocator for ranges [offset, offset + size) within a
+// fixed capacity. Adjacent free ranges are merged when ranges are released.
+struct RangeAllocator {
+    int capacity = 0;
+    std::map<int, int> freeRanges;  // Offset -> size
+};
+
+// Allocated range in one of the arena buffers
+struct ArenaRange {
+    int offset = 0;
+    int size = 0;
+};
+
+// Vertex and index buffers shared by all loaded primitives, together with a
+// single vertex array object describing the Vertex format. Primitives are
+// sub-allocated from the buffers and addressed with a base vertex and index
+// byte offset, so loading and unloading models does not create GL buffers
+// (unless the arena has to grow).
+struct GeometryArena {
+    GLuint vao = 0;
+    GLuint vertexBuffer = 0;
+    GLuint indexBuffer = 0;
+    RangeAllocator vertices;  // In units of vertices
+    RangeAllocator indices;   // In units of bytes
+};
+
+// Index value that restarts triangle strips (see gltf_indices.h). Chunks
+// with 16-bit indices have at most this many vertices, so that the value is
+// never a vertex.
+const uint32_t PRIMITIVE_RESTART_INDEX = 0xffff;
+
+// Part of a primitive that is drawn with one draw command
+struct DrawableChunk {
     int indexCount;
-    int indexByteOffset;
+    int indexByteOffset;  // Byte offset into the arena index buffer
+    int baseVertex;       // Index of the first vertex in the arena vertex buffer
+    int triangleCount;
+};
+
+struct DrawablePrimitive {
+    GLenum mode;          // GL_TRIANGLES, or GL_TRIANGLE_STRIP with primitive restart
+    GLenum indexType;     // Same for all chunks
+    int assetIndexBytes;  // Size of the indices in the asset (for statistics)
+    int material;         // Set to -1 if the primitive has no material
+    glm::vec3 boundsMin;  // Object-space bounding box of the vertex positions
+    glm::vec3 boundsMax;
+    ArenaRange vertexRange;
+    ArenaRange indexRange;
+    std::vector<DrawableChunk> chunks;  // A single one, unless the vertices are split
+};
+
+// One drawable per mesh, with one entry per mesh primitive
+struct Drawable {
+    std::vector<DrawablePrimitive> primitives;
+    glm::vec3 boundsMin;  // Object-space bounding box of all primitives
+    glm::vec3 boundsMax;
 };
 
 typedef std::vector<Drawable> DrawableList;
-typedef std::vector<GLuint> TextureList;
 
-void create_drawables_from_gltf_asset(DrawableList &drawables, const GLTFAsset &asset);
+// Textures of an asset, pooled into 2D texture arrays by size and sampler
+// state (all are RGBA8 with full mip chains), so that materials whose
+// textures are in the same arrays can be drawn without rebinding them.
+// Images are resized to the nearest power-of-two size per axis, up to
+// MAX_POOLED_TEXTURE_SIZE.
+const int MAX_POOLED_TEXTURE_SIZE = 4096;
+
+// Return the size (width or height) that images of a size are resized to
+int pooled_texture_size(int size);
+
+struct TextureArray {
+    GLuint texture = 0;
+    int width = 0;  // Size of the full-resolution level
+    int height = 0;
+    int layerCount = 0;
+    Sampler sampler;
+    std::vector<int> images;  // Image of each layer
+
+    // Residency (see update_texture_residency()). The texture only holds the
+    // levels from residentLevel of the full-resolution mip chain.
+    int residentLevel = 0;
+    int lastUsedFrame = 0;
+    int demandLevel = 0;  // Finest level requested in the last frame that the array was used
+    GLuint pendingTexture = 0;  // Reallocated texture whose levels are still being streamed
+    int pendingLevel = 0;
+};
+
+// Array and layer of a texture (textures with the same image and sampler
+// share a layer)
+struct TextureLayer {
+    int array;
+    int layer;
+};
+
+struct TexturePool {
+    std::vector<TextureArray> arrays;
+    std::vector<TextureLayer> layers;  // One per texture of the asset
+    int frame = 0;
+
+    // Statistics
+    int64_t residentBytes = 0;  // Including textures that are being reallocated
+    int64_t evictedBytes = 0;   // Levels dropped from the full-resolution chains
+    int reallocations = 0;
+};
+
+// Number of frames after which an array that has not been drawn is cold, and
+// drops its levels larger than cg::TEXTURE_STREAM_MIN_SIZE
+const int TEXTURE_COLD_FRAMES = 300;
+
+// Group of nodes that share the same mesh primitive and material, and that
+// therefore can be drawn with a single instanced draw call
+struct InstanceBatch {
+    int mesh;
+    int primitive;
+    int material;       // Set to -1 if the primitive has no material
+    int baseInstance;   // Index of the first transform in the instance buffer
+    int instanceCount;
+    glm::vec3 boundsMin;  // World-space bounding box of all instances
+    glm::vec3 boundsMax;
+};
+
+typedef std::vector<InstanceBatch> InstanceBatchList;
+
+// Per-instance world matrices, which shaders read through a buffer texture
+// (four RGBA32F texels per matrix). The matrices of each frame are written to
+// a stream buffer, which is attached to the texture as a whole.
+struct InstanceBuffer {
+    GLuint buffer = 0;  // Stream buffer that is attached to the texture
+    GLuint texture = 0;
+};
+
+void create_geometry_arena(GeometryArena &arena, int vertexCapacity, int indexByteCapacity);
+
+void destroy_geometry_arena(GeometryArena &arena);
+
+struct TangentCache;  // See gltf_tangents.h
+
+// Pack all primitives of all meshes in the asset into the arena. Their
+// vertices are read (and tangents generated, with the cache if one is given)
+// and their indices compacted (see pack_primitive_indices()) on the workers,
+// if a pool is given.
+void create_drawables_from_gltf_asset(DrawableList &drawables, GeometryArena &arena,
+                                      const GLTFAsset &asset, cg::WorkerPool *workers = nullptr,
+                                      TangentCache *tangentCache = nullptr,
+                                      bool useTriangleStrips = false);
+
+// Release the arena ranges of the drawables
+void destroy_drawables(DrawableList &drawables, GeometryArena &arena);
+
+// Index data of the drawables, compared to the indices of the asset
+struct IndexStats {
+    int64_t bytes = 0;
+    int64_t assetBytes = 0;
+    int chunks = 0;
+    int splitPrimitives = 0;  // Primitives with more than one chunk
+    int stripPrimitives = 0;
+};
+
+IndexStats drawable_index_stats(const DrawableList &drawables);
+
+// Read the vertices and indices of a primitive, with tangents generated if
+// it has a normal texture, and normals and texture coordinates but no
+// tangents (see generate_cached_tangents())
+void read_primitive_geometry(const GLTFAsset &asset, const Primitive &primitive,
+                             TangentCache *tangentCache, std::vector<Vertex> &vertices,
+                             std::vector<uint32_t> &indices);
+
+// Set the material and object-space bounds of a drawable primitive
+void set_primitive_info(DrawablePrimitive &drawable, const Primitive &primitive,
+                        const std::vector<Vertex> &vertices);
+
+// Set the bounds of a drawable to the union of the bounds of its primitives
+void set_drawable_bounds(Drawable &drawable);
+
+// Read the vertex positions and triangle indices of a primitive (e.g., for
+// CPU-side processing such as occlusion culling)
+void read_primitive_triangles(const GLTFAsset &asset, const Primitive &primitive,
+                              std::vector<glm::vec3> &positions, std::vector<uint32_t> &indices);
+
+// Create the texture arrays of the asset. Their mip levels are uploaded by
+// the streamer over the next frames (see cg::update_texture_streamer()). If
+// memoryBudget is not 0, the largest arrays start without their top levels
+// as needed to fit the budget (in bytes).
+void create_textures_from_gltf_asset(TexturePool &pool, const GLTFAsset &asset,
+                                     cg::TextureStreamer &streamer, int64_t memoryBudget = 0);
+
+void destroy_textures(TexturePool &pool);
+
+// Bytes of the mip chain of an array from a level of its full-resolution
+// chain down to 1x1
+int64_t texture_array_bytes(const TextureArray &array, int level);
+
+// Record that an array is sampled in the current frame by a draw that is
+// about screenSize pixels across (assuming that the textures cover it once)
+void request_texture_array(TexturePool &pool, int array, float screenSize);
+
+// Keep the arrays within a budget of GPU memory (in bytes, or 0 for no
+// limit), from the requests of the last frame. Arrays drop their top levels
+// when they are cold, or least recently used while the budget is exceeded,
+// and get them back when the demand rises. Either way they are reallocated
+// at the new size, and their levels are streamed from the images of the
+// asset; the old texture is used until all have arrived. Call once per
+// frame, before the requests of the frame.
+void update_texture_residency(TexturePool &pool, const GLTFAsset &asset,
+                              cg::TextureStreamer &streamer, int64_t memoryBudget);
+
+// Group the mesh nodes of the asset by mesh, pack their world matrices mesh
+// by mesh into instanceTransforms, and emit one batch per mesh primitive.
+// Meshes with more than maxBatchInstances nodes are split into several
+// batches (set it to 1 to disable instancing).
+void create_instance_batches(InstanceBatchList &batches, std::vector<glm::mat4> &instanceTransforms,
+                             const GLTFAsset &asset, const DrawableList &drawables,
+                             const std::vector<glm::mat4> &worldMatrices,
+                             int maxBatchInstances = INT_MAX);
+
+// Like create_instance_batches(), but only group the mesh nodes: the batches
+// get their instance ranges and empty bounds, and instanceNodes gets the node
+// of each instance. The grouping only changes with the nodes and meshes of
+// the asset, so it can be kept while the transforms change.
+void group_instance_batches(InstanceBatchList &batches, std::vector<int> &instanceNodes,
+                            const GLTFAsset &asset, const DrawableList &drawables,
+                            int maxBatchInstances = INT_MAX);
 
-void destroy_drawables(DrawableList &drawables);
+// Expand a world-space box by the bounds of the primitive of a batch at the
+// instance transforms [first, last), e.g., a part of the instances of the
+// batch, so that large batches can be split between threads
+void expand_batch_bounds(const InstanceBatch &batch, const DrawableList &drawables,
+                         const std::vector<glm::mat4> &instanceTransforms, int first, int last,
+                         glm::vec3 &boundsMin, glm::vec3 &boundsMax);
 
-void create_textures_from_gltf_asset(TextureList &textures, const GLTFAsset &asset);
+// Write the instance transforms of a frame to the current frame of the
+// stream buffer, and return the index of the first one in the texture (to
+// be added to the first instances of the draws). The buffer is re-attached
+// to the texture if it is a new one (e.g., after the stream buffer has grown).
+int write_instance_buffer(InstanceBuffer &instances, cg::StreamBuffer &stream,
+                          const std::vector<glm::mat4> &transforms);
 
-void destroy_textures(TextureList &textures);
+void destroy_instance_buffer(InstanceBuffer &instances);
 
 }  // namespace gltf
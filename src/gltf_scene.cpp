@@ -5,6 +5,89 @@
 
 #include "gltf_scene.h"
 
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtx/quaternion.hpp>
+
+#include <cmath>
+
 namespace gltf {
 
+static glm::mat4 local_matrix(const Node &node)
+{
+    if (node.hasMatrix) return node.matrix;
+
+    glm::mat4 T = glm::translate(glm::mat4(1.0f), node.translation);
+    glm::mat4 R = glm::toMat4(node.rotation);
+    glm::mat4 S = glm::scale(glm::mat4(1.0f), node.scale);
+    return T * R * S;
+}
+
+void compute_subtree_world_matrices(const GLTFAsset &asset, int index, const glm::mat4 &parent,
+                                    std::vector<glm::mat4> &worldMatrices)
+{
+    const Node &node = asset.nodes[index];
+    worldMatrices[index] = parent * local_matrix(node);
+    for (int child : node.children) {
+        compute_subtree_world_matrices(asset, child, worldMatrices[index], worldMatrices);
+    }
+}
+
+void find_root_nodes(const GLTFAsset &asset, std::vector<int> &roots)
+{
+    std::vector<bool> isChild(asset.nodes.size(), false);
+    for (const auto &node : asset.nodes) {
+        for (int child : node.children) { isChild[child] = true; }
+    }
+
+    roots.clear();
+    for (unsigned i = 0; i < asset.nodes.size(); ++i) {
+        if (!isChild[i]) roots.push_back(i);
+    }
+}
+
+void compute_world_matrices(const GLTFAsset &asset, std::vector<glm::mat4> &worldMatrices)
+{
+    std::vector<int> roots;
+    find_root_nodes(asset, roots);
+    worldMatrices.resize(asset.nodes.size());
+    for (int root : roots) {
+        compute_subtree_world_matrices(asset, root, glm::mat4(1.0f), worldMatrices);
+    }
+}
+
+void create_instanced_grid(GLTFAsset &asset, int count)
+{
+    std::vector<Node> meshNodes;
+    for (const auto &node : asset.nodes) {
+        if (node.mesh >= 0) meshNodes.push_back(node);
+    }
+    if (meshNodes.empty() || count <= 0) return;
+
+    // Place the copies in a cube of size 3 around the origin, so that the
+    // grid stays within the default view
+    int n = int(std::ceil(std::cbrt(double(count))));
+    float cellSize = 3.0f / n;
+    float scale = 0.5f * cellSize;
+
+    asset.nodes.clear();
+    for (int i = 0; i < count; ++i) {
+        glm::vec3 cell = glm::vec3(i % n, (i / n) % n, i / (n * n));
+        glm::vec3 center = (cell + 0.5f) * cellSize - 1.5f;
+        for (const auto &original : meshNodes) {
+            Node node = original;
+            node.name = original.name + "_" + std::to_string(i);
+            node.children.clear();
+            node.matrix = glm::translate(glm::mat4(1.0f), center) *
+                          glm::scale(glm::mat4(1.0f), glm::vec3(scale)) * local_matrix(original);
+            node.hasMatrix = true;
+            asset.nodes.push_back(node);
+        }
+    }
+
+    for (auto &scene : asset.scenes) {
+        scene.nodes.resize(asset.nodes.size());
+        for (unsigned i = 0; i < asset.nodes.size(); ++i) { scene.nodes[i] = i; }
+    }
+}
+
 }  // namespace gltf
@@ -21,7 +21,7 @@ struct Scene {
 };
 
 struct Node {
-    int mesh;
+    int mesh;  // Set to -1 if the node has no mesh
     std::string name;
     std::vector<int> children;
     glm::vec3 translation;
@@ -36,6 +36,7 @@ struct MaterialTexture {
     int texCoord;
     float scale;     // Only used by normal map textures
     float strength;  // Only used by occlusion textures
+    bool heightMap;  // Normal texture flagged with "extras": {"heightMap": true}
 };
 
 struct PBRMetallicRoughness {
@@ -68,6 +69,7 @@ struct Image {
     std::string uri;
     int width;               // Image width (in pixels)
     int height;              // Image height (in pixels)
+    int components;          // Channels in the image file (before conversion to RGBA8)
     std::vector<char> data;  // Pixel data in RGBA8 format
 };
 
@@ -85,7 +87,7 @@ struct Attribute {
 
 struct Primitive {
     std::vector<Attribute> attributes;
-    int indices;
+    int indices;  // Set to -1 if the primitive is not indexed
     int material;
     bool hasMaterial;
 };
@@ -129,4 +131,21 @@ struct GLTFAsset {
     std::vector<Buffer> buffers;
 };
 
+// Compute the world matrix of every node in the asset by concatenating the
+// local node transforms (T * R * S, or the node matrix) down the hierarchy
+void compute_world_matrices(const GLTFAsset &asset, std::vector<glm::mat4> &worldMatrices);
+
+// Find the nodes that are not the child of any other node
+void find_root_nodes(const GLTFAsset &asset, std::vector<int> &roots);
+
+// Compute the world matrices of a node and its descendants, given the world
+// matrix of its parent (worldMatrices must have one matrix per node). The
+// subtrees of different roots can be computed on different threads.
+void compute_subtree_world_matrices(const GLTFAsset &asset, int index, const glm::mat4 &parent,
+                                    std::vector<glm::mat4> &worldMatrices);
+
+// Replace the nodes of the asset with count copies of its mesh nodes, laid
+// out on a regular grid. Useful for generating synthetic stress-test scenes.
+void create_instanced_grid(GLTFAsset &asset, int count);
+
 }  // namespace gltf
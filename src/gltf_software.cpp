@@ -0,0 +1,232 @@
+// Scenes of glTF assets for the software renderer and the path tracer: the
+// converted meshes and textures, the draws (or objects and materials) of the
+// mesh node instances, and the camera, lighting and shadow parameters of
+// frames.
+//
+
+#include "gltf_software.h"
+#include "gltf_io.h"
+#include "gltf_scene.h"
+
+#include <algorithm>
+
+namespace gltf {
+
+// Convert a glTF sampler to the sampler state of a software texture
+static void set_software_sampler(cg::SoftwareTexture &texture, const Sampler &sampler)
+{
+    const GLint wraps[] = {sampler.wrapS, sampler.wrapT};
+    cg::SoftwareWrap *targets[] = {&texture.wrapS, &texture.wrapT};
+    for (int i = 0; i < 2; ++i) {
+        *targets[i] = (wraps[i] == GL_REPEAT)            ? cg::SOFTWARE_WRAP_REPEAT
+                      : (wraps[i] == GL_MIRRORED_REPEAT) ? cg::SOFTWARE_WRAP_MIRROR
+                                                         : cg::SOFTWARE_WRAP_CLAMP;
+    }
+    texture.magLinear = sampler.magFilter != GL_NEAREST;
+    switch (sampler.minFilter) {
+    case GL_NEAREST:
+    case GL_LINEAR: texture.mipmapFilter = cg::SOFTWARE_MIPMAP_NONE; break;
+    case GL_NEAREST_MIPMAP_NEAREST:
+    case GL_LINEAR_MIPMAP_NEAREST: texture.mipmapFilter = cg::SOFTWARE_MIPMAP_NEAREST; break;
+    default: texture.mipmapFilter = cg::SOFTWARE_MIPMAP_LINEAR; break;
+    }
+    texture.minLinear = sampler.minFilter != GL_NEAREST &&
+                        sampler.minFilter != GL_NEAREST_MIPMAP_NEAREST &&
+                        sampler.minFilter != GL_NEAREST_MIPMAP_LINEAR;
+}
+
+void create_software_asset(SoftwareAsset &software, DrawableList &drawables,
+                           const GLTFAsset &asset, TangentCache *tangentCache)
+{
+    software = SoftwareAsset();
+    drawables.assign(asset.meshes.size(), Drawable());
+    software.meshes.resize(asset.meshes.size());
+    std::vector<Vertex> vertices;
+    std::vector<uint32_t> indices;
+    for (unsigned i = 0; i < asset.meshes.size(); ++i) {
+        const Mesh &mesh = asset.meshes[i];
+        drawables[i].primitives.resize(mesh.primitives.size(), DrawablePrimitive());
+        software.meshes[i].resize(mesh.primitives.size());
+        for (unsigned j = 0; j < mesh.primitives.size(); ++j) {
+            read_primitive_geometry(asset, mesh.primitives[j], tangentCache, vertices, indices);
+            set_primitive_info(drawables[i].primitives[j], mesh.primitives[j], vertices);
+
+            cg::SoftwareMesh &softwareMesh = software.meshes[i][j];
+            softwareMesh.vertices.resize(vertices.size());
+            for (unsigned k = 0; k < vertices.size(); ++k) {
+                cg::SoftwareVertex &v = softwareMesh.vertices[k];
+                v.position = vertices[k].position;
+                v.normal = vertices[k].normal;
+                v.texcoord = vertices[k].texcoord0;
+                v.color = glm::vec3(vertices[k].color);
+                v.tangent = vertices[k].tangent;
+            }
+            softwareMesh.indices.swap(indices);
+        }
+        set_drawable_bounds(drawables[i]);
+    }
+
+    // Textures are resized to the sizes of the texture pool, so that they
+    // are filtered the same way
+    software.textures.resize(asset.textures.size());
+    for (unsigned i = 0; i < asset.textures.size(); ++i) {
+        const Texture &texture = asset.textures[i];
+        const Image &image = asset.images[texture.source];
+        cg::SoftwareTexture &softwareTexture = software.textures[i];
+        int width = image.data.empty() ? 1 : pooled_texture_size(image.width);
+        int height = image.data.empty() ? 1 : pooled_texture_size(image.height);
+        cg::create_rgba8_mip_chain(image.data.empty() ? nullptr : image.data.data(), image.width,
+                                   image.height, width, height, softwareTexture.levels);
+        for (unsigned level = 0; level < softwareTexture.levels.size(); ++level) {
+            softwareTexture.widths.push_back(std::max(width >> level, 1));
+            softwareTexture.heights.push_back(std::max(height >> level, 1));
+        }
+        if (texture.hasSampler) {
+            set_software_sampler(softwareTexture, asset.samplers[texture.sampler]);
+        }
+    }
+}
+
+bool load_software_scene(SoftwareScene &scene, const std::string &directory,
+                         const std::string &filename, int syntheticInstanceCount,
+                         int maxBatchInstances, TangentCache *tangentCache)
+{
+    scene.asset = GLTFAsset();
+    if (!load_gltf_asset(filename, directory, scene.asset)) return false;
+    if (syntheticInstanceCount > 0) create_instanced_grid(scene.asset, syntheticInstanceCount);
+    create_software_asset(scene.software, scene.drawables, scene.asset, tangentCache);
+    compute_world_matrices(scene.asset, scene.worldMatrices);
+    create_instance_batches(scene.batches, scene.instanceTransforms, scene.asset, scene.drawables,
+                            scene.worldMatrices, maxBatchInstances);
+    return true;
+}
+
+unsigned software_material_features(const SoftwareShading &shading, const GLTFAsset &asset,
+                                    int materialIndex)
+{
+    bool hasBaseColorTexture = false, hasNormalTexture = false;
+    if (materialIndex >= 0) {
+        const Material &material = asset.materials[materialIndex];
+        hasBaseColorTexture = material.pbrMetallicRoughness.hasBaseColorTexture;
+        hasNormalTexture = material.hasNormalTexture;
+    }
+
+    if (shading.visualiseTextureCoords && (hasBaseColorTexture || hasNormalTexture)) {
+        return cg::SOFTWARE_TEXCOORDS_AS_COLOR;
+    }
+    if (shading.useCubemap) return cg::SOFTWARE_CUBEMAP;
+
+    unsigned features = shading.useGammaCorrection ? cg::SOFTWARE_GAMMA_CORRECTION : 0;
+    if (shading.useNormalsAsColor) return features | cg::SOFTWARE_NORMALS_AS_COLOR;
+    if (shading.useDiffuseTexture && hasBaseColorTexture) {
+        features |= cg::SOFTWARE_BASE_COLOR_TEXTURE;
+    }
+    if (shading.useNormalTexture && hasNormalTexture) features |= cg::SOFTWARE_NORMAL_TEXTURE;
+    if (shading.useLighting) {
+        features |= cg::SOFTWARE_LIGHTING;
+        if (shading.useAmbientLighting) features |= cg::SOFTWARE_AMBIENT_LIGHTING;
+        if (shading.useDiffuseLighting) features |= cg::SOFTWARE_DIFFUSE_LIGHTING;
+        if (shading.useSpecularLighting) features |= cg::SOFTWARE_SPECULAR_LIGHTING;
+    }
+    return features;
+}
+
+void create_software_draws(const SoftwareScene &scene, const SoftwareShading &shading,
+                           std::vector<cg::SoftwareDraw> &draws)
+{
+    draws.clear();
+    for (const InstanceBatch &batch : scene.batches) {
+        cg::SoftwareDraw draw;
+        draw.mesh = &scene.software.meshes[batch.mesh][batch.primitive];
+        draw.features = software_material_features(shading, scene.asset, batch.material);
+        draw.baseColorTexture = nullptr;
+        draw.normalTexture = nullptr;
+        if (batch.material >= 0) {
+            const Material &material = scene.asset.materials[batch.material];
+            if (material.pbrMetallicRoughness.hasBaseColorTexture) {
+                int texture = material.pbrMetallicRoughness.baseColorTexture.index;
+                draw.baseColorTexture = &scene.software.textures[texture];
+            }
+            if (material.hasNormalTexture) {
+                draw.normalTexture = &scene.software.textures[material.normalTexture.index];
+            }
+        }
+        for (int j = 0; j < batch.instanceCount; ++j) {
+            draw.model = scene.instanceTransforms[batch.baseInstance + j];
+            draws.push_back(draw);
+        }
+    }
+}
+
+void create_software_frame(const SoftwareShading &shading, const glm::mat4 &view,
+                           const glm::mat4 &projection, const cg::ShadowCascades &cascades,
+                           const cg::SoftwareCubemap &cubemap, cg::SoftwareFrame &frame)
+{
+    frame.view = view;
+    frame.projection = projection;
+    frame.lightPosition = shading.lightPosition;
+    frame.specularPower = shading.specularPower;
+    frame.ambientColor = shading.ambientColor;
+    frame.diffuseColor = shading.diffuseColor;
+    frame.specularColor = shading.specularColor;
+    frame.backgroundColor = shading.backgroundColor;
+    frame.cubemap = &cubemap;
+    frame.cascadeCount = cascades.count;
+    frame.shadowSize = cascades.size;
+    for (int i = 0; i < cg::MAX_SHADOW_CASCADES; ++i) {
+        frame.cascadeSplits[i] = cascades.splits[std::min(i, cascades.count - 1) + 1];
+        frame.shadowMatrices[i] = cascades.matrices[i];
+    }
+    frame.shadowFilter = shading.shadowFilter;
+    frame.shadowTaps = shading.shadowTaps;
+}
+
+void create_path_tracer_scene(const SoftwareScene &scene, cg::PathTracerScene &tracerScene)
+{
+    std::vector<cg::PathTracerObject> objects;
+    for (const InstanceBatch &batch : scene.batches) {
+        cg::PathTracerObject object;
+        object.mesh = &scene.software.meshes[batch.mesh][batch.primitive];
+        object.material = batch.material;
+        for (int j = 0; j < batch.instanceCount; ++j) {
+            object.model = scene.instanceTransforms[batch.baseInstance + j];
+            objects.push_back(object);
+        }
+    }
+
+    std::vector<cg::PathTracerMaterial> materials;
+    for (const Material &material : scene.asset.materials) {
+        const PBRMetallicRoughness &pbr = material.pbrMetallicRoughness;
+        cg::PathTracerMaterial pathTracerMaterial;
+        pathTracerMaterial.baseColor = glm::vec3(pbr.baseColorFactor);
+        pathTracerMaterial.metallic = pbr.metallicFactor;
+        pathTracerMaterial.roughness = pbr.roughnessFactor;
+        if (pbr.hasBaseColorTexture) {
+            pathTracerMaterial.baseColorTexture =
+                &scene.software.textures[pbr.baseColorTexture.index];
+        }
+        if (pbr.hasMetallicRoughnessTexture) {
+            pathTracerMaterial.metallicRoughnessTexture =
+                &scene.software.textures[pbr.metallicRoughnessTexture.index];
+        }
+        materials.push_back(pathTracerMaterial);
+    }
+
+    cg::build_path_tracer_scene(tracerScene, objects, materials);
+}
+
+void create_path_tracer_frame(const SoftwareShading &shading, const glm::mat4 &view,
+                              const glm::mat4 &projection, const glm::vec3 &sunDirection,
+                              const cg::SoftwareCubemap &environment,
+                              cg::PathTracerFrame &frame)
+{
+    frame.view = view;
+    frame.projection = projection;
+    frame.backgroundColor = shading.backgroundColor;
+    frame.environment = environment.size ? &environment : nullptr;
+    frame.environmentColor = shading.ambientColor;
+    frame.sunDirection = sunDirection;
+    frame.sunColor = 3.14159265f * shading.diffuseColor;
+}
+
+}  // namespace gltf
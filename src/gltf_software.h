@@ -0,0 +1,105 @@
+// Scenes of glTF assets for the software renderer and the path tracer: the
+// converted meshes and textures, the draws (or objects and materials) of the
+// mesh node instances, and the camera, lighting and shadow parameters of
+// frames.
+//
+
+#pragma once
+
+#include "gltf_render.h"
+#include "cg_path_tracer.h"
+#include "cg_shadow_cascades.h"
+#include "cg_software_renderer.h"
+
+#include <string>
+#include <vector>
+
+namespace gltf {
+
+// Meshes and textures of an asset for the software renderer
+struct SoftwareAsset {
+    std::vector<std::vector<cg::SoftwareMesh>> meshes;  // Of each primitive of each mesh
+    std::vector<cg::SoftwareTexture> textures;          // Of each texture of the asset
+};
+
+// Convert the meshes and textures of the asset for cg::render_software_frame().
+// The drawables only get their materials and bounds (e.g., for
+// create_instance_batches()), and no geometry arena ranges.
+void create_software_asset(SoftwareAsset &software, DrawableList &drawables,
+                           const GLTFAsset &asset, TangentCache *tangentCache = nullptr);
+
+// Asset converted for the software renderer (and the path tracer), with the
+// instance batches of its mesh nodes
+struct SoftwareScene {
+    GLTFAsset asset;
+    SoftwareAsset software;
+    DrawableList drawables;  // Only materials and bounds (see create_software_asset())
+    std::vector<glm::mat4> worldMatrices;
+    std::vector<glm::mat4> instanceTransforms;
+    InstanceBatchList batches;
+};
+
+// Shading settings of software frames: the flags that select the features
+// of the draws (as they select the mesh program variants of the viewer), and
+// the lighting parameters
+struct SoftwareShading {
+    bool useLighting = true;
+    bool useAmbientLighting = true;
+    bool useDiffuseLighting = true;
+    bool useSpecularLighting = true;
+    bool useNormalsAsColor = false;
+    bool useGammaCorrection = true;
+    bool useCubemap = false;
+    bool visualiseTextureCoords = false;
+    bool useDiffuseTexture = true;
+    bool useNormalTexture = true;
+
+    glm::vec3 lightPosition;  // In view space
+    float specularPower = 2.0f;
+    glm::vec3 ambientColor;
+    glm::vec3 diffuseColor;
+    glm::vec3 specularColor;
+    glm::vec3 backgroundColor;
+    cg::SoftwareShadowFilter shadowFilter = cg::SOFTWARE_SHADOW_PCF;
+    int shadowTaps = 8;
+};
+
+// Load a glTF file (given by its directory, ending with a slash, and name)
+// for the software renderer. With syntheticInstanceCount > 0, the scene is
+// replaced by that many copies of its mesh nodes (see create_instanced_grid()).
+// Returns false if the file could not be loaded.
+bool load_software_scene(SoftwareScene &scene, const std::string &directory,
+                         const std::string &filename, int syntheticInstanceCount = 0,
+                         int maxBatchInstances = INT_MAX, TangentCache *tangentCache = nullptr);
+
+// Return the SoftwareFeature bits of a material (or of no material, if
+// materialIndex is -1). Features that have no effect are left out. The
+// viewer selects its mesh program variants with this too, since they have
+// the same features (and bits), and the shadow filter on top.
+unsigned software_material_features(const SoftwareShading &shading, const GLTFAsset &asset,
+                                    int materialIndex);
+
+// Create one draw per instance of each batch of the scene
+void create_software_draws(const SoftwareScene &scene, const SoftwareShading &shading,
+                           std::vector<cg::SoftwareDraw> &draws);
+
+// Set up a frame with a camera and shadow cascades fitted to it
+void create_software_frame(const SoftwareShading &shading, const glm::mat4 &view,
+                           const glm::mat4 &projection, const cg::ShadowCascades &cascades,
+                           const cg::SoftwareCubemap &cubemap, cg::SoftwareFrame &frame);
+
+// Build the path tracer scene of a scene, with one object per instance of
+// each batch, and the materials of the asset (base color, metallic and
+// roughness). The path tracer scene refers to the textures of the scene.
+void create_path_tracer_scene(const SoftwareScene &scene, cg::PathTracerScene &tracerScene);
+
+// Set up a path-traced frame, lit by an environment cubemap (or by the
+// ambient color, if the cubemap is empty) and by the light as a sun from
+// sunDirection (in world space), whose irradiance makes white diffuse
+// surfaces facing it as bright as the diffuse color does in the rasterizers
+void create_path_tracer_frame(const SoftwareShading &shading, const glm::mat4 &view,
+                              const glm::mat4 &projection, const glm::vec3 &sunDirection,
+                              const cg::SoftwareCubemap &environment,
+                              cg::PathTracerFrame &frame);
+
+}  // namespace gltf
@@ -0,0 +1,277 @@
+// Generation of tangents for primitives without TANGENT attributes, and a
+// cache of generated tangents on disk.
+//
+
+#include "gltf_tangents.h"
+#include "cg_utils.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <numeric>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+namespace gltf {
+
+// Return a unit vector perpendicular to a normal, for vertices whose
+// triangles have no texture coordinate gradient
+static glm::vec3 any_tangent(const glm::vec3 &normal)
+{
+    glm::vec3 axis = std::abs(normal.x) < 0.9f ? glm::vec3(1.0f, 0.0f, 0.0f)
+                                               : glm::vec3(0.0f, 1.0f, 0.0f);
+    glm::vec3 tangent = axis - normal * glm::dot(normal, axis);
+    float length = glm::length(tangent);
+    return length > 0.0f ? tangent / length : glm::vec3(1.0f, 0.0f, 0.0f);
+}
+
+// Project a vector onto the plane of a unit normal, and return it normalized
+// (or zero if it is parallel to the normal)
+static glm::vec3 project_to_plane(const glm::vec3 &v, const glm::vec3 &normal)
+{
+    glm::vec3 projected = v - normal * glm::dot(normal, v);
+    float length = glm::length(projected);
+    return length > 1e-20f ? projected / length : glm::vec3(0.0f);
+}
+
+// See generate_tangents(). The source vertex of each appended vertex is
+// added to splitSources.
+static void generate_tangents(std::vector<Vertex> &vertices, std::vector<uint32_t> &indices,
+                              std::vector<uint32_t> &splitSources)
+{
+    int vertexCount = int(vertices.size());
+    int triangleCount = int(indices.size()) / 3;
+
+    // Weld the vertices that have the same position, normal and texture
+    // coordinate, by sorting them
+    typedef std::array<float, 8> WeldKey;
+    auto weld_key = [&](int i) {
+        const Vertex &v = vertices[i];
+        WeldKey key = {{v.position.x, v.position.y, v.position.z, v.normal.x, v.normal.y,
+                        v.normal.z, v.texcoord0.x, v.texcoord0.y}};
+        return key;
+    };
+    std::vector<int> order(vertexCount);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return weld_key(a) < weld_key(b); });
+    std::vector<int> welded(vertexCount);
+    for (int i = 0; i < vertexCount; ++i) {
+        bool same = i > 0 && weld_key(order[i]) == weld_key(order[i - 1]);
+        welded[order[i]] = same ? welded[order[i - 1]] : order[i];
+    }
+
+    // Sum the tangents of the triangles at their corners, weighted by the
+    // angles of the corners, per welded vertex and handedness (the sum of a
+    // vertex v is at 2 * v for positive and 2 * v + 1 for negative handedness)
+    std::vector<glm::vec3> sums(2 * vertexCount, glm::vec3(0.0f));
+    std::vector<int> handedness(triangleCount);  // 0 or 1 as above, or -1 if degenerate
+    for (int i = 0; i < triangleCount; ++i) {
+        const uint32_t *triangle = &indices[3 * i];
+        const Vertex &v0 = vertices[triangle[0]], &v1 = vertices[triangle[1]],
+                     &v2 = vertices[triangle[2]];
+        glm::vec3 e1 = v1.position - v0.position, e2 = v2.position - v0.position;
+        glm::vec2 d1 = v1.texcoord0 - v0.texcoord0, d2 = v2.texcoord0 - v0.texcoord0;
+        float area = d1.x * d2.y - d2.x * d1.y;  // Signed, in texture space
+        if (area == 0.0f) {
+            handedness[i] = -1;
+            continue;
+        }
+        handedness[i] = area > 0.0f ? 0 : 1;
+        glm::vec3 faceTangent = (e1 * d2.y - e2 * d1.y) * (area > 0.0f ? 1.0f : -1.0f);
+
+        for (int j = 0; j < 3; ++j) {
+            const Vertex &v = vertices[triangle[j]];
+            float length = glm::length(v.normal);
+            glm::vec3 normal = length > 0.0f ? v.normal / length : v.normal;
+            glm::vec3 tangent = project_to_plane(faceTangent, normal);
+            glm::vec3 a = project_to_plane(vertices[triangle[(j + 1) % 3]].position - v.position,
+                                           normal);
+            glm::vec3 b = project_to_plane(vertices[triangle[(j + 2) % 3]].position - v.position,
+                                           normal);
+            float angle = std::acos(glm::clamp(glm::dot(a, b), -1.0f, 1.0f));
+            sums[2 * welded[triangle[j]] + handedness[i]] += angle * tangent;
+        }
+    }
+
+    // Give each vertex the handedness of its first triangle, and point the
+    // corners of triangles with the other handedness to a copy of it.
+    // Degenerate triangles use the vertices as they are.
+    std::vector<int> slots(2 * vertexCount, -1);  // Vertex of each sum
+    for (int i = 0; i < triangleCount; ++i) {
+        if (handedness[i] < 0) continue;
+        for (int j = 0; j < 3; ++j) {
+            uint32_t &index = indices[3 * i + j];
+            int &slot = slots[2 * index + handedness[i]];
+            if (slot < 0) {
+                if (slots[2 * index + 1 - handedness[i]] < 0) {
+                    slot = index;
+                } else {
+                    Vertex copy = vertices[index];
+                    slot = int(vertices.size());
+                    vertices.push_back(copy);
+                    splitSources.push_back(index);
+                }
+            }
+            index = slot;
+        }
+    }
+
+    for (int v = 0; v < vertexCount; ++v) {
+        glm::vec3 normal = vertices[v].normal;
+        float length = glm::length(normal);
+        if (length > 0.0f) normal /= length;
+        bool assigned = false;
+        for (int h = 0; h < 2; ++h) {
+            int slot = slots[2 * v + h];
+            if (slot < 0) continue;
+            glm::vec3 sum = sums[2 * welded[v] + h];
+            float sumLength = glm::length(sum);
+            glm::vec3 tangent = sumLength > 0.0f ? sum / sumLength : any_tangent(normal);
+            vertices[slot].tangent = glm::vec4(tangent, h == 0 ? 1.0f : -1.0f);
+            assigned = assigned || slot == v;
+        }
+        if (!assigned) vertices[v].tangent = glm::vec4(any_tangent(normal), 1.0f);
+    }
+}
+
+void generate_tangents(std::vector<Vertex> &vertices, std::vector<uint32_t> &indices)
+{
+    std::vector<uint32_t> splitSources;
+    generate_tangents(vertices, indices, splitSources);
+}
+
+// 64-bit FNV-1a hash
+static uint64_t hash_bytes(const void *data, size_t size, uint64_t hash)
+{
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= ((const unsigned char *)data)[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Return the name of the cache file of a primitive. The tangents only depend
+// on the positions, normals and texture coordinates of the vertices, and on
+// the indices.
+static std::string tangent_cache_filename(const TangentCache &cache,
+                                          const std::vector<Vertex> &vertices,
+                                          const std::vector<uint32_t> &indices)
+{
+    uint64_t hash = hash_bytes("tangents 1", 10, 14695981039346656037ull);
+    for (const Vertex &v : vertices) {
+        hash = hash_bytes(&v.position, sizeof(v.position), hash);
+        hash = hash_bytes(&v.normal, sizeof(v.normal), hash);
+        hash = hash_bytes(&v.texcoord0, sizeof(v.texcoord0), hash);
+    }
+    hash = hash_bytes(indices.data(), indices.size() * sizeof(uint32_t), hash);
+
+    char key[17];
+    std::snprintf(key, sizeof(key), "%016llx", (unsigned long long)hash);
+    return cache.directory + key + ".tangents";
+}
+
+// The file has a header of the vertex count, the index count, the number of
+// split vertices and the number of changed indices, followed by the tangents
+// (of the vertices and the split vertices), the source vertex of each split
+// vertex, and pairs of changed indices and their new values
+static bool load_cached_tangents(const std::string &filename, std::vector<Vertex> &vertices,
+                                 std::vector<uint32_t> &indices)
+{
+    std::ifstream file(filename, std::ios::binary);
+    uint32_t header[4];
+    if (!file.read((char *)header, sizeof(header))) return false;
+    if (header[0] != vertices.size() || header[1] != indices.size()) return false;
+
+    std::vector<glm::vec4> tangents(header[0] + header[2]);
+    std::vector<uint32_t> splitSources(header[2]);
+    std::vector<uint32_t> changes(2 * header[3]);
+    file.read((char *)tangents.data(), tangents.size() * sizeof(glm::vec4));
+    file.read((char *)splitSources.data(), splitSources.size() * sizeof(uint32_t));
+    file.read((char *)changes.data(), changes.size() * sizeof(uint32_t));
+    if (!file) return false;
+    for (uint32_t source : splitSources) {
+        if (source >= header[0]) return false;
+    }
+    for (unsigned i = 0; i < changes.size(); i += 2) {
+        if (changes[i] >= header[1] || changes[i + 1] >= tangents.size()) return false;
+    }
+
+    for (uint32_t source : splitSources) {
+        Vertex copy = vertices[source];
+        vertices.push_back(copy);
+    }
+    for (unsigned i = 0; i < vertices.size(); ++i) vertices[i].tangent = tangents[i];
+    for (unsigned i = 0; i < changes.size(); i += 2) indices[changes[i]] = changes[i + 1];
+    return true;
+}
+
+static void save_cached_tangents(const std::string &filename, const std::vector<Vertex> &vertices,
+                                 const std::vector<uint32_t> &oldIndices,
+                                 const std::vector<uint32_t> &indices,
+                                 const std::vector<uint32_t> &splitSources)
+{
+    std::vector<glm::vec4> tangents(vertices.size());
+    for (unsigned i = 0; i < vertices.size(); ++i) tangents[i] = vertices[i].tangent;
+    std::vector<uint32_t> changes;
+    for (unsigned i = 0; i < indices.size(); ++i) {
+        if (indices[i] == oldIndices[i]) continue;
+        changes.push_back(i);
+        changes.push_back(indices[i]);
+    }
+    uint32_t header[4] = {uint32_t(vertices.size() - splitSources.size()),
+                          uint32_t(indices.size()), uint32_t(splitSources.size()),
+                          uint32_t(changes.size() / 2)};
+
+    // Write to a temporary file first (see cg::temporary_filename())
+    std::string tempFilename = cg::temporary_filename(filename);
+    {
+        std::ofstream file(tempFilename, std::ios::binary);
+        file.write((const char *)header, sizeof(header));
+        file.write((const char *)tangents.data(), tangents.size() * sizeof(glm::vec4));
+        file.write((const char *)splitSources.data(), splitSources.size() * sizeof(uint32_t));
+        file.write((const char *)changes.data(), changes.size() * sizeof(uint32_t));
+    }
+    if (std::rename(tempFilename.c_str(), filename.c_str()) != 0) std::remove(tempFilename.c_str());
+}
+
+void create_tangent_cache(TangentCache &cache, const std::string &directory)
+{
+    cache.directory = directory;
+    cache.loadedCount = 0;
+    cache.generatedCount = 0;
+    if (directory.empty()) return;
+#ifdef _WIN32
+    _mkdir(directory.c_str());
+#else
+    mkdir(directory.c_str(), 0755);
+#endif
+}
+
+void generate_cached_tangents(TangentCache *cache, std::vector<Vertex> &vertices,
+                              std::vector<uint32_t> &indices)
+{
+    if (!cache || cache->directory.empty()) {
+        generate_tangents(vertices, indices);
+        if (cache) cache->generatedCount += 1;
+        return;
+    }
+
+    std::string filename = tangent_cache_filename(*cache, vertices, indices);
+    if (load_cached_tangents(filename, vertices, indices)) {
+        cache->loadedCount += 1;
+        return;
+    }
+    std::vector<uint32_t> oldIndices = indices;
+    std::vector<uint32_t> splitSources;
+    generate_tangents(vertices, indices, splitSources);
+    save_cached_tangents(filename, vertices, oldIndices, indices, splitSources);
+    cache->generatedCount += 1;
+}
+
+}  // namespace gltf
@@ -0,0 +1,41 @@
+// Generation of tangents for primitives without TANGENT attributes, and a
+// cache of generated tangents on disk.
+//
+
+#pragma once
+
+#include "gltf_render.h"
+
+#include <atomic>
+#include <string>
+
+namespace gltf {
+
+// Generate the tangent of each vertex (with the handedness of the bitangent
+// in w, as in glTF: bitangent = cross(normal, tangent.xyz) * tangent.w) the
+// way MikkTSpace does: the tangents of the triangles are projected onto the
+// plane of the vertex normal, and averaged with the angles of the corners as
+// weights over the vertices that have the same position, normal and texture
+// coordinate. Vertices whose triangles have texture coordinates of both
+// handedness (e.g., on the mirror line of mirrored texture coordinates) are
+// split, appending vertices and updating the indices.
+void generate_tangents(std::vector<Vertex> &vertices, std::vector<uint32_t> &indices);
+
+// Generated tangents are stored in one file per primitive, named by a hash
+// of its vertices and indices
+struct TangentCache {
+    std::string directory;  // Empty if the cache is disabled
+    std::atomic<int> loadedCount{0};
+    std::atomic<int> generatedCount{0};
+};
+
+// Set up a cache in a directory (which is created if needed, and can be the
+// directory of the program cache)
+void create_tangent_cache(TangentCache &cache, const std::string &directory);
+
+// Like generate_tangents(), but load the tangents from the cache if they have
+// been generated before (cache can be null)
+void generate_cached_tangents(TangentCache *cache, std::vector<Vertex> &vertices,
+                              std::vector<uint32_t> &indices);
+
+}  // namespace gltf
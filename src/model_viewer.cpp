@@ -3,11 +3,24 @@
 // Modify this and other source files according to the tasks in the instructions.
 //
 
+#include "model_viewer.h"
+#include "model_viewer_headless.h"
 #include "gltf_io.h"
 #include "gltf_scene.h"
 #include "gltf_render.h"
+#include "gltf_tangents.h"
 #include "cg_utils.h"
 #include "cg_trackball.h"
+#include "cg_multi_draw.h"
+#include "cg_occlusion_culling.h"
+#include "cg_profiler.h"
+#include "cg_render_queue.h"
+#include "cg_shader_variants.h"
+#include "cg_shadow_cache.h"
+#include "cg_shadow_cascades.h"
+#include "cg_texture_streamer.h"
+#include "cg_uniform_blocks.h"
+#include "cg_worker_pool.h"
 
 #include <GL/gl3w.h>
 #include <GLFW/glfw3.h>
@@ -19,75 +32,15 @@
 #include <glm/glm.hpp>
 #include <glm/gtx/quaternion.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/matrix_access.hpp>
 
+#include <algorithm>
+#include <cctype>
+#include <cfloat>
+#include <cmath>
 #include <cstdlib>
 #include <iostream>
-
-// Struct for representing a shadow casting point light
-struct ShadowCastingLight {
-    glm::vec3 position;      // Light source position
-    glm::mat4 shadowMatrix;  // Camera matrix for shadowmap
-    GLuint shadowmap;        // Depth texture
-    GLuint shadowFBO;        // Depth framebuffer
-    float shadowBias;        // Bias for depth comparison
-};
-
-// Struct for our application context
-struct Context {
-    int width = 512;
-    int height = 512;
-    GLFWwindow *window;
-    gltf::GLTFAsset asset;
-    gltf::DrawableList drawables;
-    cg::Trackball trackball;
-    GLuint program;
-    GLuint emptyVAO;
-    float elapsedTime;
-    std::string gltfFilename = "armadillo.gltf";
-    glm::vec4 backgroundColor = glm::vec4(0);
-    
-    // Shadow Mapping
-    ShadowCastingLight light;
-    GLuint shadowProgram;
-    bool showShadowMap = false;
-
-    // Lighting Parameters
-    glm::vec3 ambientColor = glm::vec3(0.01);
-    glm::vec3 lightPosition;
-    glm::vec3 diffuseColor = glm::vec3(0.01);
-    glm::vec3 specularColor = glm::vec3(0.04);
-    float specularPower = 2.0f;
-
-    // Textures
-    gltf::TextureList textures;
-    int baseColorTextureId = 9;
-    int normalMapTextureId = 10;
-
-    // Cube Map Active Texture ID
-    int cubemapId;
-
-    // Camera Parameters
-    glm::mat4 projectionMatrix;
-    float fov = 45.0f;
-    float zoomFactor = 0.0f;
-    float orthographicScale = 3.0f;
-
-    // Flags
-    bool useLighting = true;
-    bool useDiffuseLighting = true;
-    bool useAmbientLighting = true;
-    bool useSpecularLighting = true;
-    bool useNormalsAsColor = false;
-    bool useOrthographicProjection = false;
-    bool useGammaCorrection = true;
-    bool useCubemap = false;
-
-    bool visualiseTextureCoords = false;
-    bool useDiffuseTexture = true;
-    bool useNormalTexture = true;
-
-    // Add more variables here...
-};
+#include <mutex>
 
 // Returns the absolute path to the src/shader directory
 std::string shader_dir(void)
@@ -122,6 +75,17 @@ std::string gltf_dir(void)
     return rootDir + "/assets/gltf/";
 }
 
+// Returns the absolute path to the cache directory for program binaries
+std::string cache_dir(void)
+{
+    std::string rootDir = cg::get_env_var("MODEL_VIEWER_ROOT");
+    if (rootDir.empty()) {
+        std::cout << "Error: MODEL_VIEWER_ROOT is not set." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    return rootDir + "/cache/";
+}
+
 void load_cubemaps(Context &ctx, std::string cubemap_name)
 {
     // Load basic cubemap
@@ -140,229 +104,1374 @@ void load_cubemaps(Context &ctx, std::string cubemap_name)
     }
 }
 
-void initialize_shadow_map(Context &ctx)
+// (Re)create the shadowmap cascades of the light with a new size
+void resize_shadow_cascades(Context &ctx, int size)
+{
+    cg::create_shadow_cascades(ctx.light.cascades, size);
+    if (ctx.shadowFilter == cg::SHADOW_FILTER_VARIANCE) {
+        cg::create_shadow_moments(ctx.light.cascades);
+    }
+    for (int i = 0; i < cg::MAX_SHADOW_CASCADES; ++i) {
+        ctx.shadowCaches[i].size = size;
+        cg::invalidate_shadow_cache(ctx.shadowCaches[i]);
+    }
+}
+
+// Select a shadow filter. The variance filter needs depth moments, so the
+// cascades are re-rendered when switching filters.
+void set_shadow_filter(Context &ctx, int filter)
 {
-    ctx.shadowProgram =
-        cg::load_shader_program(shader_dir() + "shadow.vert", shader_dir() + "shadow.frag");
+    ctx.shadowFilter = filter;
+    if (filter == cg::SHADOW_FILTER_VARIANCE) cg::create_shadow_moments(ctx.light.cascades);
+    for (int i = 0; i < cg::MAX_SHADOW_CASCADES; ++i) {
+        cg::invalidate_shadow_cache(ctx.shadowCaches[i]);
+    }
+}
 
-    ctx.light.shadowmap = cg::create_depth_texture(4096, 4096);
-    ctx.light.shadowFBO = cg::create_depth_framebuffer(ctx.light.shadowmap);
+void initialize_shadow_map(Context &ctx)
+{
+    // Issue all builds before finishing any, so that they compile in parallel
+    cg::ProgramCache *cache = &ctx.programCache;
+    cg::ShaderProgramBuild builds[] = {
+        cg::begin_shader_program(shader_dir() + "shadow.vert", shader_dir() + "shadow.frag", "",
+                                 cache),
+        cg::begin_shader_program(shader_dir() + "shadowmap_view.vert",
+                                 shader_dir() + "shadowmap_view.frag", "", cache),
+        cg::begin_shader_program(shader_dir() + "shadowmap_view.vert",
+                                 shader_dir() + "shadow_blur.frag", "", cache)};
+    ctx.shadowProgram = cg::finish_shader_program(builds[0]);
+    ctx.shadowViewProgram = cg::finish_shader_program(builds[1]);
+    ctx.shadowBlurProgram = cg::finish_shader_program(builds[2]);
+
+    resize_shadow_cascades(ctx, 1024);
     ctx.light.shadowBias = 0;
-    ctx.light.shadowMatrix = glm::mat4(1.0f);
-    ctx.light.position = glm::vec3(0, 5, 0);
 }
 
-void calculate_projection(Context &ctx)
+// Return the near and far plane distances of the camera projection. They
+// scale with the camera distance, so that views fitted to large or small
+// scenes keep the same depth precision.
+glm::vec2 camera_depth_range(const Context &ctx)
 {
+    float scale = ctx.cameraDistance / 5.0f;
+    return scale * (ctx.useOrthographicProjection ? glm::vec2(0.1f, 100.0f)
+                                                  : glm::vec2(1.0f, 100.0f));
+}
+
+glm::mat4 projection_matrix(const Context &ctx)
+{
+    glm::vec2 depthRange = camera_depth_range(ctx);
+
     // If orthographic projection
     if (ctx.useOrthographicProjection)
     {
         // Calculate the aspect ratio
         float aspect = static_cast<float>(ctx.width) / static_cast<float>(ctx.height);
         // Create orthographic projection matrix using the context scale and aspect ratio
-        ctx.projectionMatrix = glm::ortho(-aspect * ctx.orthographicScale, aspect * ctx.orthographicScale
-                                          , -ctx.orthographicScale, ctx.orthographicScale, 0.1f, 100.0f);
+        return glm::ortho(-aspect * ctx.orthographicScale, aspect * ctx.orthographicScale
+                                          , -ctx.orthographicScale, ctx.orthographicScale, depthRange.x, depthRange.y);
     }
     // If prespective projection
     else
     {
         // Create prespective projection matrix using the context FOV
-        ctx.projectionMatrix = glm::perspective(glm::radians(ctx.fov), (float)ctx.width/ctx.height, 1.0f, 100.0f);
+        return glm::perspective(glm::radians(ctx.fov), (float)ctx.width/ctx.height, depthRange.x, depthRange.y);
     }    
 }
 
-// Update the shadowmap and shadow matrix for a light source
-void update_shadowmap(Context &ctx, ShadowCastingLight &light, GLuint shadowFBO)
+void calculate_projection(Context &ctx)
 {
-    // // Set up rendering to shadowmap framebuffer
-    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, shadowFBO);
-    if (shadowFBO) glViewport(0, 0, 4096, 4096);  // Set viewport to shadowmap size
-    glClear(GL_DEPTH_BUFFER_BIT);               // Clear depth values to 1.0
+    ctx.projectionMatrix = projection_matrix(ctx);
+}
 
-    // Set up pipeline
-    glUseProgram(ctx.shadowProgram);
-    // glUseProgram(ctx.program);
-    glEnable(GL_DEPTH_TEST);  // Enable Z-buffering
+glm::mat4 camera_view_matrix(const Context &ctx)
+{
+    glm::vec3 eye = glm::vec3(0, 0, ctx.cameraDistance);
+    return glm::lookAt(eye, glm::vec3(0, 0, 0), glm::vec3(0, 1, 0)) *
+           glm::mat4(ctx.trackball.orient) * glm::translate(glm::mat4(1.0f), -ctx.cameraTarget);
+}
 
-    // Define view and projection matrices for the shadowmap camera. The
-    // view matrix should be a lookAt-matrix computed from the light source
-    // position, and the projection matrix should be a frustum that covers the
-    // parts of the scene that shall recieve shadows.
-    glm::mat4 view = glm::lookAt(glm::vec3(2, 2, 2), glm::vec3(0,0,0), glm::vec3(0,1,0)) * glm::mat4(ctx.trackball.orient);
-    glm::mat4 proj = glm::perspective(glm::radians(45.0f), (float)4096/4096, 1.0f, 100.0f);
+// Return the world-space direction of the light, which rotates with the
+// camera (as the light view did before)
+glm::vec3 light_direction(const Context &ctx)
+{
+    return glm::inverse(glm::mat3_cast(ctx.trackball.orient)) * -glm::normalize(ctx.light.position);
+}
 
-    glUniformMatrix4fv(glGetUniformLocation(ctx.shadowProgram, "u_view"), 1, GL_FALSE, &view[0][0]);
-    glUniformMatrix4fv(glGetUniformLocation(ctx.shadowProgram, "u_proj"), 1, GL_FALSE, &proj[0][0]);
+// Return the world-space bounds of all instance batches (zero if the scene
+// is empty)
+void scene_bounds(const gltf::InstanceBatchList &batches, glm::vec3 &sceneMin,
+                  glm::vec3 &sceneMax)
+{
+    sceneMin = sceneMax = glm::vec3(0.0f);
+    for (unsigned i = 0; i < batches.size(); ++i) {
+        const gltf::InstanceBatch &batch = batches[i];
+        sceneMin = i ? glm::min(sceneMin, batch.boundsMin) : batch.boundsMin;
+        sceneMax = i ? glm::max(sceneMax, batch.boundsMax) : batch.boundsMax;
+    }
+}
+
+// Set the camera of a frame from the current settings, and copy the shadow
+// cascades of the light for fitting them to it
+void set_frame_camera(const Context &ctx, FrameSnapshot &frame)
+{
+    frame.view = camera_view_matrix(ctx);
+    frame.projection = projection_matrix(ctx);
+    frame.cascades = ctx.light.cascades;
+}
+
+// Fit the shadow cascades of a frame to its view frustum and the world-space
+// bounds of all instance batches
+void update_shadow_cascades(const Context &ctx, FrameSnapshot &frame)
+{
+    cg::ProfileScope profileScope("update_shadow_cascades");
+    glm::vec3 sceneMin, sceneMax;
+    scene_bounds(frame.instanceBatches, sceneMin, sceneMax);
+
+    glm::vec2 depthRange = camera_depth_range(ctx);
+    cg::fit_shadow_cascades(frame.cascades, light_direction(ctx), frame.view, frame.projection,
+                            depthRange.x, depthRange.y, sceneMin, sceneMax);
+}
+
+// Track the currently bound state while submitting the render queue, so that
+// redundant binds can be skipped
+struct SubmitState {
+    GLuint program = 0;
+    GLuint vao = 0;
+    int textureSet = -1;
+    GLuint baseColorTexture = 0;
+    GLuint normalTexture = 0;
+    bool primitiveRestart = false;
+};
 
-    // Store updated shadow matrix for use in draw_scene()
-    light.shadowMatrix = proj * view;
+// Bind the texture arrays of a material (or of no material, if materialIndex
+// is -1). Materials in the same texture set need no binds.
+void bind_material(Context &ctx, int materialIndex, SubmitState &state)
+{
+    const MaterialTextures &textures = ctx.materialTextures[materialIndex + 1];
+    GLuint baseColorTexture =
+        (textures.baseColorArray >= 0) ? ctx.textures.arrays[textures.baseColorArray].texture : 0;
+    GLuint normalTexture =
+        (textures.normalArray >= 0) ? ctx.textures.arrays[textures.normalArray].texture : 0;
+    if (baseColorTexture && baseColorTexture != state.baseColorTexture) {
+        glActiveTexture(GL_TEXTURE0 + ctx.baseColorTextureId);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, baseColorTexture);
+        state.baseColorTexture = baseColorTexture;
+        ctx.stats.binds += 1;
+    }
+    if (normalTexture && normalTexture != state.normalTexture) {
+        glActiveTexture(GL_TEXTURE0 + ctx.normalMapTextureId);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, normalTexture);
+        state.normalTexture = normalTexture;
+        ctx.stats.binds += 1;
+    }
+    state.textureSet = int(textures.textureSet);
+}
 
-    // Draw scene
-    for (unsigned i = 0; i < ctx.asset.nodes.size(); ++i) {
-        const gltf::Node &node = ctx.asset.nodes[i];
-        const gltf::Drawable &drawable = ctx.drawables[node.mesh];
+// Return true if two adjacent render queue items can be submitted with the
+// same multi-draw call
+bool can_merge_draws(const Context &ctx, const FrameSnapshot &frame, unsigned pass,
+                     const cg::RenderItem &a, const cg::RenderItem &b)
+{
+    if (cg::sort_key_program(a.key) != cg::sort_key_program(b.key)) return false;
+    if (pass == OPAQUE_PASS && cg::sort_key_material(a.key) != cg::sort_key_material(b.key)) {
+        return false;
+    }
 
-        // Define the model matrix for the drawable
-        glm::mat4 model = glm::scale(glm::toMat4(node.rotation) * glm::translate(glm::mat4(1.0), node.translation), node.scale);
-        glUniformMatrix4fv(glGetUniformLocation(ctx.shadowProgram, "u_model"), 1, GL_FALSE, &model[0][0]);
+    const gltf::InstanceBatch &batchA = frame.instanceBatches[a.index];
+    const gltf::InstanceBatch &batchB = frame.instanceBatches[b.index];
+    const gltf::DrawablePrimitive &drawableA =
+        ctx.drawables[batchA.mesh].primitives[batchA.primitive];
+    const gltf::DrawablePrimitive &drawableB =
+        ctx.drawables[batchB.mesh].primitives[batchB.primitive];
+    if (drawableA.mode != drawableB.mode || drawableA.indexType != drawableB.indexType) {
+        return false;
+    }
 
-        // Draw object
-        glBindVertexArray(drawable.vao);
-        glDrawElements(GL_TRIANGLES, drawable.indexCount, drawable.indexType,
-                       (GLvoid *)(intptr_t)drawable.indexByteOffset);
-        glBindVertexArray(0);
+    // Note: glMultiDrawElementsBaseVertex() draws a single instance per draw,
+    // and without gl_DrawIDARB all draws of the call use the same per-draw
+    // data, so this only merges the primitives of non-instanced mesh nodes
+    // whose materials have the same layers
+    if (!frame.useMultiDrawIndirect) {
+        return batchA.instanceCount == 1 && batchB.instanceCount == 1 &&
+               batchA.baseInstance == batchB.baseInstance &&
+               (pass != OPAQUE_PASS || ctx.materialTextures[batchA.material + 1].layers ==
+                                           ctx.materialTextures[batchB.material + 1].layers);
     }
+    return true;
+}
+
+// Submit the sorted draws of one render pass. The program of the pass is
+// expected to be bound already, with its per-pass uniform blocks bound.
+// Each run of adjacent draws with the same state (see plan_draw_runs()) is
+// submitted with a single multi-draw.
+void submit_render_queue(Context &ctx, unsigned pass, GLuint program)
+{
+    double startTime = cg::get_time();
+    const FrameSnapshot &frame = ctx.frame;
+    bool useIndirect = frame.useMultiDrawIndirect;
+
+    SubmitState state;
+    state.program = program;
+
+    // Find the runs of the pass
+    const cg::RenderQueue &renderQueue = frame.renderQueue;
+    const std::vector<cg::DrawElementsIndirectCommand> &commands = frame.drawCommands;
+    auto firstRun = std::lower_bound(frame.drawRuns.begin(), frame.drawRuns.end(), pass,
+                                     [&](const DrawRun &run, unsigned pass) {
+                                         return cg::sort_key_pass(renderQueue[run.first].key) <
+                                                pass;
+                                     });
+    for (auto run = firstRun; run != frame.drawRuns.end() &&
+                              cg::sort_key_pass(renderQueue[run->first].key) == pass;
+         ++run) {
+        const cg::RenderItem &item = renderQueue[run->first];
+        const gltf::InstanceBatch &batch = frame.instanceBatches[item.index];
+        const gltf::DrawablePrimitive &drawable =
+            ctx.drawables[batch.mesh].primitives[batch.primitive];
+
+        GLuint itemProgram = frame.programs[cg::sort_key_program(item.key)];
+        if (itemProgram != state.program) {
+            glUseProgram(itemProgram);
+            state = SubmitState();
+            state.program = itemProgram;
+            ctx.stats.programSwitches += 1;
+        }
+        if (ctx.geometry.vao != state.vao) {
+            glBindVertexArray(ctx.geometry.vao);
+            state.vao = ctx.geometry.vao;
+            ctx.stats.binds += 1;
+        }
+        bool primitiveRestart = drawable.mode == GL_TRIANGLE_STRIP;
+        if (primitiveRestart != state.primitiveRestart) {
+            if (primitiveRestart) {
+                glEnable(GL_PRIMITIVE_RESTART);
+                glPrimitiveRestartIndex(gltf::PRIMITIVE_RESTART_INDEX);
+            } else {
+                glDisable(GL_PRIMITIVE_RESTART);
+            }
+            state.primitiveRestart = primitiveRestart;
+        }
+        if (pass == OPAQUE_PASS &&
+            int(ctx.materialTextures[batch.material + 1].textureSet) != state.textureSet) {
+            bind_material(ctx, batch.material, state);
+        }
+
+        // Draw objects
+        int firstDraw = run->first;
+        int drawCount = run->last - run->first;
+        cg::bind_uniform_block(ctx.uniforms, cg::OBJECT_BLOCK,
+                               ctx.blockOffsets.objects[run - frame.drawRuns.begin()],
+                               sizeof(cg::ObjectBlock));
+        if (drawCount == 1) {
+            const gltf::DrawableChunk &chunk = drawable.chunks[item.part];
+            glDrawElementsInstancedBaseVertex(drawable.mode, chunk.indexCount, drawable.indexType,
+                                              (GLvoid *)(intptr_t)chunk.indexByteOffset,
+                                              commands[firstDraw].instanceCount, chunk.baseVertex);
+        } else {
+            cg::multi_draw_elements(ctx.multiDraw, commands, drawable.mode, drawable.indexType,
+                                    firstDraw, drawCount, useIndirect);
+        }
+        ctx.stats.drawCalls += 1;
+        ctx.stats.commands += drawCount;
+        for (int i = firstDraw; i < firstDraw + drawCount; ++i) {
+            // The draw commands have the instance counts of the pass. The
+            // instances are counted once per batch, not per chunk.
+            const gltf::InstanceBatch &drawBatch = frame.instanceBatches[renderQueue[i].index];
+            const gltf::DrawablePrimitive &drawPrimitive =
+                ctx.drawables[drawBatch.mesh].primitives[drawBatch.primitive];
+            const gltf::DrawableChunk &chunk = drawPrimitive.chunks[renderQueue[i].part];
+            if (renderQueue[i].part == 0) ctx.stats.instances += commands[i].instanceCount;
+            ctx.stats.triangles += int64_t(chunk.triangleCount) * commands[i].instanceCount;
+        }
+    }
+    if (state.primitiveRestart) glDisable(GL_PRIMITIVE_RESTART);
+    glBindVertexArray(0);
+    ctx.cpuSubmitTime += float(cg::get_time() - startTime);
+}
+
+// Compare the light, geometry and node transforms against those that the
+// cached shadowmap cascades were rendered with, and invalidate the caches on
+// changes
+void update_shadow_cache(Context &ctx, int cascade)
+{
+    cg::ShadowCache &cache = ctx.shadowCaches[cascade];
+    const glm::mat4 &shadowMatrix = ctx.frame.cascades.matrices[cascade];
+    if (cache.shadowMatrix != shadowMatrix || cache.geometryVersion != ctx.geometryVersion ||
+        cache.transforms.size() != ctx.frame.worldMatrices.size()) {
+        cache.shadowMatrix = shadowMatrix;
+        cache.geometryVersion = ctx.geometryVersion;
+        cache.transforms = ctx.frame.worldMatrices;
+        cg::invalidate_shadow_cache(cache);
+        return;
+    }
+
+    // Only redraw the regions covered by nodes that moved, before and after
+    // the move. The moments of variance shadow maps are blurred in place over
+    // the whole cascade, so that the blur would be applied again to the
+    // regions that are not redrawn: redraw the whole cascade instead.
+    bool useMoments = ctx.shadowFilter == cg::SHADOW_FILTER_VARIANCE;
+    for (unsigned i = 0; i < ctx.frame.worldMatrices.size(); ++i) {
+        if (cache.transforms[i] == ctx.frame.worldMatrices[i]) continue;
+        if (useMoments) {
+            cache.transforms = ctx.frame.worldMatrices;
+            cg::invalidate_shadow_cache(cache);
+            return;
+        }
+        int mesh = ctx.asset.nodes[i].mesh;
+        if (mesh >= 0) {
+            const gltf::Drawable &drawable = ctx.drawables[mesh];
+            cg::invalidate_shadow_cache_region(cache, cache.transforms[i], drawable.boundsMin,
+                                               drawable.boundsMax);
+            cg::invalidate_shadow_cache_region(cache, ctx.frame.worldMatrices[i],
+                                               drawable.boundsMin, drawable.boundsMax);
+        }
+        cache.transforms[i] = ctx.frame.worldMatrices[i];
+    }
+}
+
+// Blur the depth moments of a cascade with a separable Gaussian, going
+// through the single-layer blur texture and back
+void blur_shadow_moments(Context &ctx, ShadowCastingLight &light, int cascade)
+{
+    cg::ProfileScope profileScope("blur_shadow_moments");
+    cg::GpuProfileScope gpuProfileScope(ctx.gpuProfiler, "blur_shadow_moments");
+    cg::ShadowCascades &cascades = light.cascades;
+    float texel = 1.0f / cascades.size;
+
+    glUseProgram(ctx.shadowBlurProgram);
+    glBindVertexArray(ctx.emptyVAO);
+    glActiveTexture(GL_TEXTURE15);
+    GLint layerLocation = glGetUniformLocation(ctx.shadowBlurProgram, "u_layer");
+    GLint directionLocation = glGetUniformLocation(ctx.shadowBlurProgram, "u_direction");
+
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, cascades.blurFramebuffer);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, cascades.moments);
+    glUniform1i(layerLocation, cascade);
+    glUniform2f(directionLocation, texel, 0.0f);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, cascades.momentFramebuffers[cascade]);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, cascades.blurTexture);
+    glUniform1i(layerLocation, 0);
+    glUniform2f(directionLocation, 0.0f, texel);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    glBindVertexArray(0);
+}
+
+// Update one shadowmap cascade of a light source. Only the invalidated
+// region of the shadow cache of the cascade is cleared and redrawn.
+void update_shadowmap(Context &ctx, ShadowCastingLight &light, int cascade)
+{
+    cg::ProfileScope profileScope("update_shadowmap");
+    cg::GpuProfileScope gpuProfileScope(ctx.gpuProfiler, "update_shadowmap");
+    cg::ShadowCache &cache = ctx.shadowCaches[cascade];
+    bool useMoments = ctx.shadowFilter == cg::SHADOW_FILTER_VARIANCE;
+
+    // // Set up rendering to shadowmap framebuffer (and the depth moments for
+    // variance shadow maps)
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, useMoments ? light.cascades.momentFramebuffers[cascade]
+                                                      : light.cascades.framebuffers[cascade]);
+    glViewport(0, 0, light.cascades.size, light.cascades.size);  // Set viewport to shadowmap size
+    cg::begin_shadow_cache_update(cache);
+    glClearColor(1.0f, 1.0f, 0.0f, 1.0f);  // Moments of depth 1.0
+    glClear(useMoments ? GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT
+                       : GL_DEPTH_BUFFER_BIT);  // Clear depth values to 1.0
+
+    // Set up pipeline
+    glUseProgram(ctx.shadowProgram);
+    ctx.stats.programSwitches += 1;
+    glEnable(GL_DEPTH_TEST);  // Enable Z-buffering
+
+    // The view and projection matrices of the cascade are in its frame block
+    // (see write_uniform_blocks())
+    cg::bind_uniform_block(ctx.uniforms, cg::FRAME_BLOCK, ctx.blockOffsets.cascadeFrames[cascade],
+                           sizeof(cg::FrameBlock));
+
+    // Instance transforms, and the first instance of each draw
+    glActiveTexture(GL_TEXTURE0 + ctx.instanceTextureId);
+    glBindTexture(GL_TEXTURE_BUFFER, ctx.instances.texture);
+    glActiveTexture(GL_TEXTURE0 + ctx.drawTextureId);
+    glBindTexture(GL_TEXTURE_BUFFER, ctx.multiDraw.drawTexture);
+
+    // Draw the casters that overlap the cascade
+    submit_render_queue(ctx, SHADOW_PASS + cascade, ctx.shadowProgram);
 
     // Clean up
+    cg::end_shadow_cache_update(cache);
     cg::reset_gl_render_state();
+    if (useMoments) blur_shadow_moments(ctx, light, cascade);
     glUseProgram(0);
     glViewport(0, 0, ctx.width, ctx.height);
-    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, ctx.framebuffer);
+}
+
+// Show the cached shadowmap over the whole window (for debugging)
+void draw_shadowmap_view(Context &ctx)
+{
+    glUseProgram(ctx.shadowViewProgram);
+    glUniform1i(glGetUniformLocation(ctx.shadowViewProgram, "u_cascadeCount"),
+                ctx.frame.cascades.count);
+    glActiveTexture(GL_TEXTURE11);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, ctx.light.cascades.shadowmap);
+    glBindVertexArray(ctx.emptyVAO);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glUseProgram(0);
 }
 
+// Set up uniform block bindings and sampler units of the shader programs.
+// This only has to be done once after the programs have been linked.
+void initialize_program_bindings(Context &ctx)
+{
+    cg::set_uniform_block_bindings(ctx.shadowProgram);
+    glUseProgram(ctx.shadowProgram);
+    glUniform1i(glGetUniformLocation(ctx.shadowProgram, "u_instanceTransforms"),
+                ctx.instanceTextureId);
+    glUniform1i(glGetUniformLocation(ctx.shadowProgram, "u_drawData"), ctx.drawTextureId);
+
+    glUseProgram(ctx.shadowViewProgram);
+    glUniform1i(glGetUniformLocation(ctx.shadowViewProgram, "u_shadowmap"), 11);
+
+    glUseProgram(ctx.shadowBlurProgram);
+    glUniform1i(glGetUniformLocation(ctx.shadowBlurProgram, "u_source"), 15);
+    glUseProgram(0);
+}
+
+// Set the uniform block bindings and texture units of a mesh program. This is
+// called by cg::get_shader_variant() for each new variant.
+void initialize_mesh_program(GLuint program, void *userData)
+{
+    const Context &ctx = *static_cast<const Context *>(userData);
+    cg::set_uniform_block_bindings(program);
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "u_cubemap"), ctx.cubemapId);
+    glUniform1i(glGetUniformLocation(program, "u_baseColorTexture"), ctx.baseColorTextureId);
+    glUniform1i(glGetUniformLocation(program, "u_normalTexture"), ctx.normalMapTextureId);
+    glUniform1i(glGetUniformLocation(program, "u_shadowmap"), 11);
+    glUniform1i(glGetUniformLocation(program, "u_shadowMoments"), ctx.shadowMomentsTextureId);
+    glUniform1i(glGetUniformLocation(program, "u_instanceTransforms"), ctx.instanceTextureId);
+    glUniform1i(glGetUniformLocation(program, "u_drawData"), ctx.drawTextureId);
+    glUseProgram(0);
+}
+
+void initialize_mesh_programs(Context &ctx)
+{
+    const char *features[] = {"USE_LIGHTING",         "USE_AMBIENT_LIGHTING",
+                              "USE_DIFFUSE_LIGHTING", "USE_SPECULAR_LIGHTING",
+                              "USE_NORMALS_AS_COLOR", "USE_GAMMA_CORRECTION",
+                              "USE_CUBEMAP",          "VISUALISE_TEXCOORDS",
+                              "USE_DIFFUSE_TEXTURE",  "USE_NORMAL_TEXTURE",
+                              "SHADOW_FILTER_POISSON", "SHADOW_FILTER_VARIANCE"};
+    cg::create_shader_variants(ctx.meshPrograms, shader_dir() + "mesh.vert",
+                               shader_dir() + "mesh.frag",
+                               std::vector<std::string>(std::begin(features), std::end(features)));
+    ctx.meshPrograms.initialize = initialize_mesh_program;
+    ctx.meshPrograms.userData = &ctx;
+    ctx.meshPrograms.cache = &ctx.programCache;
+}
+
+// Return the shading settings of the context, which select the features of
+// both the mesh programs and software draws
+gltf::SoftwareShading software_shading(const Context &ctx)
+{
+    gltf::SoftwareShading shading;
+    shading.useLighting = ctx.useLighting;
+    shading.useAmbientLighting = ctx.useAmbientLighting;
+    shading.useDiffuseLighting = ctx.useDiffuseLighting;
+    shading.useSpecularLighting = ctx.useSpecularLighting;
+    shading.useNormalsAsColor = ctx.useNormalsAsColor;
+    shading.useGammaCorrection = ctx.useGammaCorrection;
+    shading.useCubemap = ctx.useCubemap;
+    shading.visualiseTextureCoords = ctx.visualiseTextureCoords;
+    shading.useDiffuseTexture = ctx.useDiffuseTexture;
+    shading.useNormalTexture = ctx.useNormalTexture;
+    shading.lightPosition = ctx.lightPosition;
+    shading.specularPower = ctx.specularPower;
+    shading.ambientColor = ctx.ambientColor;
+    shading.diffuseColor = ctx.diffuseColor;
+    shading.specularColor = ctx.specularColor;
+    shading.backgroundColor = glm::vec3(ctx.backgroundColor);
+    shading.shadowFilter = cg::SoftwareShadowFilter(ctx.shadowFilter);
+    shading.shadowTaps = ctx.shadowTaps;
+    return shading;
+}
+
+// Return the mesh program features for drawing a material (or no material,
+// if materialIndex is -1) with the current settings. Features that have no
+// effect are left out, to keep the number of variants down.
+unsigned mesh_program_features(const Context &ctx, int materialIndex)
+{
+    unsigned features =
+        gltf::software_material_features(software_shading(ctx), ctx.asset, materialIndex);
+    if ((features & USE_LIGHTING) && (ctx.useDiffuseLighting || ctx.useSpecularLighting)) {
+        if (ctx.shadowFilter == cg::SHADOW_FILTER_POISSON) features |= SHADOW_FILTER_POISSON;
+        if (ctx.shadowFilter == cg::SHADOW_FILTER_VARIANCE) features |= SHADOW_FILTER_VARIANCE;
+    }
+    return features;
+}
+
+// Read the triangles of the mesh primitives, for use as occluders
+void create_occluder_meshes(Context &ctx)
+{
+    ctx.occluderMeshes.resize(ctx.asset.meshes.size());
+    for (unsigned i = 0; i < ctx.asset.meshes.size(); ++i) {
+        const gltf::Mesh &mesh = ctx.asset.meshes[i];
+        ctx.occluderMeshes[i].resize(mesh.primitives.size());
+        for (unsigned j = 0; j < mesh.primitives.size(); ++j) {
+            cg::OccluderMesh &occluder = ctx.occluderMeshes[i][j];
+            gltf::read_primitive_triangles(ctx.asset, mesh.primitives[j], occluder.positions,
+                                           occluder.indices);
+        }
+    }
+}
+
+// Set up everything that does not depend on the glTF scene
 void do_initialization(Context &ctx)
 {
-    ctx.program = cg::load_shader_program(shader_dir() + "mesh.vert", shader_dir() + "mesh.frag");
+    glGenVertexArrays(1, &ctx.emptyVAO);
+    glBindVertexArray(ctx.emptyVAO);
+    glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+
+    cg::create_program_cache(ctx.programCache, ctx.useProgramCache ? cache_dir() : "");
+    initialize_mesh_programs(ctx);
 
     load_cubemaps(ctx, "Forrest");
     initialize_shadow_map(ctx);
+    initialize_program_bindings(ctx);
+    cg::create_uniform_ring(ctx.uniforms, 64 * 1024, ctx.usePersistentMapping);
+    ctx.multiDrawIndirectSupported = cg::has_multi_draw_indirect();
+    gltf::create_geometry_arena(ctx.geometry, 512 * 1024, 8 * 1024 * 1024);
+    cg::create_occlusion_buffer(ctx.frame.occlusionBuffer, 256, 256);
+    cg::create_occlusion_buffer(ctx.nextFrame.occlusionBuffer, 256, 256);
+    cg::create_texture_streamer(ctx.textureStreamer, ctx.textureStreamBudget);
+}
+
+// Look up the texture arrays and layers of each material, and number the
+// distinct pairs of arrays as texture sets
+void create_material_textures(Context &ctx)
+{
+    ctx.materialTextures.assign(ctx.asset.materials.size() + 1, MaterialTextures());
+    std::vector<std::pair<int, int>> textureSets(1, std::make_pair(-1, -1));  // No textures first
+    for (unsigned i = 0; i < ctx.asset.materials.size(); ++i) {
+        const gltf::Material &material = ctx.asset.materials[i];
+        const gltf::PBRMetallicRoughness &pbr = material.pbrMetallicRoughness;
+        MaterialTextures &textures = ctx.materialTextures[i + 1];
+        // If there is a base color texture
+        if (pbr.hasBaseColorTexture) {
+            const gltf::TextureLayer &layer = ctx.textures.layers[pbr.baseColorTexture.index];
+            textures.baseColorArray = layer.array;
+            textures.layers |= layer.layer;
+        }
+        // If there is a normal/bump map texture
+        if (material.hasNormalTexture) {
+            const gltf::TextureLayer &layer = ctx.textures.layers[material.normalTexture.index];
+            textures.normalArray = layer.array;
+            textures.layers |= layer.layer << 16;
+        }
 
-    gltf::load_gltf_asset(ctx.gltfFilename, gltf_dir(), ctx.asset);
-    gltf::create_drawables_from_gltf_asset(ctx.drawables, ctx.asset);
-    gltf::create_textures_from_gltf_asset(ctx.textures, ctx.asset);
+        std::pair<int, int> textureSet(textures.baseColorArray, textures.normalArray);
+        auto it = std::find(textureSets.begin(), textureSets.end(), textureSet);
+        textures.textureSet = unsigned(it - textureSets.begin());
+        if (it == textureSets.end()) textureSets.push_back(textureSet);
+    }
 }
 
-void draw_scene(Context &ctx)
+// Load a glTF file (given by its directory, ending with a slash, and name)
+// and create the drawables and textures of its scene. Returns false if the
+// file could not be loaded, in which case the scene is left empty.
+bool load_scene(Context &ctx, const std::string &directory, const std::string &filename)
 {
-    // Activate shader program
-    glUseProgram(ctx.program);
+    bool loaded = gltf::load_gltf_asset(filename, directory, ctx.asset);
+    if (!loaded) ctx.asset = gltf::GLTFAsset();
+    if (ctx.syntheticInstanceCount > 0) {
+        gltf::create_instanced_grid(ctx.asset, ctx.syntheticInstanceCount);
+    }
+    gltf::create_drawables_from_gltf_asset(ctx.drawables, ctx.geometry, ctx.asset, ctx.workers,
+                                           ctx.tangentCache, ctx.useTriangleStrips);
+    ctx.geometryVersion += 1;
+    create_occluder_meshes(ctx);
+    gltf::create_textures_from_gltf_asset(ctx.textures, ctx.asset, ctx.textureStreamer,
+                                          ctx.textureMemoryBudget);
+    create_material_textures(ctx);
+    ctx.framePrepared = false;
+    return loaded;
+}
 
+// Release the drawables and textures of the current scene, so that another
+// one can be loaded
+void unload_scene(Context &ctx)
+{
+    gltf::destroy_drawables(ctx.drawables, ctx.geometry);
+    cg::cancel_texture_streaming(ctx.textureStreamer);
+    gltf::destroy_textures(ctx.textures);
+    ctx.materialTextures.clear();
+    ctx.asset = gltf::GLTFAsset();
+    ctx.occluderMeshes.clear();
+    ctx.geometryVersion += 1;
+    ctx.framePrepared = false;
+}
+
+void draw_scene(Context &ctx)
+{
+    cg::ProfileScope profileScope("draw_scene");
+    cg::GpuProfileScope gpuProfileScope(ctx.gpuProfiler, "draw_scene");
     // Set render state
     glEnable(GL_DEPTH_TEST);  // Enable Z-buffering
 
-    // Define per-scene uniforms
-    glm::mat4 model = glm::mat4(1.0f);
-    glm::mat4 view = glm::lookAt(glm::vec3(0, 0, 5), glm::vec3(0, 0, 0), glm::vec3(0, 1, 0)) * glm::mat4(ctx.trackball.orient);
-    calculate_projection(ctx);
+    // Per-frame uniforms (matrices, lighting parameters and flags) are in the
+    // camera's frame block and the light block
+    cg::bind_uniform_block(ctx.uniforms, cg::FRAME_BLOCK, ctx.blockOffsets.cameraFrame,
+                           sizeof(cg::FrameBlock));
+    cg::bind_uniform_block(ctx.uniforms, cg::LIGHT_BLOCK, ctx.blockOffsets.light,
+                           sizeof(cg::LightBlock));
 
-    // Model and View matrices
-    glUniformMatrix4fv(glGetUniformLocation(ctx.program, "u_view"), 1, GL_FALSE, &view[0][0]);
-    glUniformMatrix4fv(glGetUniformLocation(ctx.program, "u_projection"), 1, GL_FALSE, &ctx.projectionMatrix[0][0]);
+    // Shadowmap cascades, sampled with hardware depth comparisons, and their
+    // depth moments (only used by the variance filter)
+    glActiveTexture(GL_TEXTURE11);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, ctx.light.cascades.shadowmap);
+    glBindSampler(11, ctx.light.cascades.compareSampler);
+    glActiveTexture(GL_TEXTURE0 + ctx.shadowMomentsTextureId);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, ctx.light.cascades.moments);
 
-    glm::mat4 shadowFromView = ctx.light.shadowMatrix * glm::inverse(view);
-    glUniformMatrix4fv(glGetUniformLocation(ctx.program, "u_shadowFromView"), 1, GL_FALSE, &shadowFromView[0][0]);
+    // Instance transforms, and the first instance of each draw
+    glActiveTexture(GL_TEXTURE0 + ctx.instanceTextureId);
+    glBindTexture(GL_TEXTURE_BUFFER, ctx.instances.texture);
+    glActiveTexture(GL_TEXTURE0 + ctx.drawTextureId);
+    glBindTexture(GL_TEXTURE_BUFFER, ctx.multiDraw.drawTexture);
 
-    // Elapsed time
-    glUniform1f(glGetUniformLocation(ctx.program, "u_time"), ctx.elapsedTime);
+    // ...
 
-    // Textures and Cubemaps
-    glUniform1i(glGetUniformLocation(ctx.program, "u_baseColorTexture"), ctx.baseColorTextureId);
-    glUniform1i(glGetUniformLocation(ctx.program, "u_normalTexture"), ctx.normalMapTextureId);
-    glUniform1i(glGetUniformLocation(ctx.program, "u_cubemap"), ctx.cubemapId);
+    // Depth pre-pass with the depth-only shadow program. The opaque pass then
+    // only shades the nearest fragment of each pixel.
+    // Note: this relies on both programs computing the same depth, see the
+    // invariant gl_Position in mesh.vert and shadow.vert.
+    if (ctx.frame.useDepthPrepass) {
+        glUseProgram(ctx.shadowProgram);
+        ctx.stats.programSwitches += 1;
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        submit_render_queue(ctx, DEPTH_PREPASS, ctx.shadowProgram);
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        glDepthFunc(GL_EQUAL);
+        glDepthMask(GL_FALSE);
+    }
 
-    glActiveTexture(GL_TEXTURE11);
-    glBindTexture(GL_TEXTURE_2D, ctx.light.shadowmap);
-    glUniform1i(glGetUniformLocation(ctx.program, "u_shadowmap"), 11);
+    // Draw scene (the program variant of each draw is bound by the submit)
+    if (ctx.fragmentQuery) glBeginQuery(GL_FRAGMENT_SHADER_INVOCATIONS_ARB, ctx.fragmentQuery);
+    submit_render_queue(ctx, OPAQUE_PASS, 0);
+    if (ctx.fragmentQuery) glEndQuery(GL_FRAGMENT_SHADER_INVOCATIONS_ARB);
 
-    // Lighting Parameters
-    glUniform3fv(glGetUniformLocation(ctx.program, "u_lightPosition"), 1, &ctx.lightPosition[0]);
-    glUniform3fv(glGetUniformLocation(ctx.program, "u_diffuseColor"), 1, &ctx.diffuseColor[0]);
-    glUniform3fv(glGetUniformLocation(ctx.program, "u_specularColor"), 1, &ctx.specularColor[0]);
-    glUniform1f(glGetUniformLocation(ctx.program, "u_specularPower"), ctx.specularPower);
-    glUniform3fv(glGetUniformLocation(ctx.program, "u_ambientColor"), 1, &ctx.ambientColor[0]);
-
-    // Flags
-    glUniform1i(glGetUniformLocation(ctx.program, "u_useLighting"), ctx.useLighting);
-    glUniform1i(glGetUniformLocation(ctx.program, "u_useDiffuseLighting"), ctx.useDiffuseLighting);
-    glUniform1i(glGetUniformLocation(ctx.program, "u_useAmbientLighting"), ctx.useAmbientLighting);
-    glUniform1i(glGetUniformLocation(ctx.program, "u_useSpecularLighting"), ctx.useSpecularLighting);
-    glUniform1i(glGetUniformLocation(ctx.program, "u_useNormalsAsColor"), ctx.useNormalsAsColor);
-    glUniform1i(glGetUniformLocation(ctx.program, "u_useGammaCorrection"), ctx.useGammaCorrection);
-    glUniform1i(glGetUniformLocation(ctx.program, "u_useCubemap"), ctx.useCubemap);
-
-    glUniform1i(glGetUniformLocation(ctx.program, "u_visualiseTexCoords"), ctx.visualiseTextureCoords);
-    glUniform1i(glGetUniformLocation(ctx.program, "u_useDiffuseTexture"), ctx.useDiffuseTexture);
-    glUniform1i(glGetUniformLocation(ctx.program, "u_useNormalTexture"), ctx.useNormalTexture);
-    glUniform1i(glGetUniformLocation(ctx.program, "u_hasDiffuseTexture"), false);
-    glUniform1i(glGetUniformLocation(ctx.program, "u_hasNormalTexture"), false);
+    // Clean up
+    glBindSampler(11, 0);
+    cg::reset_gl_render_state();
+    glUseProgram(0);
+}
 
-    // ...
+// Draw the scene and measure the GPU time of the opaque pass (shading cost
+// of the selected shadow filter, including the depth pre-pass) and its
+// number of fragment shader invocations. To avoid stalls, the results are
+// read back from the queries issued two frames earlier, and skipped (keeping
+// the previous results) if they are not available yet, as in
+// cg::begin_gpu_profiler_frame().
+void draw_scene_timed(Context &ctx)
+{
+    if (!ctx.opaqueTimerQueries[0]) {
+        glGenQueries(2, ctx.opaqueTimerQueries);
+        ctx.pipelineStatisticsSupported =
+            cg::has_gl_extension("GL_ARB_pipeline_statistics_query");
+        if (ctx.pipelineStatisticsSupported) glGenQueries(2, ctx.fragmentQueries);
+    }
+    GLuint query = ctx.opaqueTimerQueries[ctx.timedFrames % 2];
+    ctx.fragmentQuery = ctx.fragmentQueries[ctx.timedFrames % 2];
+    if (ctx.timedFrames >= 2) {
+        GLint available = 0;
+        glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available) {
+            GLuint64 elapsed = 0;
+            glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+            ctx.gpuOpaqueTime = float(elapsed * 1e-9);
+        }
+        if (ctx.fragmentQuery) {
+            glGetQueryObjectiv(ctx.fragmentQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+            if (available) {
+                glGetQueryObjectui64v(ctx.fragmentQuery, GL_QUERY_RESULT, &ctx.opaqueFragments);
+            }
+        }
+    }
 
-    // Draw scene
-    for (unsigned i = 0; i < ctx.asset.nodes.size(); ++i) {
-        const gltf::Node &node = ctx.asset.nodes[i];
-        const gltf::Drawable &drawable = ctx.drawables[node.mesh];
+    glBeginQuery(GL_TIME_ELAPSED, query);
+    draw_scene(ctx);
+    glEndQuery(GL_TIME_ELAPSED);
+    ctx.timedFrames += 1;
+}
 
-        // Define per-object uniforms   
-        model = glm::scale(glm::toMat4(node.rotation) * glm::translate(model, node.translation), node.scale);
-        glUniformMatrix4fv(glGetUniformLocation(ctx.program, "u_model"), 1, GL_FALSE, &model[0][0]);
-        // ...
+// Split the instance batches of a frame into slices
+void create_instance_slices(FrameSnapshot &frame)
+{
+    frame.slices.clear();
+    for (unsigned i = 0; i < frame.instanceBatches.size(); ++i) {
+        const gltf::InstanceBatch &batch = frame.instanceBatches[i];
+        int end = batch.baseInstance + batch.instanceCount;
+        for (int first = batch.baseInstance; first < end; first += INSTANCE_SLICE_SIZE) {
+            InstanceSlice slice;
+            slice.batch = int(i);
+            slice.first = first;
+            slice.last = std::min(first + INSTANCE_SLICE_SIZE, end);
+            frame.slices.push_back(slice);
+        }
+    }
+}
 
-        // Get Texture data for this node if it has any
-        const gltf::Mesh &mesh = ctx.asset.meshes[node.mesh];
-        if (mesh.primitives[0].hasMaterial)
-        {
-            const gltf::Primitive &primitive = mesh.primitives[0];
-            const gltf::Material &material = ctx.asset.materials[primitive.material];
-            const gltf::PBRMetallicRoughness &pbr = material.pbrMetallicRoughness;
-
-            // Define material textures and uniforms
-            // If there is a base color texture
-            if (pbr.hasBaseColorTexture)
-            {
-                GLuint texture_id = ctx.textures[pbr.baseColorTexture.index];
-                glActiveTexture(GL_TEXTURE0 + ctx.baseColorTextureId);
-                glBindTexture(GL_TEXTURE_2D, texture_id);
-                glUniform1i(glGetUniformLocation(ctx.program, "u_hasDiffuseTexture"), true);
+// Group mesh nodes into instance batches (if the grouping is out of date),
+// and compute the world matrices of the nodes and the bounds of the batches
+// on the worker pool: one root subtree, and one slice of a batch, per item
+void update_instances(const Context &ctx, FrameSnapshot &frame)
+{
+    cg::ProfileScope profileScope("update_instances");
+    cg::WorkerPool &workers = *ctx.workers;
+    if (frame.batchGeometryVersion != ctx.geometryVersion ||
+        frame.batchInstanceLimit != ctx.maxBatchInstances) {
+        gltf::find_root_nodes(ctx.asset, frame.rootNodes);
+        gltf::group_instance_batches(frame.instanceBatches, frame.instanceNodes, ctx.asset,
+                                     ctx.drawables, ctx.maxBatchInstances);
+        create_instance_slices(frame);
+        frame.batchGeometryVersion = ctx.geometryVersion;
+        frame.batchInstanceLimit = ctx.maxBatchInstances;
+    }
+
+    frame.worldMatrices.resize(ctx.asset.nodes.size());
+    cg::parallel_for(workers, int(frame.rootNodes.size()), 256, [&](int first, int last) {
+        for (int i = first; i < last; ++i) {
+            gltf::compute_subtree_world_matrices(ctx.asset, frame.rootNodes[i], glm::mat4(1.0f),
+                                                 frame.worldMatrices);
+        }
+    });
+    frame.instanceTransforms.resize(frame.instanceNodes.size());
+    cg::parallel_for(workers, int(frame.instanceNodes.size()), 4096, [&](int first, int last) {
+        for (int i = first; i < last; ++i) {
+            frame.instanceTransforms[i] = frame.worldMatrices[frame.instanceNodes[i]];
+        }
+    });
+
+    // Bounds of the slices, merged into those of their batches
+    int sliceCount = int(frame.slices.size());
+    frame.sliceBoundsMin.assign(sliceCount, glm::vec3(FLT_MAX));
+    frame.sliceBoundsMax.assign(sliceCount, glm::vec3(-FLT_MAX));
+    cg::parallel_for(workers, sliceCount, 16, [&](int first, int last) {
+        for (int i = first; i < last; ++i) {
+            const InstanceSlice &slice = frame.slices[i];
+            gltf::expand_batch_bounds(frame.instanceBatches[slice.batch], ctx.drawables,
+                                      frame.instanceTransforms, slice.first, slice.last,
+                                      frame.sliceBoundsMin[i], frame.sliceBoundsMax[i]);
+        }
+    });
+    for (gltf::InstanceBatch &batch : frame.instanceBatches) {
+        batch.boundsMin = glm::vec3(FLT_MAX);
+        batch.boundsMax = glm::vec3(-FLT_MAX);
+    }
+    for (int i = 0; i < sliceCount; ++i) {
+        gltf::InstanceBatch &batch = frame.instanceBatches[frame.slices[i].batch];
+        batch.boundsMin = glm::min(batch.boundsMin, frame.sliceBoundsMin[i]);
+        batch.boundsMax = glm::max(batch.boundsMax, frame.sliceBoundsMax[i]);
+    }
+}
+
+// Return the world-space bounding box of an object-space box
+void transform_bounds(const glm::mat4 &model, const glm::vec3 &boundsMin,
+                      const glm::vec3 &boundsMax, glm::vec3 &worldMin, glm::vec3 &worldMax)
+{
+    for (int i = 0; i < 8; ++i) {
+        glm::vec3 corner((i & 1) ? boundsMax.x : boundsMin.x, (i & 2) ? boundsMax.y : boundsMin.y,
+                         (i & 4) ? boundsMax.z : boundsMin.z);
+        glm::vec3 world = glm::vec3(model * glm::vec4(corner, 1.0f));
+        worldMin = i ? glm::min(worldMin, world) : world;
+        worldMax = i ? glm::max(worldMax, world) : world;
+    }
+}
+
+// Rasterize the occluders of the frame into the occlusion buffer, mark the
+// instances that are hidden behind them, and copy the transforms of the
+// visible instances of partly occluded batches after those of all instances
+void update_occlusion_culling(const Context &ctx, FrameSnapshot &frame)
+{
+    cg::ProfileScope profileScope("update_occlusion_culling");
+    int batchCount = int(frame.instanceBatches.size());
+    int instanceCount = int(frame.instanceNodes.size());
+    frame.instanceOccluded.assign(instanceCount, 0);
+    frame.visibleInstanceFirst.resize(batchCount);
+    frame.visibleInstanceCounts.resize(batchCount);
+    for (int i = 0; i < batchCount; ++i) {
+        frame.visibleInstanceFirst[i] = frame.instanceBatches[i].baseInstance;
+        frame.visibleInstanceCounts[i] = frame.instanceBatches[i].instanceCount;
+    }
+    frame.occluderCount = 0;
+    frame.occludedInstances = 0;
+    frame.occlusionCullingTime = 0.0f;
+    if (!ctx.useOcclusionCulling) return;
+
+    double startTime = cg::get_time();
+    glm::mat4 viewProjection = frame.projection * frame.view;
+
+    // Find the world-space bounds of the instances, and select occluders,
+    // slice by slice. The occluders of each chunk of slices are concatenated
+    // in order, so that the result does not depend on the threads.
+    const int grainSize = 16;
+    int sliceCount = int(frame.slices.size());
+    frame.instanceBoundsMin.resize(instanceCount);
+    frame.instanceBoundsMax.resize(instanceCount);
+    std::vector<std::vector<cg::Occluder>> chunkOccluders((sliceCount + grainSize - 1) / grainSize);
+    cg::parallel_for(*ctx.workers, sliceCount, grainSize, [&](int first, int last) {
+        std::vector<cg::Occluder> &occluders = chunkOccluders[first / grainSize];
+        for (int s = first; s < last; ++s) {
+            const InstanceSlice &slice = frame.slices[s];
+            const gltf::InstanceBatch &batch = frame.instanceBatches[slice.batch];
+            const cg::OccluderMesh &mesh = ctx.occluderMeshes[batch.mesh][batch.primitive];
+            bool isOccluderMesh = int(mesh.indices.size() / 3) <= ctx.maxOccluderTriangles;
+            const gltf::DrawablePrimitive &drawable =
+                ctx.drawables[batch.mesh].primitives[batch.primitive];
+            for (int i = slice.first; i < slice.last; ++i) {
+                const glm::mat4 &model = frame.instanceTransforms[i];
+                glm::vec3 &worldMin = frame.instanceBoundsMin[i];
+                glm::vec3 &worldMax = frame.instanceBoundsMax[i];
+                transform_bounds(model, drawable.boundsMin, drawable.boundsMax, worldMin,
+                                 worldMax);
+                if (!isOccluderMesh) continue;
+
+                glm::vec2 ndcMin, ndcMax;
+                float minDepth;
+                if (!cg::project_bounds(viewProjection, worldMin, worldMax, ndcMin, ndcMax,
+                                        minDepth)) {
+                    continue;
+                }
+                glm::vec2 size = 0.5f * (glm::min(ndcMax, glm::vec2(1.0f)) -
+                                         glm::max(ndcMin, glm::vec2(-1.0f)));
+                if (std::max(size.x, size.y) < ctx.minOccluderSize) continue;
+
+                cg::Occluder occluder;
+                occluder.mesh = &mesh;
+                occluder.model = model;
+                occluders.push_back(occluder);
             }
-            //If there is a normal/bump map texture
-            if (material.hasNormalTexture)
-            {
-                GLuint texture_id = ctx.textures[material.normalTexture.index];
-                glActiveTexture(GL_TEXTURE0 + ctx.normalMapTextureId);
-                glBindTexture(GL_TEXTURE_2D, texture_id);
-                glUniform1i(glGetUniformLocation(ctx.program, "u_hasNormalTexture"), true);
+        }
+    });
+    std::vector<cg::Occluder> occluders;
+    for (const std::vector<cg::Occluder> &chunk : chunkOccluders) {
+        occluders.insert(occluders.end(), chunk.begin(), chunk.end());
+    }
+    frame.occluderCount = int(occluders.size());
+    if (occluders.empty()) {
+        frame.occlusionCullingTime = float(cg::get_time() - startTime);
+        return;
+    }
+
+    // Test the bounds of each instance against the occluders (the occluders
+    // themselves can not be culled, since their boxes are in front of them),
+    // and count the visible instances of each slice and batch
+    cg::rasterize_occluders(frame.occlusionBuffer, *ctx.workers, viewProjection, occluders);
+    frame.sliceVisibleCounts.resize(sliceCount);
+    cg::parallel_for(*ctx.workers, sliceCount, grainSize, [&](int first, int last) {
+        for (int s = first; s < last; ++s) {
+            const InstanceSlice &slice = frame.slices[s];
+            int visibleCount = 0;
+            for (int i = slice.first; i < slice.last; ++i) {
+                bool occluded = cg::is_bounds_occluded(frame.occlusionBuffer, viewProjection,
+                                                       frame.instanceBoundsMin[i],
+                                                       frame.instanceBoundsMax[i]);
+                frame.instanceOccluded[i] = occluded;
+                visibleCount += !occluded;
             }
+            frame.sliceVisibleCounts[s] = visibleCount;
+        }
+    });
+    std::fill(frame.visibleInstanceCounts.begin(), frame.visibleInstanceCounts.end(), 0);
+    for (int s = 0; s < sliceCount; ++s) {
+        frame.visibleInstanceCounts[frame.slices[s].batch] += frame.sliceVisibleCounts[s];
+    }
 
+    // Place the visible instances of partly occluded batches after all
+    // instances (the slices of each batch are consecutive), and copy them
+    int visibleEnd = instanceCount;
+    frame.sliceVisibleFirst.resize(sliceCount);
+    for (int s = 0; s < sliceCount; ++s) {
+        const InstanceSlice &slice = frame.slices[s];
+        const gltf::InstanceBatch &batch = frame.instanceBatches[slice.batch];
+        int visibleCount = frame.visibleInstanceCounts[slice.batch];
+        frame.occludedInstances += slice.last - slice.first - frame.sliceVisibleCounts[s];
+        if (visibleCount == 0 || visibleCount == batch.instanceCount) {
+            frame.sliceVisibleFirst[s] = -1;
+            continue;
         }
+        if (slice.first == batch.baseInstance) frame.visibleInstanceFirst[slice.batch] = visibleEnd;
+        frame.sliceVisibleFirst[s] = visibleEnd;
+        visibleEnd += frame.sliceVisibleCounts[s];
+    }
+    frame.instanceTransforms.resize(visibleEnd);
+    cg::parallel_for(*ctx.workers, sliceCount, grainSize, [&](int first, int last) {
+        for (int s = first; s < last; ++s) {
+            const InstanceSlice &slice = frame.slices[s];
+            int next = frame.sliceVisibleFirst[s];
+            if (next < 0) continue;
+            for (int i = slice.first; i < slice.last; ++i) {
+                if (!frame.instanceOccluded[i]) {
+                    frame.instanceTransforms[next++] = frame.instanceTransforms[i];
+                }
+            }
+        }
+    });
+    frame.occlusionCullingTime = float(cg::get_time() - startTime);
+}
 
-        // Draw object
-        glBindVertexArray(drawable.vao);
-        glDrawElements(GL_TRIANGLES, drawable.indexCount, drawable.indexType,
-                       (GLvoid *)(intptr_t)drawable.indexByteOffset);
-        glBindVertexArray(0);
+// Return the view-space depth of the nearest of the instance transforms
+// [first, last), or farPlane if they are all farther away
+float nearest_instance_depth(const FrameSnapshot &frame, int first, int last,
+                             const glm::mat4 &view, float farPlane)
+{
+    float nearest = farPlane;
+    for (int i = first; i < last; ++i) {
+        const glm::mat4 &model = frame.instanceTransforms[i];
+        float depth = -glm::dot(glm::row(view, 2), model[3]);
+        nearest = std::min(nearest, depth);
     }
+    return nearest;
+}
 
-    // Clean up
-    cg::reset_gl_render_state();
-    glUseProgram(0);
+// Return the size on screen (in pixels) of an instance of a batch, at the
+// depth of the nearest one, for requesting the texture levels of its
+// material
+float batch_screen_size(const Context &ctx, const FrameSnapshot &frame,
+                        const gltf::InstanceBatch &batch, float depth)
+{
+    const gltf::DrawablePrimitive &drawable =
+        ctx.drawables[batch.mesh].primitives[batch.primitive];
+    const glm::mat4 &model = frame.instanceTransforms[batch.baseInstance];
+    float scale = std::max(glm::length(glm::vec3(model[0])), glm::length(glm::vec3(model[1])));
+    scale = std::max(scale, glm::length(glm::vec3(model[2])));
+    float radius = 0.5f * glm::length(drawable.boundsMax - drawable.boundsMin) * scale;
+    if (ctx.useOrthographicProjection) return radius / ctx.orthographicScale * ctx.height;
+    depth = std::max(depth, camera_depth_range(ctx).x);
+    return radius / (depth * std::tan(glm::radians(ctx.fov) * 0.5f)) * ctx.height;
+}
+
+// Look up the mesh program variant of each material with the current
+// settings (building the missing ones), and number the programs of the frame
+// as program slots. This needs OpenGL, so it is done before the rest of the
+// frame is prepared.
+void prepare_frame_programs(Context &ctx, FrameSnapshot &frame)
+{
+    cg::ProfileScope profileScope("prepare_frame_programs");
+    // Each material is drawn with the program variant of its features.
+    // Note: the program slot is 8 bits of the sort key, which limits the
+    // number of variants per frame to 255.
+    std::vector<unsigned> materialFeatures(ctx.asset.materials.size() + 1);
+    for (unsigned i = 0; i < materialFeatures.size(); ++i) {
+        materialFeatures[i] = mesh_program_features(ctx, int(i) - 1);
+    }
+    cg::prepare_shader_variants(ctx.meshPrograms, materialFeatures);
+
+    frame.programs.assign(1, ctx.shadowProgram);
+    frame.materialSlots.resize(materialFeatures.size());
+    for (unsigned i = 0; i < materialFeatures.size(); ++i) {
+        GLuint program = cg::get_shader_variant(ctx.meshPrograms, materialFeatures[i]);
+        auto slot = std::find(frame.programs.begin(), frame.programs.end(), program);
+        frame.materialSlots[i] = unsigned(slot - frame.programs.begin());
+        if (slot == frame.programs.end()) frame.programs.push_back(program);
+    }
+}
+
+// Build and sort the render queue with one item per batch and pass. Opaque
+// draws are sorted by program and texture set first, and front-to-back
+// second. The nearest depths are found slice by slice, and the items are
+// built chunk by chunk of batches and concatenated in order, on the worker
+// pool.
+void build_render_queue(const Context &ctx, FrameSnapshot &frame)
+{
+    cg::ProfileScope profileScope("build_render_queue");
+    cg::WorkerPool &workers = *ctx.workers;
+    const cg::ShadowCascades &cascades = frame.cascades;
+    const gltf::InstanceBatchList &batches = frame.instanceBatches;
+    float farPlane = camera_depth_range(ctx).y;
+    unsigned vao = ctx.geometry.vao;
+
+    // Depth of the instance of each batch that is closest to the light, and
+    // of the one that is closest to the camera
+    int sliceCount = int(frame.slices.size());
+    frame.sliceLightDepths.resize(sliceCount);
+    frame.sliceCameraDepths.resize(sliceCount);
+    cg::parallel_for(workers, sliceCount, 16, [&](int first, int last) {
+        for (int i = first; i < last; ++i) {
+            const InstanceSlice &slice = frame.slices[i];
+            frame.sliceLightDepths[i] = nearest_instance_depth(
+                frame, slice.first, slice.last, cascades.lightView, cascades.lightDepthRange);
+            frame.sliceCameraDepths[i] =
+                nearest_instance_depth(frame, slice.first, slice.last, frame.view, farPlane);
+        }
+    });
+    frame.batchLightDepths.assign(batches.size(), cascades.lightDepthRange);
+    frame.batchCameraDepths.assign(batches.size(), farPlane);
+    for (int i = 0; i < sliceCount; ++i) {
+        float &lightDepth = frame.batchLightDepths[frame.slices[i].batch];
+        float &cameraDepth = frame.batchCameraDepths[frame.slices[i].batch];
+        lightDepth = std::min(lightDepth, frame.sliceLightDepths[i]);
+        cameraDepth = std::min(cameraDepth, frame.sliceCameraDepths[i]);
+    }
+
+    const int grainSize = 256;
+    int batchCount = int(batches.size());
+    int chunkCount = (batchCount + grainSize - 1) / grainSize;
+    frame.chunkItems.resize(chunkCount);
+    frame.chunkScreenSizes.resize(chunkCount);
+    cg::parallel_for(workers, batchCount, grainSize, [&](int first, int last) {
+        cg::RenderQueue &items = frame.chunkItems[first / grainSize];
+        std::vector<float> &screenSizes = frame.chunkScreenSizes[first / grainSize];
+        items.clear();
+        screenSizes.assign(ctx.materialTextures.size(), -1.0f);
+        for (int i = first; i < last; ++i) {
+            const gltf::InstanceBatch &batch = batches[i];
+            // Each chunk of the primitive of the batch is a separate draw
+            int partCount =
+                int(ctx.drawables[batch.mesh].primitives[batch.primitive].chunks.size());
+            auto push_items = [&](uint64_t key) {
+                for (int part = 0; part < partCount; ++part) {
+                    cg::RenderItem item;
+                    item.key = key;
+                    item.index = i;
+                    item.part = part;
+                    items.push_back(item);
+                }
+            };
+
+            // Note: the shadow passes do not use materials, so we leave them
+            // out of their keys to get longer runs of draws with the same
+            // state. Casters are culled against the bounds of each cascade.
+            float lightDepth = frame.batchLightDepths[i] / cascades.lightDepthRange;
+            for (int c = 0; c < cascades.count; ++c) {
+                if (!cg::bounds_overlap_cascade(cascades, c, batch.boundsMin, batch.boundsMax)) {
+                    continue;
+                }
+                push_items(cg::make_sort_key(SHADOW_PASS + c, SHADOW_PROGRAM, 0, vao, lightDepth));
+            }
+
+            // Only shadows are drawn for hidden batches
+            if (frame.visibleInstanceCounts[i] == 0) continue;
+
+            float cameraDepth = frame.batchCameraDepths[i] / farPlane;
+            if (frame.useDepthPrepass) {
+                push_items(cg::make_sort_key(DEPTH_PREPASS, SHADOW_PROGRAM, 0, vao, cameraDepth));
+            }
+
+            const MaterialTextures &textures = ctx.materialTextures[batch.material + 1];
+            if (textures.baseColorArray >= 0 || textures.normalArray >= 0) {
+                float &screenSize = screenSizes[batch.material + 1];
+                screenSize = std::max(screenSize,
+                                      batch_screen_size(ctx, frame, batch, cameraDepth * farPlane));
+            }
+
+            push_items(cg::make_sort_key(OPAQUE_PASS, frame.materialSlots[batch.material + 1],
+                                         textures.textureSet, vao, cameraDepth));
+        }
+    });
+
+    frame.renderQueue.clear();
+    frame.materialScreenSizes.assign(ctx.materialTextures.size(), -1.0f);
+    for (int i = 0; i < chunkCount; ++i) {
+        frame.renderQueue.insert(frame.renderQueue.end(), frame.chunkItems[i].begin(),
+                                 frame.chunkItems[i].end());
+        for (unsigned j = 0; j < frame.materialScreenSizes.size(); ++j) {
+            frame.materialScreenSizes[j] =
+                std::max(frame.materialScreenSizes[j], frame.chunkScreenSizes[i][j]);
+        }
+    }
+    cg::sort_render_queue(frame.renderQueue);
+}
+
+// Fill in the draw command and first instance of each render queue item, in
+// queue order, so that each run of merged draws is a contiguous range
+void build_draw_commands(const Context &ctx, FrameSnapshot &frame)
+{
+    cg::ProfileScope profileScope("build_draw_commands");
+    frame.drawCommands.resize(frame.renderQueue.size());
+    frame.drawData.resize(frame.renderQueue.size());
+    cg::parallel_for(*ctx.workers, int(frame.renderQueue.size()), 1024, [&](int first, int last) {
+        for (int i = first; i < last; ++i) {
+            const cg::RenderItem &item = frame.renderQueue[i];
+            const gltf::InstanceBatch &batch = frame.instanceBatches[item.index];
+            const gltf::DrawablePrimitive &drawable =
+                ctx.drawables[batch.mesh].primitives[batch.primitive];
+            const gltf::DrawableChunk &chunk = drawable.chunks[item.part];
+            int indexSize = (drawable.indexType == GL_UNSIGNED_SHORT) ? 2 : 4;
+
+            // The camera passes draw only the visible instances
+            int firstInstance = batch.baseInstance;
+            int instanceCount = batch.instanceCount;
+            unsigned pass = cg::sort_key_pass(item.key);
+            if (pass == DEPTH_PREPASS || pass == OPAQUE_PASS) {
+                firstInstance = frame.visibleInstanceFirst[item.index];
+                instanceCount = frame.visibleInstanceCounts[item.index];
+            }
+
+            cg::DrawElementsIndirectCommand &command = frame.drawCommands[i];
+            command.count = chunk.indexCount;
+            command.instanceCount = instanceCount;
+            command.firstIndex = chunk.indexByteOffset / indexSize;
+            command.baseVertex = chunk.baseVertex;
+            command.baseInstance = 0;
+            frame.drawData[i].firstInstance = firstInstance;
+            frame.drawData[i].materialLayers = ctx.materialTextures[batch.material + 1].layers;
+        }
+    });
+}
+
+// Split the render queue into runs of adjacent draws with the same state,
+// which are each submitted with one draw call (and one object block)
+void plan_draw_runs(const Context &ctx, FrameSnapshot &frame)
+{
+    cg::ProfileScope profileScope("plan_draw_runs");
+    const cg::RenderQueue &renderQueue = frame.renderQueue;
+    int itemCount = int(renderQueue.size());
+    frame.drawRuns.clear();
+    for (int first = 0; first < itemCount;) {
+        unsigned pass = cg::sort_key_pass(renderQueue[first].key);
+        int last = first + 1;
+        while (last < itemCount && cg::sort_key_pass(renderQueue[last].key) == pass &&
+               can_merge_draws(ctx, frame, pass, renderQueue[first], renderQueue[last])) {
+            ++last;
+        }
+        DrawRun run;
+        run.first = first;
+        run.last = last;
+        frame.drawRuns.push_back(run);
+        first = last;
+    }
+}
+
+// Fill in the per-frame uniform blocks: camera and shadowmap matrices,
+// lighting parameters and flags
+void build_frame_blocks(const Context &ctx, FrameSnapshot &frame)
+{
+    const cg::ShadowCascades &cascades = frame.cascades;
+    cg::FrameBlock &block = frame.cameraFrame;
+    block.view = frame.view;
+    block.projection = frame.projection;
+    for (int i = 0; i < cg::MAX_SHADOW_CASCADES; ++i) {
+        block.shadowFromView[i] = cascades.matrices[i] * glm::inverse(frame.view);
+        block.cascadeSplits[i] = cascades.splits[std::min(i, cascades.count - 1) + 1];
+    }
+    block.time = ctx.elapsedTime;
+    block.cascadeCount = cascades.count;
+    block.shadowTaps = ctx.shadowTaps;
+    block.pad0 = 0;
+
+    // The shadow passes use the same block layout, with the cascades' matrices
+    for (int i = 0; i < cascades.count; ++i) {
+        frame.cascadeFrames[i] = block;
+        frame.cascadeFrames[i].view = cascades.lightView;
+        frame.cascadeFrames[i].projection = cascades.projections[i];
+    }
+
+    // Lighting Parameters
+    frame.light = cg::LightBlock();
+    frame.light.lightPosition = ctx.lightPosition;
+    frame.light.specularPower = ctx.specularPower;
+    frame.light.ambientColor = ctx.ambientColor;
+    frame.light.diffuseColor = ctx.diffuseColor;
+    frame.light.specularColor = ctx.specularColor;
 }
 
+// Prepare the CPU side of a frame whose camera and programs have been set.
+// This only reads the settings and the scene from the context, which are
+// not changed while frames are drawn, so it can run on the worker pool while
+// the render thread draws another frame.
+void prepare_frame(const Context &ctx, FrameSnapshot &frame)
+{
+    cg::ProfileScope profileScope("prepare_frame");
+    double startTime = cg::get_time();
+    update_instances(ctx, frame);
+    update_shadow_cascades(ctx, frame);
+    update_occlusion_culling(ctx, frame);
+    build_render_queue(ctx, frame);
+    build_draw_commands(ctx, frame);
+    plan_draw_runs(ctx, frame);
+    build_frame_blocks(ctx, frame);
+    frame.preparationTime = float(cg::get_time() - startTime);
+}
+
+// Start preparing the next frame from the current settings, on the worker
+// pool if background is set (and otherwise on this thread)
+void begin_frame_preparation(Context &ctx, bool background)
+{
+    FrameSnapshot &frame = ctx.nextFrame;
+    set_frame_camera(ctx, frame);
+    frame.useDepthPrepass = ctx.useDepthPrepass;
+    frame.useMultiDrawIndirect = ctx.multiDrawIndirectSupported && ctx.useMultiDrawIndirect;
+    prepare_frame_programs(ctx, frame);
+    if (background) {
+        const Context &settings = ctx;
+        ctx.preparation =
+            cg::run_async(*ctx.workers, [&settings, &frame]() { prepare_frame(settings, frame); })
+                .share();
+    } else {
+        prepare_frame(ctx, frame);
+    }
+}
+
+// Wait for the next frame to be prepared, and make it the frame to draw
+void finish_frame_preparation(Context &ctx)
+{
+    if (ctx.preparation.valid()) {
+        cg::ProfileScope profileScope("wait_frame_preparation");
+        ctx.preparation.wait();
+        ctx.preparation = std::shared_future<void>();
+    }
+    std::swap(ctx.frame, ctx.nextFrame);
+    ctx.framePrepared = true;
+}
+
+// Request the texture arrays of the materials of the frame from the
+// residency manager, with the largest size on screen of their draws
+void request_frame_textures(Context &ctx)
+{
+    const std::vector<float> &screenSizes = ctx.frame.materialScreenSizes;
+    for (unsigned i = 0; i < screenSizes.size(); ++i) {
+        if (screenSizes[i] < 0.0f) continue;
+        const MaterialTextures &textures = ctx.materialTextures[i];
+        if (textures.baseColorArray >= 0) {
+            gltf::request_texture_array(ctx.textures, textures.baseColorArray, screenSizes[i]);
+        }
+        if (textures.normalArray >= 0) {
+            gltf::request_texture_array(ctx.textures, textures.normalArray, screenSizes[i]);
+        }
+    }
+}
+
+// Write the uniform blocks of the frame (one per frame, light and draw run)
+// to the ring
+void write_uniform_blocks(Context &ctx)
+{
+    cg::ProfileScope profileScope("write_uniform_blocks");
+    const FrameSnapshot &frame = ctx.frame;
+    ctx.blockOffsets.cameraFrame =
+        cg::push_uniform_block(ctx.uniforms, &frame.cameraFrame, sizeof(cg::FrameBlock));
+    for (int i = 0; i < frame.cascades.count; ++i) {
+        ctx.blockOffsets.cascadeFrames[i] =
+            cg::push_uniform_block(ctx.uniforms, &frame.cascadeFrames[i], sizeof(cg::FrameBlock));
+    }
+    ctx.blockOffsets.light =
+        cg::push_uniform_block(ctx.uniforms, &frame.light, sizeof(cg::LightBlock));
+
+    // Per-draw data
+    ctx.blockOffsets.objects.resize(frame.drawRuns.size());
+    for (unsigned i = 0; i < frame.drawRuns.size(); ++i) {
+        cg::ObjectBlock object = cg::ObjectBlock();
+        object.firstDraw = ctx.multiDraw.firstDraw + frame.drawRuns[i].first;
+        ctx.blockOffsets.objects[i] = cg::push_uniform_block(ctx.uniforms, &object, sizeof(object));
+    }
+}
+
+// Upload the instance transforms, draw commands and per-draw data, and
+// uniform blocks of the frame with a single update of the ring. The instance
+// transforms and per-draw data are read through buffer textures of the whole
+// ring buffer, with offsets that move if the ring grows while the frame is
+// written; the frame is then written again, to the next (large enough) region.
+void upload_frame_buffers(Context &ctx)
+{
+    cg::ProfileScope profileScope("upload_frame_buffers");
+    cg::StreamBuffer &stream = ctx.uniforms.stream;
+    bool useIndirect = ctx.frame.useMultiDrawIndirect;
+    int reallocations;
+    do {
+        reallocations = stream.reallocations;
+        cg::begin_uniform_ring_frame(ctx.uniforms);
+        int firstInstance =
+            gltf::write_instance_buffer(ctx.instances, stream, ctx.frame.instanceTransforms);
+        cg::write_multi_draw_buffer(ctx.multiDraw, stream, ctx.frame.drawCommands,
+                                    ctx.frame.drawData, firstInstance, useIndirect);
+        write_uniform_blocks(ctx);
+        cg::flush_uniform_ring(ctx.uniforms);
+    } while (stream.reallocations != reallocations);
+}
+
+// Draw the prepared frame (ctx.frame)
 void do_rendering(Context &ctx)
 {
+    cg::ProfileScope profileScope("do_rendering");
     // Clear render states at the start of each frame
     cg::reset_gl_render_state();
 
+    // Draw into the window, or into the offscreen target when rendering headless
+    glBindFramebuffer(GL_FRAMEBUFFER, ctx.framebuffer);
+    glViewport(0, 0, ctx.width, ctx.height);
+
     // Clear color and depth buffers
     glClearColor(ctx.backgroundColor.r, ctx.backgroundColor.g, ctx.backgroundColor.b, ctx.backgroundColor[3]);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    // Update Shadow Map
-    update_shadowmap(ctx, ctx.light, ctx.light.shadowFBO);
-    draw_scene(ctx);
+    ctx.stats = cg::RenderStats();
+    ctx.cpuSubmitTime = 0.0f;
+    {
+        cg::ProfileScope profileScope("update_texture_residency");
+        gltf::update_texture_residency(ctx.textures, ctx.asset, ctx.textureStreamer,
+                                       ctx.textureMemoryBudget);
+    }
+    {
+        cg::ProfileScope profileScope("update_texture_streamer");
+        cg::update_texture_streamer(ctx.textureStreamer);
+    }
+    request_frame_textures(ctx);
+    upload_frame_buffers(ctx);
+
+    // Update Shadow Map cascades (if the cached ones are out of date)
+    ctx.shadowCascadesUpdated = 0;
+    for (int i = 0; i < ctx.frame.cascades.count; ++i) {
+        update_shadow_cache(ctx, i);
+        if (!cg::shadow_cache_needs_update(ctx.shadowCaches[i])) continue;
+        update_shadowmap(ctx, ctx.light, i);
+        ctx.shadowCascadesUpdated += 1;
+    }
+    draw_scene_timed(ctx);
 
     if (ctx.showShadowMap)
     {
-        glClearColor(1.0, 1.0, 1.0, 1.0);
-        glClear(GL_COLOR_BUFFER_BIT);
-        update_shadowmap(ctx, ctx.light, 0);
+        draw_shadowmap_view(ctx);
     }
 }
 
+// Prepare and draw a frame. When pipelining, the frame prepared by the
+// previous call is drawn while this one is prepared on the worker pool, so
+// what is shown lags the settings by one frame. Frames are prepared and
+// drawn in turn otherwise, and after changes that leave the prepared frame
+// unusable (see framePrepared).
+void render_frame(Context &ctx)
+{
+    bool pipelined = ctx.pipelineFrames && ctx.framePrepared;
+    begin_frame_preparation(ctx, pipelined);
+    if (pipelined) do_rendering(ctx);
+    finish_frame_preparation(ctx);
+    if (!pipelined) do_rendering(ctx);
+}
+
+// Release the OpenGL resources of the renderer and the scene
+void do_cleanup(Context &ctx)
+{
+    gltf::destroy_instance_buffer(ctx.instances);
+    cg::destroy_uniform_ring(ctx.uniforms);
+    cg::destroy_shadow_cascades(ctx.light.cascades);
+    cg::destroy_multi_draw_buffer(ctx.multiDraw);
+    cg::destroy_shader_variants(ctx.meshPrograms);
+    glDeleteQueries(2, ctx.opaqueTimerQueries);
+    glDeleteQueries(2, ctx.fragmentQueries);
+    cg::destroy_gpu_profiler(ctx.gpuProfiler);
+    cg::destroy_texture_streamer(ctx.textureStreamer);
+    gltf::destroy_textures(ctx.textures);
+    gltf::destroy_drawables(ctx.drawables, ctx.geometry);
+    gltf::destroy_geometry_arena(ctx.geometry);
+}
+
+// Recompile the mesh program variants (lazily, as they are used next). The
+// prepared frame refers to the deleted programs, so it can not be drawn.
 void reload_shaders(Context *ctx)
 {
-    glDeleteProgram(ctx->program);
-    ctx->program = cg::load_shader_program(shader_dir() + "mesh.vert", shader_dir() + "mesh.frag");
+    cg::invalidate_shader_variants(ctx->meshPrograms);
+    ctx->framePrepared = false;
 }
 
 void error_callback(int /*error*/, const char *description)
@@ -483,13 +1592,33 @@ void show_gui_widgets(Context& ctx)
     if (ImGui::CollapsingHeader("Shadow Mapping"))
     {
         ImGui::Checkbox("Show Shadow Map", &ctx.showShadowMap);
+        ImGui::SliderInt("Cascades", &ctx.light.cascades.count, 1, cg::MAX_SHADOW_CASCADES);
+        ImGui::SliderFloat("Split Lambda", &ctx.light.cascades.splitLambda, 0.0f, 1.0f);
+        const char *filters[] = {"PCF (hardware 2x2)", "Poisson Disk", "Variance (blurred)"};
+        if (ImGui::Combo("Shadow Filter", &ctx.shadowFilter, filters, 3)) {
+            set_shadow_filter(ctx, ctx.shadowFilter);
+        }
+        if (ctx.shadowFilter == cg::SHADOW_FILTER_POISSON) {
+            ImGui::SliderInt("Poisson Taps", &ctx.shadowTaps, 4, 16);
+        }
+        const char *sizes[] = {"512", "1024", "2048", "4096"};
+        int sizeIndex = 0;
+        while ((512 << sizeIndex) < ctx.light.cascades.size && sizeIndex < 3) sizeIndex++;
+        if (ImGui::Combo("Cascade Size", &sizeIndex, sizes, 4)) {
+            resize_shadow_cascades(ctx, 512 << sizeIndex);
+        }
     }
 
     // Enivronment Mapping
     if (ImGui::CollapsingHeader("Environment Mapping"))
     {
         ImGui::Checkbox("Use Environment Mapping", &ctx.useCubemap);
-        ImGui::SliderInt("Cubemap Index", &ctx.cubemapId, 0, 8);
+        if (ImGui::SliderInt("Cubemap Index", &ctx.cubemapId, 0, 8)) {
+            // Point the compiled mesh programs to the texture unit of the cubemap
+            for (auto &variant : ctx.meshPrograms.programs) {
+                if (variant.second) initialize_mesh_program(variant.second, &ctx);
+            }
+        }
     }
 
     // Texture Mapping
@@ -506,12 +1635,236 @@ void show_gui_widgets(Context& ctx)
         ImGui::Checkbox("Use Normals as RGB Colors", &ctx.useNormalsAsColor);
         ImGui::Checkbox("Use Gamma Correction", &ctx.useGammaCorrection);
     }
+
+    // Statistics
+    if (ImGui::CollapsingHeader("Statistics"))
+    {
+        ImGui::Text("Draw calls: %d", ctx.stats.drawCalls);
+        ImGui::Text("Draws (incl. multi-draws): %d", ctx.stats.commands);
+        ImGui::Text("Instances drawn: %d", ctx.stats.instances);
+        ImGui::Text("Instance batches: %d", int(ctx.frame.instanceBatches.size()));
+        ImGui::Text("Binds: %d", ctx.stats.binds);
+        ImGui::Text("Program switches: %d", ctx.stats.programSwitches);
+        ImGui::Text("CPU frame time: %.3f ms", ctx.cpuFrameTime * 1000.0f);
+        ImGui::Text("CPU submit time: %.3f ms", ctx.cpuSubmitTime * 1000.0f);
+        ImGui::Text("Shadow cascades updated: %d", ctx.shadowCascadesUpdated);
+        ImGui::Text("Opaque pass GPU time: %.3f ms", ctx.gpuOpaqueTime * 1000.0f);
+        if (ctx.pipelineStatisticsSupported) {
+            ImGui::Text("Opaque pass fragments: %llu", (unsigned long long)ctx.opaqueFragments);
+        }
+        ImGui::Text("Startup time: %.3f s", ctx.startupTime);
+        ImGui::Text("Programs: %d from cache, %d compiled", ctx.programCache.loadedCount,
+                    ctx.programCache.compiledCount);
+        ImGui::Text("Tangents: %d from cache, %d generated", ctx.tangentCache->loadedCount.load(),
+                    ctx.tangentCache->generatedCount.load());
+        gltf::IndexStats indexStats = gltf::drawable_index_stats(ctx.drawables);
+        ImGui::Text("Index data: %.1f KB (%.1f KB in the asset)", indexStats.bytes / 1024.0,
+                    indexStats.assetBytes / 1024.0);
+        ImGui::Text("Index chunks: %d (%d split primitives, %d with strips)", indexStats.chunks,
+                    indexStats.splitPrimitives, indexStats.stripPrimitives);
+        ImGui::Text("Texture arrays: %d (%d textures)", int(ctx.textures.arrays.size()),
+                    int(ctx.textures.layers.size()));
+        ImGui::Text("Texture levels streamed: %d (%.1f MB), %d pending",
+                    ctx.textureStreamer.uploadedLevels,
+                    ctx.textureStreamer.uploadedBytes / (1024.0 * 1024.0),
+                    cg::pending_texture_levels(ctx.textureStreamer));
+        ImGui::Text("Texture memory: %.1f MB resident, %.1f MB evicted",
+                    ctx.textures.residentBytes / (1024.0 * 1024.0),
+                    ctx.textures.evictedBytes / (1024.0 * 1024.0));
+        if (ctx.textureMemoryBudget > 0) {
+            ImGui::Text("Texture budget: %.1f MB (%d reallocations)",
+                        ctx.textureMemoryBudget / (1024.0 * 1024.0), ctx.textures.reallocations);
+        }
+        if (ctx.multiDrawIndirectSupported) {
+            ImGui::Checkbox("Use Multi-Draw Indirect", &ctx.useMultiDrawIndirect);
+        } else {
+            ImGui::Text("Multi-draw indirect: not supported");
+        }
+        ImGui::Checkbox("Use Depth Pre-Pass", &ctx.useDepthPrepass);
+        ImGui::Checkbox("Pipeline Frame Preparation", &ctx.pipelineFrames);
+        ImGui::Text("Frame preparation: %.3f ms (%d worker threads)",
+                    ctx.frame.preparationTime * 1000.0f, int(ctx.workers->threads.size()));
+        const cg::StreamBuffer &stream = ctx.uniforms.stream;
+        ImGui::Text("Frame data ring: %d KB per frame (%s), %d KB used",
+                    stream.frameSize / 1024, stream.persistent ? "persistent" : "mapped per frame",
+                    stream.used / 1024);
+        ImGui::Text("Frame data ring fence waits: %d (%.3f ms), %d reallocations",
+                    stream.fenceWaits, stream.fenceWaitTime * 1000.0, stream.reallocations);
+    }
+
+    // Profiler (statistics of the last frames, in ms)
+    if (ImGui::CollapsingHeader("Profiler"))
+    {
+        bool profilerEnabled = cg::profilerEnabled.load();
+        if (ImGui::Checkbox("Enable Profiler", &profilerEnabled)) {
+            cg::set_profiler_enabled(profilerEnabled);
+        }
+        ImGui::Columns(4, "Profile");
+        ImGui::Text("Scope");
+        ImGui::NextColumn();
+        ImGui::Text("Min");
+        ImGui::NextColumn();
+        ImGui::Text("Avg");
+        ImGui::NextColumn();
+        ImGui::Text("p99");
+        ImGui::NextColumn();
+        for (const cg::ProfileScopeStats &scope : cg::get_profile_stats()) {
+            ImGui::Text("%s%s", scope.gpu ? "GPU " : "", scope.name.c_str());
+            ImGui::NextColumn();
+            ImGui::Text("%.3f", scope.minTime * 1000.0f);
+            ImGui::NextColumn();
+            ImGui::Text("%.3f", scope.avgTime * 1000.0f);
+            ImGui::NextColumn();
+            ImGui::Text("%.3f", scope.p99Time * 1000.0f);
+            ImGui::NextColumn();
+        }
+        ImGui::Columns(1);
+    }
+
+    // Occlusion Culling
+    if (ImGui::CollapsingHeader("Occlusion Culling"))
+    {
+        ImGui::Checkbox("Use Occlusion Culling", &ctx.useOcclusionCulling);
+        ImGui::SliderInt("Max Occluder Triangles", &ctx.maxOccluderTriangles, 0, 20000);
+        ImGui::SliderFloat("Min Occluder Size", &ctx.minOccluderSize, 0.0f, 1.0f);
+        ImGui::Text("Occluders: %d", ctx.frame.occluderCount);
+        ImGui::Text("Culled nodes: %d of %d", ctx.frame.occludedInstances,
+                    int(ctx.frame.instanceNodes.size()));
+        ImGui::Text("Culling time: %.3f ms", ctx.frame.occlusionCullingTime * 1000.0f);
+    }
+}
+
+// Load the OpenGL functions (once per process, since the function pointers
+// are shared by all contexts). A context has to be current.
+bool load_gl_functions()
+{
+    static std::once_flag once;
+    static bool loaded = false;
+    std::call_once(once, [] { loaded = !gl3wInit() && gl3wIsSupported(3, 3); });
+    return loaded;
 }
 
 int main(int argc, char *argv[])
 {
     Context ctx = Context();
-    if (argc > 1) { ctx.gltfFilename = std::string(argv[1]); }
+    int frameThreads = 0;
+    bool batch = false;
+    BatchOptions batchOptions;
+    BenchmarkOptions benchmarkOptions;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--instances" && i + 1 < argc) {
+            ctx.syntheticInstanceCount = std::atoi(argv[++i]);
+        } else if (arg == "--no-instancing") {
+            ctx.maxBatchInstances = 1;
+        } else if (arg == "--no-indirect") {
+            ctx.useMultiDrawIndirect = false;
+        } else if (arg == "--occlusion-culling") {
+            ctx.useOcclusionCulling = true;
+        } else if (arg == "--depth-prepass") {
+            ctx.useDepthPrepass = true;
+        } else if (arg == "--no-pipelining") {
+            ctx.pipelineFrames = false;
+        } else if (arg == "--no-persistent-mapping") {
+            ctx.usePersistentMapping = false;
+        } else if (arg == "--triangle-strips") {
+            ctx.useTriangleStrips = true;
+        } else if (arg == "--frame-threads" && i + 1 < argc) {
+            frameThreads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--texture-budget" && i + 1 < argc) {
+            ctx.textureStreamBudget = std::atoi(argv[++i]) * 1024;
+        } else if (arg == "--texture-memory" && i + 1 < argc) {
+            ctx.textureMemoryBudget = int64_t(std::atoi(argv[++i])) * 1024 * 1024;
+        } else if (arg == "--no-program-cache") {
+            ctx.useProgramCache = false;
+        } else if (arg == "--shadow-filter" && i + 1 < argc) {
+            std::string filter = argv[++i];
+            ctx.shadowFilter = (filter == "poisson")    ? cg::SHADOW_FILTER_POISSON
+                               : (filter == "variance") ? cg::SHADOW_FILTER_VARIANCE
+                                                        : cg::SHADOW_FILTER_PCF;
+        } else if (arg == "--profile") {
+            cg::set_profiler_enabled(true);
+        } else if (arg == "--trace" && i + 1 < argc) {
+            ctx.traceFilename = argv[++i];
+            cg::set_profiler_enabled(true);
+            cg::start_profile_trace();
+        } else if (arg == "--batch") {
+            batch = true;
+        } else if (arg == "--output" && i + 1 < argc) {
+            batchOptions.outputDir = argv[++i];
+        } else if (arg == "--size" && i + 1 < argc) {
+            // WIDTHxHEIGHT, or a single number for square images
+            std::string size = argv[++i];
+            batchOptions.width = std::atoi(size.c_str());
+            size_t x = size.find('x');
+            batchOptions.height = (x != std::string::npos) ? std::atoi(size.c_str() + x + 1)
+                                                           : batchOptions.width;
+            ctx.width = batchOptions.width;
+            ctx.height = batchOptions.height;
+        } else if (arg == "--turntable" && i + 1 < argc) {
+            batchOptions.turntableFrames = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--elevation" && i + 1 < argc) {
+            batchOptions.elevation = float(std::atof(argv[++i]));
+            benchmarkOptions.elevation = batchOptions.elevation;
+        } else if (arg == "--software") {
+            // Optionally followed by the number of threads
+            batchOptions.software = true;
+            if (i + 1 < argc && std::isdigit(argv[i + 1][0])) {
+                batchOptions.softwareThreads = std::atoi(argv[++i]);
+            }
+        } else if (arg == "--path-trace" && i + 1 < argc) {
+            batchOptions.pathTraceSamples = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--path-trace-time" && i + 1 < argc) {
+            batchOptions.pathTraceSeconds = std::atof(argv[++i]);
+        } else if (arg == "--no-fit") {
+            batchOptions.fitCamera = false;
+        } else if (arg == "--jobs" && i + 1 < argc) {
+            batchOptions.jobs = std::atoi(argv[++i]);
+        } else if (arg == "--encoder-threads" && i + 1 < argc) {
+            batchOptions.encoderThreads = std::atoi(argv[++i]);
+        } else if (arg == "--shard" && i + 1 < argc) {
+            // K/N: render the K:th (from 0) of N interleaved shares of the files
+            std::string shard = argv[++i];
+            size_t slash = shard.find('/');
+            if (slash != std::string::npos) {
+                batchOptions.shard = std::atoi(shard.c_str());
+                batchOptions.shardCount = std::max(1, std::atoi(shard.c_str() + slash + 1));
+            }
+        } else if (arg == "--benchmark" && i + 1 < argc) {
+            benchmarkOptions.frames = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--warmup" && i + 1 < argc) {
+            benchmarkOptions.warmupFrames = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--camera-path" && i + 1 < argc) {
+            benchmarkOptions.cameraPath = argv[++i];
+        } else if (arg == "--time-step" && i + 1 < argc) {
+            benchmarkOptions.timeStep = float(std::atof(argv[++i]));
+        } else if (arg == "--benchmark-json" && i + 1 < argc) {
+            benchmarkOptions.jsonFilename = argv[++i];
+        } else if (arg == "--record-camera" && i + 1 < argc) {
+            ctx.cameraRecordFilename = argv[++i];
+        } else {
+            ctx.gltfFilename = arg;
+            batchOptions.inputs.push_back(arg);
+        }
+    }
+
+    // Worker threads that prepare frames
+    cg::WorkerPool workers;
+    cg::start_worker_pool(workers, frameThreads);
+    ctx.workers = &workers;
+
+    // Tangents of normal-mapped primitives, which are generated when a file
+    // has none, and cached together with the program binaries
+    gltf::TangentCache tangentCache;
+    gltf::create_tangent_cache(tangentCache, ctx.useProgramCache ? cache_dir() : "");
+    ctx.tangentCache = &tangentCache;
+
+    // Headless batch rendering does not need a window (or a display)
+    if (batch || benchmarkOptions.frames > 0) {
+        int status = batch ? run_batch(ctx, batchOptions) : run_benchmark(ctx, benchmarkOptions);
+        cg::stop_worker_pool(workers);
+        std::exit(status);
+    }
 
     // Create a GLFW window
     glfwSetErrorCallback(error_callback);
@@ -531,7 +1884,7 @@ int main(int argc, char *argv[])
     glfwSetFramebufferSizeCallback(ctx.window, resize_callback);
 
     // Load OpenGL functions
-    if (gl3wInit() || !gl3wIsSupported(3, 3) /*check OpenGL version*/) {
+    if (!load_gl_functions()) {
         std::cerr << "Error: failed to initialize OpenGL" << std::endl;
         std::exit(EXIT_FAILURE);
     }
@@ -543,31 +1896,65 @@ int main(int argc, char *argv[])
     ImGui_ImplOpenGL3_Init("#version 330" /*GLSL version*/);
 
     // Initialize rendering
-    glGenVertexArrays(1, &ctx.emptyVAO);
-    glBindVertexArray(ctx.emptyVAO);
-    glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+    double startupStart = glfwGetTime();
     do_initialization(ctx);
+    load_scene(ctx, gltf_dir(), ctx.gltfFilename);
 
     // Start rendering loop
     while (!glfwWindowShouldClose(ctx.window)) {
+        // Collect the profile of the previous frame
+        cg::collect_profile_events();
+        cg::begin_gpu_profiler_frame(ctx.gpuProfiler);
+        cg::ProfileScope frameScope("frame");
+
         glfwPollEvents();
         ctx.elapsedTime = glfwGetTime();
 
-        ImGui_ImplOpenGL3_NewFrame();
-        ImGui_ImplGlfw_NewFrame();
-        ImGui::NewFrame();
-        ImGui::ShowDemoWindow();
-        show_gui_widgets(ctx);
-        do_rendering(ctx);
+        {
+            cg::ProfileScope profileScope("ImGui widgets");
+            ImGui_ImplOpenGL3_NewFrame();
+            ImGui_ImplGlfw_NewFrame();
+            ImGui::NewFrame();
+            ImGui::ShowDemoWindow();
+            show_gui_widgets(ctx);
+        }
+        double frameStart = glfwGetTime();
+        render_frame(ctx);
+        ctx.cpuFrameTime = float(glfwGetTime() - frameStart);
+        if (ctx.startupTime == 0.0f) {
+            // The mesh programs are built in the first frame, so include it
+            glFinish();
+            ctx.startupTime = float(glfwGetTime() - startupStart);
+            std::cout << "Startup time: " << ctx.startupTime << " s ("
+                      << ctx.programCache.loadedCount << " programs from cache, "
+                      << ctx.programCache.compiledCount << " compiled)" << std::endl;
+        }
         calculate_projection(ctx);
-        ImGui::Render();
-        ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        {
+            cg::ProfileScope profileScope("ImGui render");
+            cg::GpuProfileScope gpuProfileScope(ctx.gpuProfiler, "ImGui render");
+            ImGui::Render();
+            ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        }
 
+        if (!ctx.cameraRecordFilename.empty()) ctx.cameraRecord.push_back(ctx.trackball.orient);
 
+        cg::ProfileScope swapScope("glfwSwapBuffers");
         glfwSwapBuffers(ctx.window);
     }
+    if (!ctx.cameraRecordFilename.empty() &&
+        !write_camera_path(ctx.cameraRecordFilename, ctx.cameraRecord)) {
+        std::cerr << "Error: could not write " << ctx.cameraRecordFilename << std::endl;
+    }
+    if (!ctx.traceFilename.empty()) {
+        cg::flush_gpu_profiler(ctx.gpuProfiler);
+        cg::collect_profile_events();
+        cg::write_profile_trace(ctx.traceFilename);
+    }
 
     // Shutdown
+    do_cleanup(ctx);
+    cg::stop_worker_pool(workers);
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
     ImGui::DestroyContext();
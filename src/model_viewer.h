@@ -0,0 +1,337 @@
+// Rendering context of the model viewer, and the functions of the viewer
+// that both the interactive viewer (model_viewer.cpp) and the headless
+// drivers (model_viewer_headless.cpp) use.
+//
+
+#pragma once
+
+#include "gltf_render.h"
+#include "gltf_software.h"
+#include "gltf_tangents.h"
+#include "cg_trackball.h"
+#include "cg_multi_draw.h"
+#include "cg_occlusion_culling.h"
+#include "cg_profiler.h"
+#include "cg_render_queue.h"
+#include "cg_shader_variants.h"
+#include "cg_shadow_cache.h"
+#include "cg_shadow_cascades.h"
+#include "cg_texture_streamer.h"
+#include "cg_uniform_blocks.h"
+#include "cg_worker_pool.h"
+
+#include <GL/gl3w.h>
+#include <GLFW/glfw3.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtx/quaternion.hpp>
+
+#include <climits>
+#include <future>
+#include <string>
+#include <vector>
+
+// Struct for representing a shadow casting directional light
+struct ShadowCastingLight {
+    glm::vec3 position = glm::vec3(2, 2, 2);  // Light source position (shines towards the origin)
+    cg::ShadowCascades cascades;   // Cascaded shadowmaps
+    float shadowBias;              // Bias for depth comparison
+};
+
+// Texture arrays (indices into the texture pool) and layers of a material,
+// and the index of its texture set (distinct pair of arrays). Opaque draws
+// are sorted and merged by texture set rather than by material, since the
+// layers are per-draw data.
+struct MaterialTextures {
+    int baseColorArray = -1;
+    int normalArray = -1;
+    int layers = 0;  // Packed as cg::DrawData::materialLayers
+    unsigned textureSet = 0;
+};
+
+// Render passes, in the order they are submitted. There is one shadow pass
+// per cascade, starting at SHADOW_PASS.
+enum RenderPass {
+    SHADOW_PASS = 0,
+    DEPTH_PREPASS = cg::MAX_SHADOW_CASCADES,
+    OPAQUE_PASS = cg::MAX_SHADOW_CASCADES + 1
+};
+
+// Program slots used in render queue sort keys. The mesh program variants
+// used in a frame get the slots after the shadow program.
+enum ProgramSlot { SHADOW_PROGRAM = 0, FIRST_MESH_PROGRAM = 1 };
+
+// Feature bits of the mesh program variants, in the order of the #define
+// names passed to cg::create_shader_variants(). All but the shadow filters
+// are the cg::SoftwareFeature bits (see mesh_program_features()).
+enum MeshFeature {
+    USE_LIGHTING = cg::SOFTWARE_LIGHTING,
+    USE_AMBIENT_LIGHTING = cg::SOFTWARE_AMBIENT_LIGHTING,
+    USE_DIFFUSE_LIGHTING = cg::SOFTWARE_DIFFUSE_LIGHTING,
+    USE_SPECULAR_LIGHTING = cg::SOFTWARE_SPECULAR_LIGHTING,
+    USE_NORMALS_AS_COLOR = cg::SOFTWARE_NORMALS_AS_COLOR,
+    USE_GAMMA_CORRECTION = cg::SOFTWARE_GAMMA_CORRECTION,
+    USE_CUBEMAP = cg::SOFTWARE_CUBEMAP,
+    VISUALISE_TEXCOORDS = cg::SOFTWARE_TEXCOORDS_AS_COLOR,
+    USE_DIFFUSE_TEXTURE = cg::SOFTWARE_BASE_COLOR_TEXTURE,
+    USE_NORMAL_TEXTURE = cg::SOFTWARE_NORMAL_TEXTURE,
+    SHADOW_FILTER_POISSON = 1 << 10,
+    SHADOW_FILTER_VARIANCE = 1 << 11
+};
+
+// Range of the instances of a batch. Batches are split into slices of at
+// most INSTANCE_SLICE_SIZE instances for the worker threads, so that a few
+// large batches spread over the threads as well as many small ones.
+struct InstanceSlice {
+    int batch;
+    int first;  // Instance transforms [first, last)
+    int last;
+};
+
+const int INSTANCE_SLICE_SIZE = 1024;
+
+// Run of adjacent render queue items that are submitted with one draw call
+struct DrawRun {
+    int first;  // Render queue items [first, last)
+    int last;
+};
+
+// Everything that the render thread needs to draw a frame. It is prepared
+// from the settings and the scene by prepare_frame(), and not changed while
+// it is drawn. The context holds two, so that the next frame can be prepared
+// on the worker pool while the current one is drawn (see render_frame()).
+struct FrameSnapshot {
+    // Camera, and a copy of the shadow cascades of the light fitted to it
+    glm::mat4 view;
+    glm::mat4 projection;
+    cg::ShadowCascades cascades;
+    bool useDepthPrepass = false;
+    bool useMultiDrawIndirect = false;
+
+    // Program of each program slot in the render queue, and the slot of each
+    // material (of material index + 1)
+    std::vector<GLuint> programs;
+    std::vector<unsigned> materialSlots;
+
+    // Instancing. The grouping of the batches and their slices is kept until
+    // the geometry or the batch size limit changes.
+    std::vector<glm::mat4> worldMatrices;
+    std::vector<glm::mat4> instanceTransforms;
+    gltf::InstanceBatchList instanceBatches;
+    std::vector<int> rootNodes;
+    std::vector<int> instanceNodes;  // Node of each instance transform
+    std::vector<InstanceSlice> slices;
+    unsigned batchGeometryVersion = 0;
+    int batchInstanceLimit = 0;  // Value of maxBatchInstances that the batches were grouped with
+
+    // Software occlusion culling. The camera passes draw only the visible
+    // instances of each batch: those of partly occluded batches are copied
+    // after the transforms of all instances (see update_occlusion_culling()).
+    cg::OcclusionBuffer occlusionBuffer;
+    std::vector<char> instanceOccluded;  // Of each instance
+    std::vector<int> visibleInstanceFirst;  // Of each batch
+    std::vector<int> visibleInstanceCounts;
+    int occluderCount = 0;
+    int occludedInstances = 0;
+    float occlusionCullingTime = 0.0f;
+
+    // Render queue, the multi-draw command of each item, and the runs of
+    // items that are merged into one draw call
+    cg::RenderQueue renderQueue;
+    std::vector<cg::DrawElementsIndirectCommand> drawCommands;
+    std::vector<cg::DrawData> drawData;
+    std::vector<DrawRun> drawRuns;
+
+    // Largest size on screen of the draws of each material (of material
+    // index + 1, or -1 if it is not drawn), for texture residency requests
+    std::vector<float> materialScreenSizes;
+
+    // Contents of the uniform blocks of the frame
+    cg::FrameBlock cameraFrame;
+    cg::FrameBlock cascadeFrames[cg::MAX_SHADOW_CASCADES];
+    cg::LightBlock light;
+
+    // Partial results of the threads, kept to reuse their memory
+    std::vector<glm::vec3> sliceBoundsMin;
+    std::vector<glm::vec3> sliceBoundsMax;
+    std::vector<float> sliceLightDepths;
+    std::vector<float> sliceCameraDepths;
+    std::vector<glm::vec3> instanceBoundsMin;
+    std::vector<glm::vec3> instanceBoundsMax;
+    std::vector<int> sliceVisibleCounts;
+    std::vector<int> sliceVisibleFirst;
+    std::vector<float> batchLightDepths;
+    std::vector<float> batchCameraDepths;
+    std::vector<cg::RenderQueue> chunkItems;
+    std::vector<std::vector<float>> chunkScreenSizes;
+
+    float preparationTime = 0.0f;
+};
+
+// Struct for our application context
+struct Context {
+    int width = 512;
+    int height = 512;
+    GLFWwindow *window;
+    GLuint framebuffer = 0;  // Framebuffer that the scene is drawn into (0 for the window)
+    gltf::GLTFAsset asset;
+    gltf::GeometryArena geometry;
+    gltf::DrawableList drawables;
+    unsigned geometryVersion = 0;  // Incremented when drawables are (re)created
+    bool useTriangleStrips = false;  // Where they take fewer indices than triangle lists
+    cg::Trackball trackball;
+    cg::ProgramCache programCache;
+    bool useProgramCache = true;
+    gltf::TangentCache *tangentCache = nullptr;  // Shared by all contexts (see main())
+    cg::ShaderVariants meshPrograms;  // Mesh program variants, keyed by MeshFeature bits
+    GLuint emptyVAO;
+    float elapsedTime;
+    std::string gltfFilename = "armadillo.gltf";
+    glm::vec4 backgroundColor = glm::vec4(0);
+    
+    // Shadow Mapping
+    ShadowCastingLight light;
+    GLuint shadowProgram;
+    GLuint shadowViewProgram;
+    GLuint shadowBlurProgram;
+    cg::ShadowCache shadowCaches[cg::MAX_SHADOW_CASCADES];
+    bool showShadowMap = false;
+    int shadowFilter = cg::SHADOW_FILTER_PCF;
+    int shadowTaps = 8;
+    int shadowMomentsTextureId = 14;
+
+    // Lighting Parameters
+    glm::vec3 ambientColor = glm::vec3(0.01);
+    glm::vec3 lightPosition;
+    glm::vec3 diffuseColor = glm::vec3(0.01);
+    glm::vec3 specularColor = glm::vec3(0.04);
+    float specularPower = 2.0f;
+
+    // Textures
+    gltf::TexturePool textures;
+    std::vector<MaterialTextures> materialTextures;  // Of material index + 1 (none first)
+    cg::TextureStreamer textureStreamer;
+    int textureStreamBudget = 2 * 1024 * 1024;  // Bytes of texture levels uploaded per frame
+    int64_t textureMemoryBudget = 0;            // Bytes of resident texture arrays (0: no limit)
+    int baseColorTextureId = 9;
+    int normalMapTextureId = 10;
+
+    // Cube Map Active Texture ID
+    int cubemapId;
+
+    // Frame preparation. The frame that is drawn, and the next one, which is
+    // prepared on the worker pool while the other is drawn when pipelining.
+    cg::WorkerPool *workers = nullptr;
+    FrameSnapshot frame;
+    FrameSnapshot nextFrame;
+    std::shared_future<void> preparation;  // Of the next frame, while it runs on the pool
+    bool framePrepared = false;            // Cleared when the frame can no longer be drawn
+    bool pipelineFrames = true;
+
+    // Instancing
+    gltf::InstanceBuffer instances;
+    int instanceTextureId = 12;
+    int syntheticInstanceCount = 0;
+    int maxBatchInstances = INT_MAX;
+
+    // Multi-draw commands, one per render queue item
+    cg::MultiDrawBuffer multiDraw;
+    int drawTextureId = 13;
+    bool multiDrawIndirectSupported = false;
+    bool useMultiDrawIndirect = true;
+
+    // Depth pre-pass, so that the opaque pass shades each pixel only once
+    bool useDepthPrepass = false;
+
+    // Software occlusion culling of the opaque pass. Instances of mesh
+    // primitives with few triangles that cover a large part of the view are
+    // used as occluders.
+    bool useOcclusionCulling = false;
+    std::vector<std::vector<cg::OccluderMesh>> occluderMeshes;  // Per mesh primitive
+    int maxOccluderTriangles = 2048;
+    float minOccluderSize = 0.2f;  // Screen-space size, relative to the view
+
+    // Ring for the uniform blocks, instance transforms and draw data of each
+    // frame (see upload_frame_buffers()), and the uniform block offsets in the
+    // current frame
+    cg::UniformRing uniforms;
+    bool usePersistentMapping = true;  // Of the ring, if GL_ARB_buffer_storage is supported
+    struct {
+        int cameraFrame;
+        int cascadeFrames[cg::MAX_SHADOW_CASCADES];
+        int light;
+        std::vector<int> objects;    // Draw run -> offset of ObjectBlock
+    } blockOffsets;
+
+    // Camera Parameters
+    glm::mat4 projectionMatrix;
+    glm::vec3 cameraTarget = glm::vec3(0.0f);  // Point that the camera looks at and orbits
+    float cameraDistance = 5.0f;
+    float fov = 45.0f;
+    float zoomFactor = 0.0f;
+    float orthographicScale = 3.0f;
+
+    // Flags
+    bool useLighting = true;
+    bool useDiffuseLighting = true;
+    bool useAmbientLighting = true;
+    bool useSpecularLighting = true;
+    bool useNormalsAsColor = false;
+    bool useOrthographicProjection = false;
+    bool useGammaCorrection = true;
+    bool useCubemap = false;
+
+    bool visualiseTextureCoords = false;
+    bool useDiffuseTexture = true;
+    bool useNormalTexture = true;
+
+    // Statistics
+    cg::RenderStats stats;
+    float cpuFrameTime = 0.0f;
+    float cpuSubmitTime = 0.0f;
+    int shadowCascadesUpdated = 0;
+    GLuint opaqueTimerQueries[2] = {};  // GPU time of the opaque pass
+    GLuint fragmentQueries[2] = {};     // Fragment shader invocations of the opaque pass
+    GLuint fragmentQuery = 0;           // Fragment query of the current frame
+    bool pipelineStatisticsSupported = false;
+    int timedFrames = 0;
+    float gpuOpaqueTime = 0.0f;
+    GLuint64 opaqueFragments = 0;
+    float startupTime = 0.0f;  // Time to initialize and draw the first frame
+
+    // Profiling (scopes are only timed while the profiler is enabled)
+    cg::GpuProfiler gpuProfiler;
+    std::string traceFilename;  // Chrome trace to write at exit, if not empty
+    std::string cameraRecordFilename;  // Trackball orientations to write at exit (--record-camera)
+    std::vector<glm::quat> cameraRecord;
+
+    // Add more variables here...
+};
+
+// Directories of the shaders, cubemaps, glTF files and cached program
+// binaries, under $MODEL_VIEWER_ROOT
+std::string shader_dir(void);
+std::string cubemap_dir(void);
+std::string gltf_dir(void);
+std::string cache_dir(void);
+
+// Camera and light
+void calculate_projection(Context &ctx);
+glm::mat4 camera_view_matrix(const Context &ctx);
+glm::vec3 light_direction(const Context &ctx);
+void scene_bounds(const gltf::InstanceBatchList &batches, glm::vec3 &sceneMin,
+                  glm::vec3 &sceneMax);
+void set_frame_camera(const Context &ctx, FrameSnapshot &frame);
+void update_shadow_cascades(const Context &ctx, FrameSnapshot &frame);
+
+gltf::SoftwareShading software_shading(const Context &ctx);
+unsigned mesh_program_features(const Context &ctx, int materialIndex);
+
+// Set-up, scenes, and rendering of frames
+bool load_gl_functions();
+void do_initialization(Context &ctx);
+bool load_scene(Context &ctx, const std::string &directory, const std::string &filename);
+void unload_scene(Context &ctx);
+void update_instances(const Context &ctx, FrameSnapshot &frame);
+void render_frame(Context &ctx);
+void do_cleanup(Context &ctx);
@@ -0,0 +1,604 @@
+// Headless drivers of the model viewer: batch rendering of images of glTF
+// files (--batch), and the scripted benchmark (--benchmark).
+//
+
+#include "model_viewer_headless.h"
+#include "gltf_render.h"
+#include "gltf_software.h"
+#include "cg_utils.h"
+#include "cg_headless.h"
+#include "cg_image_writer.h"
+#include "cg_path_tracer.h"
+#include "cg_profiler.h"
+#include "cg_software_renderer.h"
+
+#include <GL/gl3w.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+#include <glm/gtx/quaternion.hpp>
+
+#include <rapidjson/prettywriter.h>
+#include <rapidjson/stringbuffer.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+bool has_suffix(const std::string &str, const std::string &suffix)
+{
+    return str.size() >= suffix.size() &&
+           str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Split a path into its directory (empty, or ending with a slash) and name
+void split_path(const std::string &path, std::string &directory, std::string &name)
+{
+    size_t slash = path.find_last_of("/\\");
+    directory = (slash == std::string::npos) ? "" : path.substr(0, slash + 1);
+    name = path.substr(directory.size());
+}
+
+// Expand the batch inputs into the list of glTF files of this shard
+std::vector<std::string> collect_batch_files(const BatchOptions &options)
+{
+    std::vector<std::string> files;
+    for (const std::string &input : options.inputs) {
+        if (has_suffix(input, ".gltf")) {
+            files.push_back(input);
+        } else if (has_suffix(input, ".txt")) {
+            std::ifstream list(input);
+            std::string line;
+            while (std::getline(list, line)) {
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                if (!line.empty()) files.push_back(line);
+            }
+        } else {
+            for (const std::string &name : cg::list_directory(input, ".gltf")) {
+                files.push_back(input + "/" + name);
+            }
+        }
+    }
+
+    std::vector<std::string> shardFiles;
+    for (unsigned i = options.shard; i < files.size(); i += options.shardCount) {
+        shardFiles.push_back(files[i]);
+    }
+    return shardFiles;
+}
+
+// Point the camera at the center of the instance batches, from a distance at
+// which their bounding sphere fits in the view
+void fit_camera_to_bounds(Context &ctx)
+{
+    glm::vec3 sceneMin, sceneMax;
+    scene_bounds(ctx.frame.instanceBatches, sceneMin, sceneMax);
+    float radius = 0.5f * glm::length(sceneMax - sceneMin);
+    if (radius <= 0.0f) return;
+
+    float aspect = float(ctx.width) / float(ctx.height);
+    float halfFov = std::atan(std::tan(glm::radians(0.5f * ctx.fov)) * std::min(aspect, 1.0f));
+    ctx.cameraTarget = 0.5f * (sceneMin + sceneMax);
+    ctx.cameraDistance = radius / std::sin(halfFov);
+    ctx.orthographicScale = radius / std::min(aspect, 1.0f);
+}
+
+void fit_camera_to_scene(Context &ctx)
+{
+    update_instances(ctx, ctx.frame);
+    fit_camera_to_bounds(ctx);
+}
+
+// Return the model orientation of a camera that orbits the vertical axis
+glm::quat orbit_orientation(float elevation, float angle)
+{
+    return glm::angleAxis(glm::radians(elevation), glm::vec3(1, 0, 0)) *
+           glm::angleAxis(angle, glm::vec3(0, 1, 0));
+}
+
+// Return the model orientation of an image of a turntable
+glm::quat turntable_orientation(const BatchOptions &options, int frame)
+{
+    float angle = glm::two_pi<float>() * frame / options.turntableFrames;
+    return orbit_orientation(options.elevation, angle);
+}
+
+std::string batch_image_filename(const BatchOptions &options, const std::string &name, int frame)
+{
+    std::string filename = options.outputDir + "/" + name.substr(0, name.size() - 5);
+    if (options.turntableFrames > 1) {
+        char suffix[16];
+        std::snprintf(suffix, sizeof(suffix), "_%03d", frame);
+        filename += suffix;
+    }
+    return filename + ".png";
+}
+
+// Render the batch files of one worker thread (files worker, worker + jobs,
+// ...) with its own headless context. The pixels of each image are read back
+// while the next image renders, and handed to the image writer for encoding.
+void run_batch_worker(const Context &settings, const BatchOptions &options,
+                      const std::vector<std::string> &files, int worker,
+                      cg::ImageWriter &writer, int &failedFiles)
+{
+    cg::HeadlessContext headless;
+    if (!cg::create_headless_context(headless) || !load_gl_functions()) {
+        for (unsigned i = worker; i < files.size(); i += options.jobs) failedFiles += 1;
+        cg::destroy_headless_context(headless);
+        return;
+    }
+
+    Context ctx = settings;
+    ctx.width = options.width;
+    ctx.height = options.height;
+    ctx.pipelineFrames = false;  // Each image shows its own turntable frame
+    do_initialization(ctx);
+    cg::OffscreenTarget target;
+    cg::create_offscreen_target(target, ctx.width, ctx.height);
+    ctx.framebuffer = target.framebuffer;
+
+    std::vector<uint8_t> pixels;
+    std::string pendingFilename;  // Image of the readback that is in flight
+    int imageCount = 0;
+    for (unsigned i = worker; i < files.size(); i += options.jobs) {
+        std::string directory, name;
+        split_path(files[i], directory, name);
+        {
+            cg::ProfileScope profileScope("load_scene");
+            unload_scene(ctx);
+            if (!load_scene(ctx, directory, name)) {
+                failedFiles += 1;
+                continue;
+            }
+            cg::finish_texture_streaming(ctx.textureStreamer);
+            if (options.fitCamera) fit_camera_to_scene(ctx);
+        }
+
+        for (int frame = 0; frame < options.turntableFrames; ++frame) {
+            cg::collect_profile_events();
+            cg::begin_gpu_profiler_frame(ctx.gpuProfiler);
+            ctx.trackball.orient = turntable_orientation(options, frame);
+            render_frame(ctx);
+            cg::begin_offscreen_readback(target, imageCount % 2);
+            if (!pendingFilename.empty()) {
+                cg::ProfileScope profileScope("finish_offscreen_readback");
+                cg::finish_offscreen_readback(target, (imageCount + 1) % 2, pixels);
+                cg::write_png_async(writer, pendingFilename, ctx.width, ctx.height, pixels);
+            }
+            pendingFilename = batch_image_filename(options, name, frame);
+            imageCount += 1;
+        }
+    }
+    if (!pendingFilename.empty()) {
+        cg::finish_offscreen_readback(target, (imageCount + 1) % 2, pixels);
+        cg::write_png_async(writer, pendingFilename, ctx.width, ctx.height, pixels);
+    }
+
+    cg::flush_gpu_profiler(ctx.gpuProfiler);
+    cg::destroy_offscreen_target(target);
+    do_cleanup(ctx);
+    cg::destroy_headless_context(headless);
+}
+
+// Return the directory of the cubemap that mesh programs sample (the one
+// bound to texture unit ctx.cubemapId by load_cubemaps())
+std::string mesh_cubemap_dir(const Context &ctx)
+{
+    const char *prefiltered[] = {"2048", "512", "128", "32", "8", "2", "0.5", "0.125"};
+    std::string dirname = cubemap_dir() + "Forrest";
+    if (ctx.cubemapId >= 1 && ctx.cubemapId <= 8) {
+        dirname += std::string("/prefiltered/") + prefiltered[ctx.cubemapId - 1];
+    }
+    return dirname;
+}
+
+// Load a glTF file for the software renderers, and fit the camera (unless
+// options.fitCamera is off) and the shadow cascades of the frames to its
+// instance batches. Returns false if the file could not be loaded.
+bool load_batch_software_scene(Context &ctx, const BatchOptions &options,
+                               const std::string &directory, const std::string &name,
+                               gltf::SoftwareScene &scene)
+{
+    cg::ProfileScope profileScope("load_scene");
+    if (!gltf::load_software_scene(scene, directory, name, ctx.syntheticInstanceCount,
+                                   ctx.maxBatchInstances, ctx.tangentCache)) {
+        return false;
+    }
+    ctx.frame.instanceBatches = scene.batches;
+    if (options.fitCamera) fit_camera_to_bounds(ctx);
+    return true;
+}
+
+// Start the workers that a software renderer or path tracer of a batch
+// worker thread shares its passes with, so that it runs on softwareThreads
+// threads in all (one per hardware thread if 0)
+void start_software_workers(cg::WorkerPool &workers, const BatchOptions &options)
+{
+    if (options.softwareThreads != 1) {
+        cg::start_worker_pool(workers, std::max(options.softwareThreads - 1, 0));
+    }
+}
+
+// Render the batch files of one worker thread like run_batch_worker(), but
+// with the software renderer, so that no OpenGL context is needed
+void run_software_batch_worker(const Context &settings, const BatchOptions &options,
+                               const std::vector<std::string> &files, int worker,
+                               cg::ImageWriter &writer, int &failedFiles)
+{
+    Context ctx = settings;
+    ctx.width = options.width;
+    ctx.height = options.height;
+    cg::WorkerPool workers;
+    start_software_workers(workers, options);
+    cg::SoftwareRenderer renderer;
+    cg::create_software_renderer(renderer, ctx.width, ctx.height, workers);
+    cg::SoftwareCubemap cubemap;
+    if (ctx.useCubemap && !cg::load_software_cubemap(cubemap, mesh_cubemap_dir(ctx))) {
+        std::cerr << "Error: could not load cubemap " << mesh_cubemap_dir(ctx) << std::endl;
+    }
+
+    gltf::SoftwareShading shading = software_shading(ctx);
+    gltf::SoftwareScene scene;
+    std::vector<cg::SoftwareDraw> draws;
+    std::vector<uint8_t> pixels;
+    for (unsigned i = worker; i < files.size(); i += options.jobs) {
+        std::string directory, name;
+        split_path(files[i], directory, name);
+        if (!load_batch_software_scene(ctx, options, directory, name, scene)) {
+            failedFiles += 1;
+            continue;
+        }
+        gltf::create_software_draws(scene, shading, draws);
+
+        for (int frame = 0; frame < options.turntableFrames; ++frame) {
+            cg::collect_profile_events();
+            ctx.trackball.orient = turntable_orientation(options, frame);
+            set_frame_camera(ctx, ctx.frame);
+            update_shadow_cascades(ctx, ctx.frame);
+            cg::SoftwareFrame softwareFrame;
+            gltf::create_software_frame(shading, ctx.frame.view, ctx.frame.projection,
+                                        ctx.frame.cascades, cubemap, softwareFrame);
+            {
+                cg::ProfileScope profileScope("render_software_frame");
+                cg::render_software_frame(renderer, softwareFrame, draws);
+            }
+            cg::read_software_pixels(renderer, pixels);
+            cg::write_png_async(writer, batch_image_filename(options, name, frame), ctx.width,
+                                ctx.height, pixels);
+        }
+    }
+    cg::stop_worker_pool(workers);
+}
+
+// Render reference images of the batch files of one worker thread with the
+// path tracer. The scene is lit by the Forrest cubemap (or the ambient color
+// if it cannot be loaded) and by the shadow-casting light as a sun.
+void run_path_tracer_batch_worker(const Context &settings, const BatchOptions &options,
+                                  const std::vector<std::string> &files, int worker,
+                                  cg::ImageWriter &writer, int &failedFiles)
+{
+    Context ctx = settings;
+    ctx.width = options.width;
+    ctx.height = options.height;
+    cg::WorkerPool workers;
+    start_software_workers(workers, options);
+    cg::PathTracer tracer;
+    cg::create_path_tracer(tracer, ctx.width, ctx.height, workers);
+    cg::SoftwareCubemap environment;
+    std::string environmentDir = cubemap_dir() + "Forrest";
+    if (!cg::load_software_cubemap(environment, environmentDir)) {
+        std::cerr << "Error: could not load cubemap " << environmentDir << std::endl;
+    }
+
+    gltf::SoftwareShading shading = software_shading(ctx);
+    gltf::SoftwareScene scene;
+    cg::PathTracerScene tracerScene;
+    std::vector<uint8_t> pixels;
+    for (unsigned i = worker; i < files.size(); i += options.jobs) {
+        std::string directory, name;
+        split_path(files[i], directory, name);
+        if (!load_batch_software_scene(ctx, options, directory, name, scene)) {
+            failedFiles += 1;
+            continue;
+        }
+
+        {
+            cg::ProfileScope profileScope("build_path_tracer_scene");
+            gltf::create_path_tracer_scene(scene, tracerScene);
+        }
+
+        for (int frame = 0; frame < options.turntableFrames; ++frame) {
+            cg::collect_profile_events();
+            ctx.trackball.orient = turntable_orientation(options, frame);
+            calculate_projection(ctx);
+            cg::PathTracerFrame pathTracerFrame;
+            gltf::create_path_tracer_frame(shading, camera_view_matrix(ctx), ctx.projectionMatrix,
+                                           -light_direction(ctx), environment, pathTracerFrame);
+            {
+                cg::ProfileScope profileScope("trace_path_tracer_samples");
+                cg::reset_path_tracer(tracer);
+                cg::trace_path_tracer_samples(tracer, tracerScene, pathTracerFrame,
+                                              options.pathTraceSamples, options.pathTraceSeconds);
+            }
+            std::ostringstream message;
+            message << batch_image_filename(options, name, frame) << ": " << tracer.samples
+                    << " samples/pixel in " << tracer.seconds << " s ("
+                    << tracer.rays / tracer.seconds * 1e-6 << " Mrays/s)" << std::endl;
+            std::cout << message.str();
+            cg::read_path_tracer_pixels(tracer, pixels);
+            cg::write_png_async(writer, batch_image_filename(options, name, frame), ctx.width,
+                                ctx.height, pixels);
+        }
+    }
+    cg::stop_worker_pool(workers);
+}
+
+int run_batch(const Context &settings, BatchOptions options)
+{
+    std::vector<std::string> files = collect_batch_files(options);
+    if (files.empty()) {
+        std::cerr << "Error: no glTF files to render" << std::endl;
+        return EXIT_FAILURE;
+    }
+    options.jobs = std::max(1, std::min(options.jobs, int(files.size())));
+
+    cg::ImageWriter writer;
+    cg::start_image_writer(writer, std::max(1, options.encoderThreads));
+    double startTime = cg::get_time();
+    std::vector<int> failedFiles(options.jobs, 0);
+    std::vector<std::thread> workers;
+    auto worker = options.software ? run_software_batch_worker : run_batch_worker;
+    if (options.pathTraceSamples > 0) worker = run_path_tracer_batch_worker;
+    for (int i = 1; i < options.jobs; ++i) {
+        workers.push_back(std::thread(worker, std::cref(settings), std::cref(options),
+                                      std::cref(files), i, std::ref(writer),
+                                      std::ref(failedFiles[i])));
+    }
+    worker(settings, options, files, 0, writer, failedFiles[0]);
+    for (std::thread &worker : workers) worker.join();
+    cg::stop_image_writer(writer);
+    double elapsed = cg::get_time() - startTime;
+
+    int failed = 0;
+    for (int count : failedFiles) failed += count;
+    std::cout << "Rendered " << writer.writtenCount << " images of " << files.size() - failed
+              << " files in " << elapsed << " s (" << writer.writtenCount / elapsed
+              << " images/s, " << options.jobs << " render threads)" << std::endl;
+    if (failed) std::cerr << "Error: " << failed << " files could not be rendered" << std::endl;
+    if (!settings.traceFilename.empty()) {
+        cg::collect_profile_events();
+        cg::write_profile_trace(settings.traceFilename);
+    }
+    return (failed || writer.failedCount) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+bool write_camera_path(const std::string &filename, const std::vector<glm::quat> &path)
+{
+    std::ofstream file(filename);
+    if (!file) return false;
+    file.precision(9);
+    for (const glm::quat &orient : path) {
+        file << orient.w << " " << orient.x << " " << orient.y << " " << orient.z << "\n";
+    }
+    return bool(file);
+}
+
+bool read_camera_path(const std::string &filename, std::vector<glm::quat> &path)
+{
+    std::ifstream file(filename);
+    if (!file) return false;
+    glm::quat orient;
+    while (file >> orient.w >> orient.x >> orient.y >> orient.z) {
+        path.push_back(glm::normalize(orient));
+    }
+    return !path.empty();
+}
+
+// Return the p:th percentile (0-100) of sorted samples, by the nearest rank
+float percentile(const std::vector<float> &sorted, float p)
+{
+    if (sorted.empty()) return 0.0f;
+    int rank = int(std::ceil(p / 100.0f * sorted.size()));
+    return sorted[std::max(rank, 1) - 1];
+}
+
+// Results of a benchmark, in seconds and per frame
+struct BenchmarkResults {
+    std::vector<float> frameTimes;  // Sorted
+    double drawCalls = 0.0;
+    double triangles = 0.0;
+    double instances = 0.0;
+    std::vector<cg::ProfileScopeStats> scopes;
+};
+
+void print_benchmark_results(const Context &ctx, const BenchmarkResults &results)
+{
+    const std::vector<float> &times = results.frameTimes;
+    double sum = 0.0;
+    for (float time : times) sum += time;
+    std::printf("Benchmark: %s, %dx%d, %d frames (%s)\n", ctx.gltfFilename.c_str(), ctx.width,
+                ctx.height, int(times.size()), (const char *)glGetString(GL_RENDERER));
+    std::printf("Frame time (ms): mean %.3f, median %.3f, p95 %.3f, p99 %.3f, min %.3f, "
+                "max %.3f\n",
+                sum / times.size() * 1e3, percentile(times, 50) * 1e3,
+                percentile(times, 95) * 1e3, percentile(times, 99) * 1e3, times.front() * 1e3,
+                times.back() * 1e3);
+    std::printf("Per frame: %.1f draw calls, %.0f triangles, %.1f instances\n",
+                results.drawCalls, results.triangles, results.instances);
+    std::printf("Throughput: %.2f M triangles/s\n",
+                results.triangles * times.size() / sum * 1e-6);
+    gltf::IndexStats indexStats = gltf::drawable_index_stats(ctx.drawables);
+    std::printf("Index data: %.1f KB (%.1f KB in the asset), %d chunks, %d split primitives, "
+                "%d with strips\n",
+                indexStats.bytes / 1024.0, indexStats.assetBytes / 1024.0, indexStats.chunks,
+                indexStats.splitPrimitives, indexStats.stripPrimitives);
+    const cg::StreamBuffer &stream = ctx.uniforms.stream;
+    std::printf("Frame data ring: %d KB per frame (%s), %d fence waits (%.3f ms), "
+                "%d reallocations\n",
+                stream.frameSize / 1024, stream.persistent ? "persistent" : "mapped per frame",
+                stream.fenceWaits, stream.fenceWaitTime * 1e3, stream.reallocations);
+    std::printf("%-28s %10s %10s %10s\n", "Scope (ms)", "min", "avg", "p99");
+    for (const cg::ProfileScopeStats &scope : results.scopes) {
+        std::printf("%-24s %s %10.3f %10.3f %10.3f\n", scope.name.c_str(),
+                    scope.gpu ? "GPU" : "CPU", scope.minTime * 1e3, scope.avgTime * 1e3,
+                    scope.p99Time * 1e3);
+    }
+}
+
+bool write_benchmark_json(const std::string &filename, const Context &ctx,
+                          const BenchmarkResults &results)
+{
+    const std::vector<float> &times = results.frameTimes;
+    double sum = 0.0;
+    for (float time : times) sum += time;
+
+    // Times are in milliseconds
+    rapidjson::StringBuffer buffer;
+    rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key("asset");
+    writer.String(ctx.gltfFilename.c_str());
+    writer.Key("renderer");
+    writer.String((const char *)glGetString(GL_RENDERER));
+    writer.Key("width");
+    writer.Int(ctx.width);
+    writer.Key("height");
+    writer.Int(ctx.height);
+    writer.Key("frames");
+    writer.Int(int(times.size()));
+    writer.Key("frameTime");
+    writer.StartObject();
+    writer.Key("mean");
+    writer.Double(sum / times.size() * 1e3);
+    writer.Key("median");
+    writer.Double(percentile(times, 50) * 1e3);
+    writer.Key("p95");
+    writer.Double(percentile(times, 95) * 1e3);
+    writer.Key("p99");
+    writer.Double(percentile(times, 99) * 1e3);
+    writer.Key("min");
+    writer.Double(times.front() * 1e3);
+    writer.Key("max");
+    writer.Double(times.back() * 1e3);
+    writer.EndObject();
+    writer.Key("drawCalls");
+    writer.Double(results.drawCalls);
+    writer.Key("triangles");
+    writer.Double(results.triangles);
+    writer.Key("instances");
+    writer.Double(results.instances);
+    writer.Key("fenceWaits");
+    writer.Int(ctx.uniforms.stream.fenceWaits);
+    gltf::IndexStats indexStats = gltf::drawable_index_stats(ctx.drawables);
+    writer.Key("indexBytes");
+    writer.Int64(indexStats.bytes);
+    writer.Key("assetIndexBytes");
+    writer.Int64(indexStats.assetBytes);
+    writer.Key("scopes");
+    writer.StartArray();
+    for (const cg::ProfileScopeStats &scope : results.scopes) {
+        writer.StartObject();
+        writer.Key("name");
+        writer.String(scope.name.c_str());
+        writer.Key("gpu");
+        writer.Bool(scope.gpu);
+        writer.Key("min");
+        writer.Double(scope.minTime * 1e3);
+        writer.Key("avg");
+        writer.Double(scope.avgTime * 1e3);
+        writer.Key("p99");
+        writer.Double(scope.p99Time * 1e3);
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
+
+    std::ofstream file(filename);
+    file << buffer.GetString() << "\n";
+    return bool(file);
+}
+
+int run_benchmark(const Context &settings, const BenchmarkOptions &options)
+{
+    std::vector<glm::quat> cameraPath;
+    if (!options.cameraPath.empty() && !read_camera_path(options.cameraPath, cameraPath)) {
+        std::cerr << "Error: could not read camera path " << options.cameraPath << std::endl;
+        return EXIT_FAILURE;
+    }
+    cg::HeadlessContext headless;
+    if (!cg::create_headless_context(headless) || !load_gl_functions()) {
+        cg::destroy_headless_context(headless);
+        return EXIT_FAILURE;
+    }
+
+    Context ctx = settings;
+    do_initialization(ctx);
+    cg::OffscreenTarget target;
+    cg::create_offscreen_target(target, ctx.width, ctx.height);
+    ctx.framebuffer = target.framebuffer;
+    bool loaded = load_scene(ctx, gltf_dir(), ctx.gltfFilename);
+    if (!loaded) std::cerr << "Error: could not load " << ctx.gltfFilename << std::endl;
+    cg::finish_texture_streaming(ctx.textureStreamer);
+
+    cg::set_profiler_enabled(true);
+    BenchmarkResults results;
+    int frameCount = options.warmupFrames + options.frames;
+    for (int frame = 0; loaded && frame < frameCount; ++frame) {
+        int timedFrame = frame - options.warmupFrames;
+        if (timedFrame == 0) {
+            // Drop the profile of the warmup frames, and keep all timed ones
+            cg::flush_gpu_profiler(ctx.gpuProfiler);
+            cg::collect_profile_events();
+            cg::reset_profile_stats(options.frames);
+        }
+        cg::collect_profile_events();
+        cg::begin_gpu_profiler_frame(ctx.gpuProfiler);
+
+        ctx.elapsedTime = std::max(timedFrame, 0) * options.timeStep;
+        if (cameraPath.empty()) {
+            float angle = glm::two_pi<float>() * std::max(timedFrame, 0) / options.frames;
+            ctx.trackball.orient = orbit_orientation(options.elevation, angle);
+        } else {
+            ctx.trackball.orient = cameraPath[std::max(timedFrame, 0) % cameraPath.size()];
+        }
+
+        // Without a window to swap, wait for the GPU to finish the frame
+        double frameStart = cg::get_time();
+        render_frame(ctx);
+        glFinish();
+        if (timedFrame < 0) continue;
+        results.frameTimes.push_back(float(cg::get_time() - frameStart));
+        results.drawCalls += ctx.stats.drawCalls;
+        results.triangles += ctx.stats.triangles;
+        results.instances += ctx.stats.instances;
+    }
+    cg::flush_gpu_profiler(ctx.gpuProfiler);
+    cg::collect_profile_events();
+
+    bool written = true;
+    if (!results.frameTimes.empty()) {
+        std::sort(results.frameTimes.begin(), results.frameTimes.end());
+        results.drawCalls /= results.frameTimes.size();
+        results.triangles /= results.frameTimes.size();
+        results.instances /= results.frameTimes.size();
+        results.scopes = cg::get_profile_stats();
+        print_benchmark_results(ctx, results);
+        if (!options.jsonFilename.empty()) {
+            written = write_benchmark_json(options.jsonFilename, ctx, results);
+            if (!written) {
+                std::cerr << "Error: could not write " << options.jsonFilename << std::endl;
+            }
+        }
+    }
+    if (!settings.traceFilename.empty()) cg::write_profile_trace(settings.traceFilename);
+
+    cg::destroy_offscreen_target(target);
+    do_cleanup(ctx);
+    cg::destroy_headless_context(headless);
+    return (loaded && written) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,55 @@
+// Headless drivers of the model viewer: batch rendering of images of glTF
+// files (--batch), and the scripted benchmark (--benchmark). Neither opens a
+// window.
+//
+
+#pragma once
+
+#include "model_viewer.h"
+
+#include <glm/gtc/quaternion.hpp>
+
+#include <string>
+#include <vector>
+
+// Settings of headless batch rendering (--batch)
+struct BatchOptions {
+    std::vector<std::string> inputs;  // glTF files, directories, or .txt lists of files
+    std::string outputDir = ".";
+    int width = 256;
+    int height = 256;
+    int turntableFrames = 1;  // Images per file, turning the model about the vertical axis
+    float elevation = 15.0f;  // Camera elevation in degrees
+    bool fitCamera = true;    // Frame the bounds of each scene
+    int jobs = 1;             // Rendering threads, each with its own context
+    int encoderThreads = 1;   // PNG encoding threads
+    int shard = 0;            // Only render every shardCount:th file, starting at shard,
+    int shardCount = 1;       // so that several processes or nodes can split the work
+    bool software = false;    // Render with the software renderer instead of OpenGL
+    int softwareThreads = 0;  // Threads of each software renderer (0: one per hardware thread)
+    int pathTraceSamples = 0;       // Samples per pixel of the path tracer (0: rasterize)
+    double pathTraceSeconds = 0.0;  // Time budget of each path-traced image (0: none)
+};
+
+// Render images of all batch files without a window, and report the
+// throughput. Returns the exit status.
+int run_batch(const Context &settings, BatchOptions options);
+
+// Settings of the scripted benchmark (--benchmark)
+struct BenchmarkOptions {
+    int frames = 0;                 // Timed frames (0 when not benchmarking)
+    int warmupFrames = 10;          // Untimed frames before them (program builds, caches)
+    std::string cameraPath;         // Recorded trackball orientations, or empty for an orbit
+    float elevation = 15.0f;        // Camera elevation of the orbit in degrees
+    float timeStep = 1.0f / 60.0f;  // Animation time per frame in seconds
+    std::string jsonFilename;       // File for the results as JSON, if not empty
+};
+
+// Render the scene headless along a scripted camera path (an orbit, or
+// recorded trackball orientations), with a fixed time step and no vsync, and
+// report frame times and the CPU and GPU times of each pass. Returns the
+// exit status.
+int run_benchmark(const Context &settings, const BenchmarkOptions &options);
+
+// Write trackball orientations as lines of "w x y z"
+bool write_camera_path(const std::string &filename, const std::vector<glm::quat> &path);
@@ -1,37 +1,41 @@
 #version 330
 #extension GL_ARB_explicit_attrib_location : require
 
-// Uniform constants
-// Lighting
-uniform vec3 u_diffuseColor;
-uniform vec3 u_ambientColor;
-uniform vec3 u_specularColor;
-uniform float u_specularPower;
-
-// // Flags
-uniform bool u_useLighting;
-uniform bool u_useDiffuseLighting;
-uniform bool u_useAmbientLighting;
-uniform bool u_useSpecularLighting;
-uniform bool u_useNormalsAsColor;
-uniform bool u_useGammaCorrection;
-uniform bool u_useCubemap;
-
-uniform bool u_visualiseTexCoords;
-uniform bool u_hasDiffuseTexture;
-uniform bool u_hasNormalTexture;
-uniform bool u_useDiffuseTexture;
-uniform bool u_useNormalTexture;
+// Shader features are selected with #defines that are inserted before this
+// line (see the MeshFeature enum in model_viewer.cpp):
+//
+// USE_LIGHTING, USE_AMBIENT_LIGHTING, USE_DIFFUSE_LIGHTING,
+// USE_SPECULAR_LIGHTING, USE_NORMALS_AS_COLOR, USE_GAMMA_CORRECTION,
+// USE_CUBEMAP, VISUALISE_TEXCOORDS, USE_DIFFUSE_TEXTURE, USE_NORMAL_TEXTURE,
+// SHADOW_FILTER_POISSON, SHADOW_FILTER_VARIANCE (hardware PCF otherwise)
+
+// Uniform blocks (see cg_uniform_blocks.h for the C++ side)
+layout(std140) uniform FrameBlock {
+    mat4 u_view;
+    mat4 u_projection;
+    mat4 u_shadowFromView[4];
+    vec4 u_cascadeSplits;
+    float u_time;
+    int u_cascadeCount;
+    int u_shadowTaps;  // Number of Poisson disk taps (4 to 16)
+};
+
+layout(std140) uniform LightBlock {
+    vec3 u_lightPosition;
+    float u_specularPower;
+    vec3 u_ambientColor;
+    vec3 u_diffuseColor;
+    vec3 u_specularColor;
+};
 
 // Cubemap
 uniform samplerCube u_cubemap;
 
-// Textures
-uniform sampler2D u_baseColorTexture;
-uniform sampler2D u_normalTexture;
-uniform sampler2D u_shadowmap;
-
-uniform mat4 u_shadowFromView;
+// Textures (arrays of the texture pool, see gltf_render.h)
+uniform sampler2DArray u_baseColorTexture;
+uniform sampler2DArray u_normalTexture;
+uniform sampler2DArrayShadow u_shadowmap;  // One layer per cascade
+uniform sampler2DArray u_shadowMoments;    // Depth moments (variance filter)
 
 // ...
 
@@ -42,143 +46,149 @@ in vec3 V;
 in vec3 v_normal;
 in vec3 v_color;
 in vec2 v_texcoord_0;
+in vec4 v_tangent;
+flat in int v_baseColorLayer;
+flat in int v_normalLayer;
 // ...
 
 // Fragment shader outputs
 out vec3 frag_color;
 
-float shadowmap_visibility(sampler2D shadowmap, vec4 shadowPos, float bias)
+const vec2 POISSON_DISK[16] = vec2[](
+    vec2(-0.94201624, -0.39906216), vec2(0.94558609, -0.76890725),
+    vec2(-0.09418410, -0.92938870), vec2(0.34495938, 0.29387760),
+    vec2(-0.91588581, 0.45771432), vec2(-0.81544232, -0.87912464),
+    vec2(-0.38277543, 0.27676845), vec2(0.97484398, 0.75648379),
+    vec2(0.44323325, -0.97511554), vec2(0.53742981, -0.47373420),
+    vec2(-0.26496911, -0.41893023), vec2(0.79197514, 0.19090188),
+    vec2(-0.24188840, 0.99706507), vec2(-0.81409955, 0.91437590),
+    vec2(0.19984126, 0.78641367), vec2(0.14383161, -0.14100790));
+
+// Return a visibility value in range [0, 1] for a position in the clip space
+// of a shadow cascade
+float shadowmap_visibility(int cascade, vec4 shadowPos, float bias)
 {
-    vec2 delta = vec2(0.5) / textureSize(shadowmap, 0).xy;
-
-    float finalVisibility = 0;
-    for (int i = -3; i < 4; i++)
+    vec2 texcoord = (shadowPos.xy / shadowPos.w) * 0.5 + 0.5;
+    float depth = (shadowPos.z / shadowPos.w) * 0.5 + 0.5;
+
+#if defined(SHADOW_FILTER_VARIANCE)
+    // Chebyshev upper bound from the blurred depth moments. The bound is
+    // remapped to reduce light bleeding between overlapping casters.
+    vec2 moments = texture(u_shadowMoments, vec3(texcoord, cascade)).rg;
+    if (depth <= moments.x) return 1.0;
+    float variance = max(moments.y - moments.x * moments.x, 1e-6);
+    float d = depth - moments.x;
+    float pMax = variance / (variance + d * d);
+    return clamp((pMax - 0.2) / 0.8, 0.0, 1.0);
+#else
+    // Each texture() call on the shadow sampler does a bilinear 2x2 comparison
+    vec4 coord = vec4(texcoord, cascade, depth - bias);
+#if !defined(SHADOW_FILTER_POISSON)
+    return texture(u_shadowmap, coord);
+#else
+    // Poisson disk, rotated per pixel to trade banding for noise
+    vec2 radius = vec2(2.5) / textureSize(u_shadowmap, 0).xy;
+    float angle = 6.2831853 * fract(sin(dot(gl_FragCoord.xy, vec2(12.9898, 78.233))) * 43758.5453);
+    mat2 rotation = mat2(cos(angle), sin(angle), -sin(angle), cos(angle));
+    float visibility = 0.0;
+    for (int i = 0; i < u_shadowTaps; i++)
     {
-        for (int j = -3; j < 4; j++)
-        {
-            vec4 offsetPos = shadowPos + vec4(i * delta.x, j * delta.y, 0.0, 0.0);
-            vec2 texcoord = (offsetPos.xy / offsetPos.w) * 0.5 + 0.5;
-            float depth = (offsetPos.z / offsetPos.w) * 0.5 + 0.5;
-            
-            // Sample the shadowmap and compare texels with (depth - bias) to
-            // return a visibility value in range [0, 1]. If you take more
-            // samples (using delta to offset the texture coordinate), the
-            // returned value should be the average of all comparisons.
-            float texel = texture(shadowmap, texcoord).r;
-            float visibility = float(texel > depth - bias);
-
-            finalVisibility += visibility;
-        }
+        vec2 offset = rotation * POISSON_DISK[i] * radius;
+        visibility += texture(u_shadowmap, coord + vec4(offset, 0.0, 0.0));
     }
+    return visibility / float(u_shadowTaps);
+#endif
+#endif
+}
 
-    finalVisibility /= 16;
-    return finalVisibility;
+// Select the shadow cascade that covers a view-space depth
+int shadow_cascade(float depth)
+{
+    for (int i = 0; i < u_cascadeCount - 1; i++)
+    {
+        if (depth < u_cascadeSplits[i]) return i;
+    }
+    return u_cascadeCount - 1;
 }
 
-// Calculate the tangent space matrix
-mat3 tangent_space(vec3 eye, vec2 texcoord, vec3 normal)
+// Calculate the tangent space matrix from the interpolated vertex tangent,
+// whose bitangent is reconstructed as in MikkTSpace
+mat3 tangent_space(vec4 tangent, vec3 normal)
 {
-    // Compute pixel derivatives
-    vec3 delta_pos1 = dFdx(eye);
-    vec3 delta_pos2 = dFdy(eye);
-    vec2 delta_uv1 = dFdx(texcoord);
-    vec2 delta_uv2 = dFdy(texcoord);
-
-    // Compute tangent space vectors
-    vec3 N = normal;
-    vec3 T = normalize(delta_pos1 * delta_uv2.y -
-                       delta_pos2 * delta_uv1.y);
-    vec3 B = normalize(delta_pos2 * delta_uv1.x -
-                       delta_pos1 * delta_uv2.x);
-    return mat3(T, B, N);
+    vec3 T = normalize(tangent.xyz);
+    vec3 B = tangent.w * cross(normal, T);
+    return mat3(T, B, normal);
 }
 
 void main()
 {
     vec3 normal = N;
 
-    // If should visualise the texture coordinates
-    if (u_visualiseTexCoords && (u_hasDiffuseTexture || u_hasNormalTexture))
-    {
-        frag_color = vec3(v_texcoord_0.x, v_texcoord_0.y, 0.0);
-    }
-    // If should use the cubemap
-    else if (u_useCubemap)
-    {
-        // Calculate the reflection vector
-        vec3 R = reflect(-V, N);
-
-        frag_color = texture(u_cubemap, R).rgb;
-    }
-    else
-    {
-        // If should use the normal vectors as the color
-        if (u_useNormalsAsColor)
-        {
-            frag_color = 0.5 * v_normal + 0.5;
-        }
-        // Otherwise
-        else
-        {
-            // If we have a diffuse texture
-            if (u_useDiffuseTexture && u_hasDiffuseTexture)
-            {
-                frag_color = texture(u_baseColorTexture, v_texcoord_0).rgb;
-            }
-            else
-            {
-                frag_color = v_color;
-            }
-
-            // If we have a normal texture
-            if (u_hasNormalTexture && u_useNormalTexture)
-            {
-                // Calculate the tangent space matrix
-                mat3 TBN = tangent_space(V, v_texcoord_0, N);
-
-                // Calculate the normal vector from the height map
-                float delta = 0.0010000000474974513;
-                vec3 t = vec3(1, 0, texture(u_normalTexture, v_texcoord_0 + vec2(delta, 0.0)).r - texture(u_normalTexture, v_texcoord_0 + vec2(-delta, 0.0)).r);
-                vec3 s = vec3(0, 1, texture(u_normalTexture, v_texcoord_0 + vec2(0.0, delta)).r - texture(u_normalTexture, v_texcoord_0 + vec2(0.0, -delta)).r);
-                normal = cross(t, s);
-
-                // Transform the normal vector from tangent space to object space
-                normal = normalize(TBN * normal);
-            }
-
-            // If should use lighting
-            if (u_useLighting)
-            {
-                // Calculate the diffuse (Lambertian) reflection term
-                float diffuse = max(0.0, dot(normal, L)) ;
-
-                // float diffuse = clamp(dot(normal, L), 0, 1);
-
-                // Calculate the specular term
-                vec3 H = normalize(L + V);
-                float specular = max(0.0, pow(dot(normal, H), u_specularPower)) ;
-
-                // Calculate the final color of the vertex by adding the ambient, diffuse, and specular terms
-                // multiplied by their respective colors (i.e. Blinn-Phong Lighting) to the color of the object itself.
-                if (u_useAmbientLighting)
-                {
-                    frag_color += u_ambientColor;
-                }
-                if (u_useDiffuseLighting)
-                {
-                    frag_color += diffuse * u_diffuseColor * shadowmap_visibility(u_shadowmap, u_shadowFromView * vec4(-V, 1.0), 0.005);
-                }
-                if (u_useSpecularLighting)
-                {
-                    // Normalize the specular term to make it more visible also
-                    frag_color += ((u_specularPower + 8) / 8) * u_specularColor * specular *  shadowmap_visibility(u_shadowmap, u_shadowFromView * vec4(-V, 1.0), 0.005);
-                }
-            }
-        }
-
-        if (u_useGammaCorrection)
-        {
-            frag_color = pow(frag_color, vec3(1 / 2.2));
-        }
-    }
+#if defined(VISUALISE_TEXCOORDS)
+    // Visualise the texture coordinates (only selected for textured materials)
+    frag_color = vec3(v_texcoord_0.x, v_texcoord_0.y, 0.0);
+#elif defined(USE_CUBEMAP)
+    // Calculate the reflection vector
+    vec3 R = reflect(-V, N);
+
+    frag_color = texture(u_cubemap, R).rgb;
+#else
+#if defined(USE_NORMALS_AS_COLOR)
+    // Use the normal vectors as the color
+    frag_color = 0.5 * v_normal + 0.5;
+#else
+#if defined(USE_DIFFUSE_TEXTURE)
+    frag_color = texture(u_baseColorTexture, vec3(v_texcoord_0, v_baseColorLayer)).rgb;
+#else
+    frag_color = v_color;
+#endif
+
+#if defined(USE_NORMAL_TEXTURE)
+    // Calculate the tangent space matrix
+    mat3 TBN = tangent_space(v_tangent, N);
+
+    // Read the tangent-space normal from the normal map (height maps are
+    // converted to normal maps when loaded), reconstructing Z from X and Y
+    vec2 xy = texture(u_normalTexture, vec3(v_texcoord_0, float(v_normalLayer))).rg * 2.0 - 1.0;
+    normal = vec3(xy, sqrt(max(1.0 - dot(xy, xy), 0.0)));
+
+    // Transform the normal vector from tangent space to object space
+    normal = normalize(TBN * normal);
+#endif
+
+#if defined(USE_LIGHTING)
+    // Calculate the diffuse (Lambertian) reflection term
+    float diffuse = max(0.0, dot(normal, L)) ;
+
+    // Calculate the specular term
+    vec3 H = normalize(L + V);
+    float specular = max(0.0, pow(dot(normal, H), u_specularPower)) ;
+
+    // Select the shadow cascade from the view-space depth, and evaluate the
+    // shadow visibility once for both terms
+#if defined(USE_DIFFUSE_LIGHTING) || defined(USE_SPECULAR_LIGHTING)
+    int cascade = shadow_cascade(V.z);
+    vec4 shadowPos = u_shadowFromView[cascade] * vec4(-V, 1.0);
+    float visibility = shadowmap_visibility(cascade, shadowPos, 0.005);
+#endif
+
+    // Calculate the final color of the vertex by adding the ambient, diffuse, and specular terms
+    // multiplied by their respective colors (i.e. Blinn-Phong Lighting) to the color of the object itself.
+#if defined(USE_AMBIENT_LIGHTING)
+    frag_color += u_ambientColor;
+#endif
+#if defined(USE_DIFFUSE_LIGHTING)
+    frag_color += diffuse * u_diffuseColor * visibility;
+#endif
+#if defined(USE_SPECULAR_LIGHTING)
+    // Normalize the specular term to make it more visible also
+    frag_color += ((u_specularPower + 8) / 8) * u_specularColor * specular * visibility;
+#endif
+#endif  // USE_LIGHTING
+#endif  // USE_NORMALS_AS_COLOR
+
+#if defined(USE_GAMMA_CORRECTION)
+    frag_color = pow(frag_color, vec3(1 / 2.2));
+#endif
+#endif
 }
@@ -1,16 +1,35 @@
 #version 330
 #extension GL_ARB_explicit_attrib_location : require
+#extension GL_ARB_shader_draw_parameters : enable
 
-// Uniform constants
-uniform float u_time;
+// Uniform blocks (see cg_uniform_blocks.h for the C++ side)
+layout(std140) uniform FrameBlock {
+    mat4 u_view;
+    mat4 u_projection;
+    mat4 u_shadowFromView[4];
+    vec4 u_cascadeSplits;
+    float u_time;
+    int u_cascadeCount;
+    int u_shadowTaps;  // Number of Poisson disk taps (4 to 16)
+};
 
-// Model, View, Projection
-uniform mat4 u_model;
-uniform mat4 u_view;
-uniform mat4 u_projection;
+layout(std140) uniform LightBlock {
+    vec3 u_lightPosition;
+    float u_specularPower;
+    vec3 u_ambientColor;
+    vec3 u_diffuseColor;
+    vec3 u_specularColor;
+};
 
-// Light position
-uniform vec3 u_lightPosition;
+layout(std140) uniform ObjectBlock {
+    int u_firstDraw;
+};
+
+// Per-instance model matrices (four texels per matrix), and the data of each
+// draw in the frame: the first instance, and the texture array layers of the
+// material (base color in the low 16 bits, normal texture in the high bits)
+uniform samplerBuffer u_instanceTransforms;
+uniform isamplerBuffer u_drawData;
 
 // ...
 
@@ -19,21 +38,47 @@ layout(location = 0) in vec4 a_position;
 layout(location = 1) in vec3 a_color;
 layout(location = 2) in vec3 a_normal;
 layout(location = 3) in vec2 a_texcoord_0;
+layout(location = 4) in vec4 a_tangent;  // Handedness of the bitangent in w
 // ...
 
-// Vertex shader outputs
+// Vertex shader outputs (gl_Position is invariant for the depth pre-pass)
+invariant gl_Position;
 out vec3 N;
 out vec3 L;
 out vec3 V;
 out vec3 v_normal;
 out vec3 v_color;
 out vec2 v_texcoord_0;
+out vec4 v_tangent;
+flat out int v_baseColorLayer;
+flat out int v_normalLayer;
 // ...
 
+ivec2 draw_data()
+{
+#ifdef GL_ARB_shader_draw_parameters
+    int draw = u_firstDraw + gl_DrawIDARB;
+#else
+    int draw = u_firstDraw;  // Multi-draws share the data of the first draw
+#endif
+    return texelFetch(u_drawData, draw).xy;
+}
+
+mat4 instance_model_matrix(int baseInstance)
+{
+    int offset = 4 * (baseInstance + gl_InstanceID);
+    return mat4(texelFetch(u_instanceTransforms, offset + 0),
+                texelFetch(u_instanceTransforms, offset + 1),
+                texelFetch(u_instanceTransforms, offset + 2),
+                texelFetch(u_instanceTransforms, offset + 3));
+}
+
 void main()
 {
+    ivec2 draw = draw_data();
+
     // Calculate MVP matrix
-    mat4 mv = u_view * u_model;
+    mat4 mv = u_view * instance_model_matrix(draw.x);
     mat4 mvp = u_projection * mv;
     
     // Calculate the coordinates of the vertex
@@ -43,8 +88,9 @@ void main()
     vec3 positionEye = vec3(mv * a_position);
     V = -positionEye;
 
-    // Calculate the view-space normal
+    // Calculate the view-space normal and tangent
     N = normalize(mat3(mv) * a_normal);
+    v_tangent = vec4(normalize(mat3(mv) * a_tangent.xyz), a_tangent.w);
 
     // Calculate the view-space light direction
     L = normalize(u_lightPosition - positionEye);
@@ -53,4 +99,6 @@ void main()
     v_normal = a_normal;
     v_color = a_color;
     v_texcoord_0 = a_texcoord_0;
+    v_baseColorLayer = draw.y & 0xffff;
+    v_normalLayer = draw.y >> 16;
 }
@@ -12,6 +12,8 @@ out vec4 frag_color;
 
 void main()
 {
-    // Write depth to fragment color (for debug drawing)
-    frag_color = vec4(vec3(gl_FragCoord.z), 1.0);
+    // Write the first two depth moments (only stored when rendering variance
+    // shadow maps; the depth buffer is used otherwise)
+    float depth = gl_FragCoord.z;
+    frag_color = vec4(depth, depth * depth, 0.0, 1.0);
 }
@@ -1,10 +1,27 @@
 #version 330
 #extension GL_ARB_explicit_attrib_location : require
+#extension GL_ARB_shader_draw_parameters : enable
 
-// Uniform constants
-uniform mat4 u_model;
-uniform mat4 u_view;
-uniform mat4 u_proj;
+// Uniform blocks (see cg_uniform_blocks.h for the C++ side). The frame
+// block holds the view and projection of the light.
+layout(std140) uniform FrameBlock {
+    mat4 u_view;
+    mat4 u_projection;
+    mat4 u_shadowFromView[4];
+    vec4 u_cascadeSplits;
+    float u_time;
+    int u_cascadeCount;
+    int u_shadowTaps;  // Number of Poisson disk taps (4 to 16)
+};
+
+layout(std140) uniform ObjectBlock {
+    int u_firstDraw;
+};
+
+// Per-instance model matrices (four texels per matrix), and the data of each
+// draw in the frame (first instance, material layers)
+uniform samplerBuffer u_instanceTransforms;
+uniform isamplerBuffer u_drawData;
 // ...
 
 // Vertex inputs (attributes from vertex buffers)
@@ -12,9 +29,29 @@ layout(location = 0) in vec4 a_position;
 // ...
 
 // Vertex shader outputs
+invariant gl_Position;
 // ...
 
+mat4 instance_model_matrix()
+{
+#ifdef GL_ARB_shader_draw_parameters
+    int draw = u_firstDraw + gl_DrawIDARB;
+#else
+    int draw = u_firstDraw;  // Multi-draws share the first instance
+#endif
+    int baseInstance = texelFetch(u_drawData, draw).x;
+    int offset = 4 * (baseInstance + gl_InstanceID);
+    return mat4(texelFetch(u_instanceTransforms, offset + 0),
+                texelFetch(u_instanceTransforms, offset + 1),
+                texelFetch(u_instanceTransforms, offset + 2),
+                texelFetch(u_instanceTransforms, offset + 3));
+}
+
 void main()
 {
-    gl_Position = u_proj * u_view * u_model * a_position;
+    // Same computation as in mesh.vert, so that the depth pre-pass matches
+    // the depth of the opaque pass exactly
+    mat4 mv = u_view * instance_model_matrix();
+    mat4 mvp = u_projection * mv;
+    gl_Position = mvp * vec4(a_position.xyz, 1.0f);
 }
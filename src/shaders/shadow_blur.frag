@@ -0,0 +1,28 @@
+#version 330
+#extension GL_ARB_explicit_attrib_location : require
+
+// Uniform constants
+uniform sampler2DArray u_source;
+uniform int u_layer;
+uniform vec2 u_direction;  // One texel along the blur direction
+
+// Fragment shader inputs
+in vec2 v_texcoord;
+
+// Fragment shader outputs
+out vec4 frag_color;
+
+// One pass of a separable 7-tap Gaussian blur of the depth moments
+void main()
+{
+    const float weights[4] = float[](0.383103, 0.241843, 0.060626, 0.005977);
+
+    vec2 moments = weights[0] * texture(u_source, vec3(v_texcoord, u_layer)).rg;
+    for (int i = 1; i < 4; i++)
+    {
+        vec2 offset = float(i) * u_direction;
+        moments += weights[i] * texture(u_source, vec3(v_texcoord + offset, u_layer)).rg;
+        moments += weights[i] * texture(u_source, vec3(v_texcoord - offset, u_layer)).rg;
+    }
+    frag_color = vec4(moments, 0.0, 1.0);
+}
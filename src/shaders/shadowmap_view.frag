@@ -0,0 +1,22 @@
+#version 330
+#extension GL_ARB_explicit_attrib_location : require
+
+// Uniform constants
+uniform sampler2DArray u_shadowmap;  // One layer per cascade
+uniform int u_cascadeCount;
+
+// Fragment shader inputs
+in vec2 v_texcoord;
+
+// Fragment shader outputs
+out vec4 frag_color;
+
+void main()
+{
+    // Show the cached depth values of the cascades side by side as grayscale
+    // (for debug drawing)
+    float x = v_texcoord.x * u_cascadeCount;
+    int cascade = min(int(x), u_cascadeCount - 1);
+    vec2 texcoord = vec2(x - cascade, v_texcoord.y);
+    frag_color = vec4(vec3(texture(u_shadowmap, vec3(texcoord, cascade)).r), 1.0);
+}
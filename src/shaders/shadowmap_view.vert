@@ -0,0 +1,12 @@
+#version 330
+
+// Vertex shader outputs
+out vec2 v_texcoord;
+
+void main()
+{
+    // Generate a triangle that covers the whole viewport (no vertex buffers)
+    vec2 position = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    v_texcoord = position;
+    gl_Position = vec4(2.0 * position - 1.0, 0.0, 1.0);
+}